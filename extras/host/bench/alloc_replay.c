@@ -0,0 +1,617 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  alloc_replay.c
+ * @brief Replays an `ALLOC_TRACE` recording (see reimpl/alloc_trace.h)
+ *        against the slab allocator and against the host libc's malloc.
+ *
+ * The trace is turned into a flat list of operations on numbered slots
+ * first, so that the timed loop only calls the allocator and touches the
+ * first bytes of every new block. Events of all threads are replayed on one
+ * thread in time order; what is measured is the cost of the allocator's
+ * paths and the heap it grows, not its scaling.
+ *
+ * Each backend runs in its own child process so that neither inherits the
+ * other's heap. The reported footprint is how far the process break moved,
+ * which covers the slabs as well since they come from memalign().
+ *
+ *   alloc_replay [--runs N] alloc_trace.bin
+ *   alloc_replay --synthetic FRAMES out.bin
+ *
+ * The slab allocator indexes its span table by the upper 16 bits of a
+ * 32-bit address, so the replayer is linked without PIE and turns off
+ * mmap() in malloc to keep the whole heap below 4 GiB.
+ */
+
+#define _GNU_SOURCE
+
+#include "reimpl/alloc.h"
+#include "reimpl/alloc_trace.h"
+
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    uint64_t time;
+    uint32_t seq;
+    uint32_t type;
+    uint32_t ptr;
+    uint32_t size;
+    uint32_t old_ptr;
+} trace_event;
+
+enum {
+    OP_ALLOC,
+    OP_FREE,
+    OP_REALLOC
+};
+
+typedef struct {
+    uint32_t op;
+    uint32_t slot;
+    uint32_t old_slot;
+    uint32_t size;
+} replay_op;
+
+typedef struct {
+    const char * name;
+    void * (*alloc)(size_t size);
+    void (*free)(void * ptr);
+    void * (*realloc)(void * ptr, size_t size);
+} replay_backend;
+
+static const replay_backend backends[] = {
+    { "slab", malloc_soloader, free_soloader, realloc_soloader },
+    { "libc", malloc, free, realloc },
+};
+
+#define NUM_BACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+static void fail(const char * msg) {
+    fprintf(stderr, "error: %s\n", msg);
+    exit(1);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The replayer's own tables stay off the heap, a hole they leave in it
+// would be reused by the replay and hide part of its footprint
+static void * big_alloc(size_t size) {
+    void * p = mmap(NULL, size ? size : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        fail("out of memory");
+    return p;
+}
+
+static void big_free(void * p, size_t size) {
+    munmap(p, size ? size : 1);
+}
+
+/*
+ * Trace loading
+ */
+
+static uint32_t rd32(const uint8_t * p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static int event_cmp(const void * a, const void * b) {
+    const trace_event * x = a, * y = b;
+    if (x->time != y->time)
+        return x->time < y->time ? -1 : 1;
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+#define MAX_THREADS 64
+
+static trace_event * load_trace(const char * path, size_t * count, uint32_t * dropped) {
+    FILE * f = fopen(path, "rb");
+    if (!f)
+        fail("could not open the trace");
+
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t * data = big_alloc(len);
+    if (!data || fread(data, 1, len, f) != (size_t) len)
+        fail("could not read the trace");
+    fclose(f);
+
+    if (len < 16 || memcmp(data, "ALTR", 4) != 0)
+        fail("not an allocation trace");
+    if (rd32(data + 4) != ALLOC_TRACE_VERSION)
+        fail("unsupported trace version");
+
+    size_t cap = (len - 16) / 24;
+    trace_event * events = big_alloc((cap + 1) * sizeof(trace_event));
+
+    // time_us wraps per thread, undo it like alloc_trace.py does
+    uint32_t thread_ids[MAX_THREADS], last_time[MAX_THREADS], wraps[MAX_THREADS];
+    int num_threads = 0;
+
+    size_t n = 0;
+    *dropped = 0;
+    long off = 16;
+    while (off + 12 <= len) {
+        uint32_t thid = rd32(data + off), num = rd32(data + off + 4);
+        *dropped += rd32(data + off + 8);
+        off += 12;
+        if (off + (long) num * 24 > len)
+            num = (len - off) / 24; // cut off mid-chunk
+
+        int t = 0;
+        while (t < num_threads && thread_ids[t] != thid)
+            t++;
+        if (t == num_threads) {
+            if (num_threads == MAX_THREADS)
+                fail("too many threads in the trace");
+            thread_ids[t] = thid;
+            last_time[t] = wraps[t] = 0;
+            num_threads++;
+        }
+
+        for (uint32_t i = 0; i < num; i++, off += 24) {
+            const uint8_t * e = data + off;
+            uint32_t time = rd32(e);
+            if (time < last_time[t])
+                wraps[t]++;
+            last_time[t] = time;
+
+            events[n] = (trace_event) {
+                .time = (uint64_t) wraps[t] << 32 | time, .seq = (uint32_t) n,
+                .type = rd32(e + 4), .ptr = rd32(e + 8), .size = rd32(e + 12), .old_ptr = rd32(e + 16),
+            };
+            n++;
+        }
+    }
+
+    big_free(data, len);
+    qsort(events, n, sizeof(trace_event), event_cmp);
+    *count = n;
+    return events;
+}
+
+/*
+ * Trace -> slot operations
+ */
+
+// Open addressing, trace address -> slot + 1
+typedef struct {
+    uint32_t * keys;
+    uint32_t * values;
+    uint32_t mask;
+} ptr_map;
+
+static uint32_t * map_find(ptr_map * m, uint32_t key) {
+    uint32_t i = (key * 0x9E3779B1u) & m->mask;
+    while (m->values[i] && m->keys[i] != key)
+        i = (i + 1) & m->mask;
+    m->keys[i] = key;
+    return &m->values[i];
+}
+
+static void map_erase(ptr_map * m, uint32_t key) {
+    uint32_t i = (key * 0x9E3779B1u) & m->mask;
+    while (m->values[i] && m->keys[i] != key)
+        i = (i + 1) & m->mask;
+    if (!m->values[i])
+        return;
+
+    // Backward-shift deletion keeps the probe chains intact
+    m->values[i] = 0;
+    for (uint32_t j = (i + 1) & m->mask; m->values[j]; j = (j + 1) & m->mask) {
+        uint32_t home = (m->keys[j] * 0x9E3779B1u) & m->mask;
+        if (((j - home) & m->mask) >= ((j - i) & m->mask)) {
+            m->keys[i] = m->keys[j];
+            m->values[i] = m->values[j];
+            m->values[j] = 0;
+            i = j;
+        }
+    }
+}
+
+static replay_op * build_ops(const trace_event * events, size_t count, size_t * num_ops, uint32_t * num_slots,
+                             uint32_t * unknown_frees) {
+    ptr_map map;
+    map.mask = 1;
+    while (map.mask < count * 2)
+        map.mask <<= 1;
+    map.keys = big_alloc(map.mask * sizeof(uint32_t));
+    map.values = big_alloc(map.mask * sizeof(uint32_t));
+    map.mask--;
+
+    uint32_t * free_slots = big_alloc(count * sizeof(uint32_t) + 4);
+    uint32_t num_free = 0, slots = 0;
+
+    replay_op * ops = big_alloc((count + 1) * sizeof(replay_op));
+    size_t n = 0;
+    *unknown_frees = 0;
+
+#define NEW_SLOT() (num_free ? free_slots[--num_free] : slots++)
+
+    for (size_t i = 0; i < count; i++) {
+        const trace_event * e = &events[i];
+        uint32_t * v;
+
+        switch (e->type) {
+            case ALLOC_TRACE_ALLOC:
+                if (!e->ptr)
+                    break; // failed allocation
+                v = map_find(&map, e->ptr);
+                if (*v)
+                    break; // a dropped free, keep the old block
+                *v = NEW_SLOT() + 1;
+                ops[n++] = (replay_op) { OP_ALLOC, *v - 1, 0, e->size };
+                break;
+
+            case ALLOC_TRACE_FREE:
+                v = map_find(&map, e->ptr);
+                if (!*v) {
+                    // Memory the game got from newlib directly, or a dropped event
+                    (*unknown_frees)++;
+                    map_erase(&map, e->ptr);
+                    break;
+                }
+                ops[n++] = (replay_op) { OP_FREE, *v - 1, 0, 0 };
+                free_slots[num_free++] = *v - 1;
+                map_erase(&map, e->ptr);
+                break;
+
+            case ALLOC_TRACE_REALLOC: {
+                uint32_t old_slot = 0;
+                int has_old = 0;
+                if (e->old_ptr) {
+                    v = map_find(&map, e->old_ptr);
+                    if (*v) {
+                        old_slot = *v - 1;
+                        has_old = 1;
+                    }
+                    map_erase(&map, e->old_ptr);
+                }
+
+                if (!e->ptr) {
+                    // realloc(p, 0) frees; a failed realloc keeps the block
+                    if (has_old && e->size == 0) {
+                        ops[n++] = (replay_op) { OP_FREE, old_slot, 0, 0 };
+                        free_slots[num_free++] = old_slot;
+                    } else if (has_old) {
+                        *map_find(&map, e->old_ptr) = old_slot + 1;
+                    }
+                    break;
+                }
+
+                v = map_find(&map, e->ptr);
+                if (*v) {
+                    // Dropped free of the result, replace it
+                    ops[n++] = (replay_op) { OP_FREE, *v - 1, 0, 0 };
+                    free_slots[num_free++] = *v - 1;
+                }
+                if (has_old) {
+                    *v = old_slot + 1;
+                    ops[n++] = (replay_op) { OP_REALLOC, old_slot, old_slot, e->size };
+                } else {
+                    *v = NEW_SLOT() + 1;
+                    ops[n++] = (replay_op) { OP_ALLOC, *v - 1, 0, e->size };
+                }
+                break;
+            }
+
+            default:
+                break;
+        }
+    }
+
+#undef NEW_SLOT
+
+    big_free(map.keys, (map.mask + 1) * sizeof(uint32_t));
+    big_free(map.values, (map.mask + 1) * sizeof(uint32_t));
+    big_free(free_slots, count * sizeof(uint32_t) + 4);
+    *num_ops = n;
+    *num_slots = slots;
+    return ops;
+}
+
+/*
+ * Replay
+ */
+
+typedef struct {
+    uint64_t ns;
+    uint64_t heap_peak;
+    uint64_t heap_end;
+} replay_result;
+
+#define SAMPLE_EVERY 4096
+
+static void replay_once(const replay_backend * b, const replay_op * ops, size_t num_ops, uint32_t num_slots,
+                        replay_result * out) {
+    void ** slots = big_alloc((num_slots + 1) * sizeof(void *));
+    uintptr_t brk_start = (uintptr_t) sbrk(0);
+    uintptr_t brk_peak = brk_start;
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < num_ops; i++) {
+        const replay_op * op = &ops[i];
+        switch (op->op) {
+            case OP_ALLOC: {
+                uint8_t * p = b->alloc(op->size);
+                if (p && op->size)
+                    p[0] = (uint8_t) i;
+                slots[op->slot] = p;
+                break;
+            }
+            case OP_FREE:
+                b->free(slots[op->slot]);
+                slots[op->slot] = NULL;
+                break;
+            case OP_REALLOC: {
+                uint8_t * p = b->realloc(slots[op->old_slot], op->size);
+                if (p && op->size)
+                    p[0] = (uint8_t) i;
+                slots[op->slot] = p;
+                break;
+            }
+        }
+
+        if ((i & (SAMPLE_EVERY - 1)) == 0) {
+            uintptr_t brk = (uintptr_t) sbrk(0);
+            if (brk > brk_peak)
+                brk_peak = brk;
+        }
+    }
+    out->ns = now_ns() - start;
+
+    uintptr_t brk_end = (uintptr_t) sbrk(0);
+    if (brk_end > brk_peak)
+        brk_peak = brk_end;
+    if (brk_peak >= ((uint64_t) 1 << 32))
+        fail("the heap grew past 4 GiB, the slab allocator's span table can not index it");
+
+    out->heap_peak = brk_peak - brk_start;
+    out->heap_end = brk_end - brk_start;
+
+    for (uint32_t i = 0; i < num_slots; i++)
+        b->free(slots[i]);
+    big_free(slots, (num_slots + 1) * sizeof(void *));
+}
+
+static int replay_backend_in_child(const replay_backend * b, const replay_op * ops, size_t num_ops,
+                                   uint32_t num_slots, replay_result * out) {
+    int fds[2];
+    if (pipe(fds) != 0)
+        fail("pipe");
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        replay_result r;
+        replay_once(b, ops, num_ops, num_slots, &r);
+        if (write(fds[1], &r, sizeof(r)) != sizeof(r))
+            _exit(1);
+        _exit(0);
+    }
+
+    close(fds[1]);
+    int ok = read(fds[0], out, sizeof(*out)) == sizeof(*out);
+    close(fds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/*
+ * Synthetic trace: a loading phase of long-lived objects, then frames that
+ * allocate and free many small short-lived ones, some kept for a few frames,
+ * and grow a few buffers with realloc. Sizes are skewed towards small
+ * objects like the game's (see alloc_trace.py output).
+ */
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t) rng_state;
+}
+
+static uint32_t synthetic_size(void) {
+    uint32_t r = rng() % 100;
+    if (r < 45)
+        return 8 + rng() % 57;       // 8..64
+    if (r < 75)
+        return 65 + rng() % 192;     // 65..256
+    if (r < 95)
+        return 257 + rng() % 1792;   // 257..2048
+    return 2049 + rng() % (128 * 1024);
+}
+
+typedef struct {
+    uint32_t ptr;
+    uint32_t size;
+    uint32_t dies; // frame
+} synthetic_block;
+
+typedef struct {
+    FILE * f;
+    uint32_t events[8192 * 6];
+    uint32_t count;
+    uint32_t time;
+    uint32_t next_addr;
+} synthetic_writer;
+
+static void synthetic_flush(synthetic_writer * w) {
+    if (!w->count)
+        return;
+    uint32_t chunk[3] = { 0x40010003, w->count, 0 };
+    fwrite(chunk, sizeof(chunk), 1, w->f);
+    fwrite(w->events, 24, w->count, w->f);
+    w->count = 0;
+}
+
+static void synthetic_event(synthetic_writer * w, uint32_t type, uint32_t ptr, uint32_t size, uint32_t old_ptr) {
+    uint32_t * e = &w->events[w->count * 6];
+    e[0] = w->time++;
+    e[1] = type;
+    e[2] = ptr;
+    e[3] = size;
+    e[4] = old_ptr;
+    e[5] = 0x81000000 + (rng() % 256) * 4;
+    if (++w->count == 8192)
+        synthetic_flush(w);
+}
+
+// Addresses are only keys; a unique one per block keeps them from wrapping
+static uint32_t synthetic_addr(synthetic_writer * w) {
+    uint32_t ptr = w->next_addr;
+    w->next_addr += 16;
+    return ptr;
+}
+
+static uint32_t synthetic_alloc(synthetic_writer * w, uint32_t size) {
+    uint32_t ptr = synthetic_addr(w);
+    synthetic_event(w, ALLOC_TRACE_ALLOC, ptr, size, 0);
+    return ptr;
+}
+
+static void write_synthetic(const char * path, int frames) {
+    synthetic_writer * w = calloc(1, sizeof(synthetic_writer));
+    w->f = fopen(path, "wb");
+    if (!w->f)
+        fail("could not create the trace");
+    w->next_addr = 0x90000000;
+
+    uint32_t header[4] = { 0, ALLOC_TRACE_VERSION, 0x81000000, 0x00400000 };
+    memcpy(header, "ALTR", 4);
+    fwrite(header, sizeof(header), 1, w->f);
+
+    // Level data, meshes, strings: kept for the whole run
+    for (int i = 0; i < 60000; i++)
+        synthetic_alloc(w, synthetic_size());
+
+    int cap = 1 << 16, live = 0;
+    synthetic_block * blocks = malloc(cap * sizeof(synthetic_block));
+
+    uint32_t buffers[16], buffer_size[16];
+    for (int i = 0; i < 16; i++) {
+        buffer_size[i] = 64;
+        buffers[i] = synthetic_alloc(w, buffer_size[i]);
+    }
+
+    for (int frame = 0; frame < frames; frame++) {
+        synthetic_event(w, ALLOC_TRACE_FRAME, 0, 0, 0);
+
+        for (int i = 0; i < 2000; i++) {
+            uint32_t size = synthetic_size();
+            uint32_t r = rng() % 100;
+            uint32_t dies = frame + (r < 80 ? 0 : (r < 97 ? 1 + rng() % 8 : 60 + rng() % 600));
+            if (live == cap)
+                blocks = realloc(blocks, (cap *= 2) * sizeof(synthetic_block));
+            blocks[live++] = (synthetic_block) { synthetic_alloc(w, size), size, dies };
+
+            // Temporaries die right away, in no particular order
+            if (r < 40 && live > 0) {
+                int j = live - 1 - (int) (rng() % (live < 8 ? live : 8));
+                if (blocks[j].dies == (uint32_t) frame) {
+                    synthetic_event(w, ALLOC_TRACE_FREE, blocks[j].ptr, 0, 0);
+                    blocks[j] = blocks[--live];
+                }
+            }
+        }
+
+        // Growing vectors
+        for (int i = 0; i < 4; i++) {
+            int b = rng() % 16;
+            uint32_t size = buffer_size[b] < 256 * 1024 ? buffer_size[b] * 2 : 64;
+            uint32_t ptr = synthetic_addr(w);
+            synthetic_event(w, ALLOC_TRACE_REALLOC, ptr, size, buffers[b]);
+            buffers[b] = ptr;
+            buffer_size[b] = size;
+        }
+
+        for (int i = 0; i < live;) {
+            if (blocks[i].dies <= (uint32_t) frame) {
+                synthetic_event(w, ALLOC_TRACE_FREE, blocks[i].ptr, 0, 0);
+                blocks[i] = blocks[--live];
+            } else {
+                i++;
+            }
+        }
+    }
+
+    synthetic_flush(w);
+    fclose(w->f);
+    free(blocks);
+    free(w);
+}
+
+int main(int argc, char ** argv) {
+    // Before anything is allocated: keep every block, and so every slab, on
+    // the brk heap below 4 GiB
+    mallopt(M_MMAP_MAX, 0);
+    mallopt(M_ARENA_MAX, 1);
+
+    int runs = 5;
+    const char * path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--synthetic") && i + 2 < argc) {
+            write_synthetic(argv[i + 2], atoi(argv[i + 1]));
+            return 0;
+        } else if (!strcmp(argv[i], "--runs") && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else {
+            path = argv[i];
+        }
+    }
+    if (!path || runs < 1) {
+        fprintf(stderr, "usage: %s [--runs N] alloc_trace.bin\n"
+                        "       %s --synthetic FRAMES out.bin\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    size_t count, num_ops;
+    uint32_t dropped, num_slots, unknown_frees;
+    trace_event * events = load_trace(path, &count, &dropped);
+    replay_op * ops = build_ops(events, count, &num_ops, &num_slots, &unknown_frees);
+    big_free(events, (count + 1) * sizeof(trace_event));
+
+    printf("%zu events, %u dropped; %zu operations on %u slots, %u frees of unknown blocks skipped\n",
+           count, dropped, num_ops, num_slots, unknown_frees);
+    printf("best of %d runs\n\n", runs);
+    printf("%-8s %10s %8s %12s %12s\n", "backend", "total ms", "ns/op", "peak KiB", "end KiB");
+
+    for (size_t b = 0; b < NUM_BACKENDS; b++) {
+        replay_result best = { UINT64_MAX, 0, 0 };
+        for (int r = 0; r < runs; r++) {
+            replay_result res;
+            if (!replay_backend_in_child(&backends[b], ops, num_ops, num_slots, &res))
+                fail("a replay failed");
+            if (res.ns < best.ns)
+                best = res;
+        }
+
+        printf("%-8s %10.1f %8.1f %12llu %12llu\n", backends[b].name, best.ns / 1e6,
+               num_ops ? (double) best.ns / num_ops : 0.0,
+               (unsigned long long) best.heap_peak / 1024, (unsigned long long) best.heap_end / 1024);
+    }
+
+    big_free(ops, (count + 1) * sizeof(replay_op));
+    return 0;
+}
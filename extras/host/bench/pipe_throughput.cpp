@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  pipe_throughput.cpp
+ * @brief Throughput and round-trip latency of pseudo_pipe, and how it
+ *        scales with several pipes streaming at once while each read end
+ *        is watched by an epoll instance.
+ *
+ * Built twice like the epoll suite: against falso_ndk, and with
+ * BENCH_LINUX_EPOLL against Linux pipes for reference.
+ *
+ *   bench_pipe [PIPES]
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#ifdef BENCH_LINUX_EPOLL
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#define E_IN    EPOLLIN
+#define CTL_ADD EPOLL_CTL_ADD
+#define IMPL    "linux"
+
+typedef struct epoll_event event_t;
+
+static int ep_create() { return epoll_create1(0); }
+static int ep_ctl(int ep, int op, int fd, event_t * e) { return epoll_ctl(ep, op, fd, e); }
+static ssize_t fd_read(int fd, void * buf, size_t n) { return read(fd, buf, n); }
+static ssize_t fd_write(int fd, const void * buf, size_t n) { return write(fd, buf, n); }
+static int fd_close(int fd) { return close(fd); }
+
+static int pipe_create(int fds[2], size_t capacity) {
+    if (pipe(fds) != 0)
+        return -1;
+    fcntl(fds[1], F_SETPIPE_SZ, (int) capacity);
+    return 0;
+}
+#else
+#include "PseudoEpoll.h"
+#include "polling/pseudo_pipe.h"
+
+#define E_IN    PSEUDO_EPOLLIN
+#define CTL_ADD PSEUDO_EPOLL_CTL_ADD
+#define IMPL    "falso"
+
+typedef struct pseudo_epoll_event event_t;
+
+static int ep_create() { return pseudo_epoll_create1(0); }
+static int ep_ctl(int ep, int op, int fd, event_t * e) { return pseudo_epoll_ctl(ep, op, fd, e); }
+static ssize_t fd_read(int fd, void * buf, size_t n) { return pseudo_read(fd, buf, n); }
+static ssize_t fd_write(int fd, const void * buf, size_t n) { return pseudo_write(fd, buf, n); }
+static int fd_close(int fd) { return pseudo_close(fd); }
+static int pipe_create(int fds[2], size_t capacity) { return pseudo_pipe_with_capacity(fds, capacity); }
+#endif
+
+#define CAPACITY (64 * 1024)
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Streams `total` bytes in `chunk` sized writes; the reader drains whatever
+// is there. Returns MiB/s.
+static double stream(size_t chunk, size_t total) {
+    int fds[2];
+    pipe_create(fds, CAPACITY);
+    std::vector<uint8_t> out(chunk, 0x5a);
+
+    auto start = std::chrono::steady_clock::now();
+    std::thread writer([&]() {
+        for (size_t sent = 0; sent < total; sent += chunk)
+            fd_write(fds[1], out.data(), chunk);
+        fd_close(fds[1]);
+    });
+
+    std::vector<uint8_t> in(CAPACITY);
+    size_t received = 0;
+    ssize_t n;
+    while ((n = fd_read(fds[0], in.data(), in.size())) > 0)
+        received += n;
+    writer.join();
+    double elapsed = seconds_since(start);
+    fd_close(fds[0]);
+
+    if (received != total)
+        printf("short stream: %zu of %zu bytes\n", received, total);
+    return (double) total / (1024 * 1024) / elapsed;
+}
+
+// One byte there and back over two pipes. Returns us per round trip.
+static double ping_pong(int rounds) {
+    int there[2], back[2];
+    pipe_create(there, CAPACITY);
+    pipe_create(back, CAPACITY);
+
+    std::thread echo([&]() {
+        char c;
+        while (fd_read(there[0], &c, 1) == 1)
+            fd_write(back[1], &c, 1);
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    char c = 'x';
+    for (int i = 0; i < rounds; i++) {
+        fd_write(there[1], &c, 1);
+        fd_read(back[0], &c, 1);
+    }
+    double elapsed = seconds_since(start);
+
+    fd_close(there[1]);
+    echo.join();
+    fd_close(there[0]);
+    fd_close(back[0]);
+    fd_close(back[1]);
+    return elapsed * 1e6 / rounds;
+}
+
+// `pipes` independent writer/reader pairs sending 64-byte messages, each
+// read end registered with its own epoll instance like an ALooper's wake
+// pipe. Returns messages per second over all pipes.
+static double parallel_messages(int pipes, int messages) {
+    std::vector<int> eps(pipes), rfds(pipes), wfds(pipes);
+    for (int i = 0; i < pipes; i++) {
+        int fds[2];
+        pipe_create(fds, CAPACITY);
+        rfds[i] = fds[0];
+        wfds[i] = fds[1];
+
+        eps[i] = ep_create();
+        event_t e = {};
+        e.events = E_IN;
+        ep_ctl(eps[i], CTL_ADD, rfds[i], &e);
+    }
+
+    std::atomic<int> go { 0 };
+    std::vector<std::thread> threads;
+    for (int i = 0; i < pipes; i++) {
+        threads.emplace_back([&, i]() {
+            while (!go.load(std::memory_order_acquire))
+                std::this_thread::yield();
+            uint8_t msg[64] = {};
+            for (int m = 0; m < messages; m++)
+                fd_write(wfds[i], msg, sizeof(msg));
+        });
+        threads.emplace_back([&, i]() {
+            while (!go.load(std::memory_order_acquire))
+                std::this_thread::yield();
+            uint8_t buf[64];
+            for (int m = 0; m < messages; m++)
+                fd_read(rfds[i], buf, sizeof(buf));
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    go.store(1, std::memory_order_release);
+    for (auto & t : threads)
+        t.join();
+    double elapsed = seconds_since(start);
+
+    for (int i = 0; i < pipes; i++) {
+        fd_close(rfds[i]);
+        fd_close(wfds[i]);
+        fd_close(eps[i]);
+    }
+    return (double) pipes * messages / elapsed;
+}
+
+int main(int argc, char ** argv) {
+    int pipes = argc > 1 ? atoi(argv[1]) : 4;
+    if (pipes < 1)
+        return 1;
+
+    printf("%s, %d KiB pipes\n", IMPL, CAPACITY / 1024);
+    printf("  stream 64 B writes     %10.1f MiB/s\n", stream(64, 64 << 20));
+    printf("  stream 4 KiB writes    %10.1f MiB/s\n", stream(4096, 512 << 20));
+    printf("  stream 64 KiB writes   %10.1f MiB/s\n", stream(65536, 1024 << 20));
+    printf("  ping-pong 1 B          %10.2f us/round trip\n", ping_pong(20000));
+    printf("  1 pipe, 64 B messages  %10.0f msg/s\n", parallel_messages(1, 1000000));
+    printf("  %d pipes, 64 B messages %9.0f msg/s\n", pipes, parallel_messages(pipes, 1000000));
+    return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  pthr_create.c
+ * @brief Thread creation latency and memory churn of pthread_create_soloader,
+ *        built once plain and once with PTHR_THREAD_POOL.
+ *
+ * Every job touches 64 KiB of its stack like a decoder thread would. Churn
+ * is reported as kernel threads created (distinct tids seen by the jobs)
+ * and page faults taken per job; a fresh stack faults its pages in again.
+ *
+ * glibc keeps a cache of thread stacks of its own, so on the host the plain
+ * build already avoids part of the churn that newlib's pthread_create pays
+ * on the Vita, where every thread gets a newly allocated stack.
+ *
+ *   bench_pthr_create / bench_pthr_create_pool [JOBS]
+ */
+
+#define _GNU_SOURCE
+
+#include "reimpl/pthr.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef PTHR_THREAD_POOL
+#define LABEL "pool"
+#else
+#define LABEL "plain"
+#endif
+
+#define MAX_TIDS 4096
+
+static volatile int tids[MAX_TIDS];
+static volatile int num_tids;
+static volatile uint64_t started_at;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void note_tid(void) {
+    int tid = (int) syscall(SYS_gettid);
+    int n = __atomic_load_n(&num_tids, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++)
+        if (tids[i] == tid)
+            return;
+
+    int slot = __atomic_fetch_add(&num_tids, 1, __ATOMIC_ACQ_REL);
+    if (slot < MAX_TIDS)
+        tids[slot] = tid;
+}
+
+static void * job(void * arg) {
+    __atomic_store_n(&started_at, now_ns(), __ATOMIC_RELEASE);
+
+    volatile char stack[64 * 1024];
+    memset((char *) stack, 1, sizeof(stack));
+
+    note_tid();
+    return arg;
+}
+
+static long page_faults(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt + usage.ru_majflt;
+}
+
+// Create and join one thread at a time
+static void joined(int jobs) {
+    num_tids = 0;
+    long faults = page_faults();
+    uint64_t to_start = 0, total = 0;
+
+    for (int i = 0; i < jobs; i++) {
+        pthread_t t;
+        uint64_t start = now_ns();
+        pthread_create_soloader(&t, NULL, job, NULL);
+        pthread_join_soloader(t, NULL);
+        total += now_ns() - start;
+        to_start += started_at - start;
+    }
+
+    printf("%-6s %-22s %10.2f %12.2f %10d %12.1f\n", LABEL, "create+join", total / 1e3 / jobs,
+           to_start / 1e3 / jobs, num_tids, (double) (page_faults() - faults) / jobs);
+}
+
+static int burst_done;
+
+static void * burst_job(void * arg) {
+    job(arg);
+    sem_post_soloader(&burst_done);
+    return NULL;
+}
+
+// Bursts of 8 detached threads, like a streaming batch
+static void detached_bursts(int jobs) {
+    num_tids = 0;
+    sem_init_soloader(&burst_done, 0, 0);
+    long faults = page_faults();
+    uint64_t start = now_ns();
+
+    pthread_attr_t_bionic attr = { 0 };
+    pthread_attr_init_soloader(&attr);
+    pthread_attr_setdetachstate_soloader(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (int i = 0; i < jobs; i += 8) {
+        for (int j = 0; j < 8; j++) {
+            pthread_t t;
+            pthread_create_soloader(&t, &attr, burst_job, NULL);
+        }
+        for (int j = 0; j < 8; j++)
+            sem_wait_soloader(&burst_done);
+    }
+
+    uint64_t total = now_ns() - start;
+    pthread_attr_destroy_soloader(&attr);
+    printf("%-6s %-22s %10.2f %12s %10d %12.1f\n", LABEL, "detached bursts of 8", total / 1e3 / jobs, "-",
+           num_tids, (double) (page_faults() - faults) / jobs);
+}
+
+int main(int argc, char ** argv) {
+    int jobs = argc > 1 ? atoi(argv[1]) : 5000;
+    if (jobs < 8)
+        return 1;
+
+    printf("%-6s %-22s %10s %12s %10s %12s\n", "build", "case", "us/job", "us to start", "threads",
+           "faults/job");
+    joined(jobs);
+    detached_bursts(jobs);
+    return 0;
+}
@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  pthr_mutex_contention.c
+ * @brief N threads, each locking and unlocking a mutex of its own, with the
+ *        in-place mutexes of reimpl/pthr.c against the registry-based shim
+ *        they replaced.
+ *
+ * No two threads share a mutex, so any slowdown with more threads is the
+ * shim's own serialization. The legacy shim looked every mutex up in a
+ * 1024-slot registry under one global lock; OTHER_OBJECTS registered mutexes
+ * stand in for the rest of a game's and sit in front of the bench's own.
+ *
+ * The legacy code is copied here as it was, over the host's glibc mutex and
+ * the shim's LwMutex instead of newlib's and the kernel's. On a single-CPU
+ * host the threads only contend when one is preempted inside the global
+ * lock; on the Vita's three cores they contend all the time.
+ *
+ *   bench_pthr_mutex_contention [ITERATIONS] [OTHER_OBJECTS]
+ */
+
+#define _GNU_SOURCE
+
+#include "reimpl/pthr.h"
+
+#include <psp2/kernel/threadmgr.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Legacy implementation
+ */
+
+#define PTHR_MAX_OBJECTS 1024
+
+typedef struct {
+    pthread_mutex_t * real_ptr;
+} legacy_mutex_t;
+
+static void * initializedObjects[PTHR_MAX_OBJECTS];
+static SceKernelLwMutexWork pthr_mutex;
+
+static int isObjectInitialized(const void * mut) {
+    sceKernelLockLwMutex(&pthr_mutex, 1, NULL);
+    for (int i = 0; i < PTHR_MAX_OBJECTS; ++i) {
+        if (initializedObjects[i] == mut) {
+            sceKernelUnlockLwMutex(&pthr_mutex, 1);
+            return 1;
+        }
+    }
+    sceKernelUnlockLwMutex(&pthr_mutex, 1);
+    return 0;
+}
+
+static int rememberObject(void * mut) {
+    sceKernelLockLwMutex(&pthr_mutex, 1, NULL);
+    for (int i = 0; i < PTHR_MAX_OBJECTS; ++i) {
+        if (initializedObjects[i] == 0) {
+            initializedObjects[i] = mut;
+            sceKernelUnlockLwMutex(&pthr_mutex, 1);
+            return 1;
+        }
+    }
+    sceKernelUnlockLwMutex(&pthr_mutex, 1);
+    return 0;
+}
+
+static void legacy_static_init(legacy_mutex_t * mutex) {
+    if (isObjectInitialized(mutex))
+        return;
+    mutex->real_ptr = malloc(sizeof(pthread_mutex_t));
+    pthread_mutex_init(mutex->real_ptr, NULL);
+    rememberObject(mutex);
+}
+
+static int legacy_lock(void * m) {
+    legacy_mutex_t * mutex = m;
+    legacy_static_init(mutex);
+    return pthread_mutex_lock(mutex->real_ptr);
+}
+
+static int legacy_unlock(void * m) {
+    legacy_mutex_t * mutex = m;
+    if (!mutex->real_ptr) return EINVAL;
+    return pthread_mutex_unlock(mutex->real_ptr);
+}
+
+/*
+ * Implementations under test
+ */
+
+static int inplace_lock(void * m) {
+    return pthread_mutex_lock_soloader(m);
+}
+
+static int inplace_unlock(void * m) {
+    return pthread_mutex_unlock_soloader(m);
+}
+
+static int glibc_lock(void * m) {
+    return pthread_mutex_lock(m);
+}
+
+static int glibc_unlock(void * m) {
+    return pthread_mutex_unlock(m);
+}
+
+typedef struct {
+    const char * name;
+    int (*lock)(void *);
+    int (*unlock)(void *);
+} impl;
+
+static const impl impls[] = {
+    { "in-place", inplace_lock, inplace_unlock },
+    { "legacy", legacy_lock, legacy_unlock },
+    { "glibc", glibc_lock, glibc_unlock },
+};
+
+#define MAX_THREADS 8
+
+// One mutex per cache line; big enough for any of the three layouts
+typedef union {
+    pthread_mutex_t_bionic inplace;
+    legacy_mutex_t legacy;
+    pthread_mutex_t glibc;
+    char pad[64];
+} slot;
+
+static slot mutexes[MAX_THREADS] __attribute__((aligned(64)));
+
+typedef struct {
+    const impl * im;
+    void * mutex;
+    int iterations;
+    volatile int * go;
+} worker_arg;
+
+static void * worker(void * p) {
+    worker_arg * a = p;
+    while (!__atomic_load_n(a->go, __ATOMIC_ACQUIRE))
+        sched_yield();
+    for (int i = 0; i < a->iterations; i++) {
+        a->im->lock(a->mutex);
+        a->im->unlock(a->mutex);
+    }
+    return NULL;
+}
+
+// Wall time per lock+unlock pair, over all threads
+static double run(const impl * im, int threads, int iterations) {
+    for (int i = 0; i < MAX_THREADS; i++) {
+        if (im->lock == glibc_lock)
+            pthread_mutex_init(&mutexes[i].glibc, NULL);
+        else if (im->lock == inplace_lock)
+            pthread_mutex_init_soloader(&mutexes[i].inplace, NULL);
+        // legacy ones stay registered, initialized on first lock
+    }
+
+    volatile int go = 0;
+    pthread_t t[MAX_THREADS];
+    worker_arg args[MAX_THREADS];
+    for (int i = 0; i < threads; i++) {
+        args[i] = (worker_arg) { im, &mutexes[i], iterations, &go };
+        pthread_create(&t[i], NULL, worker, &args[i]);
+    }
+
+    uint64_t start = now_ns();
+    __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < threads; i++)
+        pthread_join(t[i], NULL);
+    return (double) (now_ns() - start) / ((double) threads * iterations);
+}
+
+int main(int argc, char ** argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 1000000;
+    int others = argc > 2 ? atoi(argv[2]) : 128;
+    if (iterations <= 0 || others < 0 || others > PTHR_MAX_OBJECTS - MAX_THREADS)
+        return 1;
+
+    sceKernelCreateLwMutex(&pthr_mutex, "log_lock", 0, 0, NULL);
+    static legacy_mutex_t other[PTHR_MAX_OBJECTS];
+    for (int i = 0; i < others; i++)
+        legacy_static_init(&other[i]);
+
+    printf("ns per lock+unlock, %d iterations per thread, %d other registered mutexes\n",
+           iterations, others);
+    printf("%-10s %10s %10s %10s %10s\n", "impl", "1 thread", "2 threads", "4 threads", "8 threads");
+
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        printf("%-10s", impls[i].name);
+        for (int threads = 1; threads <= MAX_THREADS; threads *= 2)
+            printf(" %10.1f", run(&impls[i], threads, iterations));
+        printf("\n");
+    }
+    return 0;
+}
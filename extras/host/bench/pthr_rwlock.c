@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  pthr_rwlock.c
+ * @brief Read-mostly cache behind the bionic rwlock of reimpl/pthr.c, against
+ *        the same cache behind a shim mutex (what such caches were reduced to
+ *        before the rwlock existed) and behind glibc's rwlock for reference.
+ *
+ * N readers look keys up in a small table while one writer replaces an
+ * entry every WRITE_EVERY reads of its own. Reported are reader lookups
+ * per second over all readers, the writer's updates per second, and the
+ * uncontended cost of a read lock plus unlock and of a spinlock round.
+ *
+ * On a single-CPU host readers only overlap when one is preempted while
+ * holding the lock, so the rwlock cannot pull ahead of the mutex there; it
+ * takes the Vita's three cores for readers to run side by side. What the
+ * host does show is fairness: the writer's update rate should keep up with
+ * the mutex's, where glibc's reader-preferring rwlock starves it.
+ *
+ *   bench_pthr_rwlock [MILLISECONDS] [WRITE_EVERY]
+ */
+
+#define _GNU_SOURCE
+
+#include "reimpl/pthr.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Locks under test, behind one read/write interface
+ */
+
+static union {
+    pthread_rwlock_t_bionic bionic;
+    pthread_mutex_t_bionic mutex;
+    pthread_rwlock_t glibc;
+} lock;
+
+static void bionic_init(void) {
+    pthread_rwlock_init_soloader(&lock.bionic, NULL);
+}
+
+static void bionic_rd(void) {
+    pthread_rwlock_rdlock_soloader(&lock.bionic);
+}
+
+static void bionic_wr(void) {
+    pthread_rwlock_wrlock_soloader(&lock.bionic);
+}
+
+static void bionic_unlock(void) {
+    pthread_rwlock_unlock_soloader(&lock.bionic);
+}
+
+static void mutex_init(void) {
+    pthread_mutex_init_soloader(&lock.mutex, NULL);
+}
+
+static void mutex_lock(void) {
+    pthread_mutex_lock_soloader(&lock.mutex);
+}
+
+static void mutex_unlock(void) {
+    pthread_mutex_unlock_soloader(&lock.mutex);
+}
+
+static void glibc_init(void) {
+    pthread_rwlock_init(&lock.glibc, NULL);
+}
+
+static void glibc_rd(void) {
+    pthread_rwlock_rdlock(&lock.glibc);
+}
+
+static void glibc_wr(void) {
+    pthread_rwlock_wrlock(&lock.glibc);
+}
+
+static void glibc_unlock(void) {
+    pthread_rwlock_unlock(&lock.glibc);
+}
+
+typedef struct {
+    const char * name;
+    void (*init)(void);
+    void (*rd)(void);
+    void (*wr)(void);
+    void (*unlock)(void);
+} impl;
+
+static const impl impls[] = {
+    { "rwlock", bionic_init, bionic_rd, bionic_wr, bionic_unlock },
+    { "mutex", mutex_init, mutex_lock, mutex_lock, mutex_unlock },
+    { "glibc", glibc_init, glibc_rd, glibc_wr, glibc_unlock },
+};
+
+/*
+ * The cache: a small open table of key/value pairs
+ */
+
+#define CACHE_SIZE 64
+
+static volatile uint32_t cache_keys[CACHE_SIZE];
+static volatile uint32_t cache_values[CACHE_SIZE];
+
+static uint32_t cache_lookup(uint32_t key) {
+    for (int i = 0; i < CACHE_SIZE; i++)
+        if (cache_keys[i] == key)
+            return cache_values[i];
+    return 0;
+}
+
+#define MAX_READERS 8
+
+static volatile int running;
+static volatile int inconsistent;
+
+typedef struct {
+    const impl * im;
+    int seed;
+    int write_every;
+    uint64_t ops;
+} worker_arg;
+
+static void * reader(void * p) {
+    worker_arg * a = p;
+    uint32_t x = a->seed;
+    uint64_t ops = 0;
+
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        x = x * 1103515245 + 12345;
+        uint32_t key = (x >> 16) % CACHE_SIZE;
+
+        a->im->rd();
+        // A writer keeps value == key * 3 + generation * CACHE_SIZE * 3
+        uint32_t value = cache_lookup(key);
+        if (value % (CACHE_SIZE * 3) != key * 3)
+            inconsistent = 1;
+        a->im->unlock();
+        ops++;
+    }
+
+    a->ops = ops;
+    return NULL;
+}
+
+static void * writer(void * p) {
+    worker_arg * a = p;
+    uint64_t ops = 0;
+    uint32_t generation = 0;
+
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        for (int i = 0; i < a->write_every; i++)
+            cache_lookup(i % CACHE_SIZE); // read-side work of its own, unlocked
+
+        a->im->wr();
+        int slot = ops % CACHE_SIZE;
+        if (slot == 0)
+            generation++;
+        cache_keys[slot] = CACHE_SIZE; // briefly absent, a reader would see 0
+        cache_values[slot] = slot * 3 + generation * CACHE_SIZE * 3;
+        cache_keys[slot] = slot;
+        a->im->unlock();
+        ops++;
+    }
+
+    a->ops = ops;
+    return NULL;
+}
+
+static void run(const impl * im, int readers, int ms, int write_every) {
+    im->init();
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        cache_keys[i] = i;
+        cache_values[i] = i * 3;
+    }
+    inconsistent = 0;
+    running = 1;
+
+    pthread_t t[MAX_READERS + 1];
+    worker_arg args[MAX_READERS + 1];
+    for (int i = 0; i < readers; i++) {
+        args[i] = (worker_arg) { im, i * 7919 + 1, write_every, 0 };
+        pthread_create(&t[i], NULL, reader, &args[i]);
+    }
+    args[readers] = (worker_arg) { im, 0, write_every, 0 };
+    pthread_create(&t[readers], NULL, writer, &args[readers]);
+
+    uint64_t start = now_ns();
+    struct timespec duration = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&duration, NULL);
+    __atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+
+    uint64_t reads = 0;
+    for (int i = 0; i <= readers; i++) {
+        pthread_join(t[i], NULL);
+        if (i < readers)
+            reads += args[i].ops;
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    printf("%-8s %8d %14.2f %14.0f%s\n", im->name, readers, reads / seconds / 1e6,
+           args[readers].ops / seconds, inconsistent ? "  INCONSISTENT" : "");
+}
+
+// Uncontended read lock + unlock, ns
+static double uncontended(const impl * im, int n) {
+    im->init();
+    uint64_t start = now_ns();
+    for (int i = 0; i < n; i++) {
+        im->rd();
+        im->unlock();
+    }
+    return (double) (now_ns() - start) / n;
+}
+
+static double spin_round(int n) {
+    pthread_spinlock_t_bionic spin;
+    pthread_spin_init_soloader(&spin, 0);
+    uint64_t start = now_ns();
+    for (int i = 0; i < n; i++) {
+        pthread_spin_lock_soloader(&spin);
+        pthread_spin_unlock_soloader(&spin);
+    }
+    return (double) (now_ns() - start) / n;
+}
+
+int main(int argc, char ** argv) {
+    int ms = argc > 1 ? atoi(argv[1]) : 500;
+    int write_every = argc > 2 ? atoi(argv[2]) : 1000;
+    if (ms <= 0 || write_every <= 0)
+        return 1;
+
+    printf("uncontended ns:");
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++)
+        printf(" %s %.1f,", impls[i].name, uncontended(&impls[i], 10000000));
+    printf(" spinlock %.1f\n\n", spin_round(10000000));
+
+    printf("one writer, an update every %d of its own lookups, %d ms per row\n", write_every, ms);
+    printf("%-8s %8s %14s %14s\n", "impl", "readers", "Mlookups/s", "updates/s");
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++)
+        for (int readers = 1; readers <= MAX_READERS; readers *= 2)
+            run(&impls[i], readers, ms, write_every);
+    return 0;
+}
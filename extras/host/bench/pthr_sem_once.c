@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  pthr_sem_once.c
+ * @brief Micro-benchmark of the futex-word semaphores and pthread_once in
+ *        reimpl/pthr.c against the versions they replaced: a kernel
+ *        semaphore per sem_t, and a bare test-and-set once.
+ *
+ * The legacy code is copied here as it was. On the host its kernel calls
+ * are the pthread-based shim's, which are cheaper than real syscalls, so
+ * the legacy numbers are a lower bound of what it costs on the Vita.
+ *
+ *   bench_pthr_sem_once
+ */
+
+#define _GNU_SOURCE
+
+#include "reimpl/pthr.h"
+
+#include <psp2/kernel/threadmgr.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Legacy implementation
+ */
+
+static int legacy_sem_init(int * uid, int pshared, unsigned int value) {
+    *uid = sceKernelCreateSema("sema", 0, (int) value, 0x7fffffff, NULL);
+    return *uid < 0 ? -1 : 0;
+}
+
+static int legacy_sem_destroy(int * uid) {
+    return sceKernelDeleteSema(*uid) < 0 ? -1 : 0;
+}
+
+static int legacy_sem_post(int * uid) {
+    return sceKernelSignalSema(*uid, 1) < 0 ? -1 : 0;
+}
+
+static int legacy_sem_wait(int * uid) {
+    return sceKernelWaitSema(*uid, 1, NULL) < 0 ? -1 : 0;
+}
+
+static int legacy_sem_trywait(int * uid) {
+    SceUInt timeout = 1000;
+    return sceKernelWaitSema(*uid, 1, &timeout) < 0 ? -1 : 0;
+}
+
+static int legacy_once(volatile int * once_control, void (*init_routine)(void)) {
+    if (!once_control || !init_routine)
+        return -1;
+    if (__sync_lock_test_and_set(once_control, 1) == 0)
+        (*init_routine)();
+    return 0;
+}
+
+typedef struct {
+    const char * name;
+    int (*init)(int *, int, unsigned int);
+    int (*destroy)(int *);
+    int (*post)(int *);
+    int (*wait)(int *);
+    int (*trywait)(int *);
+    int (*once)(volatile int *, void (*)(void));
+} impl;
+
+static const impl impls[] = {
+    { "futex", sem_init_soloader, sem_destroy_soloader, sem_post_soloader, sem_wait_soloader,
+      sem_trywait_soloader, pthread_once_soloader },
+    { "legacy", legacy_sem_init, legacy_sem_destroy, legacy_sem_post, legacy_sem_wait,
+      legacy_sem_trywait, legacy_once },
+};
+
+/*
+ * Cases, each returns ns per operation
+ */
+
+static double post_wait(const impl * im, int n) {
+    int sem;
+    im->init(&sem, 0, 0);
+    uint64_t start = now_ns();
+    for (int i = 0; i < n; i++) {
+        im->post(&sem);
+        im->wait(&sem);
+    }
+    uint64_t ns = now_ns() - start;
+    im->destroy(&sem);
+    return (double) ns / n;
+}
+
+static double trywait_empty(const impl * im, int n) {
+    int sem;
+    im->init(&sem, 0, 0);
+    uint64_t start = now_ns();
+    for (int i = 0; i < n; i++)
+        im->trywait(&sem);
+    uint64_t ns = now_ns() - start;
+    im->destroy(&sem);
+    return (double) ns / n;
+}
+
+typedef struct {
+    const impl * im;
+    int * ping;
+    int * pong;
+    int n;
+} pong_arg;
+
+static void * pong_thread(void * p) {
+    pong_arg * a = p;
+    for (int i = 0; i < a->n; i++) {
+        a->im->wait(a->ping);
+        a->im->post(a->pong);
+    }
+    return NULL;
+}
+
+// Hand-off between two threads, per round trip
+static double ping_pong(const impl * im, int n) {
+    int ping, pong;
+    im->init(&ping, 0, 0);
+    im->init(&pong, 0, 0);
+
+    pong_arg a = { im, &ping, &pong, n };
+    pthread_t t;
+    pthread_create(&t, NULL, pong_thread, &a);
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < n; i++) {
+        im->post(&ping);
+        im->wait(&pong);
+    }
+    uint64_t ns = now_ns() - start;
+
+    pthread_join(t, NULL);
+    im->destroy(&ping);
+    im->destroy(&pong);
+    return (double) ns / n;
+}
+
+static void nothing(void) {
+}
+
+static double once_done(const impl * im, int n) {
+    volatile int control = 0;
+    im->once(&control, nothing);
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < n; i++)
+        im->once(&control, nothing);
+    return (double) (now_ns() - start) / n;
+}
+
+int main() {
+    printf("%-8s %18s %18s %18s %18s\n", "impl", "post+wait ns", "trywait empty ns",
+           "ping-pong ns", "once (done) ns");
+
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        const impl * im = &impls[i];
+        // The legacy trywait sleeps for its 1 ms timeout every time
+        int trywaits = im->trywait == legacy_sem_trywait ? 200 : 1000000;
+        printf("%-8s %18.1f %18.1f %18.1f %18.2f\n", im->name,
+               post_wait(im, 1000000), trywait_empty(im, trywaits),
+               ping_pong(im, 100000), once_done(im, 10000000));
+    }
+    return 0;
+}
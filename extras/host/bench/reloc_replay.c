@@ -0,0 +1,490 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  reloc_replay.c
+ * @brief Replays the import relocations of an Android .so through the
+ *        default_dynlib lookup as so_resolve() does it, and as it did before
+ *        the index: a strcmp scan over the whole table for every relocation.
+ *
+ * The .so is read through the same sections as so_load() uses: .dynsym,
+ * .dynstr, .rel.dyn and .rel.plt. Only the symbol lookups are replayed;
+ * writing the results into the module costs the same in every variant.
+ *
+ * The index is the one gen_dynlib_index.py generates from source/dynlib.c
+ * in its default configuration, so table size and probe pattern are the
+ * Vita build's. so_dynlib_find() is copied from so_util.c, which only
+ * builds with VitaSDK; every table entry is looked up through the copy
+ * before timing, so a copy out of step with the generator fails loudly.
+ *
+ *   bench_reloc_replay libsmashhit.so [ROUNDS]
+ *   bench_reloc_replay --synthetic out.so
+ */
+
+#define _GNU_SOURCE
+
+#include "so_util/so_util.h"
+#include "dynlib_names.h"
+#include "dynlib_index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Lookup, as in lib/so_util/so_util.c
+ */
+
+uint32_t so_dynlib_hash(const char *symbol, uint32_t seed) {
+    uint32_t h = 0x811c9dc5 ^ seed;
+    while (*symbol) {
+        h ^= (uint8_t)*symbol++;
+        h *= 0x01000193;
+    }
+    return h;
+}
+
+static inline uint32_t so_fmix32(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+so_default_dynlib *so_dynlib_find(const so_dynlib_index *index, const char *symbol) {
+    uint32_t h = so_dynlib_hash(symbol, index->seed);
+    uint32_t disp = index->disp[h & (index->num_disp - 1)];
+    uint32_t slot = so_fmix32(h ^ (disp * 0x9e3779b9)) & (index->num_slots - 1);
+
+    uint16_t i = index->slots[slot];
+    if (i == SO_DYNLIB_EMPTY || strcmp(index->entries[i].symbol, symbol) != 0)
+        return NULL;
+
+    return &index->entries[i];
+}
+
+static so_default_dynlib default_dynlib[DEFAULT_DYNLIB_COUNT];
+
+static const so_dynlib_index default_dynlib_index = {
+    .entries = default_dynlib,
+    .num_entries = DEFAULT_DYNLIB_COUNT,
+    .seed = DEFAULT_DYNLIB_SEED,
+    .disp = default_dynlib_disp,
+    .num_disp = sizeof(default_dynlib_disp) / sizeof(default_dynlib_disp[0]),
+    .slots = default_dynlib_slots,
+    .num_slots = sizeof(default_dynlib_slots) / sizeof(default_dynlib_slots[0]),
+};
+
+static int dynlib_setup(void) {
+    for (int i = 0; i < DEFAULT_DYNLIB_COUNT; i++) {
+        default_dynlib[i].symbol = (char *) default_dynlib_names[i];
+        default_dynlib[i].func = 0x1000 + i * 4;
+    }
+    for (int i = 0; i < DEFAULT_DYNLIB_COUNT; i++) {
+        if (so_dynlib_find(&default_dynlib_index, default_dynlib_names[i]) != &default_dynlib[i]) {
+            fprintf(stderr, "so_dynlib_find() is out of step with gen_dynlib_index.py at \"%s\"\n",
+                    default_dynlib_names[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The module, as much of it as so_resolve() reads
+ */
+
+typedef struct {
+    char *dynstr;
+    Elf32_Sym *dynsym;
+    int num_dynsym;
+    Elf32_Rel *reldyn, *relplt;
+    int num_reldyn, num_relplt;
+} module;
+
+static void *read_file(const char *path, size_t *size) {
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    void *data = malloc(*size);
+    if (data && fread(data, 1, *size, f) != *size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+static int module_load(module *mod, const char *path) {
+    size_t size;
+    uint8_t *data = read_file(path, &size);
+    if (!data) {
+        fprintf(stderr, "%s: could not read\n", path);
+        return -1;
+    }
+
+    Elf32_Ehdr *ehdr = (Elf32_Ehdr *) data;
+    if (size < sizeof(Elf32_Ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr->e_ident[EI_CLASS] != ELFCLASS32 || ehdr->e_machine != EM_ARM ||
+        ehdr->e_shoff + (size_t) ehdr->e_shnum * sizeof(Elf32_Shdr) > size ||
+        ehdr->e_shstrndx >= ehdr->e_shnum) {
+        fprintf(stderr, "%s: not a 32-bit ARM ELF with section headers\n", path);
+        return -1;
+    }
+
+    Elf32_Shdr *shdr = (Elf32_Shdr *) (data + ehdr->e_shoff);
+    const char *shstrtab = (const char *) data + shdr[ehdr->e_shstrndx].sh_offset;
+
+    memset(mod, 0, sizeof(module));
+    for (int i = 0; i < ehdr->e_shnum; i++) {
+        if (shdr[i].sh_offset + (size_t) shdr[i].sh_size > size && shdr[i].sh_type != SHT_NOBITS)
+            continue;
+
+        const char *sh_name = shstrtab + shdr[i].sh_name;
+        void *sh_data = data + shdr[i].sh_offset;
+
+        if (strcmp(sh_name, ".dynstr") == 0) {
+            mod->dynstr = sh_data;
+        } else if (strcmp(sh_name, ".dynsym") == 0) {
+            mod->dynsym = sh_data;
+            mod->num_dynsym = shdr[i].sh_size / sizeof(Elf32_Sym);
+        } else if (strcmp(sh_name, ".rel.dyn") == 0) {
+            mod->reldyn = sh_data;
+            mod->num_reldyn = shdr[i].sh_size / sizeof(Elf32_Rel);
+        } else if (strcmp(sh_name, ".rel.plt") == 0) {
+            mod->relplt = sh_data;
+            mod->num_relplt = shdr[i].sh_size / sizeof(Elf32_Rel);
+        }
+    }
+
+    if (!mod->dynstr || !mod->dynsym || (!mod->reldyn && !mod->relplt)) {
+        fprintf(stderr, "%s: no .dynsym, .dynstr or relocations\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static inline Elf32_Rel *module_rel(const module *mod, int i) {
+    return i < mod->num_reldyn ? &mod->reldyn[i] : &mod->relplt[i - mod->num_reldyn];
+}
+
+static inline int is_import(const module *mod, const Elf32_Rel *rel) {
+    int type = ELF32_R_TYPE(rel->r_info);
+    return (type == R_ARM_ABS32 || type == R_ARM_GLOB_DAT || type == R_ARM_JUMP_SLOT) &&
+           mod->dynsym[ELF32_R_SYM(rel->r_info)].st_shndx == SHN_UNDEF;
+}
+
+/*
+ * Resolvers, each writes what every relocation resolved to into `out`
+ */
+
+// Before the index: every relocation scans default_dynlib
+static void resolve_scan(const module *mod, uintptr_t *out) {
+    for (int i = 0; i < mod->num_reldyn + mod->num_relplt; i++) {
+        Elf32_Rel *rel = module_rel(mod, i);
+        if (!is_import(mod, rel))
+            continue;
+
+        const char *name = mod->dynstr + mod->dynsym[ELF32_R_SYM(rel->r_info)].st_name;
+        out[i] = 0;
+        for (int j = 0; j < DEFAULT_DYNLIB_COUNT; j++) {
+            if (strcmp(name, default_dynlib[j].symbol) == 0) {
+                out[i] = default_dynlib[j].func;
+                break;
+            }
+        }
+    }
+}
+
+// One index probe per relocation
+static void resolve_index(const module *mod, uintptr_t *out) {
+    for (int i = 0; i < mod->num_reldyn + mod->num_relplt; i++) {
+        Elf32_Rel *rel = module_rel(mod, i);
+        if (!is_import(mod, rel))
+            continue;
+
+        so_default_dynlib *entry = so_dynlib_find(&default_dynlib_index,
+                                                  mod->dynstr + mod->dynsym[ELF32_R_SYM(rel->r_info)].st_name);
+        out[i] = entry ? entry->func : 0;
+    }
+}
+
+#define SO_SYM_UNKNOWN    0
+#define SO_SYM_DEFAULT    1
+#define SO_SYM_UNRESOLVED 3
+
+// What so_resolve() does: one probe per dynsym entry, cached
+static void resolve_index_cached(const module *mod, uintptr_t *out) {
+    uint8_t *sym_state = calloc(mod->num_dynsym, sizeof(uint8_t));
+    uintptr_t *sym_value = malloc(mod->num_dynsym * sizeof(uintptr_t));
+
+    for (int i = 0; i < mod->num_reldyn + mod->num_relplt; i++) {
+        Elf32_Rel *rel = module_rel(mod, i);
+        if (!is_import(mod, rel))
+            continue;
+
+        int sym_idx = ELF32_R_SYM(rel->r_info);
+        if (sym_state[sym_idx] == SO_SYM_UNKNOWN) {
+            so_default_dynlib *entry = so_dynlib_find(&default_dynlib_index, mod->dynstr + mod->dynsym[sym_idx].st_name);
+            if (entry) {
+                sym_value[sym_idx] = entry->func;
+                sym_state[sym_idx] = SO_SYM_DEFAULT;
+            } else {
+                sym_state[sym_idx] = SO_SYM_UNRESOLVED;
+            }
+        }
+        out[i] = sym_state[sym_idx] == SO_SYM_DEFAULT ? sym_value[sym_idx] : 0;
+    }
+
+    free(sym_value);
+    free(sym_state);
+}
+
+typedef struct {
+    const char *name;
+    void (*resolve)(const module *, uintptr_t *);
+} resolver;
+
+static const resolver resolvers[] = {
+    { "scan", resolve_scan },
+    { "index", resolve_index },
+    { "index+cache", resolve_index_cached },
+};
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static int replay(const char *path, int rounds) {
+    module mod;
+    if (module_load(&mod, path) < 0)
+        return 1;
+
+    int num_rel = mod.num_reldyn + mod.num_relplt;
+    int imports = 0, found = 0, symbols = 0;
+    uint8_t *seen = calloc(mod.num_dynsym, 1);
+    for (int i = 0; i < num_rel; i++) {
+        Elf32_Rel *rel = module_rel(&mod, i);
+        if (!is_import(&mod, rel))
+            continue;
+        imports++;
+        int sym_idx = ELF32_R_SYM(rel->r_info);
+        if (!seen[sym_idx]) {
+            seen[sym_idx] = 1;
+            symbols++;
+            if (so_dynlib_find(&default_dynlib_index, mod.dynstr + mod.dynsym[sym_idx].st_name))
+                found++;
+        }
+    }
+    free(seen);
+
+    printf("%s: %d relocations, %d to imports, %d imported symbols, %d of them in default_dynlib (%d entries)\n",
+           path, num_rel, imports, symbols, found, DEFAULT_DYNLIB_COUNT);
+    printf("%-12s %12s %12s %12s %14s\n", "resolver", "first us", "median us", "min us", "ns/import rel");
+
+    uintptr_t *expected = calloc(num_rel, sizeof(uintptr_t));
+    uintptr_t *out = calloc(num_rel, sizeof(uintptr_t));
+    uint64_t *times = malloc(rounds * sizeof(uint64_t));
+    resolve_scan(&mod, expected);
+
+    for (size_t r = 0; r < sizeof(resolvers) / sizeof(resolvers[0]); r++) {
+        for (int i = 0; i < rounds; i++) {
+            uint64_t start = now_ns();
+            resolvers[r].resolve(&mod, out);
+            times[i] = now_ns() - start;
+        }
+        if (memcmp(out, expected, num_rel * sizeof(uintptr_t)) != 0) {
+            fprintf(stderr, "%s resolved differently from the scan\n", resolvers[r].name);
+            return 1;
+        }
+
+        uint64_t first = times[0];
+        qsort(times, rounds, sizeof(uint64_t), cmp_u64);
+        printf("%-12s %12.1f %12.1f %12.1f %14.1f\n", resolvers[r].name, first / 1e3, times[rounds / 2] / 1e3,
+               times[0] / 1e3, imports ? (double) times[rounds / 2] / imports : 0.0);
+    }
+
+    free(times);
+    free(out);
+    free(expected);
+    return 0;
+}
+
+/*
+ * Synthetic module, for when no real .so is at hand. Shaped after a game
+ * binary: most relocations are RELATIVE or point at its own symbols, popular
+ * imports are referenced many times, and a few imports are not provided by
+ * default_dynlib at all, which is the scan's worst case.
+ */
+
+#define SYN_IMPORTS     700
+#define SYN_UNKNOWN     60
+#define SYN_DEFINED     3000
+#define SYN_RELATIVE    25000
+#define SYN_ABS_DEFINED 6000
+#define SYN_ABS_IMPORTS 1500
+
+static uint32_t syn_x = 2024;
+
+static uint32_t syn_rand(uint32_t n) {
+    syn_x = syn_x * 1103515245 + 12345;
+    return (syn_x >> 8) % n;
+}
+
+typedef struct {
+    char *data;
+    size_t len, cap;
+} buffer;
+
+static size_t buf_put(buffer *b, const void *data, size_t len) {
+    if (b->len + len > b->cap) {
+        b->cap = (b->len + len) * 2;
+        b->data = realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return b->len - len;
+}
+
+static size_t buf_str(buffer *b, const char *s) {
+    return buf_put(b, s, strlen(s) + 1);
+}
+
+static int synthetic(const char *path) {
+    buffer dynstr = { 0 }, dynsym = { 0 }, reldyn = { 0 }, relplt = { 0 }, shstr = { 0 };
+    buf_str(&dynstr, "");
+    Elf32_Sym null_sym = { 0 };
+    buf_put(&dynsym, &null_sym, sizeof(null_sym));
+
+    // Imports first: distinct default_dynlib names, then unknown ones
+    int num_imports = SYN_IMPORTS + SYN_UNKNOWN;
+    uint8_t *taken = calloc(DEFAULT_DYNLIB_COUNT, 1);
+    char name[64];
+    for (int i = 0; i < num_imports; i++) {
+        const char *s;
+        if (i < SYN_IMPORTS) {
+            int j;
+            do j = syn_rand(DEFAULT_DYNLIB_COUNT); while (taken[j]);
+            taken[j] = 1;
+            s = default_dynlib_names[j];
+        } else {
+            snprintf(name, sizeof(name), "_ZN9synthetic6importEi%d", i);
+            s = name;
+        }
+        Elf32_Sym sym = { .st_name = buf_str(&dynstr, s), .st_info = ELF32_ST_INFO(STB_GLOBAL, STT_FUNC),
+                          .st_shndx = SHN_UNDEF };
+        buf_put(&dynsym, &sym, sizeof(sym));
+    }
+    free(taken);
+
+    for (int i = 0; i < SYN_DEFINED; i++) {
+        snprintf(name, sizeof(name), "_ZN4Game6methodEi%d", i);
+        Elf32_Sym sym = { .st_name = buf_str(&dynstr, name), .st_value = 0x10000 + i * 16,
+                          .st_info = ELF32_ST_INFO(STB_GLOBAL, STT_FUNC), .st_shndx = 9 };
+        buf_put(&dynsym, &sym, sizeof(sym));
+    }
+
+    // A call slot and, for about a third, a GOT entry per import
+    uint32_t offset = 0x200000;
+    for (int i = 0; i < num_imports; i++) {
+        Elf32_Rel rel = { offset += 4, ELF32_R_INFO(1 + i, R_ARM_JUMP_SLOT) };
+        buf_put(&relplt, &rel, sizeof(rel));
+        if (syn_rand(3) == 0) {
+            Elf32_Rel got = { offset += 4, ELF32_R_INFO(1 + i, R_ARM_GLOB_DAT) };
+            buf_put(&reldyn, &got, sizeof(got));
+        }
+    }
+
+    // Data references, skewed towards the first imports
+    int total = SYN_RELATIVE + SYN_ABS_DEFINED + SYN_ABS_IMPORTS;
+    for (int i = 0; i < total; i++) {
+        uint32_t k = syn_rand(total);
+        Elf32_Rel rel = { offset += 4, 0 };
+        if (k < SYN_RELATIVE) {
+            rel.r_info = ELF32_R_INFO(0, R_ARM_RELATIVE);
+        } else if (k < SYN_RELATIVE + SYN_ABS_DEFINED) {
+            rel.r_info = ELF32_R_INFO(1 + num_imports + syn_rand(SYN_DEFINED), R_ARM_ABS32);
+        } else {
+            uint32_t r = syn_rand(num_imports);
+            rel.r_info = ELF32_R_INFO(1 + r * r / num_imports, R_ARM_ABS32);
+        }
+        buf_put(&reldyn, &rel, sizeof(rel));
+    }
+
+    // Ehdr, section contents, section headers
+    buf_str(&shstr, "");
+    uint32_t names[5] = { buf_str(&shstr, ".dynstr"), buf_str(&shstr, ".dynsym"), buf_str(&shstr, ".rel.dyn"),
+                          buf_str(&shstr, ".rel.plt"), buf_str(&shstr, ".shstrtab") };
+    buffer *contents[5] = { &dynstr, &dynsym, &reldyn, &relplt, &shstr };
+    uint32_t types[5] = { SHT_STRTAB, SHT_DYNSYM, SHT_REL, SHT_REL, SHT_STRTAB };
+
+    buffer file = { 0 };
+    Elf32_Ehdr ehdr = { .e_type = ET_DYN, .e_machine = EM_ARM, .e_version = EV_CURRENT,
+                        .e_ehsize = sizeof(Elf32_Ehdr), .e_shentsize = sizeof(Elf32_Shdr),
+                        .e_shnum = 6, .e_shstrndx = 5 };
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS32;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    buf_put(&file, &ehdr, sizeof(ehdr));
+
+    Elf32_Shdr shdr[6] = { 0 };
+    for (int i = 0; i < 5; i++) {
+        while (file.len % 4)
+            buf_put(&file, "", 1);
+        shdr[1 + i] = (Elf32_Shdr) { .sh_name = names[i], .sh_type = types[i],
+                                     .sh_offset = buf_put(&file, contents[i]->data, contents[i]->len),
+                                     .sh_size = contents[i]->len, .sh_addralign = 4 };
+        if (types[i] == SHT_DYNSYM) {
+            shdr[1 + i].sh_link = 1;
+            shdr[1 + i].sh_entsize = sizeof(Elf32_Sym);
+        } else if (types[i] == SHT_REL) {
+            shdr[1 + i].sh_link = 2;
+            shdr[1 + i].sh_entsize = sizeof(Elf32_Rel);
+        }
+    }
+    while (file.len % 4)
+        buf_put(&file, "", 1);
+    ((Elf32_Ehdr *) file.data)->e_shoff = buf_put(&file, shdr, sizeof(shdr));
+
+    FILE *f = fopen(path, "wb");
+    if (!f || fwrite(file.data, 1, file.len, f) != file.len) {
+        fprintf(stderr, "%s: could not write\n", path);
+        return 1;
+    }
+    fclose(f);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (dynlib_setup() < 0)
+        return 1;
+
+    if (argc == 3 && strcmp(argv[1], "--synthetic") == 0)
+        return synthetic(argv[2]);
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s lib.so [ROUNDS] | --synthetic out.so\n", argv[0]);
+        return 1;
+    }
+
+    int rounds = argc > 2 ? atoi(argv[2]) : 20;
+    return replay(argv[1], rounds > 0 ? rounds : 1);
+}
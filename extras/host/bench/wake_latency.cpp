@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  wake_latency.cpp
+ * @brief Wake-to-return latency of a thread blocked in epoll_wait() on an
+ *        eventfd or a pipe, and in a blocking eventfd read(), measured from
+ *        the write() of another thread to the return of the blocked call.
+ *
+ * Built twice like the epoll suite: against falso_ndk, and with
+ * BENCH_LINUX_EPOLL against the real Linux calls for reference.
+ *
+ *   bench_wake_latency [ITERATIONS]
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <thread>
+#include <vector>
+
+#ifdef BENCH_LINUX_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define E_IN    EPOLLIN
+#define CTL_ADD EPOLL_CTL_ADD
+#define IMPL    "linux"
+
+typedef struct epoll_event event_t;
+
+static int ep_create() { return epoll_create1(0); }
+static int ep_ctl(int ep, int op, int fd, event_t * e) { return epoll_ctl(ep, op, fd, e); }
+static int ep_wait(int ep, event_t * e, int max, int timeout) { return epoll_wait(ep, e, max, timeout); }
+static int efd_create(bool nonblock) { return eventfd(0, nonblock ? EFD_NONBLOCK : 0); }
+static int pipe_create(int fds[2]) { return pipe(fds); }
+static ssize_t fd_read(int fd, void * buf, size_t n) { return read(fd, buf, n); }
+static ssize_t fd_write(int fd, const void * buf, size_t n) { return write(fd, buf, n); }
+static int fd_close(int fd) { return close(fd); }
+#else
+#include "PseudoEpoll.h"
+#include "polling/pseudo_eventfd.h"
+#include "polling/pseudo_pipe.h"
+
+#define E_IN    PSEUDO_EPOLLIN
+#define CTL_ADD PSEUDO_EPOLL_CTL_ADD
+#define IMPL    "falso"
+
+typedef struct pseudo_epoll_event event_t;
+
+static int ep_create() { return pseudo_epoll_create1(0); }
+static int ep_ctl(int ep, int op, int fd, event_t * e) { return pseudo_epoll_ctl(ep, op, fd, e); }
+static int ep_wait(int ep, event_t * e, int max, int timeout) { return pseudo_epoll_wait(ep, e, max, timeout); }
+static int efd_create(bool nonblock) { return pseudo_eventfd(0, nonblock ? PSEUDO_EFD_NONBLOCK : 0); }
+static int pipe_create(int fds[2]) { return pseudo_pipe(fds); }
+static ssize_t fd_read(int fd, void * buf, size_t n) { return pseudo_read(fd, buf, n); }
+static ssize_t fd_write(int fd, const void * buf, size_t n) { return pseudo_write(fd, buf, n); }
+static int fd_close(int fd) { return pseudo_close(fd); }
+#endif
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+enum wait_kind {
+    WAIT_EPOLL,
+    WAIT_READ,
+};
+
+/*
+ * The waiter announces it is about to block, the waker gives it 200 us to
+ * get there, stamps the time and writes. The waiter stamps the time on
+ * return; the difference is the latency of one wakeup.
+ */
+static std::vector<uint64_t> measure(wait_kind kind, int rfd, int wfd, int iterations) {
+    std::vector<uint64_t> samples;
+    std::atomic<int> round { -1 };
+    std::atomic<uint64_t> written_at { 0 };
+
+    int ep = -1;
+    if (kind == WAIT_EPOLL) {
+        ep = ep_create();
+        event_t e = {};
+        e.events = E_IN;
+        ep_ctl(ep, CTL_ADD, rfd, &e);
+    }
+
+    std::thread waker([&]() {
+        for (int i = 0; i < iterations; i++) {
+            while (round.load(std::memory_order_acquire) != i)
+                std::this_thread::yield();
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+
+            uint64_t one = 1;
+            written_at.store(now_us(), std::memory_order_release);
+            fd_write(wfd, &one, sizeof(one));
+        }
+    });
+
+    for (int i = 0; i < iterations; i++) {
+        uint64_t value;
+        round.store(i, std::memory_order_release);
+
+        if (kind == WAIT_EPOLL) {
+            event_t e;
+            while (ep_wait(ep, &e, 1, -1) != 1) {}
+        } else {
+            fd_read(rfd, &value, sizeof(value));
+        }
+        uint64_t now = now_us();
+        samples.push_back(now - written_at.load(std::memory_order_acquire));
+
+        if (kind == WAIT_EPOLL)
+            fd_read(rfd, &value, sizeof(value));
+    }
+
+    waker.join();
+    if (ep >= 0)
+        fd_close(ep);
+
+    std::sort(samples.begin(), samples.end());
+    return samples;
+}
+
+static void report(const char * name, const std::vector<uint64_t> & s) {
+    uint64_t sum = 0;
+    for (uint64_t v : s)
+        sum += v;
+    printf("%-6s %-22s %8.1f %8llu %8llu %8llu\n", IMPL, name, (double) sum / s.size(),
+           (unsigned long long) s[s.size() / 2], (unsigned long long) s[s.size() * 99 / 100],
+           (unsigned long long) s.back());
+}
+
+int main(int argc, char ** argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+    if (iterations < 1)
+        return 1;
+
+    printf("%-6s %-22s %8s %8s %8s %8s\n", "impl", "wait (us)", "mean", "p50", "p99", "max");
+
+    int efd = efd_create(true);
+    report("epoll_wait eventfd", measure(WAIT_EPOLL, efd, efd, iterations));
+    fd_close(efd);
+
+    int fds[2];
+    pipe_create(fds);
+    report("epoll_wait pipe", measure(WAIT_EPOLL, fds[0], fds[1], iterations));
+    fd_close(fds[0]);
+    fd_close(fds[1]);
+
+    efd = efd_create(false);
+    report("read eventfd", measure(WAIT_READ, efd, efd, iterations));
+    fd_close(efd);
+    return 0;
+}
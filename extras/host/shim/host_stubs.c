@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  host_stubs.c
+ * @brief Host replacements for the loader services the tested code logs to,
+ *        traces to or asks for policies.
+ */
+
+#include "utils/logger.h"
+#include "utils/thread_policy.h"
+#include "utils/trace.h"
+
+#include <psp2/kernel/processmgr.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+
+void _log_print(int t, const char * fmt, ...) {
+    if (t < LT_WARN)
+        return;
+
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+uint64_t trace_now() {
+    return sceKernelGetProcessTimeWide();
+}
+
+void trace_complete(const char * name, uintptr_t addr, uint64_t start, uint64_t end) {
+}
+
+const thread_policy * thread_policy_for_start(uintptr_t start) {
+    return NULL;
+}
+
+const thread_policy * thread_policy_for_name(const char * name) {
+    return NULL;
+}
+
+void thread_policy_apply_self(const thread_policy * policy) {
+}
+
+// Bionic and glibc agree on the clock ids the tested code uses
+int clock_gettime_soloader(clockid_t clock_id, struct timespec * tp) {
+    return clock_gettime(clock_id, tp);
+}
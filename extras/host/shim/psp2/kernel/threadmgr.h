@@ -0,0 +1 @@
+#include "vita_shim.h"
@@ -0,0 +1,465 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  vita_shim.c
+ * @brief Host implementation of vita_shim.h.
+ */
+
+#define _GNU_SOURCE
+
+#include "vita_shim.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHIM_MAX_OBJECTS 65536
+
+// Kernel objects are heap blocks behind a UID, which is their index + 1
+static void * objects[SHIM_MAX_OBJECTS];
+static int num_objects = 0;
+
+static SceUID shim_register(void * obj) {
+    int i = __atomic_fetch_add(&num_objects, 1, __ATOMIC_RELAXED);
+    if (i >= SHIM_MAX_OBJECTS) {
+        fprintf(stderr, "vita_shim: out of kernel objects\n");
+        abort();
+    }
+    __atomic_store_n(&objects[i], obj, __ATOMIC_RELEASE);
+    return i + 1;
+}
+
+static void * shim_lookup(SceUID id) {
+    if (id <= 0 || id > SHIM_MAX_OBJECTS)
+        return NULL;
+    return __atomic_load_n(&objects[id - 1], __ATOMIC_ACQUIRE);
+}
+
+static void shim_deadline(struct timespec * ts, SceUInt us) {
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    uint64_t ns = (uint64_t) ts->tv_nsec + (uint64_t) us * 1000;
+    ts->tv_sec += ns / 1000000000;
+    ts->tv_nsec = ns % 1000000000;
+}
+
+static void shim_cond_init(pthread_cond_t * cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/*
+ * LwMutex / LwCond
+ */
+
+typedef struct {
+    pthread_mutex_t mutex;
+} shim_lw_mutex;
+
+typedef struct {
+    pthread_cond_t cond;
+    shim_lw_mutex * mutex;
+} shim_lw_cond;
+
+int sceKernelCreateLwMutex(SceKernelLwMutexWork * work, const char * name, unsigned int attr, int count, void * opt) {
+    shim_lw_mutex * m = malloc(sizeof(shim_lw_mutex));
+    pthread_mutexattr_t a;
+    pthread_mutexattr_init(&a);
+    if (attr & SCE_KERNEL_LW_MUTEX_ATTR_RECURSIVE)
+        pthread_mutexattr_settype(&a, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&m->mutex, &a);
+    pthread_mutexattr_destroy(&a);
+
+    for (int i = 0; i < count; i++)
+        pthread_mutex_lock(&m->mutex);
+
+    memset(work, 0, sizeof(*work));
+    work->data[0] = (uintptr_t) m;
+    return 0;
+}
+
+int sceKernelDeleteLwMutex(SceKernelLwMutexWork * work) {
+    shim_lw_mutex * m = (shim_lw_mutex *) (uintptr_t) work->data[0];
+    if (!m)
+        return -1;
+    pthread_mutex_destroy(&m->mutex);
+    free(m);
+    work->data[0] = 0;
+    return 0;
+}
+
+int sceKernelLockLwMutex(SceKernelLwMutexWork * work, int count, unsigned int * timeout) {
+    shim_lw_mutex * m = (shim_lw_mutex *) (uintptr_t) work->data[0];
+    if (timeout) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t ns = (uint64_t) ts.tv_nsec + (uint64_t) *timeout * 1000;
+        ts.tv_sec += ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        if (pthread_mutex_timedlock(&m->mutex, &ts) != 0)
+            return SCE_KERNEL_ERROR_WAIT_TIMEOUT;
+        return 0;
+    }
+    pthread_mutex_lock(&m->mutex);
+    return 0;
+}
+
+int sceKernelTryLockLwMutex(SceKernelLwMutexWork * work, int count) {
+    shim_lw_mutex * m = (shim_lw_mutex *) (uintptr_t) work->data[0];
+    return pthread_mutex_trylock(&m->mutex) == 0 ? 0 : SCE_KERNEL_ERROR_LW_MUTEX_FAILED_TO_OWN;
+}
+
+int sceKernelUnlockLwMutex(SceKernelLwMutexWork * work, int count) {
+    shim_lw_mutex * m = (shim_lw_mutex *) (uintptr_t) work->data[0];
+    pthread_mutex_unlock(&m->mutex);
+    return 0;
+}
+
+int sceKernelCreateLwCond(SceKernelLwCondWork * work, const char * name, unsigned int attr,
+                          SceKernelLwMutexWork * mutex, void * opt) {
+    shim_lw_cond * c = malloc(sizeof(shim_lw_cond));
+    shim_cond_init(&c->cond);
+    c->mutex = (shim_lw_mutex *) (uintptr_t) mutex->data[0];
+
+    memset(work, 0, sizeof(*work));
+    work->data[0] = (uintptr_t) c;
+    return 0;
+}
+
+int sceKernelDeleteLwCond(SceKernelLwCondWork * work) {
+    shim_lw_cond * c = (shim_lw_cond *) (uintptr_t) work->data[0];
+    if (!c)
+        return -1;
+    pthread_cond_destroy(&c->cond);
+    free(c);
+    work->data[0] = 0;
+    return 0;
+}
+
+int sceKernelWaitLwCond(SceKernelLwCondWork * work, unsigned int * timeout) {
+    shim_lw_cond * c = (shim_lw_cond *) (uintptr_t) work->data[0];
+    if (!timeout) {
+        pthread_cond_wait(&c->cond, &c->mutex->mutex);
+        return 0;
+    }
+
+    struct timespec ts;
+    shim_deadline(&ts, *timeout);
+    if (pthread_cond_timedwait(&c->cond, &c->mutex->mutex, &ts) == ETIMEDOUT)
+        return SCE_KERNEL_ERROR_WAIT_TIMEOUT;
+    return 0;
+}
+
+int sceKernelSignalLwCond(SceKernelLwCondWork * work) {
+    shim_lw_cond * c = (shim_lw_cond *) (uintptr_t) work->data[0];
+    return pthread_cond_signal(&c->cond);
+}
+
+int sceKernelSignalLwCondAll(SceKernelLwCondWork * work) {
+    shim_lw_cond * c = (shim_lw_cond *) (uintptr_t) work->data[0];
+    return pthread_cond_broadcast(&c->cond);
+}
+
+/*
+ * Semaphores and event flags
+ */
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int count;
+    int max;
+} shim_sema;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned int bits;
+} shim_event_flag;
+
+SceUID sceKernelCreateSema(const char * name, SceUInt attr, int init, int max, void * opt) {
+    shim_sema * s = malloc(sizeof(shim_sema));
+    pthread_mutex_init(&s->mutex, NULL);
+    shim_cond_init(&s->cond);
+    s->count = init;
+    s->max = max;
+    return shim_register(s);
+}
+
+int sceKernelDeleteSema(SceUID id) {
+    // Never freed, a late waiter would otherwise touch freed memory
+    return shim_lookup(id) ? 0 : SCE_KERNEL_ERROR_ILLEGAL_THID;
+}
+
+int sceKernelWaitSema(SceUID id, int need, SceUInt * timeout) {
+    shim_sema * s = shim_lookup(id);
+    struct timespec ts;
+    if (timeout)
+        shim_deadline(&ts, *timeout);
+
+    int ret = 0;
+    pthread_mutex_lock(&s->mutex);
+    while (s->count < need) {
+        if (!timeout) {
+            pthread_cond_wait(&s->cond, &s->mutex);
+        } else if (pthread_cond_timedwait(&s->cond, &s->mutex, &ts) == ETIMEDOUT) {
+            ret = SCE_KERNEL_ERROR_WAIT_TIMEOUT;
+            break;
+        }
+    }
+    if (ret == 0)
+        s->count -= need;
+    pthread_mutex_unlock(&s->mutex);
+    return ret;
+}
+
+int sceKernelPollSema(SceUID id, int need) {
+    SceUInt zero = 0;
+    return sceKernelWaitSema(id, need, &zero);
+}
+
+int sceKernelSignalSema(SceUID id, int count) {
+    shim_sema * s = shim_lookup(id);
+    int ret = 0;
+    pthread_mutex_lock(&s->mutex);
+    if (s->count + count > s->max) {
+        ret = SCE_KERNEL_ERROR_SEMA_OVF;
+    } else {
+        s->count += count;
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return ret;
+}
+
+SceUID sceKernelCreateEventFlag(const char * name, int attr, int init, void * opt) {
+    shim_event_flag * f = malloc(sizeof(shim_event_flag));
+    pthread_mutex_init(&f->mutex, NULL);
+    shim_cond_init(&f->cond);
+    f->bits = init;
+    return shim_register(f);
+}
+
+int sceKernelDeleteEventFlag(SceUID id) {
+    return shim_lookup(id) ? 0 : SCE_KERNEL_ERROR_ILLEGAL_THID;
+}
+
+int sceKernelSetEventFlag(SceUID id, unsigned int bits) {
+    shim_event_flag * f = shim_lookup(id);
+    pthread_mutex_lock(&f->mutex);
+    f->bits |= bits;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->mutex);
+    return 0;
+}
+
+// Like the kernel, keeps only the bits that are set in `bits`
+int sceKernelClearEventFlag(SceUID id, unsigned int bits) {
+    shim_event_flag * f = shim_lookup(id);
+    pthread_mutex_lock(&f->mutex);
+    f->bits &= bits;
+    pthread_mutex_unlock(&f->mutex);
+    return 0;
+}
+
+static int shim_event_match(unsigned int bits, unsigned int pattern, unsigned int mode) {
+    return (mode & SCE_EVENT_WAITOR) ? (bits & pattern) != 0 : (bits & pattern) == pattern;
+}
+
+int sceKernelWaitEventFlag(SceUID id, unsigned int pattern, unsigned int mode, unsigned int * out, SceUInt * timeout) {
+    shim_event_flag * f = shim_lookup(id);
+    struct timespec ts;
+    if (timeout)
+        shim_deadline(&ts, *timeout);
+
+    int ret = 0;
+    pthread_mutex_lock(&f->mutex);
+    while (!shim_event_match(f->bits, pattern, mode)) {
+        if (!timeout) {
+            pthread_cond_wait(&f->cond, &f->mutex);
+        } else if (pthread_cond_timedwait(&f->cond, &f->mutex, &ts) == ETIMEDOUT) {
+            ret = SCE_KERNEL_ERROR_WAIT_TIMEOUT;
+            break;
+        }
+    }
+    if (out)
+        *out = f->bits;
+    if (ret == 0) {
+        if (mode & SCE_EVENT_WAITCLEAR)
+            f->bits = 0;
+        else if (mode & SCE_EVENT_WAITCLEAR_PAT)
+            f->bits &= ~pattern;
+    }
+    pthread_mutex_unlock(&f->mutex);
+    return ret;
+}
+
+int sceKernelPollEventFlag(SceUID id, unsigned int pattern, unsigned int mode, unsigned int * out) {
+    SceUInt zero = 0;
+    int ret = sceKernelWaitEventFlag(id, pattern, mode, out, &zero);
+    return ret == SCE_KERNEL_ERROR_WAIT_TIMEOUT ? SCE_KERNEL_ERROR_EVF_COND : ret;
+}
+
+/*
+ * Threads
+ */
+
+typedef struct {
+    pthread_t thread;
+    SceKernelThreadEntry entry;
+    SceSize stack_size;
+    SceUID id;
+    SceSize args;
+    void * argp;
+    int status;
+} shim_thread;
+
+static __thread SceUID shim_self = 0;
+
+static void * shim_thread_start(void * arg) {
+    shim_thread * t = arg;
+    shim_self = t->id;
+    t->status = t->entry(t->args, t->argp);
+    return NULL;
+}
+
+SceUID sceKernelCreateThread(const char * name, SceKernelThreadEntry entry, int priority, SceSize stack_size,
+                             SceUInt attr, int cpu_affinity, void * opt) {
+    shim_thread * t = calloc(1, sizeof(shim_thread));
+    t->entry = entry;
+    t->stack_size = stack_size;
+    t->id = shim_register(t);
+    return t->id;
+}
+
+// Like the kernel, copies the arguments onto the new thread's side
+int sceKernelStartThread(SceUID id, SceSize args, void * argp) {
+    shim_thread * t = shim_lookup(id);
+    if (!t)
+        return SCE_KERNEL_ERROR_ILLEGAL_THID;
+
+    t->args = args;
+    t->argp = NULL;
+    if (args && argp) {
+        t->argp = malloc(args);
+        memcpy(t->argp, argp, args);
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (t->stack_size >= PTHREAD_STACK_MIN)
+        pthread_attr_setstacksize(&attr, t->stack_size);
+    int ret = pthread_create(&t->thread, &attr, shim_thread_start, t);
+    pthread_attr_destroy(&attr);
+    return ret == 0 ? 0 : -1;
+}
+
+int sceKernelWaitThreadEnd(SceUID id, int * status, SceUInt * timeout) {
+    shim_thread * t = shim_lookup(id);
+    if (!t)
+        return SCE_KERNEL_ERROR_ILLEGAL_THID;
+    pthread_join(t->thread, NULL);
+    if (status)
+        *status = t->status;
+    return 0;
+}
+
+int sceKernelDeleteThread(SceUID id) {
+    return 0;
+}
+
+int sceKernelExitDeleteThread(int status) {
+    pthread_detach(pthread_self());
+    pthread_exit(NULL);
+}
+
+SceUID sceKernelGetThreadId(void) {
+    // Threads not started through the shim get an id on first use
+    if (!shim_self)
+        shim_self = shim_register(calloc(1, sizeof(shim_thread)));
+    return shim_self;
+}
+
+int sceKernelChangeThreadPriority(SceUID id, int priority) {
+    return 0;
+}
+
+int sceKernelGetThreadCurrentPriority(void) {
+    return 160;
+}
+
+int sceKernelChangeThreadCpuAffinityMask(SceUID id, int mask) {
+    return 0;
+}
+
+int sceKernelGetThreadCpuAffinityMask(SceUID id) {
+    return 0;
+}
+
+int sceKernelDelayThread(SceUInt us) {
+    struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+    return 0;
+}
+
+SceUInt64 sceKernelGetProcessTimeWide(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (SceUInt64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+SceUInt32 sceKernelGetProcessTimeLow(void) {
+    return (SceUInt32) sceKernelGetProcessTimeWide();
+}
+
+/*
+ * SceLibKernel's Clib
+ */
+
+int sceClibPrintf(const char * fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int ret = vprintf(fmt, args);
+    va_end(args);
+    return ret;
+}
+
+int sceClibSnprintf(char * buf, SceSize size, const char * fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int ret = vsnprintf(buf, size, fmt, args);
+    va_end(args);
+    return ret;
+}
+
+int sceClibVsnprintf(char * buf, SceSize size, const char * fmt, va_list args) {
+    return vsnprintf(buf, size, fmt, args);
+}
+
+void * sceClibMemcpy(void * dst, const void * src, SceSize size) {
+    return memcpy(dst, src, size);
+}
+
+void * sceClibMemset(void * dst, int c, SceSize size) {
+    return memset(dst, c, size);
+}
+
+int sceClibStrcmp(const char * a, const char * b) {
+    return strcmp(a, b);
+}
+
+void sceClibAbort(void) {
+    abort();
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  vita_shim.h
+ * @brief The part of the Vita SDK the host tests need, on top of pthreads.
+ *
+ * Only what the loader's platform-independent parts call is declared here.
+ * Semantics follow the real kernel where the code under test depends on
+ * them (timeouts, event flag wait modes, semaphore limits); priorities,
+ * affinities and object names are accepted and ignored.
+ */
+
+#ifndef SOLOADER_HOST_VITA_SHIM_H
+#define SOLOADER_HOST_VITA_SHIM_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int SceUID;
+typedef int SceInt;
+typedef int SceInt32;
+typedef unsigned int SceUInt;
+typedef unsigned int SceUInt32;
+typedef int64_t SceInt64;
+typedef uint64_t SceUInt64;
+typedef unsigned int SceSize;
+typedef int SceBool;
+
+typedef struct { uint64_t data[4]; } SceKernelLwMutexWork;
+typedef struct { uint64_t data[4]; } SceKernelLwCondWork;
+
+typedef int (*SceKernelThreadEntry)(SceSize args, void * argp);
+
+#define SCE_KERNEL_LW_MUTEX_ATTR_RECURSIVE 0x0200
+
+#define SCE_EVENT_WAITAND       0x00000000
+#define SCE_EVENT_WAITOR        0x00000001
+#define SCE_EVENT_WAITCLEAR     0x00000002
+#define SCE_EVENT_WAITCLEAR_PAT 0x00000004
+#define SCE_EVENT_WAITMULTIPLE  0x00001000
+
+#define SCE_KERNEL_CPU_MASK_USER_0   0x00010000
+#define SCE_KERNEL_CPU_MASK_USER_1   0x00020000
+#define SCE_KERNEL_CPU_MASK_USER_2   0x00040000
+#define SCE_KERNEL_CPU_MASK_USER_ALL 0x00070000
+
+#define SCE_KERNEL_DEFAULT_PRIORITY_USER 0x10000100
+
+#define SCE_KERNEL_ERROR_ILLEGAL_THID            ((int) 0x80028001)
+#define SCE_KERNEL_ERROR_WAIT_TIMEOUT            ((int) 0x80028005)
+#define SCE_KERNEL_ERROR_SEMA_OVF                ((int) 0x8002801E)
+#define SCE_KERNEL_ERROR_EVF_COND                ((int) 0x80028046)
+#define SCE_KERNEL_ERROR_LW_MUTEX_FAILED_TO_OWN  ((int) 0x80028141)
+
+int sceKernelCreateLwMutex(SceKernelLwMutexWork * work, const char * name, unsigned int attr, int count, void * opt);
+int sceKernelDeleteLwMutex(SceKernelLwMutexWork * work);
+int sceKernelLockLwMutex(SceKernelLwMutexWork * work, int count, unsigned int * timeout);
+int sceKernelTryLockLwMutex(SceKernelLwMutexWork * work, int count);
+int sceKernelUnlockLwMutex(SceKernelLwMutexWork * work, int count);
+
+int sceKernelCreateLwCond(SceKernelLwCondWork * work, const char * name, unsigned int attr, SceKernelLwMutexWork * mutex, void * opt);
+int sceKernelDeleteLwCond(SceKernelLwCondWork * work);
+int sceKernelWaitLwCond(SceKernelLwCondWork * work, unsigned int * timeout);
+int sceKernelSignalLwCond(SceKernelLwCondWork * work);
+int sceKernelSignalLwCondAll(SceKernelLwCondWork * work);
+
+SceUID sceKernelCreateSema(const char * name, SceUInt attr, int init, int max, void * opt);
+int sceKernelDeleteSema(SceUID id);
+int sceKernelWaitSema(SceUID id, int need, SceUInt * timeout);
+int sceKernelPollSema(SceUID id, int need);
+int sceKernelSignalSema(SceUID id, int count);
+
+SceUID sceKernelCreateEventFlag(const char * name, int attr, int init, void * opt);
+int sceKernelDeleteEventFlag(SceUID id);
+int sceKernelSetEventFlag(SceUID id, unsigned int bits);
+int sceKernelClearEventFlag(SceUID id, unsigned int bits);
+int sceKernelWaitEventFlag(SceUID id, unsigned int pattern, unsigned int mode, unsigned int * out, SceUInt * timeout);
+int sceKernelPollEventFlag(SceUID id, unsigned int pattern, unsigned int mode, unsigned int * out);
+
+SceUID sceKernelCreateThread(const char * name, SceKernelThreadEntry entry, int priority, SceSize stack_size,
+                             SceUInt attr, int cpu_affinity, void * opt);
+int sceKernelStartThread(SceUID id, SceSize args, void * argp);
+int sceKernelWaitThreadEnd(SceUID id, int * status, SceUInt * timeout);
+int sceKernelDeleteThread(SceUID id);
+int sceKernelExitDeleteThread(int status);
+SceUID sceKernelGetThreadId(void);
+int sceKernelChangeThreadPriority(SceUID id, int priority);
+int sceKernelGetThreadCurrentPriority(void);
+int sceKernelChangeThreadCpuAffinityMask(SceUID id, int mask);
+int sceKernelGetThreadCpuAffinityMask(SceUID id);
+int sceKernelDelayThread(SceUInt us);
+
+SceUInt64 sceKernelGetProcessTimeWide(void);
+SceUInt32 sceKernelGetProcessTimeLow(void);
+
+int sceClibPrintf(const char * fmt, ...) __attribute__((format(printf, 1, 2)));
+int sceClibSnprintf(char * buf, SceSize size, const char * fmt, ...) __attribute__((format(printf, 3, 4)));
+int sceClibVsnprintf(char * buf, SceSize size, const char * fmt, va_list args);
+void * sceClibMemcpy(void * dst, const void * src, SceSize size);
+void * sceClibMemset(void * dst, int c, SceSize size);
+int sceClibStrcmp(const char * a, const char * b);
+void sceClibAbort(void) __attribute__((noreturn));
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // SOLOADER_HOST_VITA_SHIM_H
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  host_test.h
+ * @brief Minimal checks for the host tests; a test binary fails (non-zero
+ *        exit) if any CHECK did.
+ */
+
+#ifndef SOLOADER_HOST_TEST_H
+#define SOLOADER_HOST_TEST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+static int test_failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        test_failures++; \
+    } \
+} while (0)
+
+#define TEST(name) static void name(void)
+
+#define RUN(name) do { \
+    int before = test_failures; \
+    name(); \
+    printf("%-4s %s\n", test_failures == before ? "ok" : "FAIL", #name); \
+} while (0)
+
+#define TEST_RESULT() (printf(test_failures ? "%d failed checks\n" : "all passed\n", test_failures), test_failures != 0)
+
+static inline uint64_t test_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#endif // SOLOADER_HOST_TEST_H
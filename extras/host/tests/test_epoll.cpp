@@ -0,0 +1,425 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  test_epoll.cpp
+ * @brief Conformance of PseudoEpoll with Linux epoll: level- and
+ *        edge-triggered reporting, EPOLLONESHOT, EPOLL_CTL_DEL, maxevents
+ *        and blocking waits, on eventfds and pipes.
+ *
+ * Built twice: against falso_ndk, and with TEST_LINUX_EPOLL against the real
+ * thing, where every check has to pass as well.
+ */
+
+#include <cerrno>
+#include <cstdint>
+#include <thread>
+
+#ifdef TEST_LINUX_EPOLL
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define E_IN       EPOLLIN
+#define E_OUT      EPOLLOUT
+#define E_HUP      EPOLLHUP
+#define E_ET       EPOLLET
+#define E_ONESHOT  EPOLLONESHOT
+#define CTL_ADD    EPOLL_CTL_ADD
+#define CTL_MOD    EPOLL_CTL_MOD
+#define CTL_DEL    EPOLL_CTL_DEL
+
+typedef struct epoll_event event_t;
+
+static int ep_create() { return epoll_create1(0); }
+static int ep_ctl(int ep, int op, int fd, event_t * e) { return epoll_ctl(ep, op, fd, e); }
+static int ep_wait(int ep, event_t * e, int max, int timeout) { return epoll_wait(ep, e, max, timeout); }
+static int efd_create() { return eventfd(0, EFD_NONBLOCK); }
+static int efd_create_blocking() { return eventfd(0, 0); }
+static ssize_t fd_read(int fd, void * buf, size_t n) { return read(fd, buf, n); }
+static ssize_t fd_write(int fd, const void * buf, size_t n) { return write(fd, buf, n); }
+static int fd_close(int fd) { return close(fd); }
+
+static int pipe_create(int fds[2]) {
+    if (pipe(fds) != 0)
+        return -1;
+    return fcntl(fds[1], F_SETPIPE_SZ, 4096) == 4096 ? 0 : -1;
+}
+#else
+#include "PseudoEpoll.h"
+#include "polling/pseudo_eventfd.h"
+#include "polling/pseudo_pipe.h"
+
+#define E_IN       PSEUDO_EPOLLIN
+#define E_OUT      PSEUDO_EPOLLOUT
+#define E_HUP      PSEUDO_EPOLLHUP
+#define E_ET       PSEUDO_EPOLLET
+#define E_ONESHOT  PSEUDO_EPOLLONESHOT
+#define CTL_ADD    PSEUDO_EPOLL_CTL_ADD
+#define CTL_MOD    PSEUDO_EPOLL_CTL_MOD
+#define CTL_DEL    PSEUDO_EPOLL_CTL_DEL
+
+typedef struct pseudo_epoll_event event_t;
+
+static int ep_create() { return pseudo_epoll_create1(0); }
+static int ep_ctl(int ep, int op, int fd, event_t * e) { return pseudo_epoll_ctl(ep, op, fd, e); }
+static int ep_wait(int ep, event_t * e, int max, int timeout) { return pseudo_epoll_wait(ep, e, max, timeout); }
+static int efd_create() { return pseudo_eventfd(0, PSEUDO_EFD_NONBLOCK); }
+static int efd_create_blocking() { return pseudo_eventfd(0, 0); }
+static ssize_t fd_read(int fd, void * buf, size_t n) { return pseudo_read(fd, buf, n); }
+static ssize_t fd_write(int fd, const void * buf, size_t n) { return pseudo_write(fd, buf, n); }
+static int fd_close(int fd) { return pseudo_close(fd); }
+static int pipe_create(int fds[2]) { return pseudo_pipe_with_capacity(fds, 4096); }
+#endif
+
+#include "host_test.h"
+
+#define PIPE_SIZE 4096
+
+static int watch(int ep, int fd, uint32_t events, int op = CTL_ADD) {
+    event_t e = {};
+    e.events = events;
+    e.data.u64 = (uint64_t) fd;
+    return ep_ctl(ep, op, fd, &e);
+}
+
+static int poll_now(int ep, event_t * out, int max = 8) {
+    return ep_wait(ep, out, max, 0);
+}
+
+static void efd_signal(int fd) {
+    uint64_t one = 1;
+    CHECK(fd_write(fd, &one, sizeof(one)) == sizeof(one));
+}
+
+static void efd_drain(int fd) {
+    uint64_t value;
+    CHECK(fd_read(fd, &value, sizeof(value)) == sizeof(value));
+}
+
+static void pipe_fill(int fd) {
+    static char buf[PIPE_SIZE];
+    CHECK(fd_write(fd, buf, sizeof(buf)) == sizeof(buf));
+}
+
+static void pipe_drain(int fd, size_t size) {
+    static char buf[PIPE_SIZE];
+    CHECK(fd_read(fd, buf, size) == (ssize_t) size);
+}
+
+TEST(level_triggered_reports_while_ready) {
+    event_t out[8];
+    int ep = ep_create(), fd = efd_create();
+    CHECK(watch(ep, fd, E_IN) == 0);
+
+    CHECK(poll_now(ep, out) == 0);
+    efd_signal(fd);
+    CHECK(poll_now(ep, out) == 1 && out[0].events == E_IN && out[0].data.u64 == (uint64_t) fd);
+    CHECK(poll_now(ep, out) == 1);
+    efd_drain(fd);
+    CHECK(poll_now(ep, out) == 0);
+
+    fd_close(fd);
+    fd_close(ep);
+}
+
+TEST(edge_triggered_reports_once_per_write) {
+    event_t out[8];
+    int ep = ep_create(), fd = efd_create();
+    CHECK(watch(ep, fd, E_IN | E_ET) == 0);
+
+    efd_signal(fd);
+    CHECK(poll_now(ep, out) == 1 && out[0].events == E_IN);
+    CHECK(poll_now(ep, out) == 0);
+
+    // Still readable, but only a new write is a new edge
+    efd_signal(fd);
+    CHECK(poll_now(ep, out) == 1);
+    CHECK(poll_now(ep, out) == 0);
+
+    fd_close(fd);
+    fd_close(ep);
+}
+
+TEST(oneshot_disarms_until_mod) {
+    event_t out[8];
+    int ep = ep_create(), fd = efd_create();
+    CHECK(watch(ep, fd, E_IN | E_ONESHOT) == 0);
+
+    efd_signal(fd);
+    CHECK(poll_now(ep, out) == 1);
+    CHECK(poll_now(ep, out) == 0);
+    efd_signal(fd);
+    CHECK(poll_now(ep, out) == 0);
+
+    // Re-arming a fd that is still ready reports it right away
+    CHECK(watch(ep, fd, E_IN | E_ONESHOT, CTL_MOD) == 0);
+    CHECK(poll_now(ep, out) == 1);
+    CHECK(poll_now(ep, out) == 0);
+
+    fd_close(fd);
+    fd_close(ep);
+}
+
+TEST(add_reports_already_ready_fd) {
+    event_t out[8];
+    int ep = ep_create(), fd = efd_create();
+    efd_signal(fd);
+
+    CHECK(watch(ep, fd, E_IN | E_OUT) == 0);
+    CHECK(poll_now(ep, out) == 1 && out[0].events == (E_IN | E_OUT));
+
+    fd_close(fd);
+    fd_close(ep);
+}
+
+TEST(ctl_del_and_errors) {
+    event_t out[8];
+    int ep = ep_create(), fd = efd_create();
+    efd_signal(fd);
+
+    CHECK(watch(ep, fd, E_IN) == 0);
+    CHECK(watch(ep, fd, E_IN) == -1 && errno == EEXIST);
+
+    event_t e = {};
+    CHECK(ep_ctl(ep, CTL_DEL, fd, &e) == 0);
+    CHECK(poll_now(ep, out) == 0);
+    CHECK(ep_ctl(ep, CTL_DEL, fd, &e) == -1 && errno == ENOENT);
+    CHECK(watch(ep, fd, E_IN, CTL_MOD) == -1 && errno == ENOENT);
+    CHECK(watch(ep, ep, E_IN) == -1 && errno == EINVAL);
+
+    fd_close(fd);
+    fd_close(ep);
+}
+
+TEST(close_removes_fd) {
+    event_t out[8];
+    int ep = ep_create(), fd = efd_create();
+    efd_signal(fd);
+
+    CHECK(watch(ep, fd, E_IN) == 0);
+    CHECK(poll_now(ep, out) == 1);
+    fd_close(fd);
+    CHECK(poll_now(ep, out) == 0);
+
+    fd_close(ep);
+}
+
+TEST(maxevents_caps_and_rotates) {
+    event_t out[8];
+    int ep = ep_create(), fds[3];
+    for (int & fd : fds) {
+        fd = efd_create();
+        CHECK(watch(ep, fd, E_IN) == 0);
+        efd_signal(fd);
+    }
+
+    CHECK(ep_wait(ep, out, 0, 0) == -1 && errno == EINVAL);
+
+    // A capped call must not starve the fds that did not fit
+    CHECK(poll_now(ep, out, 2) == 2);
+    uint64_t first = out[0].data.u64, second = out[1].data.u64;
+    CHECK(poll_now(ep, out, 2) == 2);
+    CHECK(out[0].data.u64 != first && out[0].data.u64 != second);
+    CHECK(poll_now(ep, out, 8) == 3);
+
+    for (int fd : fds)
+        fd_close(fd);
+    fd_close(ep);
+}
+
+TEST(pipe_level_triggered) {
+    event_t out[8];
+    int ep = ep_create(), fds[2];
+    CHECK(pipe_create(fds) == 0);
+    CHECK(watch(ep, fds[0], E_IN) == 0);
+    CHECK(watch(ep, fds[1], E_OUT) == 0);
+
+    // Only the empty write end is ready
+    CHECK(poll_now(ep, out) == 1 && out[0].data.u64 == (uint64_t) fds[1] && out[0].events == E_OUT);
+
+    pipe_fill(fds[1]);
+    CHECK(poll_now(ep, out) == 1 && out[0].data.u64 == (uint64_t) fds[0] && out[0].events == E_IN);
+
+    pipe_drain(fds[0], PIPE_SIZE);
+    CHECK(poll_now(ep, out) == 1 && out[0].data.u64 == (uint64_t) fds[1]);
+
+    fd_close(fds[0]);
+    fd_close(fds[1]);
+    fd_close(ep);
+}
+
+TEST(pipe_edge_triggered) {
+    event_t out[8];
+    int ep = ep_create(), fds[2];
+    CHECK(pipe_create(fds) == 0);
+    CHECK(watch(ep, fds[0], E_IN | E_ET) == 0);
+    CHECK(watch(ep, fds[1], E_OUT | E_ET) == 0);
+
+    CHECK(poll_now(ep, out) == 1 && out[0].data.u64 == (uint64_t) fds[1]);
+    CHECK(poll_now(ep, out) == 0);
+
+    char c = 'x';
+    CHECK(fd_write(fds[1], &c, 1) == 1);
+    CHECK(poll_now(ep, out) == 1 && out[0].data.u64 == (uint64_t) fds[0]);
+    CHECK(poll_now(ep, out) == 0);
+
+    // Empty -> non-empty is an edge again
+    pipe_drain(fds[0], 1);
+    CHECK(fd_write(fds[1], &c, 1) == 1);
+    int n = poll_now(ep, out);
+    bool saw_in = false;
+    for (int i = 0; i < n; i++)
+        saw_in |= out[i].data.u64 == (uint64_t) fds[0];
+    CHECK(saw_in);
+    pipe_drain(fds[0], 1);
+
+    // Full -> not full is an edge for the write end
+    pipe_fill(fds[1]);
+    while (poll_now(ep, out) > 0)
+        ;
+    pipe_drain(fds[0], PIPE_SIZE);
+    n = poll_now(ep, out);
+    bool saw_out = false;
+    for (int i = 0; i < n; i++)
+        saw_out |= out[i].data.u64 == (uint64_t) fds[1] && (out[i].events & E_OUT);
+    CHECK(saw_out);
+
+    fd_close(fds[0]);
+    fd_close(fds[1]);
+    fd_close(ep);
+}
+
+TEST(pipe_edge_triggered_every_write) {
+    // A reader that takes one message per wakeup: a write into a ring that
+    // still holds data has to be an edge too, as on Linux
+    event_t out[8];
+    int ep = ep_create(), fds[2];
+    CHECK(pipe_create(fds) == 0);
+    CHECK(watch(ep, fds[0], E_IN | E_ET) == 0);
+
+    char msg[2] = { 'a', 'b' };
+    CHECK(fd_write(fds[1], msg, 2) == 2);
+    CHECK(ep_wait(ep, out, 8, 100) == 1 && out[0].events == E_IN);
+    pipe_drain(fds[0], 1);
+    CHECK(poll_now(ep, out) == 0);
+
+    CHECK(fd_write(fds[1], msg, 2) == 2);
+    CHECK(ep_wait(ep, out, 8, 100) == 1 && out[0].events == E_IN && out[0].data.u64 == (uint64_t) fds[0]);
+    pipe_drain(fds[0], 3);
+
+    fd_close(fds[0]);
+    fd_close(fds[1]);
+    fd_close(ep);
+}
+
+TEST(pipe_hangup_is_reported) {
+    event_t out[8];
+    int ep = ep_create(), fds[2];
+    CHECK(pipe_create(fds) == 0);
+    CHECK(watch(ep, fds[0], E_IN) == 0);
+
+    // Linux says EPOLLHUP, falso_ndk EPOLLIN; either way read() returns 0
+    CHECK(poll_now(ep, out) == 0);
+    fd_close(fds[1]);
+    CHECK(poll_now(ep, out) == 1 && (out[0].events & (E_IN | E_HUP)));
+
+    char c;
+    CHECK(fd_read(fds[0], &c, 1) == 0);
+
+    fd_close(fds[0]);
+    fd_close(ep);
+}
+
+TEST(wait_times_out) {
+    event_t out[8];
+    int ep = ep_create(), fd = efd_create();
+    CHECK(watch(ep, fd, E_IN) == 0);
+
+    uint64_t start = test_now_us();
+    CHECK(ep_wait(ep, out, 8, 50) == 0);
+    uint64_t elapsed = test_now_us() - start;
+    CHECK(elapsed >= 49000 && elapsed < 500000);
+
+    fd_close(fd);
+    fd_close(ep);
+}
+
+TEST(wait_wakes_on_write_from_other_thread) {
+    event_t out[8];
+    int ep = ep_create(), fds[2];
+    CHECK(pipe_create(fds) == 0);
+    CHECK(watch(ep, fds[0], E_IN) == 0);
+
+    std::thread writer([&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        char c = 'x';
+        fd_write(fds[1], &c, 1);
+    });
+
+    uint64_t start = test_now_us();
+    CHECK(ep_wait(ep, out, 8, -1) == 1 && out[0].data.u64 == (uint64_t) fds[0]);
+    CHECK(test_now_us() - start < 500000);
+    writer.join();
+
+    fd_close(fds[0]);
+    fd_close(fds[1]);
+    fd_close(ep);
+}
+
+TEST(eventfd_blocking_read_and_write) {
+    int efd = efd_create_blocking();
+    uint64_t value = 0;
+
+    std::thread writer([&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        uint64_t three = 3;
+        fd_write(efd, &three, sizeof(three));
+    });
+
+    uint64_t start = test_now_us();
+    CHECK(fd_read(efd, &value, sizeof(value)) == 8 && value == 3);
+    CHECK(test_now_us() - start >= 15000);
+    writer.join();
+
+    // A write that would overflow the counter blocks until a read drains it
+    uint64_t max = 0xfffffffffffffffe, one = 1;
+    CHECK(fd_write(efd, &max, sizeof(max)) == 8);
+
+    std::thread reader([&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        uint64_t drained;
+        fd_read(efd, &drained, sizeof(drained));
+    });
+
+    start = test_now_us();
+    CHECK(fd_write(efd, &one, sizeof(one)) == 8);
+    CHECK(test_now_us() - start >= 15000);
+    reader.join();
+
+    CHECK(fd_read(efd, &value, sizeof(value)) == 8 && value == 1);
+    fd_close(efd);
+}
+
+int main() {
+    RUN(level_triggered_reports_while_ready);
+    RUN(edge_triggered_reports_once_per_write);
+    RUN(oneshot_disarms_until_mod);
+    RUN(add_reports_already_ready_fd);
+    RUN(ctl_del_and_errors);
+    RUN(close_removes_fd);
+    RUN(maxevents_caps_and_rotates);
+    RUN(pipe_level_triggered);
+    RUN(pipe_edge_triggered);
+    RUN(pipe_edge_triggered_every_write);
+    RUN(pipe_hangup_is_reported);
+    RUN(wait_times_out);
+    RUN(wait_wakes_on_write_from_other_thread);
+    RUN(eventfd_blocking_read_and_write);
+    return TEST_RESULT();
+}
@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  test_looper.cpp
+ * @brief ALooper message queue: delivery in due-time order, FIFO among
+ *        messages due at the same time, ALooper_removeMessages() watermarks,
+ *        how late delayed messages arrive while the looper is busy, and
+ *        messages delayed past the range of a poll timeout.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+
+#include "ALooper.h"
+#include "AFakeNative_Utils.h"
+#include "PseudoEpoll.h"
+#include "polling/pseudo_eventfd.h"
+
+#include "host_test.h"
+
+struct Delivery {
+    int what;
+    uint64_t at;
+};
+
+class Recorder : public MessageHandler {
+public:
+    std::vector<Delivery> delivered;
+    ALooper * looper = nullptr;
+    int remove_on = -1, remove_what = -1;
+
+    void handleMessage(const Message & message) override {
+        delivered.push_back({message.what, AFN_timeMillis()});
+        if (message.what == remove_on)
+            ALooper_removeMessages(looper, this, remove_what);
+    }
+};
+
+// Polls until nothing is due; delayed messages stay queued
+static void drain(int timeout = 0) {
+    while (ALooper_pollOnce(timeout, nullptr, nullptr, nullptr) == ALOOPER_POLL_CALLBACK) {}
+}
+
+static ALooper * looper;
+
+TEST(delivers_in_due_time_order) {
+    Recorder h;
+    uint64_t base = AFN_timeMillis() - 10000;
+
+    // All due already, sent in scrambled order
+    uint32_t x = 12345;
+    std::vector<uint64_t> sent;
+    for (int i = 0; i < 2000; i++) {
+        x = x * 1103515245 + 12345;
+        uint64_t uptime = base + (x >> 16) % 5000;
+        sent.push_back(uptime);
+        ALooper_sendMessageAtTime(looper, uptime, &h, Message(i));
+    }
+    drain();
+
+    CHECK(h.delivered.size() == sent.size());
+    bool ordered = true;
+    for (size_t i = 1; i < h.delivered.size(); i++) {
+        uint64_t prev = sent[h.delivered[i - 1].what], cur = sent[h.delivered[i].what];
+        ordered &= prev < cur || (prev == cur && h.delivered[i - 1].what < h.delivered[i].what);
+    }
+    CHECK(ordered);
+}
+
+TEST(equal_times_are_fifo) {
+    Recorder h;
+    uint64_t due = AFN_timeMillis() - 1;
+
+    // Interleave two due times so the heap has to reorder around them
+    for (int i = 0; i < 1000; i++)
+        ALooper_sendMessageAtTime(looper, i % 2 ? due : due - 1, &h, Message(i));
+    drain();
+
+    CHECK(h.delivered.size() == 1000);
+    bool fifo = true;
+    for (int i = 0; i < 500; i++) {
+        fifo &= h.delivered[i].what == 2 * i;
+        fifo &= h.delivered[500 + i].what == 2 * i + 1;
+    }
+    CHECK(fifo);
+}
+
+TEST(remove_messages_only_drops_earlier_ones) {
+    Recorder a, b;
+
+    ALooper_sendMessage(looper, &a, Message(1));
+    ALooper_sendMessage(looper, &a, Message(2));
+    ALooper_sendMessage(looper, &b, Message(1));
+    ALooper_sendMessageDelayed(looper, 30, &a, Message(1)); // not at the front
+    ALooper_removeMessages(looper, &a, 1);
+    ALooper_sendMessage(looper, &a, Message(1));           // sent after: kept
+
+    ALooper_sendMessage(looper, &b, Message(2));
+    ALooper_removeMessages(looper, &b);
+    ALooper_sendMessage(looper, &b, Message(3));
+
+    uint64_t until = AFN_timeMillis() + 60;
+    while (AFN_timeMillis() < until)
+        ALooper_pollOnce(10, nullptr, nullptr, nullptr);
+
+    CHECK(a.delivered.size() == 2);
+    CHECK(a.delivered.size() == 2 && a.delivered[0].what == 2 && a.delivered[1].what == 1);
+    CHECK(b.delivered.size() == 1 && b.delivered[0].what == 3);
+}
+
+TEST(remove_messages_from_a_handler) {
+    Recorder h;
+    h.looper = looper;
+    h.remove_on = 1;
+    h.remove_what = 2;
+
+    ALooper_sendMessage(looper, &h, Message(1));
+    ALooper_sendMessage(looper, &h, Message(2));
+    ALooper_sendMessage(looper, &h, Message(3));
+    ALooper_sendMessage(looper, &h, Message(2));
+    drain();
+
+    CHECK(h.delivered.size() == 2);
+    CHECK(h.delivered.size() == 2 && h.delivered[0].what == 1 && h.delivered[1].what == 3);
+}
+
+/*
+ * Delayed messages sent from another thread while that thread keeps the
+ * looper busy with a stream of immediate ones: none may arrive early, and
+ * the looper has to wake for them rather than when it next gets around to
+ * polling.
+ */
+TEST(delayed_messages_are_on_time_under_load) {
+    class Delayed : public MessageHandler {
+    public:
+        std::vector<int64_t> lateness;
+        void handleMessage(const Message & message) override {
+            lateness.push_back((int32_t) ((uint32_t) AFN_timeMillis() - (uint32_t) message.what));
+        }
+    } delayed;
+
+    class Busy : public MessageHandler {
+    public:
+        std::atomic<int> count { 0 };
+        void handleMessage(const Message & message) override {
+            volatile uint32_t x = 0;
+            for (int i = 0; i < 2000; i++) x = x + i;
+            count.fetch_add(1, std::memory_order_relaxed);
+        }
+    } busy;
+
+    const int delayed_count = 100;
+    std::atomic<bool> done { false };
+
+    std::thread sender([&]() {
+        uint32_t x = 777;
+        for (int i = 0; i < delayed_count; i++) {
+            x = x * 1103515245 + 12345;
+            uint64_t due = AFN_timeMillis() + 1 + (x >> 16) % 40;
+            // The due time travels in `what`, truncated like it is read back
+            ALooper_sendMessageAtTime(looper, due, &delayed, Message((int) (uint32_t) due));
+            for (int j = 0; j < 20; j++) {
+                ALooper_sendMessage(looper, &busy, Message(0));
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+        done = true;
+    });
+
+    uint64_t give_up = AFN_timeMillis() + 10000;
+    while ((!done || delayed.lateness.size() < delayed_count) && AFN_timeMillis() < give_up)
+        ALooper_pollOnce(50, nullptr, nullptr, nullptr);
+    sender.join();
+
+    CHECK(delayed.lateness.size() == delayed_count);
+    if (delayed.lateness.empty())
+        return;
+
+    std::sort(delayed.lateness.begin(), delayed.lateness.end());
+    int64_t p50 = delayed.lateness[delayed.lateness.size() / 2];
+    int64_t p99 = delayed.lateness[delayed.lateness.size() * 99 / 100];
+    printf("     lateness ms: min %lld p50 %lld p99 %lld max %lld, %d busy messages\n",
+           (long long) delayed.lateness.front(), (long long) p50, (long long) p99,
+           (long long) delayed.lateness.back(), busy.count.load());
+
+    CHECK(delayed.lateness.front() >= 0);
+    CHECK(p50 <= 2);
+    CHECK(p99 <= 20);
+}
+
+/*
+ * Messages further out than an int of milliseconds: the poll timeout is
+ * clamped rather than truncated, and a delay that would overflow the
+ * uptime saturates instead of wrapping into the past.
+ */
+TEST(far_future_messages_stay_queued) {
+    Recorder far, near;
+
+    // Truncated to an int, 2^32 + 20 ms would be a 20 ms timeout
+    ALooper_sendMessageDelayed(looper, (1ULL << 32) + 20, &far, Message(1));
+    ALooper_sendMessageDelayed(looper, UINT64_MAX, &far, Message(2));
+    drain();
+    CHECK(far.delivered.empty());
+
+    // Block until another thread sends something due now
+    uint64_t start = test_now_us();
+    std::thread waker([&near]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        ALooper_sendMessage(looper, &near, Message(3));
+    });
+    int ret = ALooper_pollOnce(-1, nullptr, nullptr, nullptr);
+    uint64_t waited = test_now_us() - start;
+    waker.join();
+    drain();
+
+    CHECK(ret != ALOOPER_POLL_TIMEOUT);
+    CHECK(waited >= 80 * 1000);
+    CHECK(near.delivered.size() == 1 && far.delivered.empty());
+    ALooper_removeMessages(looper, &far);
+}
+
+/*
+ * A looper prepared on another thread while a pseudo fd is open must not
+ * close it. The looper is allocated with malloc(), so recycle small blocks
+ * full of that fd's number first; a stale epoll fd would be read from them.
+ */
+TEST(prepare_leaves_other_fds_open) {
+    int efd = pseudo_eventfd(0, 0);
+    CHECK(efd >= 0);
+
+    std::thread other([efd]() {
+        for (size_t size = 16; size <= 2048; size += 16) {
+            int * junk = (int *) malloc(size);
+            for (size_t i = 0; i < size / sizeof(int); i++)
+                junk[i] = efd;
+            free(junk);
+        }
+        ALooper_prepare(0);
+    });
+    other.join();
+
+    uint64_t value = 1;
+    CHECK(pseudo_write(efd, &value, sizeof(value)) == sizeof(value));
+    value = 0;
+    CHECK(pseudo_read(efd, &value, sizeof(value)) == sizeof(value) && value == 1);
+    CHECK(fcntl(0, F_GETFD) >= 0); // nor the real fd 0 zeroed memory points at
+    pseudo_close(efd);
+}
+
+int main() {
+    looper = ALooper_prepare(0);
+
+    RUN(delivers_in_due_time_order);
+    RUN(equal_times_are_fifo);
+    RUN(remove_messages_only_drops_earlier_ones);
+    RUN(remove_messages_from_a_handler);
+    RUN(delayed_messages_are_on_time_under_load);
+    RUN(far_future_messages_stay_queued);
+    RUN(prepare_leaves_other_fds_open);
+    return TEST_RESULT();
+}
@@ -0,0 +1,264 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  test_pthr_mutex.c
+ * @brief Stress test of the in-place bionic mutexes in reimpl/pthr.c over
+ *        the futex emulation: mutual exclusion under contention for the
+ *        NORMAL, RECURSIVE and ERRORCHECK kinds, the kinds' error cases,
+ *        static initializers, and condvar waits re-taking the mutex.
+ */
+
+#define _GNU_SOURCE
+
+#include "reimpl/pthr.h"
+#include "reimpl/bits/_errno_bionic.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "host_test.h"
+
+#define THREADS    8
+#define ITERATIONS 50000
+
+enum {
+    KIND_NORMAL = 0,
+    KIND_RECURSIVE = 1,
+    KIND_ERRORCHECK = 2
+};
+
+// Same values as bionic's static initializers
+#define RECURSIVE_MUTEX_INITIALIZER  0x4000
+#define ERRORCHECK_MUTEX_INITIALIZER 0x8000
+
+static void init_kind(pthread_mutex_t_bionic * m, int kind) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init_soloader(&attr);
+    pthread_mutexattr_settype_soloader(&attr, kind);
+    pthread_mutex_init_soloader(m, &attr);
+    pthread_mutexattr_destroy_soloader(&attr);
+}
+
+typedef struct {
+    pthread_mutex_t_bionic * mutex;
+    int kind;
+    int seed;
+    volatile int * inside;
+    volatile long * counter;
+    int failures;
+} stress_arg;
+
+static void * stress_thread(void * p) {
+    stress_arg * a = p;
+    uint32_t x = a->seed;
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        x = x * 1103515245 + 12345;
+
+        // Mix in trylock spins, they take the same CAS path as an unlock race
+        if ((x >> 16) % 8 == 0) {
+            int ret;
+            while ((ret = pthread_mutex_trylock_soloader(a->mutex)) == EBUSY)
+                sched_yield();
+            if (ret != 0)
+                a->failures++;
+        } else if (pthread_mutex_lock_soloader(a->mutex) != 0) {
+            a->failures++;
+        }
+
+        int depth = a->kind == KIND_RECURSIVE ? (x >> 20) % 4 : 0;
+        for (int d = 0; d < depth; d++)
+            if (pthread_mutex_lock_soloader(a->mutex) != 0)
+                a->failures++;
+
+        if (__atomic_add_fetch(a->inside, 1, __ATOMIC_RELAXED) != 1)
+            a->failures++;
+
+        // Non-atomic update; lost increments mean the mutex let two in
+        long v = *a->counter;
+        if ((x >> 24) % 64 == 0)
+            sched_yield(); // get preempted while holding it
+        *a->counter = v + 1;
+
+        __atomic_sub_fetch(a->inside, 1, __ATOMIC_RELAXED);
+
+        for (int d = 0; d < depth; d++)
+            if (pthread_mutex_unlock_soloader(a->mutex) != 0)
+                a->failures++;
+        if (pthread_mutex_unlock_soloader(a->mutex) != 0)
+            a->failures++;
+    }
+    return NULL;
+}
+
+static void stress(pthread_mutex_t_bionic * m, int kind) {
+    volatile int inside = 0;
+    volatile long counter = 0;
+    pthread_t threads[THREADS];
+    stress_arg args[THREADS];
+
+    for (int i = 0; i < THREADS; i++) {
+        args[i] = (stress_arg) { m, kind, i * 7919 + 1, &inside, &counter, 0 };
+        pthread_create(&threads[i], NULL, stress_thread, &args[i]);
+    }
+
+    int failures = 0;
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        failures += args[i].failures;
+    }
+
+    CHECK(failures == 0);
+    CHECK(counter == (long) THREADS * ITERATIONS);
+    CHECK((m->value & 0x3) == 0); // left unlocked, no stale waiter bit
+    CHECK(pthread_mutex_destroy_soloader(m) == 0);
+}
+
+TEST(normal_under_contention) {
+    pthread_mutex_t_bionic m = { 0 };
+    stress(&m, KIND_NORMAL);
+}
+
+TEST(recursive_under_contention) {
+    pthread_mutex_t_bionic m;
+    init_kind(&m, KIND_RECURSIVE);
+    stress(&m, KIND_RECURSIVE);
+}
+
+TEST(errorcheck_under_contention) {
+    pthread_mutex_t_bionic m;
+    init_kind(&m, KIND_ERRORCHECK);
+    stress(&m, KIND_ERRORCHECK);
+}
+
+TEST(static_initializers_under_contention) {
+    pthread_mutex_t_bionic r = { RECURSIVE_MUTEX_INITIALIZER };
+    stress(&r, KIND_RECURSIVE);
+
+    pthread_mutex_t_bionic e = { ERRORCHECK_MUTEX_INITIALIZER };
+    stress(&e, KIND_ERRORCHECK);
+}
+
+static void * try_from_other_thread(void * p) {
+    return (void *) (intptr_t) pthread_mutex_trylock_soloader(p);
+}
+
+static void * unlock_from_other_thread(void * p) {
+    return (void *) (intptr_t) pthread_mutex_unlock_soloader(p);
+}
+
+static int on_other_thread(void * (*fn)(void *), pthread_mutex_t_bionic * m) {
+    pthread_t t;
+    void * ret;
+    pthread_create(&t, NULL, fn, m);
+    pthread_join(t, &ret);
+    return (int) (intptr_t) ret;
+}
+
+TEST(recursive_semantics) {
+    pthread_mutex_t_bionic m;
+    init_kind(&m, KIND_RECURSIVE);
+
+    CHECK(pthread_mutex_lock_soloader(&m) == 0);
+    CHECK(pthread_mutex_trylock_soloader(&m) == 0);
+    CHECK(on_other_thread(try_from_other_thread, &m) == EBUSY);
+    CHECK(on_other_thread(unlock_from_other_thread, &m) == EPERM);
+    CHECK(pthread_mutex_unlock_soloader(&m) == 0);
+    CHECK(on_other_thread(try_from_other_thread, &m) == EBUSY);
+    CHECK(pthread_mutex_unlock_soloader(&m) == 0);
+    CHECK(pthread_mutex_unlock_soloader(&m) == EPERM);
+
+    // The 11-bit counter runs out after 2047 re-locks
+    int depth = 0, ret;
+    CHECK(pthread_mutex_lock_soloader(&m) == 0);
+    while ((ret = pthread_mutex_lock_soloader(&m)) == 0 && depth < 5000)
+        depth++;
+    CHECK(ret == EAGAIN && depth == 2047);
+    for (int i = 0; i <= depth; i++)
+        pthread_mutex_unlock_soloader(&m);
+    CHECK(m.value == (KIND_RECURSIVE << 14));
+}
+
+TEST(errorcheck_semantics) {
+    pthread_mutex_t_bionic m;
+    init_kind(&m, KIND_ERRORCHECK);
+
+    CHECK(pthread_mutex_unlock_soloader(&m) == EPERM);
+    CHECK(pthread_mutex_lock_soloader(&m) == 0);
+    CHECK(pthread_mutex_lock_soloader(&m) == EDEADLK_BIONIC);
+    CHECK(pthread_mutex_trylock_soloader(&m) == EDEADLK_BIONIC);
+    CHECK(on_other_thread(try_from_other_thread, &m) == EBUSY);
+    CHECK(on_other_thread(unlock_from_other_thread, &m) == EPERM);
+    CHECK(pthread_mutex_destroy_soloader(&m) == EBUSY);
+    CHECK(pthread_mutex_unlock_soloader(&m) == 0);
+    CHECK(pthread_mutex_destroy_soloader(&m) == 0);
+}
+
+/*
+ * Producer/consumer through a condvar: every wait gives up the mutex and
+ * has to get it back, racing the producers and the other consumers.
+ */
+#define QUEUE_ITEMS 20000
+
+static pthread_mutex_t_bionic queue_lock;
+static pthread_cond_t_bionic queue_cond;
+static int queue_len, queue_produced, queue_consumed;
+
+static void * producer(void * p) {
+    for (int i = 0; i < QUEUE_ITEMS; i++) {
+        pthread_mutex_lock_soloader(&queue_lock);
+        queue_len++;
+        queue_produced++;
+        pthread_cond_signal_soloader(&queue_cond);
+        pthread_mutex_unlock_soloader(&queue_lock);
+    }
+    return NULL;
+}
+
+static void * consumer(void * p) {
+    for (int i = 0; i < QUEUE_ITEMS; i++) {
+        pthread_mutex_lock_soloader(&queue_lock);
+        while (queue_len == 0)
+            pthread_cond_wait_soloader(&queue_cond, &queue_lock);
+        queue_len--;
+        queue_consumed++;
+        pthread_mutex_unlock_soloader(&queue_lock);
+    }
+    return NULL;
+}
+
+TEST(cond_wait_retakes_mutex) {
+    for (int kind = KIND_NORMAL; kind <= KIND_ERRORCHECK; kind++) {
+        init_kind(&queue_lock, kind);
+        pthread_cond_init_soloader(&queue_cond, NULL);
+        queue_len = queue_produced = queue_consumed = 0;
+
+        pthread_t threads[8];
+        for (int i = 0; i < 4; i++) {
+            pthread_create(&threads[i], NULL, consumer, NULL);
+            pthread_create(&threads[4 + i], NULL, producer, NULL);
+        }
+        for (int i = 0; i < 8; i++)
+            pthread_join(threads[i], NULL);
+
+        CHECK(queue_produced == 4 * QUEUE_ITEMS && queue_consumed == 4 * QUEUE_ITEMS && queue_len == 0);
+        CHECK((queue_lock.value & 0x3) == 0);
+    }
+}
+
+int main() {
+    RUN(normal_under_contention);
+    RUN(recursive_under_contention);
+    RUN(errorcheck_under_contention);
+    RUN(static_initializers_under_contention);
+    RUN(recursive_semantics);
+    RUN(errorcheck_semantics);
+    RUN(cond_wait_retakes_mutex);
+    return TEST_RESULT();
+}
@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  test_pthr_rwlock.c
+ * @brief Reader-writer locks in reimpl/pthr.c: exclusion between readers
+ *        and writers under contention, the error cases, and that readers
+ *        queued behind a timed writer get the lock once it gives up.
+ */
+
+#define _GNU_SOURCE
+
+#include "reimpl/pthr.h"
+#include "reimpl/bits/_errno_bionic.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "host_test.h"
+
+#define READERS    6
+#define WRITERS    2
+#define ITERATIONS 20000
+
+static struct timespec deadline_in_ms(int ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += (long) ms * 1000000;
+    ts.tv_sec += ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+    return ts;
+}
+
+static void wait_until(volatile int * value, int expected) {
+    while (__atomic_load_n(value, __ATOMIC_ACQUIRE) != expected)
+        usleep(1000);
+}
+
+typedef struct {
+    pthread_rwlock_t_bionic * rw;
+    int write;
+    int seed;
+    volatile int * readers_inside;
+    volatile int * writers_inside;
+    volatile long * counter;
+    int failures;
+} stress_arg;
+
+static void * stress_thread(void * p) {
+    stress_arg * a = p;
+    uint32_t x = a->seed;
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        x = x * 1103515245 + 12345;
+
+        if (a->write) {
+            if ((x >> 16) % 8 == 0) {
+                int ret;
+                while ((ret = pthread_rwlock_trywrlock_soloader(a->rw)) == EBUSY)
+                    sched_yield();
+                if (ret != 0)
+                    a->failures++;
+            } else if (pthread_rwlock_wrlock_soloader(a->rw) != 0) {
+                a->failures++;
+            }
+
+            if (__atomic_add_fetch(a->writers_inside, 1, __ATOMIC_RELAXED) != 1
+                || __atomic_load_n(a->readers_inside, __ATOMIC_RELAXED) != 0)
+                a->failures++;
+
+            // Non-atomic update; lost increments mean two writers got in
+            long v = *a->counter;
+            if ((x >> 24) % 64 == 0)
+                sched_yield(); // get preempted while holding it
+            *a->counter = v + 1;
+
+            __atomic_sub_fetch(a->writers_inside, 1, __ATOMIC_RELAXED);
+        } else {
+            if ((x >> 16) % 8 == 0) {
+                int ret;
+                while ((ret = pthread_rwlock_tryrdlock_soloader(a->rw)) == EBUSY)
+                    sched_yield();
+                if (ret != 0)
+                    a->failures++;
+            } else if (pthread_rwlock_rdlock_soloader(a->rw) != 0) {
+                a->failures++;
+            }
+
+            __atomic_add_fetch(a->readers_inside, 1, __ATOMIC_RELAXED);
+            if (__atomic_load_n(a->writers_inside, __ATOMIC_RELAXED) != 0)
+                a->failures++;
+            if ((x >> 24) % 64 == 0)
+                sched_yield();
+            __atomic_sub_fetch(a->readers_inside, 1, __ATOMIC_RELAXED);
+        }
+
+        if (pthread_rwlock_unlock_soloader(a->rw) != 0)
+            a->failures++;
+    }
+    return NULL;
+}
+
+TEST(exclusion_under_contention) {
+    pthread_rwlock_t_bionic rw;
+    CHECK(pthread_rwlock_init_soloader(&rw, NULL) == 0);
+
+    volatile int readers_inside = 0, writers_inside = 0;
+    volatile long counter = 0;
+    pthread_t threads[READERS + WRITERS];
+    stress_arg args[READERS + WRITERS];
+
+    for (int i = 0; i < READERS + WRITERS; i++) {
+        args[i] = (stress_arg) { &rw, i >= READERS, i * 7919 + 1, &readers_inside, &writers_inside,
+                                 &counter, 0 };
+        pthread_create(&threads[i], NULL, stress_thread, &args[i]);
+    }
+
+    int failures = 0;
+    for (int i = 0; i < READERS + WRITERS; i++) {
+        pthread_join(threads[i], NULL);
+        failures += args[i].failures;
+    }
+
+    CHECK(failures == 0);
+    CHECK(counter == (long) WRITERS * ITERATIONS);
+    CHECK(rw.state == 0 && rw.pending_readers == 0 && rw.pending_writers == 0);
+    CHECK(pthread_rwlock_destroy_soloader(&rw) == 0);
+}
+
+static void * tryrd_from_other_thread(void * p) {
+    return (void *) (intptr_t) pthread_rwlock_tryrdlock_soloader(p);
+}
+
+static void * trywr_from_other_thread(void * p) {
+    return (void *) (intptr_t) pthread_rwlock_trywrlock_soloader(p);
+}
+
+static void * unlock_from_other_thread(void * p) {
+    return (void *) (intptr_t) pthread_rwlock_unlock_soloader(p);
+}
+
+static int on_other_thread(void * (*fn)(void *), pthread_rwlock_t_bionic * rw) {
+    pthread_t t;
+    void * ret;
+    pthread_create(&t, NULL, fn, rw);
+    pthread_join(t, &ret);
+    return (int) (intptr_t) ret;
+}
+
+TEST(error_cases) {
+    pthread_rwlock_t_bionic rw = { 0 };
+
+    CHECK(pthread_rwlock_unlock_soloader(&rw) == EPERM);
+
+    CHECK(pthread_rwlock_wrlock_soloader(&rw) == 0);
+    CHECK(pthread_rwlock_wrlock_soloader(&rw) == EDEADLK_BIONIC);
+    CHECK(pthread_rwlock_rdlock_soloader(&rw) == EDEADLK_BIONIC);
+    struct timespec deadline = deadline_in_ms(1000);
+    CHECK(pthread_rwlock_timedwrlock_soloader(&rw, &deadline) == EDEADLK_BIONIC);
+    CHECK(on_other_thread(tryrd_from_other_thread, &rw) == EBUSY);
+    CHECK(on_other_thread(unlock_from_other_thread, &rw) == EPERM);
+    CHECK(pthread_rwlock_unlock_soloader(&rw) == 0);
+
+    // Readers share it, with each other's threads too
+    CHECK(pthread_rwlock_rdlock_soloader(&rw) == 0);
+    CHECK(pthread_rwlock_tryrdlock_soloader(&rw) == 0);
+    CHECK(on_other_thread(trywr_from_other_thread, &rw) == EBUSY);
+    deadline = deadline_in_ms(20);
+    CHECK(pthread_rwlock_timedwrlock_soloader(&rw, &deadline) == ETIMEDOUT_BIONIC);
+    CHECK(pthread_rwlock_unlock_soloader(&rw) == 0);
+    CHECK(pthread_rwlock_unlock_soloader(&rw) == 0);
+    CHECK(pthread_rwlock_unlock_soloader(&rw) == EPERM);
+
+    CHECK(rw.state == 0 && rw.pending_writers == 0);
+    CHECK(pthread_rwlock_destroy_soloader(&rw) == 0);
+}
+
+/*
+ * A writer holds the lock, a timed writer queues behind it and readers queue
+ * behind that one. The holder unlocks once the timed writer has already hit
+ * its deadline but not yet deregistered, so the unlock goes to the writer
+ * side; the readers must still be woken when that writer gives up.
+ */
+
+#define TIMED_READERS 4
+
+static pthread_rwlock_t_bionic timed_rw;
+static volatile int holder_has_lock, holder_release;
+
+static void * holder_thread(void * p) {
+    pthread_rwlock_wrlock_soloader(&timed_rw);
+    __atomic_store_n(&holder_has_lock, 1, __ATOMIC_RELEASE);
+    wait_until(&holder_release, 1);
+    return (void *) (intptr_t) pthread_rwlock_unlock_soloader(&timed_rw);
+}
+
+static void * timed_writer_thread(void * p) {
+    struct timespec deadline = deadline_in_ms(50);
+    int ret = pthread_rwlock_timedwrlock_soloader(&timed_rw, &deadline);
+    if (ret == 0)
+        pthread_rwlock_unlock_soloader(&timed_rw);
+    return (void *) (intptr_t) ret;
+}
+
+static void * timed_reader_thread(void * p) {
+    // Far beyond what the test takes, only so a stranded reader can't hang it
+    struct timespec deadline = deadline_in_ms(2000);
+    int ret = pthread_rwlock_timedrdlock_soloader(&timed_rw, &deadline);
+    if (ret == 0)
+        pthread_rwlock_unlock_soloader(&timed_rw);
+    return (void *) (intptr_t) ret;
+}
+
+TEST(readers_woken_after_timed_writer_gives_up) {
+    for (int round = 0; round < 5; round++) {
+        pthread_rwlock_init_soloader(&timed_rw, NULL);
+        holder_has_lock = holder_release = 0;
+
+        pthread_t holder, writer, readers[TIMED_READERS];
+        pthread_create(&holder, NULL, holder_thread, NULL);
+        wait_until(&holder_has_lock, 1);
+
+        pthread_create(&writer, NULL, timed_writer_thread, NULL);
+        wait_until(&timed_rw.pending_writers, 1);
+        for (int i = 0; i < TIMED_READERS; i++)
+            pthread_create(&readers[i], NULL, timed_reader_thread, NULL);
+        wait_until(&timed_rw.pending_readers, TIMED_READERS);
+
+        // Keep the writer registered past its deadline, and the holder's
+        // unlock waiting to look at the pending counts meanwhile
+        pthread_mutex_lock_soloader(&timed_rw.pending_lock);
+        __atomic_store_n(&holder_release, 1, __ATOMIC_RELEASE);
+        usleep(100 * 1000);
+        uint64_t start = test_now_us();
+        pthread_mutex_unlock_soloader(&timed_rw.pending_lock);
+
+        void * ret;
+        pthread_join(holder, &ret);
+        CHECK((int) (intptr_t) ret == 0);
+        pthread_join(writer, &ret);
+        CHECK((int) (intptr_t) ret == ETIMEDOUT_BIONIC);
+        for (int i = 0; i < TIMED_READERS; i++) {
+            pthread_join(readers[i], &ret);
+            CHECK((int) (intptr_t) ret == 0);
+        }
+        CHECK(test_now_us() - start < 1000 * 1000);
+        CHECK(timed_rw.state == 0 && timed_rw.pending_readers == 0 && timed_rw.pending_writers == 0);
+    }
+}
+
+int main(void) {
+    RUN(exclusion_under_contention);
+    RUN(error_cases);
+    RUN(readers_woken_after_timed_writer_gives_up);
+    return TEST_RESULT();
+}
@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  test_pthr_sem.c
+ * @brief Semaphores and pthread_once in reimpl/pthr.c: counting, the
+ *        error cases, timeouts, wakeups under contention, and that no
+ *        pthread_once caller returns before the initializer has finished.
+ */
+
+#define _GNU_SOURCE
+
+#include "reimpl/pthr.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "host_test.h"
+
+static struct timespec deadline_in_ms(int ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += (long) ms * 1000000;
+    ts.tv_sec += ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+    return ts;
+}
+
+TEST(sem_counts) {
+    int sem, value;
+    CHECK(sem_init_soloader(&sem, 0, 2) == 0);
+    CHECK(sem_getvalue_soloader(&sem, &value) == 0 && value == 2);
+
+    CHECK(sem_wait_soloader(&sem) == 0);
+    CHECK(sem_trywait_soloader(&sem) == 0);
+    errno = 0;
+    CHECK(sem_trywait_soloader(&sem) == -1 && errno == EAGAIN);
+    CHECK(sem_getvalue_soloader(&sem, &value) == 0 && value == 0);
+
+    CHECK(sem_post_soloader(&sem) == 0);
+    CHECK(sem_post_soloader(&sem) == 0);
+    CHECK(sem_getvalue_soloader(&sem, &value) == 0 && value == 2);
+    CHECK(sem_destroy_soloader(&sem) == 0);
+}
+
+TEST(sem_errors) {
+    int sem;
+    errno = 0;
+    CHECK(sem_init_soloader(&sem, 0, 0x40000000) == -1 && errno == EINVAL);
+
+    CHECK(sem_init_soloader(&sem, 0, 0x3fffffff) == 0);
+    errno = 0;
+    CHECK(sem_post_soloader(&sem) == -1 && errno == EOVERFLOW);
+
+    errno = 0;
+    CHECK(sem_getvalue_soloader(&sem, NULL) == -1 && errno == EINVAL);
+
+    // A bad deadline is only an error if the semaphore would block
+    struct timespec bad = { 0, 1000000000 };
+    CHECK(sem_timedwait_soloader(&sem, &bad) == 0);
+    CHECK(sem_init_soloader(&sem, 0, 0) == 0);
+    errno = 0;
+    CHECK(sem_timedwait_soloader(&sem, &bad) == -1 && errno == EINVAL);
+}
+
+TEST(sem_timedwait_times_out) {
+    int sem, value;
+    sem_init_soloader(&sem, 0, 0);
+
+    struct timespec deadline = deadline_in_ms(50);
+    uint64_t start = test_now_us();
+    errno = 0;
+    CHECK(sem_timedwait_soloader(&sem, &deadline) == -1 && errno == ETIMEDOUT);
+    uint64_t elapsed = test_now_us() - start;
+    CHECK(elapsed >= 45000 && elapsed < 1000000);
+
+    // The waiter left its mark; the count still reads as zero and a post
+    // brings it to one
+    CHECK(sem_getvalue_soloader(&sem, &value) == 0 && value == 0);
+    sem_post_soloader(&sem);
+    CHECK(sem_getvalue_soloader(&sem, &value) == 0 && value == 1);
+
+    struct timespec past = deadline_in_ms(-10);
+    CHECK(sem_timedwait_soloader(&sem, &past) == 0);
+    errno = 0;
+    CHECK(sem_timedwait_soloader(&sem, &past) == -1 && errno == ETIMEDOUT);
+}
+
+static int wake_sem;
+static volatile int woken;
+
+static void * sleeper(void * p) {
+    sem_wait_soloader(&wake_sem);
+    __atomic_add_fetch(&woken, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+TEST(sem_post_wakes_one_sleeper_each) {
+    sem_init_soloader(&wake_sem, 0, 0);
+    woken = 0;
+
+    pthread_t threads[6];
+    for (int i = 0; i < 6; i++)
+        pthread_create(&threads[i], NULL, sleeper, NULL);
+    usleep(50000);
+    CHECK(woken == 0);
+
+    sem_post_soloader(&wake_sem);
+    sem_post_soloader(&wake_sem);
+    usleep(50000);
+    CHECK(woken == 2);
+
+    for (int i = 0; i < 4; i++)
+        sem_post_soloader(&wake_sem);
+    for (int i = 0; i < 6; i++)
+        pthread_join(threads[i], NULL);
+    CHECK(woken == 6);
+
+    int value;
+    CHECK(sem_getvalue_soloader(&wake_sem, &value) == 0 && value == 0);
+}
+
+#define PC_ITEMS 100000
+
+static int items_sem, space_sem;
+
+static void * sem_producer(void * p) {
+    for (int i = 0; i < PC_ITEMS; i++) {
+        sem_wait_soloader(&space_sem);
+        sem_post_soloader(&items_sem);
+    }
+    return NULL;
+}
+
+static void * sem_consumer(void * p) {
+    for (int i = 0; i < PC_ITEMS; i++) {
+        if (i % 3 == 0) {
+            while (sem_trywait_soloader(&items_sem) != 0)
+                sched_yield();
+        } else {
+            sem_wait_soloader(&items_sem);
+        }
+        sem_post_soloader(&space_sem);
+    }
+    return NULL;
+}
+
+TEST(sem_bounded_buffer) {
+    sem_init_soloader(&items_sem, 0, 0);
+    sem_init_soloader(&space_sem, 0, 16);
+
+    pthread_t threads[8];
+    for (int i = 0; i < 4; i++) {
+        pthread_create(&threads[i], NULL, sem_producer, NULL);
+        pthread_create(&threads[4 + i], NULL, sem_consumer, NULL);
+    }
+    for (int i = 0; i < 8; i++)
+        pthread_join(threads[i], NULL);
+
+    int items, space;
+    sem_getvalue_soloader(&items_sem, &items);
+    sem_getvalue_soloader(&space_sem, &space);
+    CHECK(items == 0 && space == 16);
+}
+
+static volatile int once_control;
+static volatile int once_runs, once_done, once_early;
+
+static void slow_init(void) {
+    __atomic_add_fetch(&once_runs, 1, __ATOMIC_RELAXED);
+    usleep(20000);
+    __atomic_store_n(&once_done, 1, __ATOMIC_RELEASE);
+}
+
+static void * once_caller(void * p) {
+    pthread_once_soloader(&once_control, slow_init);
+    if (!__atomic_load_n(&once_done, __ATOMIC_ACQUIRE))
+        __atomic_add_fetch(&once_early, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+TEST(once_runs_once_and_callers_wait) {
+    for (int round = 0; round < 20; round++) {
+        once_control = 0;
+        once_runs = once_done = once_early = 0;
+
+        pthread_t threads[8];
+        for (int i = 0; i < 8; i++)
+            pthread_create(&threads[i], NULL, once_caller, NULL);
+        for (int i = 0; i < 8; i++)
+            pthread_join(threads[i], NULL);
+
+        if (once_runs != 1 || once_early != 0) {
+            CHECK(once_runs == 1);
+            CHECK(once_early == 0);
+            break;
+        }
+    }
+
+    // Done already: returns without calling it again
+    once_caller(NULL);
+    CHECK(once_runs == 1);
+    CHECK(pthread_once_soloader(&once_control, NULL) == EINVAL);
+    CHECK(pthread_once_soloader(NULL, slow_init) == EINVAL);
+}
+
+int main() {
+    RUN(sem_counts);
+    RUN(sem_errors);
+    RUN(sem_timedwait_times_out);
+    RUN(sem_post_wakes_one_sleeper_each);
+    RUN(sem_bounded_buffer);
+    RUN(once_runs_once_and_callers_wait);
+    return TEST_RESULT();
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  test_scheduler.c
+ * @brief Fork/join correctness of the task scheduler, and that sched_wait()
+ *        sleeps instead of spinning once there is nothing left to steal.
+ */
+
+#define _GNU_SOURCE
+
+#include "utils/scheduler.h"
+
+#include <psp2/kernel/threadmgr.h>
+
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "host_test.h"
+
+#define NUM_ITEMS 100000
+
+static int items[NUM_ITEMS];
+
+static void add_one(int begin, int end, void * arg) {
+    for (int i = begin; i < end; i++)
+        items[i]++;
+}
+
+static void sleep_task(void * arg) {
+    sceKernelDelayThread((SceUInt) (uintptr_t) arg);
+}
+
+static void nested_task(void * arg) {
+    volatile int * done = arg;
+    sched_parallel_for("nested", 0, 64, 1, add_one, NULL);
+    __atomic_fetch_add(done, 1, __ATOMIC_RELAXED);
+}
+
+// Every sleep of the calling thread is a voluntary context switch
+static long thread_sleeps(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_nvcsw;
+}
+
+TEST(parallel_for_visits_every_index_once) {
+    for (int round = 0; round < 200; round++)
+        sched_parallel_for("add_one", 0, NUM_ITEMS, 97 + round, add_one, NULL);
+
+    int ok = 1;
+    for (int i = 0; i < NUM_ITEMS; i++)
+        ok &= items[i] == 200;
+    CHECK(ok);
+}
+
+TEST(nested_groups) {
+    for (int i = 0; i < 64; i++)
+        items[i] = 0;
+
+    volatile int done = 0;
+    sched_group group;
+    sched_group_init(&group);
+    for (int i = 0; i < 32; i++)
+        sched_spawn(&group, "nested", nested_task, (void *) &done);
+    sched_wait(&group);
+
+    CHECK(done == 32);
+    int ok = 1;
+    for (int i = 0; i < 64; i++)
+        ok &= items[i] == 32;
+    CHECK(ok);
+}
+
+TEST(wait_sleeps_until_last_task) {
+    sched_group group;
+    sched_group_init(&group);
+
+    // One task per thread: the workers steal the long ones from the top, the
+    // waiter pops the short one and then has nothing left to run
+    uint64_t start = test_now_us();
+    sched_spawn(&group, "sleep", sleep_task, (void *) 60000);
+    sched_spawn(&group, "sleep", sleep_task, (void *) 60000);
+    sched_spawn(&group, "sleep", sleep_task, (void *) 10000);
+
+    long sleeps = thread_sleeps();
+    sched_wait(&group);
+    sleeps = thread_sleeps() - sleeps;
+    uint64_t elapsed = test_now_us() - start;
+
+    CHECK((group.pending & 0xffffff) == 0);
+    CHECK(elapsed >= 59000 && elapsed < 500000);
+    // Its own task, then one wait for the last one; polling would be hundreds
+    CHECK(sleeps < 10);
+}
+
+static void * external_waiter(void * arg) {
+    // Not a scheduler thread: tasks run inline and the wait returns at once
+    sched_group group;
+    sched_group_init(&group);
+    for (int i = 0; i < 4; i++)
+        sched_spawn(&group, "sleep", sleep_task, (void *) 1000);
+    sched_wait(&group);
+    return (void *) (uintptr_t) (group.pending == 0);
+}
+
+TEST(wait_from_other_thread) {
+    pthread_t thread;
+    void * ok = NULL;
+    pthread_create(&thread, NULL, external_waiter, NULL);
+    pthread_join(thread, &ok);
+    CHECK(ok != NULL);
+}
+
+TEST(many_short_groups) {
+    // Races the last task's wakeup against the waiter going to sleep
+    for (int round = 0; round < 20000; round++) {
+        sched_group group;
+        sched_group_init(&group);
+        sched_spawn(&group, "sleep", sleep_task, (void *) 0);
+        sched_spawn(&group, "sleep", sleep_task, (void *) 0);
+        sched_spawn(&group, "sleep", sleep_task, (void *) 0);
+        sched_wait(&group);
+        if (group.pending != 0) {
+            CHECK(group.pending == 0);
+            break;
+        }
+    }
+}
+
+int main() {
+    sched_init();
+
+    RUN(parallel_for_visits_every_index_once);
+    RUN(nested_groups);
+    RUN(wait_sleeps_until_last_task);
+    RUN(wait_from_other_thread);
+    RUN(many_short_groups);
+    return TEST_RESULT();
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  test_so_reloc.c
+ * @brief Batched relocation writes of so_util/so_reloc.c over plain buffers:
+ *        which pages get staged, how dirty pages are committed, and what
+ *        happens to writes the staging does not cover.
+ */
+
+#include "so_util/so_reloc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "host_test.h"
+
+#define PAGE SO_RELOC_PAGE_SIZE
+#define MAX_CALLS 16
+
+typedef struct {
+    uintptr_t dst;
+    size_t size;
+} call;
+
+static call commits[MAX_CALLS], flushes[MAX_CALLS];
+static int num_commits, num_flushes;
+
+static void test_commit(void * dst, const void * src, size_t size, void * user) {
+    if (num_commits < MAX_CALLS)
+        commits[num_commits] = (call) { (uintptr_t) dst, size };
+    num_commits++;
+    memcpy(dst, src, size);
+}
+
+static void test_flush(void * dst, size_t size, void * user) {
+    if (num_flushes < MAX_CALLS)
+        flushes[num_flushes] = (call) { (uintptr_t) dst, size };
+    num_flushes++;
+}
+
+static const so_reloc_ops ops = { test_commit, test_flush, NULL, NULL };
+
+// A page-aligned buffer filled with a pattern, standing in for a segment
+static uint8_t * segment(size_t size) {
+    uint8_t * buf = aligned_alloc(PAGE, (size + PAGE - 1) / PAGE * PAGE);
+    for (size_t i = 0; i < size; i++)
+        buf[i] = (uint8_t) (i * 7);
+    num_commits = num_flushes = 0;
+    return buf;
+}
+
+static int untouched(const uint8_t * buf, size_t from, size_t to) {
+    for (size_t i = from; i < to; i++)
+        if (buf[i] != (uint8_t) (i * 7))
+            return 0;
+    return 1;
+}
+
+static uint32_t load(const uint8_t * p) {
+    uint32_t val;
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+TEST(straddling_word_marks_both_pages) {
+    uint8_t * buf = segment(3 * PAGE);
+    uintptr_t base = (uintptr_t) buf;
+    uintptr_t addr = base + PAGE - 2;
+
+    so_reloc_ctx ctx;
+    so_reloc_init(&ctx, &ops);
+    CHECK(so_reloc_add_segment(&ctx, base, 3 * PAGE) == 0);
+    CHECK(so_reloc_mark(&ctx, addr) == 0);
+    CHECK(so_reloc_stage(&ctx) == 0);
+    CHECK(ctx.seg[0].num_dirty == 2);
+    CHECK(ctx.seg[0].page_slot[0] == 0 && ctx.seg[0].page_slot[1] == 1 && ctx.seg[0].page_slot[2] == -1);
+
+    // Staged, so nothing reaches the segment before the commit
+    CHECK(so_reloc_read(&ctx, addr) == load(buf + PAGE - 2));
+    so_reloc_write(&ctx, addr, 0xdeadbeef);
+    CHECK(so_reloc_read(&ctx, addr) == 0xdeadbeef);
+    CHECK(num_commits == 0 && untouched(buf, 0, 3 * PAGE));
+
+    CHECK(so_reloc_commit(&ctx) == 0);
+    CHECK(num_commits == 1 && commits[0].dst == base && commits[0].size == 2 * PAGE);
+    CHECK(num_flushes == 1 && flushes[0].dst == base && flushes[0].size == 2 * PAGE);
+    CHECK(load(buf + PAGE - 2) == 0xdeadbeef);
+    CHECK(untouched(buf, 0, PAGE - 2) && untouched(buf, PAGE + 2, 3 * PAGE));
+    CHECK(ctx.seg[0].num_relocs == 1 && ctx.num_unmapped == 0);
+
+    so_reloc_free(&ctx);
+    free(buf);
+}
+
+TEST(dirty_pages_committed_in_runs) {
+    // Seven and a half pages, the last one partial
+    size_t size = 7 * PAGE + PAGE / 2;
+    uint8_t * buf = segment(size);
+    uintptr_t base = (uintptr_t) buf;
+
+    // Marked out of order; pages 1-3, 5 and the partial 7 end up dirty
+    static const size_t marked[] = { 7 * PAGE + 8, 5 * PAGE + 0x100, 3 * PAGE, 1 * PAGE + 0x40, 2 * PAGE + 0x800 };
+    const int num_marked = sizeof(marked) / sizeof(marked[0]);
+
+    so_reloc_ctx ctx;
+    so_reloc_init(&ctx, &ops);
+    CHECK(so_reloc_add_segment(&ctx, base, size) == 0);
+    for (int i = 0; i < num_marked; i++)
+        CHECK(so_reloc_mark(&ctx, base + marked[i]) == 0);
+    CHECK(so_reloc_mark(&ctx, base + size - 2) == -1); // word would run past the end
+    CHECK(so_reloc_stage(&ctx) == 0);
+    CHECK(ctx.seg[0].num_dirty == 5);
+
+    for (int i = 0; i < num_marked; i++)
+        so_reloc_write(&ctx, base + marked[i], 0x1000 + i);
+    CHECK(num_commits == 0);
+
+    CHECK(so_reloc_commit(&ctx) == 0);
+    CHECK(num_commits == 3 && ctx.seg[0].num_commits == 3);
+    CHECK(commits[0].dst == base + 1 * PAGE && commits[0].size == 3 * PAGE);
+    CHECK(commits[1].dst == base + 5 * PAGE && commits[1].size == PAGE);
+    CHECK(commits[2].dst == base + 7 * PAGE && commits[2].size == PAGE / 2);
+    CHECK(num_flushes == 3 && flushes[2].dst == commits[2].dst && flushes[2].size == commits[2].size);
+
+    for (int i = 0; i < num_marked; i++)
+        CHECK(load(buf + marked[i]) == 0x1000 + (uint32_t) i);
+
+    // Everything but the written words keeps its contents
+    for (int i = 0; i < num_marked; i++)
+        memset(buf + marked[i], 0, sizeof(uint32_t));
+    int intact = 1;
+    for (size_t i = 0; i < size; i++) {
+        int written = 0;
+        for (int m = 0; m < num_marked; m++)
+            if (i >= marked[m] && i < marked[m] + sizeof(uint32_t))
+                written = 1;
+        if (!written && buf[i] != (uint8_t) (i * 7))
+            intact = 0;
+    }
+    CHECK(intact);
+
+    so_reloc_free(&ctx);
+    free(buf);
+}
+
+TEST(unstaged_writes_go_straight_to_commit) {
+    uint8_t * buf = segment(4 * PAGE);
+    uintptr_t base = (uintptr_t) buf;
+    uint32_t outside = 0x11111111;
+
+    so_reloc_ctx ctx;
+    so_reloc_init(&ctx, &ops);
+    CHECK(so_reloc_add_segment(&ctx, base, 2 * PAGE) == 0);
+    CHECK(so_reloc_mark(&ctx, base + 0x10) == 0);
+    CHECK(so_reloc_mark(&ctx, (uintptr_t) &outside) == -1);
+    CHECK(so_reloc_stage(&ctx) == 0);
+
+    // Outside any registered segment
+    so_reloc_write(&ctx, (uintptr_t) &outside, 0xcafef00d);
+    CHECK(num_commits == 1 && commits[0].dst == (uintptr_t) &outside && commits[0].size == sizeof(uint32_t));
+    CHECK(num_flushes == 1 && flushes[0].dst == (uintptr_t) &outside);
+    CHECK(outside == 0xcafef00d);
+    CHECK(so_reloc_read(&ctx, (uintptr_t) &outside) == 0xcafef00d);
+
+    // Past the end of the segment, and in one of its pages that was not marked
+    so_reloc_write(&ctx, base + 3 * PAGE, 0x22222222);
+    so_reloc_write(&ctx, base + PAGE + 4, 0x33333333);
+    CHECK(num_commits == 3 && commits[1].dst == base + 3 * PAGE && commits[2].dst == base + PAGE + 4);
+    CHECK(load(buf + 3 * PAGE) == 0x22222222 && load(buf + PAGE + 4) == 0x33333333);
+    CHECK(ctx.num_unmapped == 3 && ctx.seg[0].num_relocs == 0);
+
+    // The staged page is still only committed at the end
+    so_reloc_write(&ctx, base + 0x10, 0x44444444);
+    CHECK(num_commits == 3 && load(buf + 0x10) != 0x44444444);
+    CHECK(so_reloc_commit(&ctx) == 0);
+    CHECK(num_commits == 4 && commits[3].dst == base && commits[3].size == PAGE);
+    CHECK(load(buf + 0x10) == 0x44444444 && load(buf + PAGE + 4) == 0x33333333);
+
+    so_reloc_free(&ctx);
+    free(buf);
+}
+
+int main(void) {
+    RUN(straddling_word_marks_both_pages);
+    RUN(dirty_pages_committed_in_runs);
+    RUN(unstaged_writes_go_straight_to_commit);
+    return TEST_RESULT();
+}
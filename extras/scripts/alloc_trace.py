@@ -0,0 +1,289 @@
+#!/usr/bin/env python3
+"""Aggregate an allocation trace recorded with `-DALLOC_TRACE=ON`.
+
+Reads `alloc_trace.bin` (see source/reimpl/alloc_trace.h for the layout),
+replays it in time order and prints:
+
+- overall live/peak heap bytes and dropped events,
+- per call site: calls, bytes, live bytes at the end of the trace (leak
+  candidates) and peak live bytes,
+- allocation rate per frame, split into the part before the first frame
+  (loading) and the frames themselves, with the busiest sites per frame.
+
+Call sites are return addresses in the game's code. Pass the .so with --so
+to resolve them to symbols.
+
+Usage: alloc_trace.py [--so libgame.so] [--top N] alloc_trace.bin
+"""
+
+import argparse
+import bisect
+import struct
+import sys
+from collections import defaultdict
+
+HEADER = struct.Struct('<4sIII')
+CHUNK = struct.Struct('<III')
+EVENT = struct.Struct('<IIIIII')
+
+VERSION = 1
+
+ALLOC = 1
+FREE = 2
+REALLOC = 3
+FRAME = 4
+
+
+def fail(msg):
+    sys.stderr.write('error: %s\n' % msg)
+    sys.exit(1)
+
+
+def read_trace(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+
+    if len(data) < HEADER.size:
+        fail('%s: too short' % path)
+    magic, version, text_base, text_size = HEADER.unpack_from(data, 0)
+    if magic != b'ALTR':
+        fail('%s: not an allocation trace' % path)
+    if version != VERSION:
+        fail('%s: version %d, expected %d' % (path, version, VERSION))
+
+    events = []
+    dropped = 0
+    last_time = {}  # per thread, to undo the 32-bit wrap
+    wraps = defaultdict(int)
+
+    off = HEADER.size
+    while off + CHUNK.size <= len(data):
+        thid, count, chunk_dropped = CHUNK.unpack_from(data, off)
+        off += CHUNK.size
+        dropped += chunk_dropped
+
+        if off + count * EVENT.size > len(data):
+            # The writer was interrupted mid-chunk; keep what is complete
+            count = (len(data) - off) // EVENT.size
+
+        for i in range(count):
+            time, kind, ptr, size, old_ptr, site = EVENT.unpack_from(data, off + i * EVENT.size)
+            if time < last_time.get(thid, 0):
+                wraps[thid] += 1
+            last_time[thid] = time
+            events.append(((wraps[thid] << 32) | time, kind, ptr, size, old_ptr, site))
+        off += count * EVENT.size
+
+    # Stable, so each thread's own order is kept on equal timestamps
+    events.sort(key=lambda e: e[0])
+    return text_base, text_size, events, dropped
+
+
+def read_symbols(path):
+    """Return a sorted list of (offset, size, name) of the .so's functions."""
+    with open(path, 'rb') as f:
+        elf = f.read()
+
+    if elf[:4] != b'\x7fELF' or elf[4] != 1:
+        fail('%s: not a 32-bit ELF file' % path)
+
+    e_shoff, = struct.unpack_from('<I', elf, 0x20)
+    e_shentsize, e_shnum = struct.unpack_from('<HH', elf, 0x2E)
+    sections = [struct.unpack_from('<IIIIIIIIII', elf, e_shoff + i * e_shentsize) for i in range(e_shnum)]
+
+    # Offsets are relative to the first loadable segment, as text_base is
+    e_phoff, = struct.unpack_from('<I', elf, 0x1C)
+    e_phentsize, e_phnum = struct.unpack_from('<HH', elf, 0x2A)
+    load_vaddr = 0
+    for i in range(e_phnum):
+        p_type, _, p_vaddr = struct.unpack_from('<III', elf, e_phoff + i * e_phentsize)
+        if p_type == 1:
+            load_vaddr = p_vaddr
+            break
+
+    symbols = {}
+    for sh in sections:
+        sh_type = sh[1]
+        if sh_type not in (2, 11):  # SHT_SYMTAB, SHT_DYNSYM
+            continue
+        strtab = sections[sh[6]]
+        for i in range(sh[5] // 16):
+            st_name, st_value, st_size, st_info, _, st_shndx = struct.unpack_from('<IIIBBH', elf, sh[4] + i * 16)
+            if (st_info & 0xF) != 2 or st_shndx == 0:  # defined STT_FUNC
+                continue
+            start = strtab[4] + st_name
+            name = elf[start:elf.index(b'\0', start)].decode(errors='replace')
+            symbols[(st_value & ~1) - load_vaddr] = (st_size, name)
+
+    return sorted((off, size, name) for off, (size, name) in symbols.items())
+
+
+class Symbolizer:
+    def __init__(self, text_base, text_size, symbols):
+        self.text_base = text_base
+        self.text_size = text_size
+        self.symbols = symbols
+        self.starts = [s[0] for s in symbols]
+
+    def __call__(self, site):
+        off = site - self.text_base
+        if off < 0 or off >= self.text_size:
+            return '0x%08X (outside .so)' % site
+
+        i = bisect.bisect_right(self.starts, off) - 1
+        if i >= 0:
+            start, size, name = self.symbols[i]
+            if size == 0 or off < start + size:
+                return '%s+0x%X' % (name, off - start)
+        return '.so+0x%X' % off
+
+
+class Site:
+    __slots__ = ('calls', 'bytes', 'live', 'peak', 'load_calls', 'load_bytes', 'frame_calls', 'frame_bytes')
+
+    def __init__(self):
+        self.calls = self.bytes = self.live = self.peak = 0
+        self.load_calls = self.load_bytes = 0
+        self.frame_calls = self.frame_bytes = 0
+
+
+def replay(events):
+    sites = defaultdict(Site)
+    live = {}  # ptr -> (size, site)
+    stats = {
+        'live': 0, 'peak': 0, 'peak_time': 0, 'unknown_frees': 0,
+        'frames': [], 'load_calls': 0, 'load_bytes': 0,
+    }
+
+    frame_times = []
+    frame_calls = frame_bytes = 0
+    in_frames = False
+
+    def add(ptr, size, site, time):
+        s = sites[site]
+        s.calls += 1
+        s.bytes += size
+        s.live += size
+        s.peak = max(s.peak, s.live)
+        if in_frames:
+            s.frame_calls += 1
+            s.frame_bytes += size
+        else:
+            s.load_calls += 1
+            s.load_bytes += size
+
+        live[ptr] = (size, site)
+        stats['live'] += size
+        if stats['live'] > stats['peak']:
+            stats['peak'] = stats['live']
+            stats['peak_time'] = time
+
+    def remove(ptr):
+        entry = live.pop(ptr, None)
+        if entry is None:
+            # Memory the game got from newlib directly (strdup etc.), or a dropped event
+            stats['unknown_frees'] += 1
+            return
+        size, site = entry
+        sites[site].live -= size
+        stats['live'] -= size
+
+    for time, kind, ptr, size, old_ptr, site in events:
+        if kind == FRAME:
+            if in_frames:
+                stats['frames'].append((time - frame_times[-1], frame_calls, frame_bytes))
+            else:
+                stats['load_calls'], stats['load_bytes'] = frame_calls, frame_bytes
+            frame_times.append(time)
+            frame_calls = frame_bytes = 0
+            in_frames = True
+            continue
+
+        if kind == ALLOC:
+            if ptr:
+                add(ptr, size, site, time)
+                frame_calls += 1
+                frame_bytes += size
+        elif kind == FREE:
+            remove(ptr)
+        elif kind == REALLOC:
+            if size == 0:
+                if old_ptr:
+                    remove(old_ptr)
+            elif ptr:
+                if old_ptr:
+                    remove(old_ptr)
+                add(ptr, size, site, time)
+                frame_calls += 1
+                frame_bytes += size
+
+    if not in_frames:
+        stats['load_calls'], stats['load_bytes'] = frame_calls, frame_bytes
+
+    return sites, stats
+
+
+def kib(n):
+    return '%.1f KiB' % (n / 1024.0)
+
+
+def print_table(title, rows, columns, symbolize):
+    print('\n%s' % title)
+    print('  ' + ''.join('%14s' % c for c in columns) + '  site')
+    for values, site in rows:
+        print('  ' + ''.join('%14s' % v for v in values) + '  ' + symbolize(site))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Aggregate an ALLOC_TRACE allocation trace.')
+    parser.add_argument('--so', help='the game .so, to resolve call sites to symbols')
+    parser.add_argument('--top', type=int, default=20, help='rows per table (default: 20)')
+    parser.add_argument('trace', help='alloc_trace.bin')
+    args = parser.parse_args()
+
+    text_base, text_size, events, dropped = read_trace(args.trace)
+    symbolize = Symbolizer(text_base, text_size, read_symbols(args.so) if args.so else [])
+    sites, stats = replay(events)
+
+    duration = events[-1][0] - events[0][0] if events else 0
+    print('%d events over %.1f s, %d dropped' % (len(events), duration / 1e6, dropped))
+    print('live at end: %s, peak: %s at %.2f s' % (kib(stats['live']), kib(stats['peak']), stats['peak_time'] / 1e6))
+    print('frees of unknown pointers: %d' % stats['unknown_frees'])
+    print('before first frame: %d allocations, %s' % (stats['load_calls'], kib(stats['load_bytes'])))
+
+    frames = stats['frames']
+    if frames:
+        n = len(frames)
+        avg_calls = sum(f[1] for f in frames) / n
+        avg_bytes = sum(f[2] for f in frames) / n
+        worst = max(frames, key=lambda f: f[1])
+        print('frames: %d, %.1f allocations and %s per frame on average, worst %d allocations (%s) in %.1f ms'
+              % (n, avg_calls, kib(avg_bytes), worst[1], kib(worst[2]), worst[0] / 1e3))
+
+    ranked = sorted(sites.items(), key=lambda kv: kv[1].live, reverse=True)
+    print_table('Live at end of trace (leak candidates)',
+                [((kib(s.live), kib(s.peak), s.calls), site) for site, s in ranked[:args.top] if s.live > 0],
+                ('live', 'peak', 'calls'), symbolize)
+
+    ranked = sorted(sites.items(), key=lambda kv: kv[1].peak, reverse=True)
+    print_table('Peak live bytes',
+                [((kib(s.peak), kib(s.bytes), s.calls), site) for site, s in ranked[:args.top]],
+                ('peak', 'total', 'calls'), symbolize)
+
+    ranked = sorted(sites.items(), key=lambda kv: kv[1].load_calls, reverse=True)
+    print_table('Before first frame (loading)',
+                [((s.load_calls, kib(s.load_bytes), s.load_bytes // max(s.load_calls, 1)), site)
+                 for site, s in ranked[:args.top] if s.load_calls > 0],
+                ('calls', 'bytes', 'avg size'), symbolize)
+
+    if frames:
+        n = len(frames)
+        ranked = sorted(sites.items(), key=lambda kv: kv[1].frame_calls, reverse=True)
+        print_table('Per frame (pool candidates)',
+                    [(('%.2f' % (s.frame_calls / n), kib(s.frame_bytes / n), s.frame_bytes // max(s.frame_calls, 1)), site)
+                     for site, s in ranked[:args.top] if s.frame_calls > 0],
+                    ('calls/frame', 'bytes/frame', 'avg size'), symbolize)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,225 @@
+#!/usr/bin/env python3
+"""Generate a perfect-hash index for the `default_dynlib` import table.
+
+Parses the `default_dynlib[]` array in source/dynlib.c, evaluates the
+`#ifdef`/`#ifndef`/`#else`/`#endif` blocks inside it for the given set of
+defines, and emits a header with a two-level (hash and displace) perfect hash
+over the entries, so that `so_resolve` can find any import with exactly one
+string comparison.
+
+The build fails if the same symbol is listed twice in the active
+configuration, reporting it as a conflict if the two entries point to
+different functions.
+
+With --names, the active symbol names are also written out in table order,
+for the relocation replay benchmark in extras/host, which cannot build
+dynlib.c itself.
+
+Usage: gen_dynlib_index.py [-DNAME ...] -o dynlib_index.h [--names dynlib_names.h] source/dynlib.c
+"""
+
+import argparse
+import os
+import re
+import sys
+
+TABLE_START = re.compile(r'^\s*so_default_dynlib\s+default_dynlib\s*\[\s*\]\s*=\s*\{')
+TABLE_END = re.compile(r'^\s*\};')
+ENTRY = re.compile(r'^\s*\{\s*"([^"]+)"\s*,\s*(.+?)\s*\}\s*,?\s*(//.*)?$')
+DIRECTIVE = re.compile(r'^\s*#\s*(\w+)\s*(\w*)')
+
+MASK32 = 0xFFFFFFFF
+EMPTY_SLOT = 0xFFFF
+MAX_DISPLACEMENT = 0xFFFF
+
+
+def so_dynlib_hash(name, seed):
+    # Must match so_dynlib_hash() in lib/so_util/so_util.c (FNV-1a)
+    h = (0x811c9dc5 ^ seed) & MASK32
+    for c in name.encode():
+        h ^= c
+        h = (h * 0x01000193) & MASK32
+    return h
+
+
+def so_fmix32(h):
+    # Must match so_fmix32() in lib/so_util/so_util.c (murmur3 finalizer)
+    h ^= h >> 16
+    h = (h * 0x85ebca6b) & MASK32
+    h ^= h >> 13
+    h = (h * 0xc2b2ae35) & MASK32
+    h ^= h >> 16
+    return h
+
+
+def so_dynlib_slot(h, disp, num_slots):
+    return so_fmix32(h ^ ((disp * 0x9e3779b9) & MASK32)) & (num_slots - 1)
+
+
+def fail(path, lineno, msg):
+    sys.stderr.write('%s:%d: error: %s\n' % (path, lineno, msg))
+    sys.exit(1)
+
+
+def parse_table(path, defines):
+    entries = []
+    in_table = False
+    stack = []  # one bool per open conditional: is this branch active?
+
+    with open(path, encoding='utf-8') as f:
+        for lineno, line in enumerate(f, 1):
+            if not in_table:
+                if TABLE_START.match(line):
+                    in_table = True
+                continue
+
+            if TABLE_END.match(line):
+                if stack:
+                    fail(path, lineno, 'unterminated conditional in default_dynlib')
+                return entries
+
+            stripped = line.strip()
+            if not stripped or stripped.startswith('//'):
+                continue
+
+            d = DIRECTIVE.match(line)
+            if d:
+                kw, arg = d.group(1), d.group(2)
+                if kw == 'ifdef':
+                    stack.append(arg in defines)
+                elif kw == 'ifndef':
+                    stack.append(arg not in defines)
+                elif kw == 'else':
+                    if not stack:
+                        fail(path, lineno, '#else without #ifdef')
+                    stack[-1] = not stack[-1]
+                elif kw == 'endif':
+                    if not stack:
+                        fail(path, lineno, '#endif without #ifdef')
+                    stack.pop()
+                else:
+                    fail(path, lineno, 'unsupported directive #%s in default_dynlib '
+                                       '(only #ifdef/#ifndef/#else/#endif are understood)' % kw)
+                continue
+
+            m = ENTRY.match(line)
+            if not m:
+                fail(path, lineno, 'could not parse default_dynlib entry: %s' % stripped)
+
+            if all(stack):
+                entries.append((m.group(1), re.sub(r'\s+', '', m.group(2)), lineno))
+
+    fail(path, 0, 'default_dynlib[] table not found')
+
+
+def check_duplicates(path, entries):
+    seen = {}
+    errors = 0
+    for name, target, lineno in entries:
+        if name in seen:
+            first_target, first_line = seen[name]
+            kind = 'duplicate' if first_target == target else 'conflicting'
+            sys.stderr.write('%s:%d: error: %s import "%s" (first defined on line %d)\n'
+                             % (path, lineno, kind, name, first_line))
+            errors += 1
+        else:
+            seen[name] = (target, lineno)
+    if errors:
+        sys.exit(1)
+
+
+def next_pow2(n):
+    p = 1
+    while p < n:
+        p <<= 1
+    return p
+
+
+def build_perfect_hash(names):
+    num_buckets = next_pow2(max(1, len(names) // 4))
+    num_slots = next_pow2(len(names) + len(names) // 4)
+
+    for seed in range(64):
+        hashes = [so_dynlib_hash(n, seed) for n in names]
+        if len(set(hashes)) != len(hashes):
+            continue  # full 32-bit collision, can never be displaced apart
+
+        buckets = [[] for _ in range(num_buckets)]
+        for i, h in enumerate(hashes):
+            buckets[h & (num_buckets - 1)].append(i)
+
+        disp = [0] * num_buckets
+        slots = [EMPTY_SLOT] * num_slots
+        ok = True
+
+        # Place the largest buckets first, while the slot table is emptiest.
+        for b in sorted(range(num_buckets), key=lambda b: -len(buckets[b])):
+            keys = buckets[b]
+            if not keys:
+                continue
+            for d in range(MAX_DISPLACEMENT + 1):
+                placed = [so_dynlib_slot(hashes[k], d, num_slots) for k in keys]
+                if len(set(placed)) == len(placed) and all(slots[s] == EMPTY_SLOT for s in placed):
+                    for k, s in zip(keys, placed):
+                        slots[s] = k
+                    disp[b] = d
+                    break
+            else:
+                ok = False
+                break
+
+        if ok:
+            return seed, disp, slots
+
+    sys.stderr.write('error: could not build a perfect hash for default_dynlib\n')
+    sys.exit(1)
+
+
+def emit_array(out, ctype, name, values):
+    out.write('static const %s %s[%d] = {\n' % (ctype, name, len(values)))
+    for i in range(0, len(values), 12):
+        out.write('    ' + ', '.join('0x%04x' % v for v in values[i:i + 12]) + ',\n')
+    out.write('};\n\n')
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-D', dest='defines', action='append', default=[])
+    parser.add_argument('-o', dest='output', required=True)
+    parser.add_argument('--names', dest='names')
+    parser.add_argument('source')
+    args = parser.parse_args()
+
+    defines = set(d.split('=')[0] for d in args.defines)
+    entries = parse_table(args.source, defines)
+    check_duplicates(args.source, entries)
+
+    if len(entries) >= EMPTY_SLOT:
+        sys.stderr.write('error: default_dynlib has too many entries\n')
+        sys.exit(1)
+
+    seed, disp, slots = build_perfect_hash([e[0] for e in entries])
+
+    with open(args.output, 'w', encoding='utf-8') as out:
+        out.write('// Generated by extras/scripts/gen_dynlib_index.py from %s.\n'
+                  '// Do not edit, changes will be overwritten.\n\n' % os.path.basename(args.source))
+        out.write('#ifndef SOLOADER_DYNLIB_INDEX_H\n#define SOLOADER_DYNLIB_INDEX_H\n\n')
+        out.write('#include <stdint.h>\n\n')
+        out.write('#define DEFAULT_DYNLIB_COUNT %d\n' % len(entries))
+        out.write('#define DEFAULT_DYNLIB_SEED 0x%08x\n\n' % seed)
+        emit_array(out, 'uint16_t', 'default_dynlib_disp', disp)
+        emit_array(out, 'uint16_t', 'default_dynlib_slots', slots)
+        out.write('#endif // SOLOADER_DYNLIB_INDEX_H\n')
+
+    if args.names:
+        with open(args.names, 'w', encoding='utf-8') as out:
+            out.write('// Generated by extras/scripts/gen_dynlib_index.py from %s.\n'
+                      '// Do not edit, changes will be overwritten.\n\n' % os.path.basename(args.source))
+            out.write('static const char *const default_dynlib_names[%d] = {\n' % len(entries))
+            for name, _, _ in entries:
+                out.write('    "%s",\n' % name)
+            out.write('};\n')
+
+
+if __name__ == '__main__':
+    main()
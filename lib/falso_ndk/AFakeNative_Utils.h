@@ -4,12 +4,14 @@
 #include <cstdint>
 
 /* Used to retry syscalls that can return EINTR. */
+#ifndef TEMP_FAILURE_RETRY
 #define TEMP_FAILURE_RETRY(exp) ({         \
     __typeof__(exp) _rc;                   \
     do {                                   \
         _rc = (exp);                       \
     } while (_rc == -1 && errno == EINTR); \
     _rc; })
+#endif
 
 //#define DEBUG_EPOLL 1
 //#define DEBUG_PIPEFD 1
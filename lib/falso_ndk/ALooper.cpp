@@ -2,7 +2,9 @@
 #include <pthread.h>
 #include <cstdio>
 #include <cstdlib>
+#include <algorithm>
 #include <climits>
+#include <map>
 #include <vector>
 #include <cstring>
 #include <unordered_map>
@@ -43,48 +45,25 @@ struct Response {
     Request request;
 };
 
-
-/**
- * A message that can be posted to a Looper.
- */
-struct Message {
-    Message() : what(0) { }
-    Message(int w) : what(w) { }
-
-    /* The message type. (interpretation is left up to the handler) */
-    int what;
-};
-
-/**
- * Interface for a Looper message handler.
- *
- * The Looper holds a strong reference to the message handler whenever it has
- * a message to deliver to it.  Make sure to call Looper::removeMessages
- * to remove any pending messages destined for the handler so that the handler
- * can be destroyed.
- */
-class MessageHandler {
-protected:
-    virtual ~MessageHandler();
-
-public:
-    /**
-     * Handles a message.
-     */
-    virtual void handleMessage(const Message& message) = 0;
-};
+MessageHandler::~MessageHandler() { }
 
 struct MessageEnvelope {
     MessageEnvelope() : uptime(0) { }
 
-    MessageEnvelope(uint64_t u, MessageHandler * h, const Message& m)
-            : uptime(u), handler(h), message(m) {}
+    MessageEnvelope(uint64_t u, SequenceNumber s, MessageHandler * h, const Message& m)
+            : uptime(u), seq(s), handler(h), message(m) {}
 
     uint64_t uptime;
+    SequenceNumber seq; // orders messages due at the same time
     MessageHandler * handler;
     Message message;
 };
 
+// Heap order for mMessageEnvelopes: the earliest message ends up at the front
+static bool messageDueLater(const MessageEnvelope& a, const MessageEnvelope& b) {
+    return a.uptime != b.uptime ? a.uptime > b.uptime : a.seq > b.seq;
+}
+
 
 struct internal_ALooper {
     bool mAllowNonCallbacks; // immutable
@@ -92,8 +71,16 @@ struct internal_ALooper {
     int mWakeEventFd;  // immutable
     pthread_mutex_t mLock;
 
+    // Binary min-heap ordered by messageDueLater().
     std::vector<MessageEnvelope>* mMessageEnvelopes; // guarded by mLock
     bool mSendingMessage; // guarded by mLock
+    SequenceNumber mNextMessageSeq; // guarded by mLock
+
+    // Removed messages stay in the heap and are dropped when they reach the
+    // front: every message sent before the recorded sequence number to the
+    // handler (or handler and what) is dead. Cleared when the heap empties.
+    std::unordered_map<MessageHandler *, SequenceNumber>* mRemovedByHandler;              // guarded by mLock
+    std::map<std::pair<MessageHandler *, int /*what*/>, SequenceNumber>* mRemovedByWhat; // guarded by mLock
 
     // Whether we are currently waiting for work.  Not protected by a lock,
     // any use of it is racy anyway.
@@ -144,6 +131,7 @@ ALooper* ALooper_prepare(int opts) {
 
     auto * ial = (internal_ALooper *) malloc(sizeof(internal_ALooper));
     ial->mAllowNonCallbacks = opts == ALOOPER_PREPARE_ALLOW_NON_CALLBACKS;
+    ial->mEpollFd = -1; // rebuildEpollLocked() closes it otherwise
     ial->mSendingMessage = false;
     ial->mPolling = false;
     ial->mEpollRebuildRequired = false;
@@ -155,6 +143,9 @@ ALooper* ALooper_prepare(int opts) {
     ial->mRequests = new std::unordered_map<SequenceNumber, Request>;
     ial->mResponses = new std::vector<Response>;
     ial->mMessageEnvelopes = new std::vector<MessageEnvelope>;
+    ial->mNextMessageSeq = 0;
+    ial->mRemovedByHandler = new std::unordered_map<MessageHandler *, SequenceNumber>;
+    ial->mRemovedByWhat = new std::map<std::pair<MessageHandler *, int>, SequenceNumber>;
 
     LOG_ALWAYS_FATAL_IF(ial->mWakeEventFd < 0, "Could not make wake event fd: %s", strerror(errno));
 
@@ -263,6 +254,7 @@ void rebuildEpollLocked(internal_ALooper * self) {
 #if DEBUG_CALLBACKS
         ALOGD("%p ~ rebuildEpollLocked - rebuilding epoll set", self);
 #endif
+        pseudo_close(self->mEpollFd);
         self->mEpollFd = -1;
     }
 
@@ -286,6 +278,37 @@ void rebuildEpollLocked(internal_ALooper * self) {
     }
 }
 
+void popMessageLocked(internal_ALooper * self) {
+    std::pop_heap(self->mMessageEnvelopes->begin(), self->mMessageEnvelopes->end(), messageDueLater);
+    self->mMessageEnvelopes->pop_back();
+
+    if (self->mMessageEnvelopes->empty()) {
+        self->mRemovedByHandler->clear();
+        self->mRemovedByWhat->clear();
+    }
+}
+
+bool isMessageRemovedLocked(internal_ALooper * self, const MessageEnvelope& messageEnvelope) {
+    if (!self->mRemovedByHandler->empty()) {
+        auto it = self->mRemovedByHandler->find(messageEnvelope.handler);
+        if (it != self->mRemovedByHandler->end() && messageEnvelope.seq < it->second) return true;
+    }
+
+    if (!self->mRemovedByWhat->empty()) {
+        auto it = self->mRemovedByWhat->find({messageEnvelope.handler, messageEnvelope.message.what});
+        if (it != self->mRemovedByWhat->end() && messageEnvelope.seq < it->second) return true;
+    }
+
+    return false;
+}
+
+// Pops removed messages off the front so it holds the next live one
+void dropRemovedMessagesLocked(internal_ALooper * self) {
+    while (!self->mMessageEnvelopes->empty() && isMessageRemovedLocked(self, self->mMessageEnvelopes->front())) {
+        popMessageLocked(self);
+    }
+}
+
 #define LOOPER_GET_SELF \
     ALooper * __self = ALooper_forThread(); \
     if (!__self) { \
@@ -304,10 +327,12 @@ int pollInner (int timeoutMillis) {
     // Adjust the timeout based on when the next message is due.
     if (timeoutMillis != 0 && self->mNextMessageUptime != LLONG_MAX) {
         uint64_t now = AFN_timeMillis();
-        uint64_t messageTimeoutMillis = self->mNextMessageUptime - now;
-        if (messageTimeoutMillis >= 0
-            && (timeoutMillis < 0 || messageTimeoutMillis < timeoutMillis)) {
-            timeoutMillis = (int) messageTimeoutMillis;
+        // Already due: don't block at all
+        uint64_t messageTimeoutMillis = self->mNextMessageUptime > now ? self->mNextMessageUptime - now : 0;
+        if (timeoutMillis < 0 || messageTimeoutMillis < (uint64_t) timeoutMillis) {
+            // Clamped like libutils' toMillisecondTimeoutDelay(); a far-off
+            // message would otherwise wrap to a short or negative timeout
+            timeoutMillis = messageTimeoutMillis > INT_MAX ? INT_MAX : (int) messageTimeoutMillis;
         }
 #if DEBUG_POLL_AND_WAKE
         ALOGD("ALooper (%p) ~ pollOnce - next message in %lluns, adjusted timeout: timeoutMillis=%d",
@@ -398,18 +423,19 @@ int pollInner (int timeoutMillis) {
 
     // Invoke pending message callbacks.
     self->mNextMessageUptime = LLONG_MAX;
+    dropRemovedMessagesLocked(self);
     while (self->mMessageEnvelopes->size() != 0) {
         uint64_t now = AFN_timeMillis();
-        const MessageEnvelope& messageEnvelope = self->mMessageEnvelopes->at(0);
+        const MessageEnvelope& messageEnvelope = self->mMessageEnvelopes->front();
         if (messageEnvelope.uptime <= now) {
-            // Remove the envelope from the list.
+            // Remove the envelope from the queue.
             // We keep a strong reference to the handler until the call to handleMessage
             // finishes.  Then we drop it so that the handler can be deleted *before*
             // we reacquire our lock.
             { // obtain handler
                 MessageHandler * handler = messageEnvelope.handler;
                 Message message = messageEnvelope.message;
-                self->mMessageEnvelopes->erase(self->mMessageEnvelopes->begin());
+                popMessageLocked(self);
                 self->mSendingMessage = true;
                 pthread_mutex_unlock(&self->mLock);
 
@@ -423,6 +449,9 @@ int pollInner (int timeoutMillis) {
             pthread_mutex_lock(&self->mLock);
             self->mSendingMessage = false;
             result = ALOOPER_POLL_CALLBACK;
+
+            // The handler may have removed messages while we were unlocked
+            dropRemovedMessagesLocked(self);
         } else {
             // The last message left at the head of the queue determines the next wakeup time.
             self->mNextMessageUptime = messageEnvelope.uptime;
@@ -532,12 +561,13 @@ int ALooper_pollAll(int timeoutMillis, int* outFd, int* outEvents, void** outDat
             }
 
             uint64_t now = AFN_timeMillis();
-            if (endTime - now <= 0) {
+            if (now >= endTime) {
 #if DEBUG_POLL_AND_WAKE
                 ALOGD("ALooper_pollAll ret -3 [ALOOPER_POLL_TIMEOUT] reataddr 0x%x\n", __builtin_return_address(0));
 #endif
                 return ALOOPER_POLL_TIMEOUT;
             }
+            timeoutMillis = (int) (endTime - now);
         }
     }
 
@@ -650,3 +680,82 @@ int ALooper_removeFd(ALooper* looper, int fd) {
     pthread_mutex_unlock(&self->mLock);
     return ret;
 }
+
+void ALooper_sendMessage(ALooper* looper, MessageHandler* handler, const Message& message) {
+    ALooper_sendMessageAtTime(looper, AFN_timeMillis(), handler, message);
+}
+
+void ALooper_sendMessageDelayed(ALooper* looper, uint64_t uptimeDelay, MessageHandler* handler,
+                                const Message& message) {
+    uint64_t now = AFN_timeMillis();
+    // Saturate, so a huge delay can't wrap around into the past
+    uint64_t uptime = uptimeDelay > UINT64_MAX - now ? UINT64_MAX : now + uptimeDelay;
+    ALooper_sendMessageAtTime(looper, uptime, handler, message);
+}
+
+void ALooper_sendMessageAtTime(ALooper* looper, uint64_t uptime, MessageHandler* handler,
+                               const Message& message) {
+    if (!looper) return;
+    auto * self = (internal_ALooper *) looper;
+
+#if DEBUG_CALLBACKS
+    ALOGD("ALooper (%p) ~ sendMessageAtTime - uptime=%llu, handler=%p, what=%d", self, uptime, handler, message.what);
+#endif
+
+    bool isFront;
+    { // acquire lock
+        pthread_mutex_lock(&self->mLock);
+
+        MessageEnvelope messageEnvelope(uptime, self->mNextMessageSeq++, handler, message);
+        self->mMessageEnvelopes->push_back(messageEnvelope);
+        std::push_heap(self->mMessageEnvelopes->begin(), self->mMessageEnvelopes->end(), messageDueLater);
+        isFront = self->mMessageEnvelopes->front().seq == messageEnvelope.seq;
+
+        // Optimization: If the Looper is currently sending a message, then we can skip
+        // the call to wake() because the next thing the Looper will do after processing
+        // messages is to decide when the next wakeup time should be.  In fact, it does
+        // not even matter whether this code is running on the Looper thread.
+        if (self->mSendingMessage) {
+            isFront = false;
+        }
+
+        pthread_mutex_unlock(&self->mLock);
+    } // release lock
+
+    // Wake the poll loop only when we enqueue a new message at the head.
+    if (isFront) {
+        wake(self);
+    }
+}
+
+void ALooper_removeMessages(ALooper* looper, MessageHandler* handler) {
+    if (!looper) return;
+    auto * self = (internal_ALooper *) looper;
+
+#if DEBUG_CALLBACKS
+    ALOGD("ALooper (%p) ~ removeMessages - handler=%p", self, handler);
+#endif
+
+    pthread_mutex_lock(&self->mLock);
+    if (!self->mMessageEnvelopes->empty()) {
+        (*self->mRemovedByHandler)[handler] = self->mNextMessageSeq;
+        dropRemovedMessagesLocked(self);
+    }
+    pthread_mutex_unlock(&self->mLock);
+}
+
+void ALooper_removeMessages(ALooper* looper, MessageHandler* handler, int what) {
+    if (!looper) return;
+    auto * self = (internal_ALooper *) looper;
+
+#if DEBUG_CALLBACKS
+    ALOGD("ALooper (%p) ~ removeMessages - handler=%p, what=%d", self, handler, what);
+#endif
+
+    pthread_mutex_lock(&self->mLock);
+    if (!self->mMessageEnvelopes->empty()) {
+        (*self->mRemovedByWhat)[{handler, what}] = self->mNextMessageSeq;
+        dropRemovedMessagesLocked(self);
+    }
+    pthread_mutex_unlock(&self->mLock);
+}
@@ -222,4 +222,92 @@ int ALooper_removeFd(ALooper* looper, int fd);
 };
 #endif
 
+#ifdef __cplusplus
+
+#include <cstdint>
+
+/*
+ * Message queue from libutils' Looper, which the NDK API does not expose.
+ * Uptimes are in AFN_timeMillis() milliseconds.
+ */
+
+/**
+ * A message that can be posted to a Looper.
+ */
+struct Message {
+    Message() : what(0) { }
+    Message(int w) : what(w) { }
+
+    /* The message type. (interpretation is left up to the handler) */
+    int what;
+};
+
+/**
+ * Interface for a Looper message handler.
+ *
+ * The Looper holds a reference to the message handler whenever it has
+ * a message to deliver to it.  Make sure to call ALooper_removeMessages
+ * to remove any pending messages destined for the handler so that the handler
+ * can be destroyed.
+ */
+class MessageHandler {
+protected:
+    virtual ~MessageHandler();
+
+public:
+    /**
+     * Handles a message.
+     */
+    virtual void handleMessage(const Message& message) = 0;
+};
+
+/**
+ * Enqueues a message to be processed by the specified handler.
+ *
+ * The handler must not be null.
+ * This method can be called on any thread.
+ */
+void ALooper_sendMessage(ALooper* looper, MessageHandler* handler, const Message& message);
+
+/**
+ * Enqueues a message to be processed by the specified handler after all pending messages
+ * after the specified delay.
+ *
+ * The time delay is specified in milliseconds.
+ * The handler must not be null.
+ * This method can be called on any thread.
+ */
+void ALooper_sendMessageDelayed(ALooper* looper, uint64_t uptimeDelay, MessageHandler* handler,
+                                const Message& message);
+
+/**
+ * Enqueues a message to be processed by the specified handler after all pending messages
+ * at the specified time. Messages due at the same time are delivered in the order they
+ * were sent.
+ *
+ * The time is specified in milliseconds, on the AFN_timeMillis() clock.
+ * The handler must not be null.
+ * This method can be called on any thread.
+ */
+void ALooper_sendMessageAtTime(ALooper* looper, uint64_t uptime, MessageHandler* handler,
+                               const Message& message);
+
+/**
+ * Removes all messages for the specified handler from the queue.
+ *
+ * The handler must not be null.
+ * This method can be called on any thread.
+ */
+void ALooper_removeMessages(ALooper* looper, MessageHandler* handler);
+
+/**
+ * Removes all messages of a particular type for the specified handler from the queue.
+ *
+ * The handler must not be null.
+ * This method can be called on any thread.
+ */
+void ALooper_removeMessages(ALooper* looper, MessageHandler* handler, int what);
+
+#endif
+
 #endif // ANDROID_LOOPER_H
@@ -1,52 +1,112 @@
 #include "PseudoEpoll.h"
 #include "AFakeNative_Utils.h"
 #include <pthread.h>
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
+#include <list>
 #include <map>
+#include <vector>
 #include <sys/unistd.h>
 #include <cstdio>
 #include <psp2/kernel/threadmgr.h>
 #include <psp2/kernel/clib.h>
 
-#include "polling/pseudo_eventfd.h"
-#include "polling/pseudo_pipe.h"
-
-#define EPOLL_FD_MARGIN 128
-#define EPOLL_FD_MAX 64
+#include "polling/pseudo_fd.h"
 
 typedef struct epollElement {
     int fd;
     pseudo_epoll_event e;
+    bool ready = false;    // queued on the instance's ready list
+    bool disarmed = false; // EPOLLONESHOT fired, waiting for EPOLL_CTL_MOD
+    std::list<epollElement *>::iterator ready_it;
 } epollElement;
 
 typedef struct _epoll_fd_internal {
-    int fd = -1; // >=0 indicates that it's in use
-    std::map<int, epollElement> * interest = nullptr;
+    int fd;
+    SceKernelLwMutexWork lock;
+    std::map<int, epollElement> interest;
+    // Elements that may be ready. Watched fds push themselves here through
+    // pseudo_epoll_notify(); level-triggered ones stay queued while ready.
+    std::list<epollElement *> ready;
+    SceUID wake_flag; // bit 0 is set whenever the ready list grows
 } _epoll_fd_internal;
 
-static _epoll_fd_internal epoll_fd_pool[EPOLL_FD_MAX];
-static SceKernelLwMutexWork * _epoll_lock = nullptr;
+static void epoll_close(void * obj);
 
+static const pseudo_fd_ops epoll_ops = {
+    .name = "epoll",
+    .read = nullptr,
+    .write = nullptr,
+    .status = nullptr,
+    .close = epoll_close,
+};
 
-void _check_init_lock() {
-    if (_epoll_lock == nullptr) {
-        _epoll_lock = (SceKernelLwMutexWork *) malloc(sizeof(SceKernelLwMutexWork));
-        sceKernelCreateLwMutex(_epoll_lock, "epoll_lock", 0, 0, NULL);
+// Live epoll instances, for pseudo_epoll_notify() to find the watchers of a fd
+static std::vector<_epoll_fd_internal *> epoll_registry;
+static SceKernelLwMutexWork * _registry_lock = nullptr;
 
-        for (int i = 0; i < EPOLL_FD_MAX; ++i) {
-            epoll_fd_pool[i].fd = -1;
-        }
+
+void _check_init_lock() {
+    if (_registry_lock == nullptr) {
+        _registry_lock = (SceKernelLwMutexWork *) malloc(sizeof(SceKernelLwMutexWork));
+        sceKernelCreateLwMutex(_registry_lock, "epoll_registry_lock", 0, 0, NULL);
     }
 }
 
 void _lock() {
     _check_init_lock();
-    sceKernelLockLwMutex(_epoll_lock, 1, NULL);
+    sceKernelLockLwMutex(_registry_lock, 1, NULL);
 }
 
 void _unlock() {
-    if (_epoll_lock) sceKernelUnlockLwMutex(_epoll_lock, 1);
+    if (_registry_lock) sceKernelUnlockLwMutex(_registry_lock, 1);
+}
+
+// Looks up an epoll instance and takes a reference to it
+static _epoll_fd_internal * _epoll_get(int epfd, pseudo_fd_file ** file) {
+    *file = pseudo_fd_get(epfd);
+    if (!*file) {
+        errno = EBADF;
+        return nullptr;
+    }
+
+    if ((*file)->ops != &epoll_ops) {
+        pseudo_fd_put(*file);
+        errno = EINVAL;
+        return nullptr;
+    }
+
+    return (_epoll_fd_internal *) (*file)->obj;
+}
+
+// Both require the instance's lock
+static void _ready_push(_epoll_fd_internal * epoll, epollElement * ele) {
+    if (ele->ready || ele->disarmed) return;
+    ele->ready_it = epoll->ready.insert(epoll->ready.end(), ele);
+    ele->ready = true;
+}
+
+static void _ready_remove(_epoll_fd_internal * epoll, epollElement * ele) {
+    if (!ele->ready) return;
+    epoll->ready.erase(ele->ready_it);
+    ele->ready = false;
+}
+
+// Current IN/OUT readiness of a pseudo fd
+static uint32_t _fd_status(int fd) {
+    pseudo_fd_file * file = pseudo_fd_get(fd);
+    if (!file || !file->ops->status) {
+#ifdef DEBUG_EPOLL
+        ALOGD("pseudo_epoll_wait: unknown fd type for fd %i", fd);
+#endif
+        if (file) pseudo_fd_put(file);
+        return 0;
+    }
+
+    uint32_t ret = file->ops->status(file->obj);
+    pseudo_fd_put(file);
+    return ret;
 }
 
 int pseudo_epoll_create(int size) {
@@ -65,26 +125,45 @@ int pseudo_epoll_create1(int flags) {
         return -1;
     }
 
+    auto * epoll = new _epoll_fd_internal;
+    sceKernelCreateLwMutex(&epoll->lock, "epoll_lock", 0, 0, NULL);
+    epoll->wake_flag = sceKernelCreateEventFlag("epoll_wake", SCE_EVENT_WAITMULTIPLE, 0, NULL);
+
+    epoll->fd = pseudo_fd_alloc(&epoll_ops, epoll);
+    if (epoll->fd < 0) {
+        sceKernelDeleteEventFlag(epoll->wake_flag);
+        sceKernelDeleteLwMutex(&epoll->lock);
+        delete epoll;
+        return -1;
+    }
+
     _lock();
+    epoll_registry.push_back(epoll);
+    _unlock();
 
-    _epoll_fd_internal * fd = nullptr;
-    for (int i = 0; i < EPOLL_FD_MAX; ++i) {
-        if (epoll_fd_pool[i].fd == -1) {
-            epoll_fd_pool[i].fd = i + EPOLL_FD_MARGIN;
-            epoll_fd_pool[i].interest = new std::map<int, epollElement>;
-            fd = &epoll_fd_pool[i];
+    return epoll->fd;
+}
+
+static void epoll_close(void * obj) {
+    auto * epoll = (_epoll_fd_internal *) obj;
+
+    _lock();
+    for (auto it = epoll_registry.begin(); it != epoll_registry.end(); ++it) {
+        if (*it == epoll) {
+            epoll_registry.erase(it);
             break;
         }
     }
+    _unlock();
 
-    if (!fd) {
-        _unlock();
-        errno = EMFILE;
-        return -1;
+    // Fds closed before were forgotten already, these are all still open
+    for (auto & [fd, ele] : epoll->interest) {
+        if (ele.e.events & PSEUDO_EPOLLET) pseudo_fd_edge_watch(fd, -1);
     }
 
-    _unlock();
-    return fd->fd;
+    sceKernelDeleteEventFlag(epoll->wake_flag);
+    sceKernelDeleteLwMutex(&epoll->lock);
+    delete epoll;
 }
 
 #ifdef DEBUG_EPOLL
@@ -102,7 +181,7 @@ const char * __op_to_str(int op) {
 #endif
 
 int pseudo_epoll_ctl(int epfd, int op, int fd, struct pseudo_epoll_event *event) {
-    if (epfd < EPOLL_FD_MARGIN || epfd > EPOLL_FD_MARGIN + EPOLL_FD_MAX || fd < 0) {
+    if (fd < 0) {
 #ifdef DEBUG_EPOLL
         ALOGD("pseudo_epoll_ctl(epfd:%i, op:%s, fd:%i): EBADF: epfd or fd is not a valid file descriptor.", epfd, __op_to_str(op), fd);
 #endif
@@ -110,28 +189,45 @@ int pseudo_epoll_ctl(int epfd, int op, int fd, struct pseudo_epoll_event *event)
         return -1;
     }
 
-    _epoll_fd_internal * epoll = nullptr;
-    for (int i = 0; i < EPOLL_FD_MAX; ++i) {
-        if (epoll_fd_pool[i].fd == epfd) {
-            epoll = &epoll_fd_pool[i];
-            break;
-        }
+    // Sets EBADF if epfd isn't open, EINVAL if it isn't an epoll instance
+    pseudo_fd_file * file;
+    _epoll_fd_internal * epoll = _epoll_get(epfd, &file);
+    if (!epoll) {
+#ifdef DEBUG_EPOLL
+        ALOGD("pseudo_epoll_ctl(epfd:%i, op:%s, fd:%i): epfd is not a valid epoll file descriptor.", epfd, __op_to_str(op), fd);
+#endif
+        return -1;
     }
 
-    if (!epoll || fd == epfd) {
+    if (fd == epfd) {
 #ifdef DEBUG_EPOLL
-        ALOGD("pseudo_epoll_ctl(epfd:%i, op:%s, fd:%i): EINVAL: epfd is not an epoll file descriptor, or fd is the same as epfd.", epfd, __op_to_str(op), fd);
+        ALOGD("pseudo_epoll_ctl(epfd:%i, op:%s, fd:%i): EINVAL: fd is the same as epfd.", epfd, __op_to_str(op), fd);
 #endif
-        _unlock();
+        pseudo_fd_put(file);
         errno = EINVAL;
         return -1;
     }
 
-    if (op == PSEUDO_EPOLL_CTL_ADD && epoll->interest->contains(fd)) {
+    if (pseudo_fd_is(fd, &epoll_ops)) {
+#ifdef DEBUG_EPOLL
+        ALOGD("pseudo_epoll_ctl(epfd:%i, op:%s, fd:%i): ELOOP: fd refers to an epoll instance and this EPOLL_CTL_ADD operation would result in a circular loop of epoll instances monitoring one another or a nesting depth of epoll instances greater than 5.", epfd, __op_to_str(op), fd);
+#endif
+
+        // fd refers to an epoll instance. while not exactly per spec, but let's easen up our life a bit by
+        // not supporting this case
+        pseudo_fd_put(file);
+        errno = ELOOP;
+        return -1;
+    }
+
+    sceKernelLockLwMutex(&epoll->lock, 1, NULL);
+
+    if (op == PSEUDO_EPOLL_CTL_ADD && epoll->interest.contains(fd)) {
 #ifdef DEBUG_EPOLL
         ALOGD("pseudo_epoll_ctl(epfd:%i, op:%s, fd:%i): EEXIST: op was EPOLL_CTL_ADD, and the supplied file descriptor fd is already registered with this epoll instance.", epfd, __op_to_str(op), fd);
 #endif
-        _unlock();
+        sceKernelUnlockLwMutex(&epoll->lock, 1);
+        pseudo_fd_put(file);
         errno = EEXIST;
         return -1;
     }
@@ -143,27 +239,30 @@ int pseudo_epoll_ctl(int epfd, int op, int fd, struct pseudo_epoll_event *event)
 #ifdef DEBUG_EPOLL
         ALOGD("pseudo_epoll_ctl(epfd:%i, op:%s, fd:%i): EINVAL: [extra]: `event` can not be null if `op` isn't EPOLL_CTL_DEL", epfd, __op_to_str(op), fd);
 #endif
-        _unlock();
+        sceKernelUnlockLwMutex(&epoll->lock, 1);
+        pseudo_fd_put(file);
         errno = EINVAL;
         return -1;
     }
 
-    if ((op == PSEUDO_EPOLL_CTL_MOD || op == PSEUDO_EPOLL_CTL_DEL) && !epoll->interest->contains(fd)) {
+    if ((op == PSEUDO_EPOLL_CTL_MOD || op == PSEUDO_EPOLL_CTL_DEL) && !epoll->interest.contains(fd)) {
 #ifdef DEBUG_EPOLL
         ALOGD("pseudo_epoll_ctl(epfd:%i, op:%s, fd:%i): ENOENT: op was EPOLL_CTL_MOD or EPOLL_CTL_DEL, and fd is not registered with this epoll instance.", epfd, __op_to_str(op), fd);
 #endif
 
-        _unlock();
+        sceKernelUnlockLwMutex(&epoll->lock, 1);
+        pseudo_fd_put(file);
         errno = ENOENT;
         return -1;
     }
 
-    if (op == PSEUDO_EPOLL_CTL_MOD && epoll->interest->at(epfd).e.events & PSEUDO_EPOLLEXCLUSIVE) {
+    if (op == PSEUDO_EPOLL_CTL_MOD && epoll->interest.at(fd).e.events & PSEUDO_EPOLLEXCLUSIVE) {
 #ifdef DEBUG_EPOLL
         ALOGD("pseudo_epoll_ctl(epfd:%i, op:%s, fd:%i): EINVAL: op was EPOLL_CTL_MOD and the EPOLLEXCLUSIVE flag has previously been applied to this epfd, fd pair.", epfd, __op_to_str(op), fd);
 #endif
 
-        _unlock();
+        sceKernelUnlockLwMutex(&epoll->lock, 1);
+        pseudo_fd_put(file);
         errno = EINVAL;
         return -1;
     }
@@ -173,38 +272,41 @@ int pseudo_epoll_ctl(int epfd, int op, int fd, struct pseudo_epoll_event *event)
         ALOGD("pseudo_epoll_ctl(epfd:%i, op:%s, fd:%i): EINVAL: op was EPOLL_CTL_MOD and events included EPOLLEXCLUSIVE.", epfd, __op_to_str(op), fd);
 #endif
 
-        _unlock();
+        sceKernelUnlockLwMutex(&epoll->lock, 1);
+        pseudo_fd_put(file);
         errno = EINVAL;
         return -1;
     }
 
-    if (fd >= EPOLL_FD_MARGIN && fd < EPOLL_FD_MARGIN + EPOLL_FD_MAX) {
-#ifdef DEBUG_EPOLL
-        ALOGD("pseudo_epoll_ctl(epfd:%i, op:%s, fd:%i): ELOOP: fd refers to an epoll instance and this EPOLL_CTL_ADD operation would result in a circular loop of epoll instances monitoring one another or a nesting depth of epoll instances greater than 5.", epfd, __op_to_str(op), fd);
-#endif
-
-        // fd refers to an epoll instance. while not exactly per spec, but let's easen up our life a bit by
-        // not supporting this case
-        _unlock();
-        errno = ELOOP;
-        return -1;
-    }
-
     if (op == PSEUDO_EPOLL_CTL_ADD || op == PSEUDO_EPOLL_CTL_MOD) {
 #ifdef DEBUG_EPOLL
         ALOGD("pseudo_epoll_ctl(epfd:%i, op:%s, fd:%i): adding/modding fd %i. IN stat:%i, OUT stat:%i", epfd, __op_to_str(op), fd, fd, event->events & PSEUDO_EPOLLIN, event->events & PSEUDO_EPOLLOUT);
 #endif
 
-        epollElement ele;
+        epollElement & ele = epoll->interest[fd];
+        bool was_edge = op == PSEUDO_EPOLL_CTL_MOD && (ele.e.events & PSEUDO_EPOLLET);
+        bool is_edge = event->events & PSEUDO_EPOLLET;
+        if (was_edge != is_edge) pseudo_fd_edge_watch(fd, is_edge ? 1 : -1);
+
         ele.e = *event;
         ele.fd = fd;
-        epoll->interest->emplace(fd, ele);
-        _unlock();
+        ele.disarmed = false;
+
+        // Like Linux, report a fd that is already ready right away; this
+        // also re-arms an EPOLLONESHOT fd on EPOLL_CTL_MOD
+        _ready_push(epoll, &ele);
+        sceKernelSetEventFlag(epoll->wake_flag, 1);
+        sceKernelUnlockLwMutex(&epoll->lock, 1);
+        pseudo_fd_put(file);
         return 0;
     }
 
-    epoll->interest->erase(fd);
-    _unlock();
+    epollElement & ele = epoll->interest.at(fd);
+    if (ele.e.events & PSEUDO_EPOLLET) pseudo_fd_edge_watch(fd, -1);
+    _ready_remove(epoll, &ele);
+    epoll->interest.erase(fd);
+    sceKernelUnlockLwMutex(&epoll->lock, 1);
+    pseudo_fd_put(file);
     return 0;
 }
 
@@ -213,16 +315,6 @@ int pseudo_epoll_wait(int epfd, struct pseudo_epoll_event *events, int maxevents
     ALOGD("pseudo_epoll_wait: epfd: %i; events: 0x%x; maxevents: %i, timeout: %i", epfd, events, maxevents, timeout);
 #endif
 
-    // fd out of our defined bounds
-    if (epfd < EPOLL_FD_MARGIN || epfd > EPOLL_FD_MARGIN + EPOLL_FD_MAX) {
-#ifdef DEBUG_EPOLL
-        ALOGD("pseudo_epoll_wait: epoll fd out of bounds");
-#endif
-
-        errno = EBADF;
-        return -1;
-    }
-
     if (maxevents <= 0) {
 #ifdef DEBUG_EPOLL
         ALOGD("pseudo_epoll_wait: maxevents <= 0");
@@ -232,105 +324,162 @@ int pseudo_epoll_wait(int epfd, struct pseudo_epoll_event *events, int maxevents
         return -1;
     }
 
-    _lock();
-
-    _epoll_fd_internal * fd = nullptr;
-    for (int i = 0; i < EPOLL_FD_MAX; ++i) {
-        if (epoll_fd_pool[i].fd == epfd) {
-            fd = &epoll_fd_pool[i];
-            break;
-        }
-    }
-
+    // Sets EBADF if epfd isn't open, EINVAL if it isn't an epoll instance
+    pseudo_fd_file * file;
+    _epoll_fd_internal * fd = _epoll_get(epfd, &file);
     if (!fd) {
 #ifdef DEBUG_EPOLL
-        ALOGD("pseudo_epoll_wait: epoll fd not found in pool");
+        ALOGD("pseudo_epoll_wait: epfd is not a valid epoll file descriptor");
 #endif
-
-        _unlock();
-        errno = EINVAL;
         return -1;
     }
 
+    sceKernelLockLwMutex(&fd->lock, 1, NULL);
+
     uint64_t time_started = AFN_timeMillis();
     int eventsReported = 0;
 
     for (;;) {
-        for (auto & e : *fd->interest) {
-            bool is_readable, is_writeable;
-
-            if (is_eventfd(e.first)) {
-                pseudo_eventfd_status(e.first, &is_readable, &is_writeable);
-            } else if (is_pipe(e.first)) {
-                pseudo_pipe_status(e.first, &is_readable, &is_writeable);
-            } else {
-#ifdef DEBUG_EPOLL
-                ALOGD("pseudo_epoll_wait: unknown fd type for fd %i", e.first);
-#endif
-                continue;
-            }
+        sceKernelClearEventFlag(fd->wake_flag, ~1);
 
-            if ((e.second.e.events & PSEUDO_EPOLLIN && is_readable) || (e.second.e.events & PSEUDO_EPOLLOUT && is_writeable)) {
-                if (eventsReported >= maxevents) {
-                    break;
-                }
+        // Visit each queued element at most once; level-triggered ones that
+        // are still ready go back to the tail for the next call
+        size_t queued = fd->ready.size();
+        while (queued-- > 0 && eventsReported < maxevents) {
+            epollElement * ele = fd->ready.front();
+            _ready_remove(fd, ele);
 
-                memcpy(&events[eventsReported], &e.second.e, sizeof(pseudo_epoll_event));
-                events[eventsReported].events = 0;
-                if (e.second.e.events & PSEUDO_EPOLLIN && is_readable) events[eventsReported].events |= PSEUDO_EPOLLIN;
-                if (e.second.e.events & PSEUDO_EPOLLOUT && is_writeable) events[eventsReported].events |= PSEUDO_EPOLLOUT;
+            uint32_t revents = _fd_status(ele->fd) & ele->e.events & (PSEUDO_EPOLLIN | PSEUDO_EPOLLOUT);
+            if (!revents) continue;
+
+            events[eventsReported].events = revents;
+            events[eventsReported].data = ele->e.data;
+            eventsReported++;
 
 #ifdef DEBUG_EPOLL
-                int __x = (e.second.e.events & PSEUDO_EPOLLIN && is_readable);
-                int __y = (e.second.e.events & PSEUDO_EPOLLOUT && is_writeable);
-                if (__x && __y) {
-                    ALOGD("pseudo_epoll_wait: reporting events IN+OUT for fd %i", e.first);
-                } else if (__x) {
-                    ALOGD("pseudo_epoll_wait: reporting event IN for fd %i", e.first);
-                } else if (__y) {
-                    ALOGD("pseudo_epoll_wait: reporting event OUT for fd %i", e.first);
-                }
+            ALOGD("pseudo_epoll_wait: reporting events 0x%x for fd %i", revents, ele->fd);
 #endif
-                eventsReported++;
+
+            if (ele->e.events & PSEUDO_EPOLLONESHOT) {
+                ele->disarmed = true;
+            } else if (!(ele->e.events & PSEUDO_EPOLLET)) {
+                _ready_push(fd, ele);
             }
         }
 
         if (timeout == 0) goto done;
-        if (eventsReported >= maxevents) goto done;
-        if (timeout == -1 && eventsReported > 0) goto done;
+        if (eventsReported > 0) goto done;
 
-        if (timeout != -1) {
-            if (AFN_timeMillis() - time_started > timeout) goto done;
+        SceUInt32 wait_us = 0;
+        if (timeout > 0) {
+            int64_t remaining = (int64_t) timeout - (int64_t) (AFN_timeMillis() - time_started);
+            if (remaining <= 0) goto done;
+            wait_us = (SceUInt32) (remaining > 3600000 ? 3600000 : remaining) * 1000;
         }
 
-        _unlock();
-        usleep(10000); // give a chance for other threads to add new FDs to pool
-        _lock();
+        // Sleep until an fd of this instance is written/read or the set
+        // changes. The flag is cleared before rescanning, so a notification
+        // that races with the scan makes the next wait return immediately.
+        sceKernelUnlockLwMutex(&fd->lock, 1);
+        sceKernelWaitEventFlag(fd->wake_flag, 1, SCE_EVENT_WAITOR, NULL, timeout > 0 ? &wait_us : NULL);
+        sceKernelLockLwMutex(&fd->lock, 1, NULL);
     }
 
 done:
-    _unlock();
+    sceKernelUnlockLwMutex(&fd->lock, 1);
+    pseudo_fd_put(file);
     return eventsReported;
 }
 
+void pseudo_epoll_notify(int fd, uint32_t events) {
+    if (_registry_lock == nullptr) return;
+
+    _lock();
+    for (auto * epoll : epoll_registry) {
+        sceKernelLockLwMutex(&epoll->lock, 1, NULL);
+
+        auto it = epoll->interest.find(fd);
+        if (it != epoll->interest.end() && (it->second.e.events & events)) {
+            _ready_push(epoll, &it->second);
+            sceKernelSetEventFlag(epoll->wake_flag, 1);
+        }
+
+        sceKernelUnlockLwMutex(&epoll->lock, 1);
+    }
+    _unlock();
+}
+
+// Like Linux, a closed fd leaves every interest list it was on
+static void _epoll_forget(int fd) {
+    if (_registry_lock == nullptr) return;
+
+    _lock();
+    for (auto * epoll : epoll_registry) {
+        sceKernelLockLwMutex(&epoll->lock, 1, NULL);
+
+        auto it = epoll->interest.find(fd);
+        if (it != epoll->interest.end()) {
+            if (it->second.e.events & PSEUDO_EPOLLET) pseudo_fd_edge_watch(fd, -1);
+            _ready_remove(epoll, &it->second);
+            epoll->interest.erase(it);
+        }
+
+        sceKernelUnlockLwMutex(&epoll->lock, 1);
+    }
+    _unlock();
+}
+
 ssize_t pseudo_read(int fd, void *buf, size_t count) {
-    if (is_eventfd(fd)) {
-        return pseudo_eventfd_read(fd, buf, count);
-    } else if (is_pipe(fd)) {
-        return pseudo_pipe_read(fd, buf, count);
-    } else {
-        // not eventfd or pipe, fallback to normal read
+    pseudo_fd_file * file = pseudo_fd_get(fd);
+    if (!file) {
+        // not a pseudo fd, fallback to normal read
         return read(fd, buf, count);
     }
+
+    ssize_t ret;
+    if (file->ops->read) {
+        ret = file->ops->read(file->obj, buf, count);
+    } else {
+        errno = EBADF;
+        ret = -1;
+    }
+
+    pseudo_fd_put(file);
+    return ret;
 }
 
 ssize_t pseudo_write(int fd, const void *buf, size_t count) {
-    if (is_eventfd(fd)) {
-        return pseudo_eventfd_write(fd, buf, count);
-    } else if (is_pipe(fd)) {
-        return pseudo_pipe_write(fd, buf, count);
-    } else {
-        // not eventfd or pipe, fallback to normal write
+    pseudo_fd_file * file = pseudo_fd_get(fd);
+    if (!file) {
+        // not a pseudo fd, fallback to normal write
         return write(fd, buf, count);
     }
+
+    ssize_t ret;
+    if (file->ops->write) {
+        ret = file->ops->write(file->obj, buf, count);
+    } else {
+        errno = EBADF;
+        ret = -1;
+    }
+
+    pseudo_fd_put(file);
+    return ret;
+}
+
+int pseudo_close(int fd) {
+    pseudo_fd_file * file = pseudo_fd_get(fd);
+    if (!file) {
+        // not a pseudo fd, fallback to normal close
+        return close(fd);
+    }
+
+    bool is_epoll = file->ops == &epoll_ops;
+    pseudo_fd_put(file);
+
+    // Forgetting the fd first also means pseudo_epoll_wait() never drops the
+    // last reference to it while holding an instance lock, so close ops are
+    // free to call pseudo_epoll_notify()
+    if (!is_epoll) _epoll_forget(fd);
+    return pseudo_fd_close(fd);
 }
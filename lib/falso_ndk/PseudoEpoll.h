@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 #include <sys/fcntl.h>
+#include <sys/types.h>
 
 #define PSEUDO_EPOLL_CLOEXEC O_CLOEXEC
 #define PSEUDO_EPOLL_CLOEXEC O_CLOEXEC
@@ -56,9 +57,23 @@ int pseudo_epoll_create1(int flags);
 
 int pseudo_epoll_ctl(int epfd, int op, int fd, struct pseudo_epoll_event *event);
 
+/**
+ * Queue `fd` on every epoll instance watching it for any of `events` and wake
+ * their waiters. Called by eventfd/pipe with none of their own locks held,
+ * after `fd` may have become readable (PSEUDO_EPOLLIN) or writable
+ * (PSEUDO_EPOLLOUT). Each call is an edge for EPOLLET watchers.
+ */
+void pseudo_epoll_notify(int fd, uint32_t events);
+
 ssize_t pseudo_read(int fd, void *buf, size_t count);
 ssize_t pseudo_write(int fd, const void *buf, size_t count);
 
+/**
+ * Close a pseudo fd of any type, removing it from every epoll interest list
+ * first. Other fds are passed on to close().
+ */
+int pseudo_close(int fd);
+
 
 #ifdef __cplusplus
 };
@@ -8,218 +8,218 @@
 #include "falso_ndk/PseudoEpoll.h"
 
 #include "pseudo_eventfd.h"
-
-#define EVENTFD_MARGIN 256
-#define EVENTFD_MAX 64
-
+#include "pseudo_fd.h"
+
+// Event flag bits, only set when someone is blocked waiting for them
+#define EVENTFD_EVF_READABLE 1
+#define EVENTFD_EVF_WRITABLE 2
+
+/*
+ * `value` is guarded by `mutex`. A blocking read (write) that can not go on
+ * counts itself in `readers_waiting` (`writers_waiting`) and clears its bit
+ * before dropping the mutex; the other side sets the bit under the mutex
+ * after changing the value, so the wakeup can not be missed.
+ */
 typedef struct eventfd_internal {
-    int fd = -1; // >=0 indicates that it's in use
-    uint64_t value{};
-    int flags{};
-    SceKernelLwMutexWork * mutex{};
+    int fd;
+    uint64_t value;
+    int flags;
+    int readers_waiting;
+    int writers_waiting;
+    SceUID evf;
+    SceKernelLwMutexWork mutex;
 } eventfd_internal;
 
-static eventfd_internal eventfd_pool[EVENTFD_MAX];
-SceKernelLwMutexWork eventfd_pool_mutex = {{0xFEE1DEAD}};
+static ssize_t eventfd_read(void * obj, void * buf, size_t count);
+static ssize_t eventfd_write(void * obj, const void * buf, size_t count);
+static uint32_t eventfd_status(void * obj);
+static void eventfd_close(void * obj);
+
+static const pseudo_fd_ops eventfd_ops = {
+    .name = "eventfd",
+    .read = eventfd_read,
+    .write = eventfd_write,
+    .status = eventfd_status,
+    .close = eventfd_close,
+};
 
 int pseudo_eventfd(unsigned int initval, int flags) {
-    if (eventfd_pool_mutex.data[0] == 0xFEE1DEAD) {
-        sceKernelCreateLwMutex(&eventfd_pool_mutex, "eventfd_pool_mutex", 0, 0, NULL);
-        sceKernelLockLwMutex(&eventfd_pool_mutex, 1, NULL);
-
-        for (int i = 0; i < EVENTFD_MAX; ++i) {
-            eventfd_pool[i].fd = -1;
-            eventfd_pool[i].value = 0;
-            eventfd_pool[i].flags = 0;
-            eventfd_pool[i].mutex = (SceKernelLwMutexWork *) malloc(sizeof(SceKernelLwMutexWork));
-        }
-    } else {
-        sceKernelLockLwMutex(&eventfd_pool_mutex, 1, NULL);
+    auto * efd = (eventfd_internal *) malloc(sizeof(eventfd_internal));
+    if (!efd) {
+        errno = ENOMEM;
+        return -1;
     }
 
-    eventfd_internal * fd = nullptr;
-    for (int i = 0; i < EVENTFD_MAX; ++i) {
-        if (eventfd_pool[i].fd == -1) {
-            eventfd_pool[i].fd = i + EVENTFD_MARGIN;
-            fd = &eventfd_pool[i];
-            sceKernelCreateLwMutex(eventfd_pool[i].mutex, "eventfd_mutex", 0, 0, NULL);
-            break;
-        }
+    efd->evf = sceKernelCreateEventFlag("eventfd_evf", SCE_EVENT_WAITMULTIPLE, 0, NULL);
+    if (efd->evf < 0) {
+        free(efd);
+        errno = ENFILE;
+        return -1;
     }
 
-    if (!fd) {
-        sceKernelUnlockLwMutex(&eventfd_pool_mutex, 1);
-        errno = EMFILE;
+    efd->value = initval;
+    efd->flags = flags;
+    efd->readers_waiting = 0;
+    efd->writers_waiting = 0;
+    sceKernelCreateLwMutex(&efd->mutex, "eventfd_mutex", 0, 0, NULL);
+
+    efd->fd = pseudo_fd_alloc(&eventfd_ops, efd);
+    if (efd->fd < 0) {
+        sceKernelDeleteEventFlag(efd->evf);
+        sceKernelDeleteLwMutex(&efd->mutex);
+        free(efd);
         return -1;
     }
 
-    fd->value = initval;
-    fd->flags = flags;
-
-    sceKernelUnlockLwMutex(&eventfd_pool_mutex, 1);
 #ifdef DEBUG_POLL_AND_WAKE
-    ALOGD("Created eventfd #%i from addr %p", fd->fd, __builtin_return_address(0));
+    ALOGD("Created eventfd #%i from addr %p", efd->fd, __builtin_return_address(0));
 #endif
-    return fd->fd;
+    return efd->fd;
 }
 
 bool is_eventfd(int fd) {
-    eventfd_internal * p = nullptr;
-
-    sceKernelLockLwMutex(&eventfd_pool_mutex, 1, NULL);
-
-    for (int i = 0; i < EVENTFD_MAX; ++i) {
-        if (eventfd_pool[i].fd == fd) {
-            p = &eventfd_pool[i];
-            break;
-        }
-    }
-
-    sceKernelUnlockLwMutex(&eventfd_pool_mutex, 1);
-
-    return p != nullptr;
+    return pseudo_fd_is(fd, &eventfd_ops);
 }
 
-ssize_t pseudo_eventfd_read(int fd, void *buf, size_t count) {
-    if (eventfd_pool_mutex.data[0] == 0xFEE1DEAD) {
-        return -1;
-    }
-    sceKernelLockLwMutex(&eventfd_pool_mutex, 1, NULL);
-
-    eventfd_internal * efd = nullptr;
-
-    for (int i = 0; i < EVENTFD_MAX; ++i) {
-        if (eventfd_pool[i].fd == fd) {
-            efd = &eventfd_pool[i];
-            break;
-        }
-    }
+// Called and returns with the mutex held
+static void eventfd_wait(eventfd_internal * efd, int * waiting, uint32_t bit) {
+    (*waiting)++;
+    sceKernelClearEventFlag(efd->evf, ~bit);
+    sceKernelUnlockLwMutex(&efd->mutex, 1);
+    sceKernelWaitEventFlag(efd->evf, bit, SCE_EVENT_WAITOR, NULL, NULL);
+    sceKernelLockLwMutex(&efd->mutex, 1, NULL);
+    (*waiting)--;
+}
 
-    if (!efd) {
-        sceKernelUnlockLwMutex(&eventfd_pool_mutex, 1);
-        errno = EINVAL;
-        return -1;
-    }
+static ssize_t eventfd_read(void * obj, void * buf, size_t count) {
+    auto * efd = (eventfd_internal *) obj;
 
     if (count < 8 || !buf) {
-        sceKernelUnlockLwMutex(&eventfd_pool_mutex, 1);
         errno = EINVAL;
         return -1;
     }
 
-    sceKernelLockLwMutex(efd->mutex, 1, NULL);
+    sceKernelLockLwMutex(&efd->mutex, 1, NULL);
 
     if (efd->value == 0) {
         if (efd->flags & PSEUDO_EFD_NONBLOCK) {
-            sceKernelUnlockLwMutex(efd->mutex, 1);
-            sceKernelUnlockLwMutex(&eventfd_pool_mutex, 1);
+            sceKernelUnlockLwMutex(&efd->mutex, 1);
             errno = EAGAIN;
             return -1;
         } else {
-            for (;;) {
-                sceKernelUnlockLwMutex(efd->mutex, 1);
-                sceKernelUnlockLwMutex(&eventfd_pool_mutex, 1);
-                usleep(10000);
-                sceKernelLockLwMutex(&eventfd_pool_mutex, 1, NULL);
-                sceKernelLockLwMutex(efd->mutex, 1, NULL);
-
-                if (efd->value != 0) {
-                    break;
-                }
-            }
+            do {
+                eventfd_wait(efd, &efd->readers_waiting, EVENTFD_EVF_READABLE);
+            } while (efd->value == 0);
         }
     }
 
+    if (efd->writers_waiting) {
+        sceKernelSetEventFlag(efd->evf, EVENTFD_EVF_WRITABLE);
+    }
+
     if (efd->flags & PSEUDO_EFD_SEMAPHORE && efd->value != 0) {
         *(uint64_t *)buf = (uint64_t) 1;
         efd->value--;
-        sceKernelUnlockLwMutex(efd->mutex, 1);
-        sceKernelUnlockLwMutex(&eventfd_pool_mutex, 1);
+        sceKernelUnlockLwMutex(&efd->mutex, 1);
+        pseudo_epoll_notify(efd->fd, PSEUDO_EPOLLOUT);
         return 8;
     }
 
     // Non-semaphore, non-zero value
     *(uint64_t *)buf = efd->value;
     efd->value = 0;
-    sceKernelUnlockLwMutex(efd->mutex, 1);
-    sceKernelUnlockLwMutex(&eventfd_pool_mutex, 1);
+    sceKernelUnlockLwMutex(&efd->mutex, 1);
+    pseudo_epoll_notify(efd->fd, PSEUDO_EPOLLOUT);
     return 8;
 }
 
-ssize_t pseudo_eventfd_write(int fd, const void *buf, size_t count) {
-    if (eventfd_pool_mutex.data[0] == 0xFEE1DEAD) {
-        return -1;
-    }
-    sceKernelLockLwMutex(&eventfd_pool_mutex, 1, NULL);
-
-    uint64_t val;
-    eventfd_internal * efd = nullptr;
-
-    for (int i = 0; i < EVENTFD_MAX; ++i) {
-        if (eventfd_pool[i].fd == fd) {
-            efd = &eventfd_pool[i];
-            break;
-        }
-    }
-
-    if (!efd) {
-        sceKernelUnlockLwMutex(&eventfd_pool_mutex, 1);
-        errno = EINVAL;
-        return -1;
-    }
+static ssize_t eventfd_write(void * obj, const void * buf, size_t count) {
+    auto * efd = (eventfd_internal *) obj;
 
     if (count < 8 || !buf) {
-        sceKernelUnlockLwMutex(&eventfd_pool_mutex, 1);
         errno = EINVAL;
         return -1;
     }
 
-    sceKernelLockLwMutex(efd->mutex, 1, NULL);
+    sceKernelLockLwMutex(&efd->mutex, 1, NULL);
 
-    val = *(uint64_t *) buf;
+    uint64_t val = *(uint64_t *) buf;
     if (0xfffffffffffffffe - efd->value < val) {
         if (efd->flags & PSEUDO_EFD_NONBLOCK) {
-            sceKernelUnlockLwMutex(efd->mutex, 1);
-            sceKernelUnlockLwMutex(&eventfd_pool_mutex, 1);
+            sceKernelUnlockLwMutex(&efd->mutex, 1);
             errno = EAGAIN;
             return -1;
         } else {
-            for (;;) {
-                sceKernelUnlockLwMutex(efd->mutex, 1);
-                sceKernelUnlockLwMutex(&eventfd_pool_mutex, 1);
-                usleep(10000);
-                sceKernelLockLwMutex(&eventfd_pool_mutex, 1, NULL);
-                sceKernelLockLwMutex(efd->mutex, 1, NULL);
-
-                if (0xfffffffffffffffe - efd->value >= val) {
-                    break;
-                }
-            }
+            do {
+                eventfd_wait(efd, &efd->writers_waiting, EVENTFD_EVF_WRITABLE);
+            } while (0xfffffffffffffffe - efd->value < val);
         }
     }
 
     efd->value += val;
-    sceKernelUnlockLwMutex(efd->mutex, 1);
-    sceKernelUnlockLwMutex(&eventfd_pool_mutex, 1);
+    if (efd->readers_waiting && efd->value != 0) {
+        sceKernelSetEventFlag(efd->evf, EVENTFD_EVF_READABLE);
+    }
+    sceKernelUnlockLwMutex(&efd->mutex, 1);
+    pseudo_epoll_notify(efd->fd, PSEUDO_EPOLLIN);
     return 8;
 }
 
+static uint32_t eventfd_status(void * obj) {
+    auto * efd = (eventfd_internal *) obj;
+
+    sceKernelLockLwMutex(&efd->mutex, 1, nullptr);
+    uint32_t ret = (efd->value > 0 ? PSEUDO_EPOLLIN : 0) | (efd->value < 0xfffffffffffffffe ? PSEUDO_EPOLLOUT : 0);
+    sceKernelUnlockLwMutex(&efd->mutex, 1);
+
+    return ret;
+}
+
+static void eventfd_close(void * obj) {
+    auto * efd = (eventfd_internal *) obj;
+
+    sceKernelDeleteEventFlag(efd->evf);
+    sceKernelDeleteLwMutex(&efd->mutex);
+    free(efd);
+}
+
+ssize_t pseudo_eventfd_read(int fd, void *buf, size_t count) {
+    pseudo_fd_file * file = pseudo_fd_get(fd);
+    if (!file || file->ops != &eventfd_ops) {
+        if (file) pseudo_fd_put(file);
+        errno = EINVAL;
+        return -1;
+    }
+
+    ssize_t ret = eventfd_read(file->obj, buf, count);
+    pseudo_fd_put(file);
+    return ret;
+}
+
+ssize_t pseudo_eventfd_write(int fd, const void *buf, size_t count) {
+    pseudo_fd_file * file = pseudo_fd_get(fd);
+    if (!file || file->ops != &eventfd_ops) {
+        if (file) pseudo_fd_put(file);
+        errno = EINVAL;
+        return -1;
+    }
+
+    ssize_t ret = eventfd_write(file->obj, buf, count);
+    pseudo_fd_put(file);
+    return ret;
+}
+
 void pseudo_eventfd_status(int fd, bool * is_readable, bool * is_writeable) {
-    if (eventfd_pool_mutex.data[0] == 0xFEE1DEAD) {
+    pseudo_fd_file * file = pseudo_fd_get(fd);
+    if (!file) {
         return;
     }
 
-    sceKernelLockLwMutex(&eventfd_pool_mutex, 1, nullptr);
-
-    for (int u = 0; u < EVENTFD_MAX; ++u) {
-        if (eventfd_pool[u].fd == fd) {
-            sceKernelLockLwMutex(eventfd_pool[u].mutex, 1, nullptr);
-            *is_readable = eventfd_pool[u].value > 0;
-            *is_writeable = eventfd_pool[u].value < 0xfffffffffffffffe;
-            sceKernelUnlockLwMutex(eventfd_pool[u].mutex, 1);
-            break;
-        }
+    if (file->ops == &eventfd_ops) {
+        uint32_t status = eventfd_status(file->obj);
+        *is_readable = status & PSEUDO_EPOLLIN;
+        *is_writeable = status & PSEUDO_EPOLLOUT;
     }
 
-    sceKernelUnlockLwMutex(&eventfd_pool_mutex, 1);
+    pseudo_fd_put(file);
 }
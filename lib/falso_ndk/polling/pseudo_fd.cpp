@@ -0,0 +1,167 @@
+#include <psp2/kernel/threadmgr.h>
+#include <cerrno>
+#include <cstdlib>
+
+#include "pseudo_fd.h"
+
+#define PSEUDO_FD_CHUNK 64
+#define PSEUDO_FD_MAX_CHUNKS 1024 // 65536 fds
+
+#define PSEUDO_FD_OPEN 0x80000000U
+
+enum {
+    TABLE_UNINITIALIZED = 0,
+    TABLE_INITIALIZING,
+    TABLE_READY
+};
+
+static pseudo_fd_file * volatile chunks[PSEUDO_FD_MAX_CHUNKS];
+static int free_head = -1;
+static int next_unused = 0;
+
+static SceKernelLwMutexWork table_lock;
+static volatile int table_state = TABLE_UNINITIALIZED;
+
+static void _table_init() {
+    int expected = TABLE_UNINITIALIZED;
+    if (__atomic_compare_exchange_n(&table_state, &expected, TABLE_INITIALIZING,
+                                    false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        sceKernelCreateLwMutex(&table_lock, "pseudo_fd_table", 0, 0, nullptr);
+        __atomic_store_n(&table_state, TABLE_READY, __ATOMIC_RELEASE);
+        return;
+    }
+
+    while (__atomic_load_n(&table_state, __ATOMIC_ACQUIRE) != TABLE_READY)
+        sceKernelDelayThread(100);
+}
+
+static pseudo_fd_file * _slot(int index) {
+    pseudo_fd_file * chunk = __atomic_load_n(&chunks[index / PSEUDO_FD_CHUNK], __ATOMIC_ACQUIRE);
+    return chunk ? &chunk[index % PSEUDO_FD_CHUNK] : nullptr;
+}
+
+int pseudo_fd_alloc(const pseudo_fd_ops * ops, void * obj) {
+    if (__atomic_load_n(&table_state, __ATOMIC_ACQUIRE) != TABLE_READY)
+        _table_init();
+
+    sceKernelLockLwMutex(&table_lock, 1, nullptr);
+
+    pseudo_fd_file * file;
+    if (free_head != -1) {
+        file = _slot(free_head);
+        free_head = file->next_free;
+    } else {
+        if (next_unused == PSEUDO_FD_MAX_CHUNKS * PSEUDO_FD_CHUNK) {
+            sceKernelUnlockLwMutex(&table_lock, 1);
+            errno = EMFILE;
+            return -1;
+        }
+
+        if (next_unused % PSEUDO_FD_CHUNK == 0) {
+            auto * chunk = (pseudo_fd_file *) calloc(PSEUDO_FD_CHUNK, sizeof(pseudo_fd_file));
+            if (!chunk) {
+                sceKernelUnlockLwMutex(&table_lock, 1);
+                errno = EMFILE;
+                return -1;
+            }
+            for (int i = 0; i < PSEUDO_FD_CHUNK; ++i) {
+                chunk[i].index = next_unused + i;
+            }
+            __atomic_store_n(&chunks[next_unused / PSEUDO_FD_CHUNK], chunk, __ATOMIC_RELEASE);
+        }
+
+        file = _slot(next_unused++);
+    }
+
+    sceKernelUnlockLwMutex(&table_lock, 1);
+
+    file->ops = ops;
+    file->obj = obj;
+    file->edge_watchers = 0;
+    __atomic_store_n(&file->refs, PSEUDO_FD_OPEN | 1, __ATOMIC_RELEASE);
+    return file->index + PSEUDO_FD_BASE;
+}
+
+pseudo_fd_file * pseudo_fd_get(int fd) {
+    int index = fd - PSEUDO_FD_BASE;
+    if (index < 0 || index >= PSEUDO_FD_MAX_CHUNKS * PSEUDO_FD_CHUNK)
+        return nullptr;
+
+    pseudo_fd_file * file = _slot(index);
+    if (!file)
+        return nullptr;
+
+    uint32_t refs = __atomic_load_n(&file->refs, __ATOMIC_ACQUIRE);
+    do {
+        if (!(refs & PSEUDO_FD_OPEN))
+            return nullptr;
+    } while (!__atomic_compare_exchange_n(&file->refs, &refs, refs + 1,
+                                          true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    return file;
+}
+
+void pseudo_fd_put(pseudo_fd_file * file) {
+    if (__atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    if (file->ops->close)
+        file->ops->close(file->obj);
+
+    sceKernelLockLwMutex(&table_lock, 1, nullptr);
+    file->ops = nullptr;
+    file->obj = nullptr;
+    file->next_free = free_head;
+    free_head = file->index;
+    sceKernelUnlockLwMutex(&table_lock, 1);
+}
+
+int pseudo_fd_close(int fd) {
+    pseudo_fd_file * file = pseudo_fd_get(fd);
+    if (!file) {
+        errno = EBADF;
+        return -1;
+    }
+
+    uint32_t refs = __atomic_fetch_and(&file->refs, ~PSEUDO_FD_OPEN, __ATOMIC_ACQ_REL);
+    if (!(refs & PSEUDO_FD_OPEN)) {
+        // Lost a race with another close()
+        pseudo_fd_put(file);
+        errno = EBADF;
+        return -1;
+    }
+
+    // Drop the reference held by the table, then our own
+    pseudo_fd_put(file);
+    pseudo_fd_put(file);
+    return 0;
+}
+
+bool pseudo_fd_is(int fd, const pseudo_fd_ops * ops) {
+    pseudo_fd_file * file = pseudo_fd_get(fd);
+    if (!file)
+        return false;
+
+    bool ret = file->ops == ops;
+    pseudo_fd_put(file);
+    return ret;
+}
+
+void pseudo_fd_edge_watch(int fd, int delta) {
+    pseudo_fd_file * file = pseudo_fd_get(fd);
+    if (!file)
+        return;
+
+    __atomic_add_fetch(&file->edge_watchers, delta, __ATOMIC_RELEASE);
+    pseudo_fd_put(file);
+}
+
+bool pseudo_fd_edge_watched(int fd) {
+    pseudo_fd_file * file = pseudo_fd_get(fd);
+    if (!file)
+        return false;
+
+    bool ret = __atomic_load_n(&file->edge_watchers, __ATOMIC_ACQUIRE) > 0;
+    pseudo_fd_put(file);
+    return ret;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Descriptor table shared by all pseudo fd types (eventfd, pipe, epoll).
+ *
+ * Pseudo fds start at PSEUDO_FD_BASE, above the range newlib hands out, and
+ * index straight into a two-level table of slots. Chunks of slots are
+ * allocated as the table grows and never freed, so looking an fd up is two
+ * loads and a reference count increment without taking any lock. The table
+ * lock only guards handing out and recycling slots; every object brings its
+ * own lock for its state.
+ */
+
+#define PSEUDO_FD_BASE 128
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Per-type operations. `read`, `write` and `status` may be NULL if the type
+ * does not support them.
+ */
+typedef struct pseudo_fd_ops {
+    const char * name;
+    ssize_t (*read)(void * obj, void * buf, size_t count);
+    ssize_t (*write)(void * obj, const void * buf, size_t count);
+    // PSEUDO_EPOLLIN/PSEUDO_EPOLLOUT conditions that currently hold
+    uint32_t (*status)(void * obj);
+    // The fd was closed and its last reference dropped
+    void (*close)(void * obj);
+} pseudo_fd_ops;
+
+typedef struct pseudo_fd_file {
+    volatile uint32_t refs; // PSEUDO_FD_OPEN while open, plus one per user
+    volatile int edge_watchers; // epoll instances watching it with EPOLLET
+    const pseudo_fd_ops * ops;
+    void * obj;
+    int index;
+    int next_free;
+} pseudo_fd_file;
+
+/**
+ * Install `obj` in a free slot. Returns the new fd, or -1 with errno set to
+ * EMFILE.
+ */
+int pseudo_fd_alloc(const pseudo_fd_ops * ops, void * obj);
+
+/**
+ * Take a reference to the object behind `fd`, which stays valid until the
+ * matching pseudo_fd_put() even if the fd is closed meanwhile. Returns NULL
+ * if `fd` is not an open pseudo fd.
+ */
+pseudo_fd_file * pseudo_fd_get(int fd);
+
+void pseudo_fd_put(pseudo_fd_file * file);
+
+/**
+ * Close `fd`. The object's close op runs once the last reference is gone.
+ * Returns -1 with errno set to EBADF if `fd` is not an open pseudo fd.
+ */
+int pseudo_fd_close(int fd);
+
+bool pseudo_fd_is(int fd, const pseudo_fd_ops * ops);
+
+/**
+ * Count an EPOLLET watcher of `fd` in (`delta` 1) or out (-1). Maintained by
+ * pseudo_epoll_ctl() for types that only notify on readiness changes, which
+ * EPOLLET watchers need on every transfer instead.
+ */
+void pseudo_fd_edge_watch(int fd, int delta);
+
+bool pseudo_fd_edge_watched(int fd);
+
+#ifdef __cplusplus
+};
+#endif
@@ -1,77 +1,143 @@
 #include <psp2/kernel/threadmgr.h>
 #include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include "pseudo_pipe.h"
+#include "pseudo_fd.h"
 #include "falso_ndk/AFakeNative_Utils.h"
+#include "falso_ndk/PseudoEpoll.h"
+
+#define PIPE_MIN_CAPACITY 4096
+
+// Event flag bits, only set when the other side is waiting for them
+#define PIPE_EVF_DATA  1
+#define PIPE_EVF_SPACE 2
+
+/*
+ * The buffer is a single-producer/single-consumer ring: the writer only
+ * advances `head`, the reader only advances `tail`, and neither needs a lock
+ * to move data. Readers (and writers) are serialized among themselves by
+ * `read_lock` (`write_lock`), which is uncontended in the usual one reader,
+ * one writer case. A side only goes to the kernel to sleep on `evf` when the
+ * ring is empty (full); the other side sets the bit after publishing if it
+ * sees the `*_waiting` flag.
+ *
+ * Level-triggered epoll watchers are only notified when readiness changes:
+ * the read end when the ring goes from empty to non-empty, the write end
+ * when it goes from full to not full. pseudo_epoll_notify() takes the
+ * registry lock, so a stream of transfers on a ring that stays non-empty
+ * never reaches it. An end watched with EPOLLET is notified on every
+ * transfer, like Linux does: these pipes always block, so an edge-triggered
+ * reader can not drain to EAGAIN and relies on an edge per write.
+ */
+typedef struct pipefd_internal {
+    int readfd;
+    int writefd;
+    int ends; // open ends, freed when it drops to 0
 
-#define PIPEFD_MARGIN 384
-#define PIPEFD_MAX 64
+    uint8_t * buf;
+    uint32_t mask; // capacity - 1
+    volatile uint32_t head;
+    volatile uint32_t tail;
 
-#define MSGPIPE_MEMTYPE_USER_MAIN 0x40
-#define MSGPIPE_THREAD_ATTR_PRIO (0x8 | 0x4)
+    volatile int reader_waiting;
+    volatile int writer_waiting;
+    volatile int reader_closed;
+    volatile int writer_closed;
 
-typedef struct pipefd_internal {
-    int readfd; // >=0 indicates that it's in use
-    int writefd;
-    int msgpipe;
-    bool readable;
-    bool writeable;
+    SceUID evf;
+    SceKernelLwMutexWork read_lock;
+    SceKernelLwMutexWork write_lock;
 } pipefd_internal;
 
-static pipefd_internal pipefd_pool[PIPEFD_MAX];
-SceKernelLwMutexWork pipefd_pool_mutex = {{0xFEE1DEAD}};
+static ssize_t pipe_read(void * obj, void * buf, size_t count);
+static ssize_t pipe_write(void * obj, const void * buf, size_t count);
+static uint32_t pipe_read_status(void * obj);
+static uint32_t pipe_write_status(void * obj);
+static void pipe_read_close(void * obj);
+static void pipe_write_close(void * obj);
+
+// Both ends share the pipe object; each fd only supports its own direction
+static const pseudo_fd_ops pipe_read_ops = {
+    .name = "pipe",
+    .read = pipe_read,
+    .write = nullptr,
+    .status = pipe_read_status,
+    .close = pipe_read_close,
+};
+
+static const pseudo_fd_ops pipe_write_ops = {
+    .name = "pipe",
+    .read = nullptr,
+    .write = pipe_write,
+    .status = pipe_write_status,
+    .close = pipe_write_close,
+};
+
+static void pipe_release(pipefd_internal * pipe) {
+    if (__atomic_sub_fetch(&pipe->ends, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
 
-int pseudo_pipe(int pipefd[2]) {
 #ifdef DEBUG_PIPEFD
-    ALOGD("pseudo_pipe: called\n");
+    ALOGD("pseudo_pipe: pipe<%i, %i> destroyed", pipe->readfd, pipe->writefd);
 #endif
+    sceKernelDeleteEventFlag(pipe->evf);
+    sceKernelDeleteLwMutex(&pipe->read_lock);
+    sceKernelDeleteLwMutex(&pipe->write_lock);
+    free(pipe->buf);
+    free(pipe);
+}
 
-    if (pipefd_pool_mutex.data[0] == 0xFEE1DEAD) {
-        sceKernelCreateLwMutex(&pipefd_pool_mutex, "pipefd_pool_mutex", 0, 0, nullptr);
-        sceKernelLockLwMutex(&pipefd_pool_mutex, 1, nullptr);
+int pseudo_pipe_with_capacity(int pipefd[2], size_t capacity) {
+#ifdef DEBUG_PIPEFD
+    ALOGD("pseudo_pipe: called, capacity %i\n", capacity);
+#endif
 
-        for (int i = 0; i < PIPEFD_MAX; ++i) {
-            pipefd_pool[i].readfd = -1;
-            pipefd_pool[i].writefd = -1;
-            pipefd_pool[i].msgpipe = -1;
-            pipefd_pool[i].readable = false;
-            pipefd_pool[i].writeable = false;
-        }
+    if (capacity > 0x40000000) {
+        errno = EINVAL;
+        return -1;
+    }
 
-        #ifdef DEBUG_PIPEFD
-            ALOGD("pseudo_pipe: initialized the pool\n");
-        #endif
-    } else {
-        sceKernelLockLwMutex(&pipefd_pool_mutex, 1, nullptr);
+    uint32_t size = PIPE_MIN_CAPACITY;
+    while (size < capacity) size <<= 1;
+
+    auto * pipe = (pipefd_internal *) calloc(1, sizeof(pipefd_internal));
+    if (!pipe || !(pipe->buf = (uint8_t *) malloc(size))) {
+        free(pipe);
+        errno = ENFILE;
+        return -1;
     }
 
-    int ret = sceKernelCreateMsgPipe("pseudo_pipe", MSGPIPE_MEMTYPE_USER_MAIN, MSGPIPE_THREAD_ATTR_PRIO, 4 * 4096, NULL);
-    if (ret < 0) {
+    pipe->evf = sceKernelCreateEventFlag("pseudo_pipe", SCE_EVENT_WAITMULTIPLE, 0, NULL);
+    if (pipe->evf < 0) {
         #ifdef DEBUG_PIPEFD
-            ALOGD("pseudo_pipe: sceKernelCreateMsgPipe failed\n");
+            ALOGD("pseudo_pipe: sceKernelCreateEventFlag failed\n");
         #endif
-        sceKernelUnlockLwMutex(&pipefd_pool_mutex, 1);
+        free(pipe->buf);
+        free(pipe);
+        errno = ENFILE;
         return -1;
     }
 
-    pipefd_internal * pipe = nullptr;
-    for (int i = 0, u = 0; u < PIPEFD_MAX; i++, u+=2) {
-        if (pipefd_pool[i].readfd == -1) {
-            pipe = &pipefd_pool[i];
-
-            pipe->readfd = u + PIPEFD_MARGIN;
-            pipe->writefd = u + 1 + PIPEFD_MARGIN;
-            pipe->readable = false;
-            pipe->writeable = true;
-            pipe->msgpipe = ret;
+    pipe->mask = size - 1;
+    pipe->ends = 2;
+    sceKernelCreateLwMutex(&pipe->read_lock, "pipefd_read_lock", 0, 0, nullptr);
+    sceKernelCreateLwMutex(&pipe->write_lock, "pipefd_write_lock", 0, 0, nullptr);
 
-            break;
-        }
+    pipe->readfd = pseudo_fd_alloc(&pipe_read_ops, pipe);
+    if (pipe->readfd < 0) {
+        pipe->ends = 1;
+        pipe_release(pipe);
+        return -1;
     }
 
-    if (!pipe) {
-        sceKernelDeleteMsgPipe(ret);
-        sceKernelUnlockLwMutex(&pipefd_pool_mutex, 1);
-        errno = EMFILE;
+    pipe->writefd = pseudo_fd_alloc(&pipe_write_ops, pipe);
+    if (pipe->writefd < 0) {
+        int err = errno;
+        pipe->ends = 1;
+        pseudo_fd_close(pipe->readfd);
+        errno = err;
         return -1;
     }
 
@@ -82,130 +148,219 @@ int pseudo_pipe(int pipefd[2]) {
     ALOGD("pseudo_pipe: pipe<%i, %i> initialized", pipe->readfd, pipe->writefd);
 #endif
 
-    sceKernelUnlockLwMutex(&pipefd_pool_mutex, 1);
     return 0;
 }
 
-ssize_t pseudo_pipe_read(int fd, void *buf, size_t count) {
-    if (pipefd_pool_mutex.data[0] == 0xFEE1DEAD) {
-        return -1;
-    }
-    sceKernelLockLwMutex(&pipefd_pool_mutex, 1, NULL);
+int pseudo_pipe(int pipefd[2]) {
+    return pseudo_pipe_with_capacity(pipefd, PSEUDO_PIPE_CAPACITY);
+}
 
-    pipefd_internal * pipe = nullptr;
-    for (int i = 0; i < PIPEFD_MAX; i++) {
-        if (pipefd_pool[i].readfd == fd) {
-#ifdef DEBUG_PIPEFD
-            ALOGD("pseudo_pipe_read: found pipe<%i, %i> for reading", pipefd_pool[i].readfd, pipefd_pool[i].writefd);
-#endif
-            pipe = &pipefd_pool[i];
-            break;
-        }
+// Sleep on `bit` until `ready` holds. `waiting` tells the other side to set
+// the bit; it is raised before the last check so no wakeup is missed.
+template <typename Ready>
+static void pipe_wait(pipefd_internal * pipe, volatile int * waiting, uint32_t bit, Ready ready) {
+    sceKernelClearEventFlag(pipe->evf, ~bit);
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    if (!ready()) {
+        sceKernelWaitEventFlag(pipe->evf, bit, SCE_EVENT_WAITOR, NULL, NULL);
     }
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+}
 
-    if (!pipe) {
-        sceKernelUnlockLwMutex(&pipefd_pool_mutex, 1);
-        errno = EINVAL;
-        return -1;
+static void pipe_wake(pipefd_internal * pipe, volatile int * waiting, uint32_t bit) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED)) {
+        sceKernelSetEventFlag(pipe->evf, bit);
     }
-    ssize_t rlen = count;
-    if (rlen > 4 * 4096) rlen = 4 * 4096;
-    size_t pResult;
-    ssize_t ret = sceKernelReceiveMsgPipe(pipe->msgpipe, buf, rlen, 1, &pResult, NULL);
-    if (ret == 0) { ret = rlen; }
+}
 
-    if (pResult == 0) {
-#ifdef DEBUG_PIPEFD
-        ALOGD("pseudo_pipe_read: pipe<%i, %i> set as NOT readable", pipe->readfd, pipe->writefd);
-#endif
-        pipe->readable = false;
+static ssize_t pipe_read(void * obj, void *buf, size_t count) {
+    auto * pipe = (pipefd_internal *) obj;
+
+    if (count == 0) return 0;
+
+    sceKernelLockLwMutex(&pipe->read_lock, 1, NULL);
+
+    uint32_t tail = pipe->tail;
+    uint32_t avail;
+    for (;;) {
+        avail = __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE) - tail;
+        if (avail) break;
+
+        if (__atomic_load_n(&pipe->writer_closed, __ATOMIC_ACQUIRE)) {
+            // Recheck, the last write may have landed right before close
+            avail = __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE) - tail;
+            if (avail) break;
+
+            sceKernelUnlockLwMutex(&pipe->read_lock, 1);
+            return 0;
+        }
+
+        pipe_wait(pipe, &pipe->reader_waiting, PIPE_EVF_DATA, [pipe, tail]() {
+            return __atomic_load_n(&pipe->head, __ATOMIC_SEQ_CST) != tail ||
+                   __atomic_load_n(&pipe->writer_closed, __ATOMIC_SEQ_CST);
+        });
     }
 
+    size_t len = count < avail ? count : avail;
+    size_t off = tail & pipe->mask;
+    size_t first = len < pipe->mask + 1 - off ? len : pipe->mask + 1 - off;
+    memcpy(buf, pipe->buf + off, first);
+    memcpy((uint8_t *) buf + first, pipe->buf, len - first);
+
+    __atomic_store_n(&pipe->tail, tail + len, __ATOMIC_RELEASE);
+    pipe_wake(pipe, &pipe->writer_waiting, PIPE_EVF_SPACE);
+
+    // The writer can not have gone past a full ring before the store above,
+    // so this never misses the full -> not full edge; a write that raced in
+    // since may make it a spurious one, which watchers tolerate
+    bool was_full = __atomic_load_n(&pipe->head, __ATOMIC_RELAXED) - tail > pipe->mask;
+
+    sceKernelUnlockLwMutex(&pipe->read_lock, 1);
+
 #ifdef DEBUG_PIPEFD
-    ALOGD("pseudo_pipe_read: pipe<%i, %i>, count %i, ret %i", pipe->readfd, pipe->writefd, count, ret);
+    ALOGD("pseudo_pipe_read: pipe<%i, %i>, count %i, ret %i", pipe->readfd, pipe->writefd, count, len);
 #endif
-    sceKernelUnlockLwMutex(&pipefd_pool_mutex, 1);
-    return ret;
+    if (was_full || pseudo_fd_edge_watched(pipe->writefd)) {
+        pseudo_epoll_notify(pipe->writefd, PSEUDO_EPOLLOUT);
+    }
+    return (ssize_t) len;
 }
 
-#define SCE_KERNEL_MSG_PIPE_MODE_FULL 0x00000001U
+static ssize_t pipe_write(void * obj, const void *buf, size_t count) {
+    auto * pipe = (pipefd_internal *) obj;
 
-ssize_t pseudo_pipe_write(int fd, const void *buf, size_t count) {
-    if (pipefd_pool_mutex.data[0] == 0xFEE1DEAD) {
-        return -1;
+    if (count == 0) return 0;
+
+    sceKernelLockLwMutex(&pipe->write_lock, 1, NULL);
+
+    // Blocking write: returns once everything is in, like write(2) on a pipe
+    size_t written = 0;
+    uint32_t head = pipe->head;
+    while (written < count) {
+        if (__atomic_load_n(&pipe->reader_closed, __ATOMIC_ACQUIRE)) break;
+
+        uint32_t space = pipe->mask + 1 - (head - __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE));
+        if (!space) {
+            pipe_wait(pipe, &pipe->writer_waiting, PIPE_EVF_SPACE, [pipe, head]() {
+                return head - __atomic_load_n(&pipe->tail, __ATOMIC_SEQ_CST) != pipe->mask + 1 ||
+                       __atomic_load_n(&pipe->reader_closed, __ATOMIC_SEQ_CST);
+            });
+            continue;
+        }
+
+        size_t len = count - written < space ? count - written : space;
+        size_t off = head & pipe->mask;
+        size_t first = len < pipe->mask + 1 - off ? len : pipe->mask + 1 - off;
+        memcpy(pipe->buf + off, (const uint8_t *) buf + written, first);
+        memcpy(pipe->buf, (const uint8_t *) buf + written + first, len - first);
+
+        uint32_t prev_head = head;
+        head += len;
+        written += len;
+        __atomic_store_n(&pipe->head, head, __ATOMIC_RELEASE);
+        pipe_wake(pipe, &pipe->reader_waiting, PIPE_EVF_DATA);
+
+        // Same reasoning as in pipe_read(). Notified before the next chunk,
+        // a reader that only reads after epoll_wait() could otherwise leave
+        // this write blocked on a full ring forever
+        if ((int32_t) (__atomic_load_n(&pipe->tail, __ATOMIC_RELAXED) - prev_head) >= 0 ||
+            pseudo_fd_edge_watched(pipe->readfd)) {
+            pseudo_epoll_notify(pipe->readfd, PSEUDO_EPOLLIN);
+        }
     }
-    sceKernelLockLwMutex(&pipefd_pool_mutex, 1, NULL);
 
-    pipefd_internal * pipe = nullptr;
-    for (int i = 0; i < PIPEFD_MAX; ++i) {
-        if (pipefd_pool[i].writefd == fd) {
+    sceKernelUnlockLwMutex(&pipe->write_lock, 1);
+
 #ifdef DEBUG_PIPEFD
-            ALOGD("pseudo_pipe_write: found pipe<%i, %i> for writing", pipefd_pool[i].readfd, pipefd_pool[i].writefd);
+    ALOGD("pseudo_pipe_write: pipe<%i, %i>, count %i, ret %i", pipe->readfd, pipe->writefd, count, written);
 #endif
-            pipe = &pipefd_pool[i];
-            break;
-        }
+    if (!written) {
+        // The read end is gone
+        errno = EPIPE;
+        return -1;
     }
 
-    if (!pipe) {
-        sceKernelUnlockLwMutex(&pipefd_pool_mutex, 1);
+    return (ssize_t) written;
+}
+
+static uint32_t pipe_read_status(void * obj) {
+    auto * pipe = (pipefd_internal *) obj;
+
+    // End of file also counts as readable, read() returns 0 right away
+    bool readable = __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE) != __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE) ||
+                    __atomic_load_n(&pipe->writer_closed, __ATOMIC_ACQUIRE);
+    return readable ? PSEUDO_EPOLLIN : 0;
+}
+
+static uint32_t pipe_write_status(void * obj) {
+    auto * pipe = (pipefd_internal *) obj;
+
+    // A closed read end counts as writable, write() fails with EPIPE right away
+    bool writeable = __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE) <= pipe->mask ||
+                     __atomic_load_n(&pipe->reader_closed, __ATOMIC_ACQUIRE);
+    return writeable ? PSEUDO_EPOLLOUT : 0;
+}
+
+static void pipe_read_close(void * obj) {
+    auto * pipe = (pipefd_internal *) obj;
+
+    __atomic_store_n(&pipe->reader_closed, 1, __ATOMIC_SEQ_CST);
+    sceKernelSetEventFlag(pipe->evf, PIPE_EVF_SPACE);
+    pseudo_epoll_notify(pipe->writefd, PSEUDO_EPOLLOUT);
+    pipe_release(pipe);
+}
+
+static void pipe_write_close(void * obj) {
+    auto * pipe = (pipefd_internal *) obj;
+
+    __atomic_store_n(&pipe->writer_closed, 1, __ATOMIC_SEQ_CST);
+    sceKernelSetEventFlag(pipe->evf, PIPE_EVF_DATA);
+    pseudo_epoll_notify(pipe->readfd, PSEUDO_EPOLLIN);
+    pipe_release(pipe);
+}
+
+ssize_t pseudo_pipe_read(int fd, void *buf, size_t count) {
+    pseudo_fd_file * file = pseudo_fd_get(fd);
+    if (!file || file->ops != &pipe_read_ops) {
+        if (file) pseudo_fd_put(file);
         errno = EINVAL;
         return -1;
     }
 
-    size_t len = count;
-    if (len > 4 * 4096) len = 4 * 4096;
-
-    ssize_t ret = sceKernelSendMsgPipe(pipe->msgpipe, (void *)buf, len, SCE_KERNEL_MSG_PIPE_MODE_FULL, NULL, NULL);
-    if (ret == 0) {
-        ret = len;
-
-#ifdef DEBUG_PIPEFD
-        ALOGD("pseudo_pipe_write: pipe<%i, %i> set as readable", pipe->readfd, pipe->writefd);
-#endif
+    ssize_t ret = pipe_read(file->obj, buf, count);
+    pseudo_fd_put(file);
+    return ret;
+}
 
-        pipe->readable = true;
+ssize_t pseudo_pipe_write(int fd, const void *buf, size_t count) {
+    pseudo_fd_file * file = pseudo_fd_get(fd);
+    if (!file || file->ops != &pipe_write_ops) {
+        if (file) pseudo_fd_put(file);
+        errno = EINVAL;
+        return -1;
     }
 
-    sceKernelUnlockLwMutex(&pipefd_pool_mutex, 1);
-#ifdef DEBUG_PIPEFD
-    ALOGD("pseudo_pipe_write: pipe<%i, %i>, count %i, ret %i", pipe->readfd, pipe->writefd, count, ret);
-#endif
+    ssize_t ret = pipe_write(file->obj, buf, count);
+    pseudo_fd_put(file);
     return ret;
 }
 
 void pseudo_pipe_status(int fd, bool * is_readable, bool * is_writeable) {
-    if (pipefd_pool_mutex.data[0] == 0xFEE1DEAD) {
+    pseudo_fd_file * file = pseudo_fd_get(fd);
+    if (!file) {
         return;
     }
-    sceKernelLockLwMutex(&pipefd_pool_mutex, 1, NULL);
-
-    for (int u = 0; u < PIPEFD_MAX; u++) {
-        if (pipefd_pool[u].writefd == fd || pipefd_pool[u].readfd == fd) {
-            *is_readable = pipefd_pool[u].readable;
-            *is_writeable = pipefd_pool[u].writeable;
-            pipefd_pool[u].readable = false;
-            pipefd_pool[u].writeable = false;
-            break;
-        }
+
+    if (file->ops == &pipe_read_ops || file->ops == &pipe_write_ops) {
+        uint32_t status = file->ops->status(file->obj);
+        *is_readable = status & PSEUDO_EPOLLIN;
+        *is_writeable = status & PSEUDO_EPOLLOUT;
     }
 
-    sceKernelUnlockLwMutex(&pipefd_pool_mutex, 1);
+    pseudo_fd_put(file);
 }
 
 bool is_pipe(int fd) {
-    pipefd_internal * p = nullptr;
-
-    sceKernelLockLwMutex(&pipefd_pool_mutex, 1, NULL);
-
-    for (int i = 0; i < PIPEFD_MAX; ++i) {
-        if (pipefd_pool[i].readfd == fd || pipefd_pool[i].writefd == fd) {
-            p = &pipefd_pool[i];
-            break;
-        }
-    }
-
-    sceKernelUnlockLwMutex(&pipefd_pool_mutex, 1);
-
-    return p != nullptr;
+    return pseudo_fd_is(fd, &pipe_read_ops) || pseudo_fd_is(fd, &pipe_write_ops);
 }
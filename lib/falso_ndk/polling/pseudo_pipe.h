@@ -2,12 +2,23 @@
 
 #include <stdio.h>
 
+// Default buffer size of a pipe, same as Linux. Rounded up to a power of two.
+#ifndef PSEUDO_PIPE_CAPACITY
+#define PSEUDO_PIPE_CAPACITY (64 * 1024)
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 int pseudo_pipe(int pipefd[2]);
 
+/**
+ * Like pseudo_pipe(), with a buffer of at least `capacity` bytes instead of
+ * PSEUDO_PIPE_CAPACITY.
+ */
+int pseudo_pipe_with_capacity(int pipefd[2], size_t capacity);
+
 bool is_pipe(int fd);
 ssize_t pseudo_pipe_read(int fd, void *buf, size_t count);
 ssize_t pseudo_pipe_write(int fd, const void *buf, size_t count);
@@ -0,0 +1,194 @@
+/* so_reloc.c -- batched relocation writes for so_util
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.	See the LICENSE file for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "so_reloc.h"
+
+static uint64_t so_reloc_clock(so_reloc_ctx *ctx) {
+    return ctx->ops.clock ? ctx->ops.clock(ctx->ops.user) : 0;
+}
+
+static so_reloc_segment *so_reloc_find(so_reloc_ctx *ctx, uintptr_t addr) {
+    for (int i = 0; i < ctx->num_segments; i++) {
+        so_reloc_segment *seg = &ctx->seg[i];
+        if (addr >= seg->base && addr - seg->base + sizeof(uint32_t) <= seg->size)
+            return seg;
+    }
+    return NULL;
+}
+
+static uint8_t *so_reloc_ptr(so_reloc_segment *seg, uintptr_t addr) {
+    size_t off = addr - seg->base;
+    int32_t slot = seg->page_slot[off / SO_RELOC_PAGE_SIZE];
+    if (slot < 0)
+        return NULL;
+    return seg->staging + (size_t)slot * SO_RELOC_PAGE_SIZE + off % SO_RELOC_PAGE_SIZE;
+}
+
+void so_reloc_init(so_reloc_ctx *ctx, const so_reloc_ops *ops) {
+    memset(ctx, 0, sizeof(so_reloc_ctx));
+    ctx->ops = *ops;
+}
+
+int so_reloc_add_segment(so_reloc_ctx *ctx, uintptr_t base, size_t size) {
+    // Nothing can be relocated in an empty segment
+    if (size == 0)
+        return 0;
+    if (ctx->num_segments >= SO_RELOC_MAX_SEGMENTS)
+        return -1;
+
+    so_reloc_segment *seg = &ctx->seg[ctx->num_segments];
+    memset(seg, 0, sizeof(so_reloc_segment));
+    seg->base = base;
+    seg->size = size;
+    seg->num_pages = (int)((size + SO_RELOC_PAGE_SIZE - 1) / SO_RELOC_PAGE_SIZE);
+    seg->page_slot = malloc(seg->num_pages * sizeof(int32_t));
+    if (!seg->page_slot)
+        return -1;
+
+    for (int i = 0; i < seg->num_pages; i++)
+        seg->page_slot[i] = -1;
+
+    ctx->num_segments++;
+    return 0;
+}
+
+int so_reloc_mark(so_reloc_ctx *ctx, uintptr_t addr) {
+    so_reloc_segment *seg = so_reloc_find(ctx, addr);
+    if (!seg)
+        return -1;
+
+    // A word may straddle two pages; dirty both so it stays contiguous in staging
+    size_t off = addr - seg->base;
+    seg->page_slot[off / SO_RELOC_PAGE_SIZE] = 0;
+    seg->page_slot[(off + sizeof(uint32_t) - 1) / SO_RELOC_PAGE_SIZE] = 0;
+    return 0;
+}
+
+int so_reloc_stage(so_reloc_ctx *ctx) {
+    for (int i = 0; i < ctx->num_segments; i++) {
+        so_reloc_segment *seg = &ctx->seg[i];
+        uint64_t start = so_reloc_clock(ctx);
+
+        // Slots are handed out in page order, so a run of contiguous dirty
+        // pages is also contiguous in staging and can be committed at once.
+        seg->num_dirty = 0;
+        for (int p = 0; p < seg->num_pages; p++) {
+            if (seg->page_slot[p] >= 0)
+                seg->page_slot[p] = seg->num_dirty++;
+        }
+
+        if (seg->num_dirty == 0)
+            continue;
+
+        seg->staging = malloc((size_t)seg->num_dirty * SO_RELOC_PAGE_SIZE);
+        if (!seg->staging)
+            return -1;
+
+        for (int p = 0; p < seg->num_pages; p++) {
+            int32_t slot = seg->page_slot[p];
+            if (slot < 0)
+                continue;
+
+            size_t off = (size_t)p * SO_RELOC_PAGE_SIZE;
+            size_t len = seg->size - off < SO_RELOC_PAGE_SIZE ? seg->size - off : SO_RELOC_PAGE_SIZE;
+            memcpy(seg->staging + (size_t)slot * SO_RELOC_PAGE_SIZE, (void *)(seg->base + off), len);
+        }
+
+        seg->stage_time = so_reloc_clock(ctx) - start;
+    }
+
+    return 0;
+}
+
+uint32_t so_reloc_read(so_reloc_ctx *ctx, uintptr_t addr) {
+    uint32_t val;
+    so_reloc_segment *seg = so_reloc_find(ctx, addr);
+    uint8_t *ptr = seg ? so_reloc_ptr(seg, addr) : NULL;
+
+    // Unmarked addresses are read straight from the live segment
+    memcpy(&val, ptr ? ptr : (void *)addr, sizeof(uint32_t));
+    return val;
+}
+
+void so_reloc_write(so_reloc_ctx *ctx, uintptr_t addr, uint32_t val) {
+    so_reloc_segment *seg = so_reloc_find(ctx, addr);
+    uint8_t *ptr = seg ? so_reloc_ptr(seg, addr) : NULL;
+    if (!ptr) {
+        // Not staged, write the word straight to its destination
+        ctx->ops.commit((void *)addr, &val, sizeof(uint32_t), ctx->ops.user);
+        if (ctx->ops.flush)
+            ctx->ops.flush((void *)addr, sizeof(uint32_t), ctx->ops.user);
+        ctx->num_unmapped++;
+        return;
+    }
+
+    memcpy(ptr, &val, sizeof(uint32_t));
+    seg->num_relocs++;
+}
+
+int so_reloc_commit(so_reloc_ctx *ctx) {
+    for (int i = 0; i < ctx->num_segments; i++) {
+        so_reloc_segment *seg = &ctx->seg[i];
+        if (!seg->staging)
+            continue;
+
+        uint64_t start = so_reloc_clock(ctx);
+
+        for (int p = 0; p < seg->num_pages;) {
+            if (seg->page_slot[p] < 0) {
+                p++;
+                continue;
+            }
+
+            int first = p;
+            while (p < seg->num_pages && seg->page_slot[p] >= 0)
+                p++;
+
+            size_t off = (size_t)first * SO_RELOC_PAGE_SIZE;
+            size_t end = (size_t)p * SO_RELOC_PAGE_SIZE;
+            if (end > seg->size)
+                end = seg->size;
+
+            void *dst = (void *)(seg->base + off);
+            const void *src = seg->staging + (size_t)seg->page_slot[first] * SO_RELOC_PAGE_SIZE;
+
+            ctx->ops.commit(dst, src, end - off, ctx->ops.user);
+            if (ctx->ops.flush)
+                ctx->ops.flush(dst, end - off, ctx->ops.user);
+            seg->num_commits++;
+        }
+
+        seg->commit_time = so_reloc_clock(ctx) - start;
+    }
+
+    return 0;
+}
+
+void so_reloc_report(const so_reloc_ctx *ctx, const char *tag) {
+    for (int i = 0; i < ctx->num_segments; i++) {
+        const so_reloc_segment *seg = &ctx->seg[i];
+        printf("%s: segment %d (0x%08X): %d relocs, %d pages in %d commits, stage %llu us, commit %llu us\n",
+               tag, i, (unsigned int)seg->base, seg->num_relocs, seg->num_dirty, seg->num_commits,
+               (unsigned long long)seg->stage_time, (unsigned long long)seg->commit_time);
+    }
+
+    if (ctx->num_unmapped)
+        printf("%s: %d relocations outside of the staged pages were written directly\n", tag, ctx->num_unmapped);
+}
+
+void so_reloc_free(so_reloc_ctx *ctx) {
+    for (int i = 0; i < ctx->num_segments; i++) {
+        free(ctx->seg[i].staging);
+        free(ctx->seg[i].page_slot);
+        ctx->seg[i].staging = NULL;
+        ctx->seg[i].page_slot = NULL;
+    }
+    ctx->num_segments = 0;
+}
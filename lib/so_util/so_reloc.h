@@ -0,0 +1,75 @@
+/* so_reloc.h -- batched relocation writes for so_util
+ *
+ * Fixups are applied into a compact staging copy of the touched pages and
+ * then committed with one (possibly privileged) copy and one cache flush per
+ * run of contiguous dirty pages. The engine only depends on libc, all
+ * platform specifics are supplied through so_reloc_ops, so it can be built
+ * and exercised on a host against plain memory buffers.
+ *
+ * Usage:
+ *   so_reloc_init(), so_reloc_add_segment() for every target segment,
+ *   so_reloc_mark() every address that will be written,
+ *   so_reloc_stage(), so_reloc_read()/so_reloc_write() the fixups,
+ *   so_reloc_commit(), so_reloc_free().
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.	See the LICENSE file for details.
+ */
+
+#ifndef __SO_RELOC_H__
+#define __SO_RELOC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SO_RELOC_PAGE_SIZE 0x1000
+#define SO_RELOC_MAX_SEGMENTS 8
+
+typedef struct {
+    // Copy staged bytes over the live segment. Required.
+    void (*commit)(void *dst, const void *src, size_t size, void *user);
+    // Make a committed range coherent for instruction fetch. Optional.
+    void (*flush)(void *dst, size_t size, void *user);
+    // Monotonic clock in microseconds, used for statistics. Optional.
+    uint64_t (*clock)(void *user);
+    void *user;
+} so_reloc_ops;
+
+typedef struct {
+    uintptr_t base;
+    size_t size;
+
+    int num_pages;
+    int32_t *page_slot; // staging slot for each page, -1 if clean
+    uint8_t *staging;
+    int num_dirty;
+
+    int num_relocs;
+    int num_commits;
+    uint64_t stage_time;  // us spent copying live pages into staging
+    uint64_t commit_time; // us spent in commit + flush
+} so_reloc_segment;
+
+typedef struct {
+    so_reloc_segment seg[SO_RELOC_MAX_SEGMENTS];
+    int num_segments;
+    so_reloc_ops ops;
+    int num_unmapped; // writes that were not staged and went straight to ops.commit
+} so_reloc_ctx;
+
+void so_reloc_init(so_reloc_ctx *ctx, const so_reloc_ops *ops);
+// Returns -1 if the segment could not be registered
+int so_reloc_add_segment(so_reloc_ctx *ctx, uintptr_t base, size_t size);
+
+int so_reloc_mark(so_reloc_ctx *ctx, uintptr_t addr);
+int so_reloc_stage(so_reloc_ctx *ctx);
+
+uint32_t so_reloc_read(so_reloc_ctx *ctx, uintptr_t addr);
+// Writes to addresses that were not marked are committed immediately
+void so_reloc_write(so_reloc_ctx *ctx, uintptr_t addr, uint32_t val);
+
+int so_reloc_commit(so_reloc_ctx *ctx);
+void so_reloc_report(const so_reloc_ctx *ctx, const char *tag);
+void so_reloc_free(so_reloc_ctx *ctx);
+
+#endif
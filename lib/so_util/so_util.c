@@ -15,6 +15,7 @@
 
 #include "utils/dialog.h"
 #include "so_util.h"
+#include "so_reloc.h"
 
 #ifndef SCE_KERNEL_MEMBLOCK_TYPE_USER_RX
 #define SCE_KERNEL_MEMBLOCK_TYPE_USER_RX                 (0x0C20D050)
@@ -58,12 +59,340 @@ typedef struct ldst_enc {
 #define PATCH_SZ 0x10000 //64 KB-ish arenas
 static so_module *head = NULL, *tail = NULL;
 
+static so_hook_record hook_log[SO_MAX_HOOK_LOG];
+static int hook_log_num = 0;
+
+static void so_hook_record_add(uintptr_t addr, uintptr_t dst) {
+    if (hook_log_num < SO_MAX_HOOK_LOG) {
+        hook_log[hook_log_num].addr = addr;
+        hook_log[hook_log_num].dst = dst;
+    }
+    hook_log_num++;
+}
+
+int so_hook_log(const so_hook_record **records) {
+    *records = hook_log;
+    return hook_log_num < SO_MAX_HOOK_LOG ? hook_log_num : SO_MAX_HOOK_LOG;
+}
+
+/*
+ * Detour trampolines
+ *
+ * The instructions overwritten by a hook are relocated into the patch arena,
+ * followed by a jump back to the rest of the function, so the original can
+ * be called as a plain function. PC-relative instructions are rewritten to
+ * build their absolute target in a register with MOVW/MOVT; anything that
+ * can not be relocated leaves the hook without a trampoline.
+ *
+ * The relocated code must not clobber registers the original code may rely
+ * on. Literal loads build the address in their own destination register,
+ * instructions without a free one borrow a low register around a PUSH/POP,
+ * and branches load PC from a literal. Only calls use ip, which the AAPCS
+ * lets any call corrupt through veneers anyway.
+ */
+
+#define SO_TRAMPOLINE_MAX 128
+
+#define ARM_MOVW(cond, rd, imm) (((cond) << 28) | 0x03000000 | (((imm) >> 12 & 0xf) << 16) | ((rd) << 12) | ((imm) & 0xfff))
+#define ARM_MOVT(cond, rd, imm) (((cond) << 28) | 0x03400000 | (((imm) >> 12 & 0xf) << 16) | ((rd) << 12) | ((imm) & 0xfff))
+
+#define REG_IP 12
+#define REG_SP 13
+#define REG_PC 15
+
+typedef struct {
+    uint8_t buf[SO_TRAMPOLINE_MAX];
+    size_t len;
+} so_detour;
+
+static int detour_emit16(so_detour *d, uint16_t hw) {
+    if (d->len + 2 > SO_TRAMPOLINE_MAX)
+        return -1;
+    memcpy(d->buf + d->len, &hw, 2);
+    d->len += 2;
+    return 0;
+}
+
+static int detour_emit32(so_detour *d, uint32_t w) {
+    if (d->len + 4 > SO_TRAMPOLINE_MAX)
+        return -1;
+    memcpy(d->buf + d->len, &w, 4);
+    d->len += 4;
+    return 0;
+}
+
+// Thumb-2 32-bit instructions are stored as two halfwords, high one first
+static int detour_emit_t32(so_detour *d, uint16_t hw1, uint16_t hw2) {
+    return detour_emit16(d, hw1) | detour_emit16(d, hw2);
+}
+
+static int detour_thumb_mov32(so_detour *d, int rd, uint32_t val) {
+    uint16_t lo = val & 0xffff, hi = val >> 16;
+    return detour_emit_t32(d, 0xf240 | ((lo >> 11 & 1) << 10) | (lo >> 12), ((lo >> 8 & 7) << 12) | (rd << 8) | (lo & 0xff)) |
+           detour_emit_t32(d, 0xf2c0 | ((hi >> 11 & 1) << 10) | (hi >> 12), ((hi >> 8 & 7) << 12) | (rd << 8) | (hi & 0xff));
+}
+
+static int detour_arm_mov32(so_detour *d, uint32_t cond, int rd, uint32_t val) {
+    return detour_emit32(d, ARM_MOVW(cond, rd, val & 0xffff)) | detour_emit32(d, ARM_MOVT(cond, rd, val >> 16));
+}
+
+// LDR.W PC, [PC, #0] followed by the target, the literal must be word aligned
+static int detour_thumb_jump(so_detour *d, uint32_t target) {
+    if ((d->len & 2) && detour_emit16(d, 0xbf00))
+        return -1;
+    return detour_emit_t32(d, 0xf8df, 0xf000) | detour_emit32(d, target);
+}
+
+// Size of the detour_thumb_jump() emitted after a 16-bit instruction
+static uint32_t detour_thumb_jump_size(so_detour *d) {
+    return ((d->len + 2) & 2) ? 10 : 8;
+}
+
+// Conditional version of LDR PC, [PC, #-4] followed by the target
+static int detour_arm_jump(so_detour *d, uint32_t cond, uint32_t target) {
+    if (cond == 0xe)
+        return detour_emit32(d, 0xe51ff004) | detour_emit32(d, target);
+    // LDR<c> PC, [PC]; B over the literal
+    return detour_emit32(d, cond << 28 | 0x059ff000) | detour_emit32(d, 0xea000000) | detour_emit32(d, target);
+}
+
+static inline int32_t sext(uint32_t val, int bits) {
+    return (int32_t)(val << (32 - bits)) >> (32 - bits);
+}
+
+// Relocate one Thumb instruction at `pc_addr`. Returns its size, or -1 if it
+// can not be relocated.
+static int detour_thumb_insn(so_detour *d, uintptr_t pc_addr, const uint16_t *insn) {
+    uint16_t hw1 = insn[0];
+    uint32_t pc = pc_addr + 4;
+    uint32_t apc = pc & ~3;
+
+    if ((hw1 & 0xf800) < 0xe800) {
+        if ((hw1 & 0xf800) == 0x4800) { // LDR Rt, [PC, #imm]
+            int rt = hw1 >> 8 & 7;
+            return (detour_thumb_mov32(d, rt, apc + ((hw1 & 0xff) << 2)) |
+                    detour_emit16(d, 0x6800 | (rt << 3) | rt)) ? -1 : 2;
+        }
+        if ((hw1 & 0xf800) == 0xa000) // ADR Rd, #imm
+            return detour_thumb_mov32(d, hw1 >> 8 & 7, apc + ((hw1 & 0xff) << 2)) ? -1 : 2;
+        if ((hw1 & 0xff78) == 0x4478) { // ADD Rdn, PC
+            int rdn = (hw1 & 7) | (hw1 >> 4 & 8);
+            if (rdn == REG_PC || rdn == REG_SP)
+                return -1;
+            // No free register, borrow one that is not Rdn
+            int tmp = rdn == 0 ? 1 : 0;
+            return (detour_emit16(d, 0xb400 | 1 << tmp) | detour_thumb_mov32(d, tmp, pc) |
+                    detour_emit16(d, 0x4400 | (tmp << 3) | (rdn & 7) | ((rdn & 8) << 4)) |
+                    detour_emit16(d, 0xbc00 | 1 << tmp)) ? -1 : 2;
+        }
+        if ((hw1 & 0xf000) == 0xd000 && (hw1 >> 8 & 0xf) < 0xe) { // B<c> #imm
+            uint32_t target = pc + sext((hw1 & 0xff) << 1, 9);
+            // B<!c> over the jump below
+            return (detour_emit16(d, 0xd000 | ((hw1 >> 8 & 0xf) ^ 1) << 8 | (detour_thumb_jump_size(d) - 2) / 2) |
+                    detour_thumb_jump(d, target | 1)) ? -1 : 2;
+        }
+        if ((hw1 & 0xf800) == 0xe000) { // B #imm
+            uint32_t target = pc + sext((hw1 & 0x7ff) << 1, 12);
+            return detour_thumb_jump(d, target | 1) ? -1 : 2;
+        }
+        if ((hw1 & 0xf500) == 0xb100) { // CB{N}Z Rn, #imm
+            uint32_t target = pc + ((hw1 >> 9 & 1) << 6 | (hw1 >> 3 & 0x1f) << 1);
+            // CB{!N}Z over the jump below
+            return (detour_emit16(d, ((hw1 & ~0x02f8) ^ 0x0800) | ((detour_thumb_jump_size(d) - 2) / 2) << 3) |
+                    detour_thumb_jump(d, target | 1)) ? -1 : 2;
+        }
+        if ((hw1 & 0xff00) == 0xbf00 && (hw1 & 0xf) != 0) // IT
+            return -1;
+        if ((hw1 & 0xfc00) == 0x4400 && (hw1 >> 3 & 0xf) == REG_PC) // hi-register op reading PC
+            return -1;
+        if ((hw1 & 0xfe00) == 0x4400 && ((hw1 & 7) | (hw1 >> 4 & 8)) == REG_PC) // ADD/CMP PC, Rm
+            return -1;
+
+        return detour_emit16(d, hw1) ? -1 : 2;
+    }
+
+    uint16_t hw2 = insn[1];
+    int rn = hw1 & 0xf;
+
+    if ((hw1 & 0xff7f) == 0xf85f) { // LDR.W Rt, [PC, #imm]
+        uint32_t addr = (hw1 & 0x80) ? apc + (hw2 & 0xfff) : apc - (hw2 & 0xfff);
+        int rt = hw2 >> 12;
+        // Rt doubles as the base, except for SP (MOVW can't write it) and PC
+        // (a jump, and ip is dead at a branch)
+        int base = (rt == REG_SP || rt == REG_PC) ? REG_IP : rt;
+        return (detour_thumb_mov32(d, base, addr) |
+                detour_emit_t32(d, 0xf8d0 | base, hw2 & 0xf000)) ? -1 : 4;
+    }
+    if ((hw1 & 0xff30) == 0xed10 && rn == REG_PC) { // VLDR Sd/Dd, [PC, #imm]
+        uint32_t addr = (hw1 & 0x80) ? apc + ((hw2 & 0xff) << 2) : apc - ((hw2 & 0xff) << 2);
+        // No core register is written, borrow r0 as the base
+        return (detour_emit16(d, 0xb401) | detour_thumb_mov32(d, 0, addr) |
+                detour_emit_t32(d, (hw1 & ~0x000f) | 0x0080, hw2 & ~0xff) |
+                detour_emit16(d, 0xbc01)) ? -1 : 4;
+    }
+    if ((hw1 & 0xfbff) == 0xf20f || (hw1 & 0xfbff) == 0xf2af) { // ADR.W Rd, #imm
+        uint32_t imm = (hw1 >> 10 & 1) << 11 | (hw2 >> 12 & 7) << 8 | (hw2 & 0xff);
+        uint32_t val = (hw1 & 0x00a0) ? apc - imm : apc + imm;
+        int rd = hw2 >> 8 & 0xf;
+        if (rd == REG_PC)
+            return -1;
+        return detour_thumb_mov32(d, rd, val) ? -1 : 4;
+    }
+    if ((hw1 & 0xf800) == 0xf000 && (hw2 & 0x8000)) { // branches
+        uint32_t s = hw1 >> 10 & 1, j1 = hw2 >> 13 & 1, j2 = hw2 >> 11 & 1;
+
+        if ((hw2 & 0xd000) == 0x8000) { // B<c>.W
+            uint32_t cond = hw1 >> 6 & 0xf;
+            if (cond >= 0xe)
+                return -1;
+            uint32_t target = pc + sext(s << 20 | j2 << 19 | j1 << 18 | (hw1 & 0x3f) << 12 | (hw2 & 0x7ff) << 1, 21);
+            return (detour_emit16(d, 0xd000 | (cond ^ 1) << 8 | (detour_thumb_jump_size(d) - 2) / 2) |
+                    detour_thumb_jump(d, target | 1)) ? -1 : 4;
+        }
+
+        uint32_t i1 = !(j1 ^ s), i2 = !(j2 ^ s);
+        int32_t off = sext(s << 24 | i1 << 23 | i2 << 22 | (hw1 & 0x3ff) << 12 | (hw2 & 0x7ff) << 1, 25);
+
+        if ((hw2 & 0xd000) == 0x9000) // B.W
+            return detour_thumb_jump(d, (pc + off) | 1) ? -1 : 4;
+        if ((hw2 & 0xd000) == 0xd000) // BL
+            return (detour_thumb_mov32(d, REG_IP, (pc + off) | 1) | detour_emit16(d, 0x47e0)) ? -1 : 4;
+        if ((hw2 & 0xd001) == 0xc000) // BLX to ARM
+            return (detour_thumb_mov32(d, REG_IP, apc + off) | detour_emit16(d, 0x47e0)) ? -1 : 4;
+    }
+    // Any other load/store or table branch addressing off PC
+    if (((hw1 & 0xfe00) == 0xf800 || (hw1 & 0xfe00) == 0xe800 || (hw1 & 0xee00) == 0xec00) && rn == REG_PC)
+        return -1;
+
+    return detour_emit_t32(d, hw1, hw2) ? -1 : 4;
+}
+
+// Relocate one ARM instruction at `pc_addr`. Returns 0, or -1 if it can not
+// be relocated.
+static int detour_arm_insn(so_detour *d, uintptr_t pc_addr, uint32_t insn) {
+    uint32_t pc = pc_addr + 8;
+    uint32_t cond = insn >> 28;
+    int rn = insn >> 16 & 0xf;
+
+    if (cond == 0xf) {
+        if ((insn & 0xfe000000) == 0xfa000000) { // BLX #imm to Thumb
+            uint32_t target = pc + (sext(insn & 0xffffff, 24) << 2) + ((insn >> 24 & 1) << 1);
+            return detour_arm_mov32(d, 0xe, REG_IP, target | 1) | detour_emit32(d, 0xe12fff3c);
+        }
+        return rn == REG_PC ? -1 : detour_emit32(d, insn);
+    }
+
+    if ((insn & 0x0e000000) == 0x0a000000) { // B/BL #imm
+        uint32_t target = pc + (sext(insn & 0xffffff, 24) << 2);
+        if (!(insn & 0x01000000))
+            return detour_arm_jump(d, cond, target);
+        return detour_arm_mov32(d, 0xe, REG_IP, target) | detour_emit32(d, cond << 28 | 0x012fff3c); // BLX<c> ip
+    }
+    if ((insn & 0x0f3f0000) == 0x051f0000) { // LDR/LDRB Rt, [PC, #imm]
+        uint32_t addr = (insn & 0x00800000) ? pc + (insn & 0xfff) : pc - (insn & 0xfff);
+        int rt = insn >> 12 & 0xf;
+        // Rt doubles as the base, built under the same condition so it is
+        // left alone when the load is skipped. A load into PC is a jump and
+        // ip is dead at a branch.
+        if (rt == REG_PC)
+            return detour_arm_mov32(d, 0xe, REG_IP, addr) |
+                   detour_emit32(d, (insn & ~0x008f0fff) | 0x00800000 | (REG_IP << 16));
+        return detour_arm_mov32(d, cond, rt, addr) |
+               detour_emit32(d, (insn & ~0x008f0fff) | 0x00800000 | (rt << 16));
+    }
+    if ((insn & 0x0fff0000) == 0x028f0000 || (insn & 0x0fff0000) == 0x024f0000) { // ADR Rd, #imm
+        uint32_t rot = (insn >> 8 & 0xf) * 2, imm8 = insn & 0xff;
+        uint32_t imm = rot ? (imm8 >> rot) | (imm8 << (32 - rot)) : imm8;
+        int rd = insn >> 12 & 0xf;
+        if (rd == REG_PC)
+            return -1;
+        return detour_arm_mov32(d, cond, rd, (insn & 0x00800000) ? pc + imm : pc - imm);
+    }
+    if ((insn & 0x0f3f0e00) == 0x0d1f0a00) { // VLDR Sd/Dd, [PC, #imm]
+        uint32_t addr = (insn & 0x00800000) ? pc + ((insn & 0xff) << 2) : pc - ((insn & 0xff) << 2);
+        // No core register is written, borrow r0 as the base
+        return detour_emit32(d, 0xe52d0004) | detour_arm_mov32(d, 0xe, 0, addr) | // STR r0, [sp, #-4]!
+               detour_emit32(d, (insn & ~0x008f00ff) | 0x00800000) |
+               detour_emit32(d, 0xe49d0004); // LDR r0, [sp], #4
+    }
+
+    if ((insn & 0x0fffffd0) == 0x012fff10) // BX/BLX Rm
+        return (insn & 0xf) == REG_PC ? -1 : detour_emit32(d, insn);
+
+    // Anything else reading PC
+    uint32_t op = insn >> 25 & 7;
+    if ((insn & 0x0fb00000) != 0x03000000 && // MOVW/MOVT keep an immediate in Rn
+        (((op == 0 || op == 1) && (rn == REG_PC || (op == 0 && (insn & 0xf) == REG_PC))) ||
+         ((op == 2 || op == 3 || op == 4 || op == 6) && rn == REG_PC)))
+        return -1;
+
+    return detour_emit32(d, insn);
+}
+
+// Build a trampoline for the original code at `addr` (bit 0 set for Thumb),
+// given a copy of its first bytes taken before any patching, with at least
+// `patch_sz` bytes to relocate. Returns the callable address, or 0.
+static uintptr_t so_detour_create(uintptr_t addr, const uint8_t *orig, size_t orig_sz, size_t patch_sz) {
+    so_module *mod = head;
+    while (mod && !(addr >= mod->text_base && addr < mod->text_base + mod->text_size))
+        mod = mod->next;
+    if (!mod)
+        return 0;
+
+    so_detour d = { .len = 0 };
+    uintptr_t start = addr & ~1;
+    size_t done = 0;
+
+    if (addr & 1) {
+        while (done < patch_sz) {
+            uint16_t insn[2];
+            memcpy(insn, orig + done, done + 4 <= orig_sz ? 4 : 2);
+            int sz = detour_thumb_insn(&d, start + done, insn);
+            if (sz < 0)
+                return 0;
+            done += sz;
+        }
+
+        if (detour_thumb_jump(&d, (start + done) | 1))
+            return 0;
+    } else {
+        for (; done < patch_sz; done += 4) {
+            uint32_t insn;
+            memcpy(&insn, orig + done, 4);
+            if (detour_arm_insn(&d, start + done, insn) < 0)
+                return 0;
+        }
+
+        if (detour_arm_jump(&d, 0xe, start + done))
+            return 0;
+    }
+
+    uintptr_t tramp = so_alloc_arena(mod, 0, 0, d.len);
+    if (!tramp)
+        return 0;
+
+    kuKernelCpuUnrestrictedMemcpy((void *)tramp, d.buf, d.len);
+    kuKernelFlushCaches((void *)tramp, d.len);
+
+    return (addr & 1) ? tramp | 1 : tramp;
+}
+
 so_hook hook_thumb(uintptr_t addr, uintptr_t dst) {
-    so_hook h;
+    so_hook h = { 0 };
     printf("THUMB HOOK\n");
     if (addr == 0)
         return h;
     h.thumb_addr = addr;
+    so_hook_record_add(addr | 1, dst);
+
+    // Relocate everything the patch (and alignment NOP) overwrites, before
+    // anything is written
+    uint8_t orig[16];
+    kuKernelCpuUnrestrictedMemcpy(orig, (void *)(addr & ~1), sizeof(orig));
+    h.trampoline = so_detour_create(addr | 1, orig, sizeof(orig), (addr & 2) ? 10 : 8);
+    if (!h.trampoline)
+        printf("THUMB HOOK: prologue can not be relocated, no trampoline\n");
+
     addr &= ~1;
     if (addr & 2) {
         uint16_t nop = 0xbf00;
@@ -82,13 +411,21 @@ so_hook hook_thumb(uintptr_t addr, uintptr_t dst) {
 }
 
 so_hook hook_arm(uintptr_t addr, uintptr_t dst) {
-    so_hook h;
+    so_hook h = { 0 };
     printf("ARM HOOK\n");
     if (addr == 0)
         return h;
     uint32_t hook[2];
     h.thumb_addr = 0;
     h.addr = addr;
+    so_hook_record_add(addr, dst);
+
+    uint8_t orig[8];
+    kuKernelCpuUnrestrictedMemcpy(orig, (void *)addr, sizeof(orig));
+    h.trampoline = so_detour_create(addr, orig, sizeof(orig), sizeof(orig));
+    if (!h.trampoline)
+        printf("ARM HOOK: prologue can not be relocated, no trampoline\n");
+
     h.patch_instr[0] = 0xe51ff004; // LDR PC, [PC, #-0x4]
     h.patch_instr[1] = dst;
     kuKernelCpuUnrestrictedMemcpy(&h.orig_instr, (void *)addr, sizeof(h.orig_instr));
@@ -99,7 +436,7 @@ so_hook hook_arm(uintptr_t addr, uintptr_t dst) {
 
 so_hook hook_addr(uintptr_t addr, uintptr_t dst) {
     if (addr == 0) {
-        so_hook h;
+        so_hook h = { 0 };
         return h;
     }
 
@@ -113,20 +450,108 @@ void so_flush_caches(so_module *mod) {
     kuKernelFlushCaches((void *)mod->text_base, mod->text_size);
 }
 
-int _so_load(so_module *mod, SceUID so_blockid, void *so_data, uintptr_t load_addr) {
+#define SO_READ_CHUNK 0x10000
+
+// Source of the ELF image for _so_load, read with positioned reads
+typedef struct so_reader {
+    int (*read)(struct so_reader *reader, void *dst, size_t size, size_t offset);
+    SceUID fd;
+    const uint8_t *data;
+    size_t size;
+} so_reader;
+
+static int so_file_read(so_reader *reader, void *dst, size_t size, size_t offset) {
+    while (size > 0) {
+        int res = sceIoPread(reader->fd, dst, size, offset);
+        if (res <= 0)
+            return -1;
+        dst = (uint8_t *)dst + res;
+        offset += res;
+        size -= res;
+    }
+    return 0;
+}
+
+static int so_mem_read(so_reader *reader, void *dst, size_t size, size_t offset) {
+    if (offset > reader->size || size > reader->size - offset)
+        return -1;
+    sceClibMemcpy(dst, reader->data + offset, size);
+    return 0;
+}
+
+// Fill [dst, dst + size) from the image at offset if src is set, with zeroes
+// otherwise. Code blocks are not writable from usermode, so those go through
+// a bounce buffer and a privileged copy; data blocks are read into directly.
+static int so_fill_segment(so_reader *reader, uintptr_t dst, size_t size, size_t offset, int src, int privileged) {
+    if (size == 0)
+        return 0;
+
+    if (!privileged) {
+        if (src)
+            return reader->read(reader, (void *)dst, size, offset);
+        memset((void *)dst, 0, size);
+        return 0;
+    }
+
+    uint8_t *chunk = calloc(1, size < SO_READ_CHUNK ? size : SO_READ_CHUNK);
+    if (!chunk)
+        return -1;
+
+    for (size_t done = 0; done < size;) {
+        size_t n = size - done < SO_READ_CHUNK ? size - done : SO_READ_CHUNK;
+        if (src && reader->read(reader, chunk, n, offset + done) < 0) {
+            free(chunk);
+            return -1;
+        }
+        kuKernelCpuUnrestrictedMemcpy((void *)(dst + done), chunk, n);
+        done += n;
+    }
+
+    free(chunk);
+    return 0;
+}
+
+static int _so_load(so_module *mod, so_reader *reader, uintptr_t load_addr) {
     int res = 0;
     uintptr_t data_addr = 0;
+    Elf32_Ehdr ehdr;
 
-    if (memcmp(so_data, ELFMAG, SELFMAG) != 0) {
+    if (reader->read(reader, &ehdr, sizeof(ehdr), 0) < 0 || memcmp(&ehdr, ELFMAG, SELFMAG) != 0) {
         res = -1;
         goto err_free_so;
     }
 
-    mod->ehdr = (Elf32_Ehdr *)so_data;
-    mod->phdr = (Elf32_Phdr *)((uintptr_t)so_data + mod->ehdr->e_phoff);
-    mod->shdr = (Elf32_Shdr *)((uintptr_t)so_data + mod->ehdr->e_shoff);
+    // Headers and section names are the only parts of the file needed outside
+    // of the PT_LOAD segments; keep them in one small side allocation
+    {
+        Elf32_Shdr shstr_hdr;
+        if (reader->read(reader, &shstr_hdr, sizeof(shstr_hdr), ehdr.e_shoff + ehdr.e_shstrndx * sizeof(Elf32_Shdr)) < 0) {
+            res = -1;
+            goto err_free_so;
+        }
+
+        size_t phdr_size = ehdr.e_phnum * sizeof(Elf32_Phdr);
+        size_t shdr_size = ehdr.e_shnum * sizeof(Elf32_Shdr);
 
-    mod->shstr = (char *)((uintptr_t)so_data + mod->shdr[mod->ehdr->e_shstrndx].sh_offset);
+        uint8_t *meta = malloc(sizeof(Elf32_Ehdr) + phdr_size + shdr_size + shstr_hdr.sh_size);
+        if (!meta) {
+            res = -1;
+            goto err_free_so;
+        }
+
+        mod->ehdr = (Elf32_Ehdr *)meta;
+        mod->phdr = (Elf32_Phdr *)(meta + sizeof(Elf32_Ehdr));
+        mod->shdr = (Elf32_Shdr *)(meta + sizeof(Elf32_Ehdr) + phdr_size);
+        mod->shstr = (char *)(meta + sizeof(Elf32_Ehdr) + phdr_size + shdr_size);
+
+        memcpy(mod->ehdr, &ehdr, sizeof(Elf32_Ehdr));
+        if (reader->read(reader, mod->phdr, phdr_size, ehdr.e_phoff) < 0 ||
+            reader->read(reader, mod->shdr, shdr_size, ehdr.e_shoff) < 0 ||
+            reader->read(reader, mod->shstr, shstr_hdr.sh_size, shstr_hdr.sh_offset) < 0) {
+            res = -1;
+            goto err_free_so;
+        }
+    }
 
     for (int i = 0; i < mod->ehdr->e_phnum; i++) {
         if (mod->phdr[i].p_type == PT_LOAD) {
@@ -202,12 +627,12 @@ int _so_load(so_module *mod, SceUID so_blockid, void *so_data, uintptr_t load_ad
                 mod->n_data++;
             }
 
-            char *zero = malloc(prog_size - mod->phdr[i].p_filesz);
-            memset(zero, 0, prog_size - mod->phdr[i].p_filesz);
-            kuKernelCpuUnrestrictedMemcpy(prog_data + mod->phdr[i].p_filesz, zero, prog_size - mod->phdr[i].p_filesz);
-            free(zero);
-
-            kuKernelCpuUnrestrictedMemcpy((void *)mod->phdr[i].p_vaddr, (void *)((uintptr_t)so_data + mod->phdr[i].p_offset), mod->phdr[i].p_filesz);
+            int privileged = (mod->phdr[i].p_flags & PF_X) == PF_X;
+            if (so_fill_segment(reader, (uintptr_t)prog_data + mod->phdr[i].p_filesz, prog_size - mod->phdr[i].p_filesz, 0, 0, privileged) < 0 ||
+                so_fill_segment(reader, mod->phdr[i].p_vaddr, mod->phdr[i].p_filesz, mod->phdr[i].p_offset, 1, privileged) < 0) {
+                res = -1;
+                goto err_free_data;
+            }
         }
     }
 
@@ -234,6 +659,8 @@ int _so_load(so_module *mod, SceUID so_blockid, void *so_data, uintptr_t load_ad
             mod->num_init_array = sh_size / sizeof(void *);
         } else if (strcmp(sh_name, ".hash") == 0) {
             mod->hash = (void *)sh_addr;
+        } else if (strcmp(sh_name, ".gnu.hash") == 0) {
+            mod->gnu_hash = (void *)sh_addr;
         }
     }
 
@@ -251,13 +678,19 @@ int _so_load(so_module *mod, SceUID so_blockid, void *so_data, uintptr_t load_ad
             case DT_SONAME:
                 mod->soname = mod->dynstr + mod->dynamic[i].d_un.d_ptr;
                 break;
+            case DT_HASH:
+                if (!mod->hash)
+                    mod->hash = (uint32_t *)(mod->text_base + mod->dynamic[i].d_un.d_ptr);
+                break;
+            case DT_GNU_HASH:
+                if (!mod->gnu_hash)
+                    mod->gnu_hash = (uint32_t *)(mod->text_base + mod->dynamic[i].d_un.d_ptr);
+                break;
             default:
                 break;
         }
     }
 
-    sceKernelFreeMemBlock(so_blockid);
-
     if (!head && !tail) {
         head = mod;
         tail = mod;
@@ -274,78 +707,105 @@ int _so_load(so_module *mod, SceUID so_blockid, void *so_data, uintptr_t load_ad
     err_free_text:
     sceKernelFreeMemBlock(mod->text_blockid);
     err_free_so:
-    sceKernelFreeMemBlock(so_blockid);
+    free(mod->ehdr);
+    mod->ehdr = NULL;
+    mod->phdr = NULL;
+    mod->shdr = NULL;
+    mod->shstr = NULL;
 
     return res;
 }
 
 int so_mem_load(so_module *mod, void *buffer, size_t so_size, uintptr_t load_addr) {
-    SceUID so_blockid;
-    void *so_data;
-
     memset(mod, 0, sizeof(so_module));
 
-    so_blockid = sceKernelAllocMemBlock("so block", SCE_KERNEL_MEMBLOCK_TYPE_USER_RW, (so_size + 0xfff) & ~0xfff, NULL);
-    if (so_blockid < 0)
-        return so_blockid;
-
-    sceKernelGetMemBlockBase(so_blockid, &so_data);
-    sceClibMemcpy(so_data, buffer, so_size);
-
-    return _so_load(mod, so_blockid, so_data, load_addr);
+    so_reader reader = { .read = so_mem_read, .data = buffer, .size = so_size };
+    return _so_load(mod, &reader, load_addr);
 }
 
 int so_file_load(so_module *mod, const char *filename, uintptr_t load_addr) {
-    SceUID so_blockid;
-    void *so_data;
-
     memset(mod, 0, sizeof(so_module));
 
     SceUID fd = sceIoOpen(filename, SCE_O_RDONLY, 0);
     if (fd < 0)
         return fd;
 
-    size_t so_size = sceIoLseek(fd, 0, SCE_SEEK_END);
-    sceIoLseek(fd, 0, SCE_SEEK_SET);
+    // Segments are read straight into their final blocks, the file is
+    // never held in memory as a whole
+    so_reader reader = { .read = so_file_read, .fd = fd };
+    int res = _so_load(mod, &reader, load_addr);
 
-    so_blockid = sceKernelAllocMemBlock("so block", SCE_KERNEL_MEMBLOCK_TYPE_USER_RW, (so_size + 0xfff) & ~0xfff, NULL);
-    if (so_blockid < 0)
-        return so_blockid;
+    sceIoClose(fd);
+    return res;
+}
 
-    sceKernelGetMemBlockBase(so_blockid, &so_data);
+static void so_reloc_kernel_commit(void *dst, const void *src, size_t size, void *user) {
+    kuKernelCpuUnrestrictedMemcpy(dst, src, size);
+}
 
-    sceIoRead(fd, so_data, so_size);
-    sceIoClose(fd);
+static void so_reloc_kernel_flush(void *dst, size_t size, void *user) {
+    kuKernelFlushCaches(dst, size);
+}
 
-    return _so_load(mod, so_blockid, so_data, load_addr);
+static uint64_t so_reloc_kernel_clock(void *user) {
+    return sceKernelGetProcessTimeWide();
+}
+
+static void so_reloc_begin(so_module *mod, so_reloc_ctx *ctx) {
+    static const so_reloc_ops ops = {
+        .commit = so_reloc_kernel_commit,
+        .flush = so_reloc_kernel_flush,
+        .clock = so_reloc_kernel_clock,
+    };
+
+    so_reloc_init(ctx, &ops);
+    if (so_reloc_add_segment(ctx, mod->text_base, mod->text_size) < 0)
+        fatal_error("Error: could not register text segment for relocation.\n");
+    for (int i = 0; i < mod->n_data; i++) {
+        if (so_reloc_add_segment(ctx, mod->data_base[i], mod->data_size[i]) < 0)
+            fatal_error("Error: could not register data segment %d for relocation.\n", i);
+    }
+}
+
+static void so_reloc_end(so_reloc_ctx *ctx, const char *tag) {
+    so_reloc_commit(ctx);
+    so_reloc_report(ctx, tag);
+    so_reloc_free(ctx);
 }
 
 int so_relocate(so_module *mod) {
-    uintptr_t val;
+    so_reloc_ctx ctx;
+    so_reloc_begin(mod, &ctx);
+
+    // Pass 1: find the pages that will be written
+    for (int i = 0; i < mod->num_reldyn + mod->num_relplt; i++) {
+        Elf32_Rel *rel = i < mod->num_reldyn ? &mod->reldyn[i] : &mod->relplt[i - mod->num_reldyn];
+        so_reloc_mark(&ctx, mod->text_base + rel->r_offset);
+    }
+
+    if (so_reloc_stage(&ctx) < 0)
+        fatal_error("Error: could not allocate relocation staging.\n");
+
+    // Pass 2: apply the fixups to the staged pages
     for (int i = 0; i < mod->num_reldyn + mod->num_relplt; i++) {
         Elf32_Rel *rel = i < mod->num_reldyn ? &mod->reldyn[i] : &mod->relplt[i - mod->num_reldyn];
         Elf32_Sym *sym = &mod->dynsym[ELF32_R_SYM(rel->r_info)];
-        uintptr_t *ptr = (uintptr_t *)(mod->text_base + rel->r_offset);
+        uintptr_t ptr = mod->text_base + rel->r_offset;
 
         int type = ELF32_R_TYPE(rel->r_info);
         switch (type) {
             case R_ARM_ABS32:
-                if (sym->st_shndx != SHN_UNDEF) {
-                    val = *ptr + mod->text_base + sym->st_value;
-                    kuKernelCpuUnrestrictedMemcpy(ptr, &val, sizeof(uintptr_t));
-                }
+                if (sym->st_shndx != SHN_UNDEF)
+                    so_reloc_write(&ctx, ptr, so_reloc_read(&ctx, ptr) + mod->text_base + sym->st_value);
                 break;
             case R_ARM_RELATIVE:
-                val = *ptr + mod->text_base;
-                kuKernelCpuUnrestrictedMemcpy(ptr, &val, sizeof(uintptr_t));
+                so_reloc_write(&ctx, ptr, so_reloc_read(&ctx, ptr) + mod->text_base);
                 break;
             case R_ARM_GLOB_DAT:
             case R_ARM_JUMP_SLOT:
             {
-                if (sym->st_shndx != SHN_UNDEF) {
-                    val = mod->text_base + sym->st_value;
-                    kuKernelCpuUnrestrictedMemcpy(ptr, &val, sizeof(uintptr_t));
-                }
+                if (sym->st_shndx != SHN_UNDEF)
+                    so_reloc_write(&ctx, ptr, mod->text_base + sym->st_value);
                 break;
             }
             default:
@@ -354,6 +814,8 @@ int so_relocate(so_module *mod) {
         }
     }
 
+    so_reloc_end(&ctx, "so_relocate");
+
     return 0;
 }
 
@@ -426,12 +888,240 @@ __attribute__((naked)) void plt0_stub()
     reloc_err(got0);
 }
 
-int so_resolve(so_module *mod, so_default_dynlib *default_dynlib, int size_default_dynlib, int default_dynlib_only) {
-    uintptr_t val;
+uint32_t so_dynlib_hash(const char *symbol, uint32_t seed) {
+    // FNV-1a, must match extras/scripts/gen_dynlib_index.py
+    uint32_t h = 0x811c9dc5 ^ seed;
+    while (*symbol) {
+        h ^= (uint8_t)*symbol++;
+        h *= 0x01000193;
+    }
+    return h;
+}
+
+static inline uint32_t so_fmix32(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+so_default_dynlib *so_dynlib_find(const so_dynlib_index *index, const char *symbol) {
+    uint32_t h = so_dynlib_hash(symbol, index->seed);
+    uint32_t disp = index->disp[h & (index->num_disp - 1)];
+    uint32_t slot = so_fmix32(h ^ (disp * 0x9e3779b9)) & (index->num_slots - 1);
+
+    uint16_t i = index->slots[slot];
+    if (i == SO_DYNLIB_EMPTY || strcmp(index->entries[i].symbol, symbol) != 0)
+        return NULL;
+
+    return &index->entries[i];
+}
+
+#ifdef SO_IMPORT_PROFILE
+/*
+ * Counting thunks (ARM, 44 bytes): atomically bump the per-import counter,
+ * then jump to the real target with all argument registers intact.
+ *   push {r0-r2}
+ *   ldr r0, [pc, #28]      ; &counter
+ * 1:ldrex r1, [r0]
+ *   add r1, r1, #1
+ *   strex r2, r1, [r0]
+ *   cmp r2, #0
+ *   bne 1b
+ *   pop {r0-r2}
+ *   ldr pc, [pc, #-4]      ; target
+ *   .word target
+ *   .word &counter
+ */
+#define SO_THUNK_WORDS 11
+#define SO_MAX_IMPORT_THUNKS 4096
+
+typedef struct {
+    const char *name;
+    uintptr_t target;
+    uint32_t calls;
+} so_import_counter;
+
+static SceUID thunk_blockid = -1;
+static uint32_t *thunk_base = NULL;
+static so_import_counter *import_counters = NULL;
+static int num_import_thunks = 0;
+
+static uintptr_t so_import_thunk(const char *name, uintptr_t target) {
+    if (thunk_blockid < 0) {
+        size_t size = ALIGN_MEM(SO_MAX_IMPORT_THUNKS * SO_THUNK_WORDS * sizeof(uint32_t), 0x1000);
+        thunk_blockid = kuKernelAllocMemBlock("thunk_block", SCE_KERNEL_MEMBLOCK_TYPE_USER_RX, size, NULL);
+        import_counters = calloc(SO_MAX_IMPORT_THUNKS, sizeof(so_import_counter));
+        if (thunk_blockid < 0 || !import_counters)
+            fatal_error("Error: could not allocate import profiling thunks.\n");
+        sceKernelGetMemBlockBase(thunk_blockid, (void **)&thunk_base);
+    }
+
+    int i = __atomic_fetch_add(&num_import_thunks, 1, __ATOMIC_RELAXED);
+    if (i >= SO_MAX_IMPORT_THUNKS)
+        return target;
+
+    so_import_counter *counter = &import_counters[i];
+    counter->name = name;
+    counter->target = target;
+
+    uint32_t thunk[SO_THUNK_WORDS] = {
+        0xe92d0007, 0xe59f001c, 0xe1901f9f, 0xe2811001, 0xe1802f91, 0xe3520000,
+        0x1afffffa, 0xe8bd0007, 0xe51ff004, target, (uint32_t)&counter->calls,
+    };
+    uint32_t *dst = thunk_base + i * SO_THUNK_WORDS;
+    kuKernelCpuUnrestrictedMemcpy(dst, thunk, sizeof(thunk));
+    kuKernelFlushCaches(dst, sizeof(thunk));
+
+    return (uintptr_t)dst;
+}
+
+static int so_import_counter_cmp(const void *a, const void *b) {
+    uint32_t x = ((const so_import_counter *)a)->calls, y = ((const so_import_counter *)b)->calls;
+    return (x < y) - (x > y);
+}
+
+void so_import_profile_dump(int top_n) {
+    int num = num_import_thunks < SO_MAX_IMPORT_THUNKS ? num_import_thunks : SO_MAX_IMPORT_THUNKS;
+    so_import_counter *snapshot = malloc(num * sizeof(so_import_counter));
+    if (!snapshot)
+        return;
+
+    uint64_t total = 0;
+    for (int i = 0; i < num; i++) {
+        snapshot[i] = import_counters[i];
+        snapshot[i].calls = __atomic_load_n(&import_counters[i].calls, __ATOMIC_RELAXED);
+        total += snapshot[i].calls;
+    }
+    qsort(snapshot, num, sizeof(so_import_counter), so_import_counter_cmp);
+
+    printf("Import profile: %llu calls through %d imports\n", total, num);
+    for (int i = 0; i < num && i < top_n && snapshot[i].calls; i++)
+        printf("%4d %10u %5.1f%% %s\n", i + 1, (unsigned int)snapshot[i].calls,
+               total ? snapshot[i].calls * 100.0 / total : 0.0, snapshot[i].name);
+
+    free(snapshot);
+}
+
+void so_import_profile_reset() {
+    int num = num_import_thunks < SO_MAX_IMPORT_THUNKS ? num_import_thunks : SO_MAX_IMPORT_THUNKS;
+    for (int i = 0; i < num; i++)
+        __atomic_store_n(&import_counters[i].calls, 0, __ATOMIC_RELAXED);
+}
+#endif
+
+#ifdef SO_LAZY_BIND
+void so_lazy_stub();
+
+static int so_lazy_slot_cmp(const void *a, const void *b) {
+    uintptr_t x = ((const so_lazy_slot *)a)->got, y = ((const so_lazy_slot *)b)->got;
+    return (x > y) - (x < y);
+}
+
+// Called from so_lazy_stub with the GOT entry the PLT loaded into ip. Binds
+// the slot and returns the target to tail-call.
+__attribute__((used)) uintptr_t so_lazy_resolve(uintptr_t got) {
+    so_lazy_slot key = { .got = got };
+
+    for (so_module *curr = head; curr; curr = curr->next) {
+        so_lazy_slot *slot = bsearch(&key, curr->lazy_slots, curr->num_lazy_slots, sizeof(so_lazy_slot), so_lazy_slot_cmp);
+        if (!slot)
+            continue;
+
+        const char *name = curr->dynstr + curr->dynsym[slot->sym].st_name;
+        uintptr_t val = 0;
+
+        so_default_dynlib *entry = so_dynlib_find(curr->lazy_index, name);
+        if (entry)
+            val = entry->func;
+        else if (!curr->lazy_default_dynlib_only)
+            val = so_resolve_link(curr, name);
+
+        if (!val)
+            reloc_err(got);
+
+#ifdef SO_IMPORT_PROFILE
+        val = so_import_thunk(name, val);
+#endif
+
+        // Two threads racing here both store an equivalent value
+        kuKernelCpuUnrestrictedMemcpy((void *)got, &val, sizeof(uintptr_t));
+        printf("Lazy bind: %s -> 0x%08X, first call at %llu us\n", name, (unsigned int)val, sceKernelGetProcessTimeWide());
+
+        return val;
+    }
+
+    reloc_err(got);
+    return 0;
+}
+
+// The PLT enters here with the GOT entry address in ip and the caller's
+// arguments in r0-r3 and on the stack. The .so is softfp, so no argument is
+// passed in VFP registers.
+__attribute__((naked)) void so_lazy_stub() {
+    asm volatile(
+        "push {r0-r3, ip, lr}\n"
+        "mov r0, ip\n"
+        "bl so_lazy_resolve\n"
+        "str r0, [sp, #16]\n"
+        "pop {r0-r3, ip, lr}\n"
+        "bx ip\n"
+    );
+}
+#endif
+
+// Per-dynsym resolution cache states
+#define SO_SYM_UNKNOWN    0
+#define SO_SYM_DEFAULT    1
+#define SO_SYM_LINK       2
+#define SO_SYM_UNRESOLVED 3
+
+int so_resolve(so_module *mod, const so_dynlib_index *index, int default_dynlib_only) {
+    // The same dynsym entry is usually referenced by several relocations
+    // (GLOB_DAT + JUMP_SLOT, or many ABS32), so resolve each one only once.
+    uint8_t *sym_state = calloc(mod->num_dynsym, sizeof(uint8_t));
+    uintptr_t *sym_value = malloc(mod->num_dynsym * sizeof(uintptr_t));
+    if (!sym_state || !sym_value)
+        fatal_error("Error: could not allocate import cache.\n");
+
+#ifdef SO_IMPORT_PROFILE
+    uintptr_t *sym_thunk = calloc(mod->num_dynsym, sizeof(uintptr_t));
+    if (!sym_thunk)
+        fatal_error("Error: could not allocate import cache.\n");
+#endif
+
+#ifdef SO_LAZY_BIND
+    free(mod->lazy_slots);
+    mod->lazy_slots = malloc(mod->num_relplt * sizeof(so_lazy_slot));
+    mod->num_lazy_slots = 0;
+    mod->lazy_index = index;
+    mod->lazy_default_dynlib_only = default_dynlib_only;
+#endif
+
+    so_reloc_ctx ctx;
+    so_reloc_begin(mod, &ctx);
+
+    // Pass 1: find the pages holding imports
     for (int i = 0; i < mod->num_reldyn + mod->num_relplt; i++) {
         Elf32_Rel *rel = i < mod->num_reldyn ? &mod->reldyn[i] : &mod->relplt[i - mod->num_reldyn];
         Elf32_Sym *sym = &mod->dynsym[ELF32_R_SYM(rel->r_info)];
-        uintptr_t *ptr = (uintptr_t *)(mod->text_base + rel->r_offset);
+
+        int type = ELF32_R_TYPE(rel->r_info);
+        if ((type == R_ARM_ABS32 || type == R_ARM_GLOB_DAT || type == R_ARM_JUMP_SLOT) && sym->st_shndx == SHN_UNDEF)
+            so_reloc_mark(&ctx, mod->text_base + rel->r_offset);
+    }
+
+    if (so_reloc_stage(&ctx) < 0)
+        fatal_error("Error: could not allocate relocation staging.\n");
+
+    // Pass 2: resolve and apply to the staged pages
+    for (int i = 0; i < mod->num_reldyn + mod->num_relplt; i++) {
+        Elf32_Rel *rel = i < mod->num_reldyn ? &mod->reldyn[i] : &mod->relplt[i - mod->num_reldyn];
+        int sym_idx = ELF32_R_SYM(rel->r_info);
+        Elf32_Sym *sym = &mod->dynsym[sym_idx];
+        uintptr_t ptr = mod->text_base + rel->r_offset;
 
         int type = ELF32_R_TYPE(rel->r_info);
         switch (type) {
@@ -440,39 +1130,58 @@ int so_resolve(so_module *mod, so_default_dynlib *default_dynlib, int size_defau
             case R_ARM_JUMP_SLOT:
             {
                 if (sym->st_shndx == SHN_UNDEF) {
-                    int resolved = 0;
-                    if (!default_dynlib_only) {
-                        uintptr_t link = so_resolve_link(mod, mod->dynstr + sym->st_name);
-                        if (link) {
-                            // debugPrintf("Resolved from dependencies: %s\n", mod->dynstr + sym->st_name);
-                            if (type == R_ARM_ABS32) {
-                                val = *ptr + link;
-                                kuKernelCpuUnrestrictedMemcpy(ptr, &val, sizeof(uintptr_t));
+#ifdef SO_LAZY_BIND
+                    // Leave calls to be bound by so_lazy_resolve, unless the
+                    // symbol has already been resolved for a data reference
+                    if (type == R_ARM_JUMP_SLOT && sym_state[sym_idx] == SO_SYM_UNKNOWN &&
+                        mod->lazy_slots && mod->num_lazy_slots < mod->num_relplt) {
+                        mod->lazy_slots[mod->num_lazy_slots].got = ptr;
+                        mod->lazy_slots[mod->num_lazy_slots].sym = sym_idx;
+                        mod->num_lazy_slots++;
+                        so_reloc_write(&ctx, ptr, (uintptr_t)&so_lazy_stub);
+                        break;
+                    }
+#endif
+                    if (sym_state[sym_idx] == SO_SYM_UNKNOWN) {
+                        // default_dynlib takes priority over dependencies
+                        so_default_dynlib *entry = so_dynlib_find(index, mod->dynstr + sym->st_name);
+                        if (entry) {
+                            sym_value[sym_idx] = entry->func;
+                            sym_state[sym_idx] = SO_SYM_DEFAULT;
+                        } else {
+                            uintptr_t link = default_dynlib_only ? 0 : so_resolve_link(mod, mod->dynstr + sym->st_name);
+                            if (link) {
+                                // debugPrintf("Resolved from dependencies: %s\n", mod->dynstr + sym->st_name);
+                                sym_value[sym_idx] = link;
+                                sym_state[sym_idx] = SO_SYM_LINK;
                             } else {
-                                val = link;
-                                kuKernelCpuUnrestrictedMemcpy(ptr, &val, sizeof(uintptr_t));
+                                sym_state[sym_idx] = SO_SYM_UNRESOLVED;
                             }
-                            resolved = 1;
                         }
                     }
 
-                    for (int j = 0; j < size_default_dynlib / sizeof(so_default_dynlib); j++) {
-                        if (strcmp(mod->dynstr + sym->st_name, default_dynlib[j].symbol) == 0) {
-                            val = default_dynlib[j].func;
-                            kuKernelCpuUnrestrictedMemcpy(ptr, &val, sizeof(uintptr_t));
-                            resolved = 1;
-                            break;
-                        }
+#ifdef SO_IMPORT_PROFILE
+                    // Route calls (not data references) through a counting thunk
+                    if (type == R_ARM_JUMP_SLOT && sym_state[sym_idx] != SO_SYM_UNRESOLVED) {
+                        if (!sym_thunk[sym_idx])
+                            sym_thunk[sym_idx] = so_import_thunk(mod->dynstr + sym->st_name, sym_value[sym_idx]);
+                        so_reloc_write(&ctx, ptr, sym_thunk[sym_idx]);
+                        break;
                     }
+#endif
 
-                    if (!resolved) {
-                        if (type == R_ARM_JUMP_SLOT) {
-                            printf("Unresolved import: %s\n", mod->dynstr + sym->st_name);
-                            *ptr = (uintptr_t)&plt0_stub;
-                        }
-                        else {
+                    switch (sym_state[sym_idx]) {
+                        case SO_SYM_DEFAULT:
+                            so_reloc_write(&ctx, ptr, sym_value[sym_idx]);
+                            break;
+                        case SO_SYM_LINK:
+                            so_reloc_write(&ctx, ptr, (type == R_ARM_ABS32) ? so_reloc_read(&ctx, ptr) + sym_value[sym_idx] : sym_value[sym_idx]);
+                            break;
+                        default:
                             printf("Unresolved import: %s\n", mod->dynstr + sym->st_name);
-                        }
+                            if (type == R_ARM_JUMP_SLOT)
+                                so_reloc_write(&ctx, ptr, (uintptr_t)&plt0_stub);
+                            break;
                     }
                 }
 
@@ -483,6 +1192,19 @@ int so_resolve(so_module *mod, so_default_dynlib *default_dynlib, int size_defau
         }
     }
 
+    so_reloc_end(&ctx, "so_resolve");
+
+#ifdef SO_LAZY_BIND
+    qsort(mod->lazy_slots, mod->num_lazy_slots, sizeof(so_lazy_slot), so_lazy_slot_cmp);
+    printf("so_resolve: %d calls left for lazy binding\n", mod->num_lazy_slots);
+#endif
+
+#ifdef SO_IMPORT_PROFILE
+    free(sym_thunk);
+#endif
+    free(sym_value);
+    free(sym_state);
+
     return 0;
 }
 
@@ -490,7 +1212,7 @@ int __ret0() {
     return 0;
 }
 
-int so_resolve_with_dummy(so_module *mod, so_default_dynlib *default_dynlib, int size_default_dynlib, int default_dynlib_only) {
+int so_resolve_with_dummy(so_module *mod, const so_dynlib_index *index, int default_dynlib_only) {
     for (int i = 0; i < mod->num_reldyn + mod->num_relplt; i++) {
         Elf32_Rel *rel = i < mod->num_reldyn ? &mod->reldyn[i] : &mod->relplt[i - mod->num_reldyn];
         Elf32_Sym *sym = &mod->dynsym[ELF32_R_SYM(rel->r_info)];
@@ -502,14 +1224,8 @@ int so_resolve_with_dummy(so_module *mod, so_default_dynlib *default_dynlib, int
             case R_ARM_GLOB_DAT:
             case R_ARM_JUMP_SLOT:
             {
-                if (sym->st_shndx == SHN_UNDEF) {
-                    for (int j = 0; j < size_default_dynlib / sizeof(so_default_dynlib); j++) {
-                        if (strcmp(mod->dynstr + sym->st_name, default_dynlib[j].symbol) == 0) {
-                            *ptr = (uintptr_t) &__ret0;
-                            break;
-                        }
-                    }
-                }
+                if (sym->st_shndx == SHN_UNDEF && so_dynlib_find(index, mod->dynstr + sym->st_name))
+                    *ptr = (uintptr_t) &__ret0;
 
                 break;
             }
@@ -522,9 +1238,17 @@ int so_resolve_with_dummy(so_module *mod, so_default_dynlib *default_dynlib, int
 }
 
 void so_initialize(so_module *mod) {
+    so_initialize_cb(mod, NULL);
+}
+
+void so_initialize_cb(so_module *mod, so_ctor_cb cb) {
     for (int i = 0; i < mod->num_init_array; i++) {
-        if (mod->init_array[i] && (int)mod->init_array[i] != -1)
+        if (mod->init_array[i] && (int)mod->init_array[i] != -1) {
+            SceUInt64 start = cb ? sceKernelGetProcessTimeWide() : 0;
             mod->init_array[i]();
+            if (cb)
+                cb(mod, (uintptr_t)mod->init_array[i], start, sceKernelGetProcessTimeWide());
+        }
     }
 }
 
@@ -539,8 +1263,59 @@ uint32_t so_hash(const uint8_t *name) {
     return h;
 }
 
+uint32_t so_gnu_hash(const uint8_t *name) {
+    uint32_t h = 5381;
+    while (*name)
+        h = (h << 5) + h + *name++;
+    return h;
+}
+
+/*
+ * DT_GNU_HASH layout (ELFCLASS32):
+ *   nbucket, symoffset, bloom_size, bloom_shift,
+ *   bloom[bloom_size], bucket[nbucket], chain[num_dynsym - symoffset]
+ * Only defined symbols (index >= symoffset) are hashed, so a miss here is
+ * authoritative and most misses are rejected by the bloom filter alone.
+ */
+static int so_gnu_symbol_index(so_module *mod, const char *symbol)
+{
+    uint32_t nbucket = mod->gnu_hash[0];
+    uint32_t symoffset = mod->gnu_hash[1];
+    uint32_t bloom_size = mod->gnu_hash[2];
+    uint32_t bloom_shift = mod->gnu_hash[3];
+    uint32_t *bloom = &mod->gnu_hash[4];
+    uint32_t *bucket = &bloom[bloom_size];
+    uint32_t *chain = &bucket[nbucket];
+
+    uint32_t hash = so_gnu_hash((const uint8_t *)symbol);
+
+    uint32_t word = bloom[(hash / 32) % bloom_size];
+    uint32_t mask = (1u << (hash % 32)) | (1u << ((hash >> bloom_shift) % 32));
+    if ((word & mask) != mask)
+        return -1;
+
+    uint32_t i = bucket[hash % nbucket];
+    if (i < symoffset)
+        return -1;
+
+    for (;; i++) {
+        uint32_t chain_hash = chain[i - symoffset];
+        if ((hash | 1) == (chain_hash | 1)
+            && mod->dynsym[i].st_shndx != SHN_UNDEF
+            && strcmp(mod->dynstr + mod->dynsym[i].st_name, symbol) == 0)
+            return (int)i;
+        if (chain_hash & 1)
+            break;
+    }
+
+    return -1;
+}
+
 static int so_symbol_index(so_module *mod, const char *symbol)
 {
+    if (mod->gnu_hash)
+        return so_gnu_symbol_index(mod, symbol);
+
     if (mod->hash) {
         uint32_t hash = so_hash((const uint8_t *)symbol);
         uint32_t nbucket = mod->hash[0];
@@ -552,6 +1327,9 @@ static int so_symbol_index(so_module *mod, const char *symbol)
             if (mod->dynsym[i].st_info != SHN_UNDEF && strcmp(mod->dynstr + mod->dynsym[i].st_name, symbol) == 0)
                 return i;
         }
+
+        // Every dynsym entry is on one of the chains, no need to scan
+        return -1;
     }
 
     for (int i = 0; i < mod->num_dynsym; i++) {
@@ -642,6 +1420,38 @@ uintptr_t so_symbol(so_module *mod, const char *symbol) {
     return mod->text_base + mod->dynsym[index].st_value;
 }
 
+const char *so_symbol_name(so_module *mod, uintptr_t addr, uintptr_t *offset) {
+    if (addr < mod->text_base)
+        return NULL;
+
+    // Nearest defined symbol at or below addr; Thumb functions have bit 0 set
+    uintptr_t rel = addr - mod->text_base;
+    int best = -1;
+    uintptr_t best_value = 0;
+    for (int i = 0; i < mod->num_dynsym; i++) {
+        Elf32_Sym *sym = &mod->dynsym[i];
+        if (sym->st_shndx == SHN_UNDEF || sym->st_value == 0)
+            continue;
+
+        int type = ELF32_ST_TYPE(sym->st_info);
+        if (type != STT_FUNC && type != STT_OBJECT)
+            continue;
+
+        uintptr_t value = type == STT_FUNC ? sym->st_value & ~1 : sym->st_value;
+        if (value <= rel && (best == -1 || value > best_value)) {
+            best = i;
+            best_value = value;
+        }
+    }
+
+    if (best == -1)
+        return NULL;
+
+    if (offset)
+        *offset = rel - best_value;
+    return mod->dynstr + mod->dynsym[best].st_name;
+}
+
 void so_symbol_fix_ldmia(so_module *mod, const char *symbol) {
     // This is meant to work around crashes due to unaligned accesses (SIGBUS :/) due to certain
     // kernels not having the fault trap enabled, e.g. certain RK3326 Odroid Go Advance clone distros.
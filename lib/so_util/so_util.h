@@ -13,8 +13,25 @@ typedef struct {
     uintptr_t thumb_addr;
     uint32_t orig_instr[2];
     uint32_t patch_instr[2];
+    uintptr_t trampoline; // relocated original prologue, 0 if unavailable
 } so_hook;
 
+#define SO_MAX_HOOK_LOG 256
+
+// Record of a hook installed through hook_thumb/hook_arm
+typedef struct {
+    uintptr_t addr; // hooked address, with bit 0 set for Thumb
+    uintptr_t dst;
+} so_hook_record;
+
+#ifdef SO_LAZY_BIND
+// JUMP_SLOT left for binding on first call
+typedef struct {
+    uintptr_t got;
+    uint32_t sym;
+} so_lazy_slot;
+#endif
+
 typedef struct so_module {
     struct so_module *next;
 
@@ -34,6 +51,7 @@ typedef struct so_module {
 
     int (** init_array)(void);
     uint32_t *hash;
+    uint32_t *gnu_hash;
 
     int num_dynamic;
     int num_dynsym;
@@ -44,6 +62,13 @@ typedef struct so_module {
     char *soname;
     char *shstr;
     char *dynstr;
+
+#ifdef SO_LAZY_BIND
+    so_lazy_slot *lazy_slots; // sorted by got
+    int num_lazy_slots;
+    const struct so_dynlib_index *lazy_index;
+    int lazy_default_dynlib_only;
+#endif
 } so_module;
 
 typedef struct {
@@ -51,26 +76,61 @@ typedef struct {
     uintptr_t func;
 } so_default_dynlib;
 
+#define SO_DYNLIB_EMPTY 0xFFFF
+
+// Perfect hash over a so_default_dynlib table, generated at build time by
+// extras/scripts/gen_dynlib_index.py
+typedef struct so_dynlib_index {
+    so_default_dynlib *entries;
+    int num_entries;
+    uint32_t seed;
+    const uint16_t *disp;  // per-bucket displacement
+    uint32_t num_disp;     // power of two
+    const uint16_t *slots; // index into entries, SO_DYNLIB_EMPTY if unused
+    uint32_t num_slots;    // power of two
+} so_dynlib_index;
+
+// Called after each init_array constructor with its start and end time (us)
+typedef void (*so_ctor_cb)(so_module *mod, uintptr_t ctor, SceUInt64 start, SceUInt64 end);
+
 so_hook hook_thumb(uintptr_t addr, uintptr_t dst);
 so_hook hook_arm(uintptr_t addr, uintptr_t dst);
 so_hook hook_addr(uintptr_t addr, uintptr_t dst);
+int so_hook_log(const so_hook_record **records);
 
 void so_flush_caches(so_module *mod);
 int so_file_load(so_module *mod, const char *filename, uintptr_t load_addr);
 int so_mem_load(so_module *mod, void * buffer, size_t so_size, uintptr_t load_addr);
 int so_relocate(so_module *mod);
-int so_resolve(so_module *mod, so_default_dynlib *default_dynlib, int size_default_dynlib, int default_dynlib_only);
-int so_resolve_with_dummy(so_module *mod, so_default_dynlib *default_dynlib, int size_default_dynlib, int default_dynlib_only);
+uint32_t so_dynlib_hash(const char *symbol, uint32_t seed);
+so_default_dynlib *so_dynlib_find(const so_dynlib_index *index, const char *symbol);
+int so_resolve(so_module *mod, const so_dynlib_index *index, int default_dynlib_only);
+int so_resolve_with_dummy(so_module *mod, const so_dynlib_index *index, int default_dynlib_only);
 void so_symbol_fix_ldmia(so_module *mod, const char *symbol);
+uintptr_t so_alloc_arena(so_module *so, uintptr_t range, uintptr_t dst, size_t sz);
 void so_initialize(so_module *mod);
+void so_initialize_cb(so_module *mod, so_ctor_cb cb);
+#ifdef SO_IMPORT_PROFILE
+void so_import_profile_dump(int top_n);
+void so_import_profile_reset();
+#endif
 uintptr_t so_symbol(so_module *mod, const char *symbol);
+const char *so_symbol_name(so_module *mod, uintptr_t addr, uintptr_t *offset);
+void plt0_stub();
 
+// Call the original function of a hook. Goes through the detour trampoline
+// when there is one, otherwise temporarily unpatches the hook (not thread-safe).
 #define SO_CONTINUE(type, h, ...) ({ \
-  kuKernelCpuUnrestrictedMemcpy((void *)h.addr, h.orig_instr, sizeof(h.orig_instr)); \
-  kuKernelFlushCaches((void *)h.addr, sizeof(h.orig_instr)); \
-  type r = h.thumb_addr ? ((type(*)())h.thumb_addr)(__VA_ARGS__) : ((type(*)())h.addr)(__VA_ARGS__); \
-  kuKernelCpuUnrestrictedMemcpy((void *)h.addr, h.patch_instr, sizeof(h.patch_instr)); \
-  kuKernelFlushCaches((void *)h.addr, sizeof(h.patch_instr)); \
+  type r; \
+  if (h.trampoline) { \
+    r = ((type(*)())h.trampoline)(__VA_ARGS__); \
+  } else { \
+    kuKernelCpuUnrestrictedMemcpy((void *)h.addr, h.orig_instr, sizeof(h.orig_instr)); \
+    kuKernelFlushCaches((void *)h.addr, sizeof(h.orig_instr)); \
+    r = h.thumb_addr ? ((type(*)())h.thumb_addr)(__VA_ARGS__) : ((type(*)())h.addr)(__VA_ARGS__); \
+    kuKernelCpuUnrestrictedMemcpy((void *)h.addr, h.patch_instr, sizeof(h.patch_instr)); \
+    kuKernelFlushCaches((void *)h.addr, sizeof(h.patch_instr)); \
+  } \
   r; \
 })
 
@@ -35,6 +35,7 @@
 #include <sys/time.h>
 
 #include <so_util/so_util.h>
+#include <sha1/sha1.h>
 #include <utime.h>
 
 #include "utils/glutil.h"
@@ -50,6 +51,8 @@
 #include "reimpl/errno.h"
 #include "reimpl/io.h"
 #include "reimpl/log.h"
+#include "reimpl/alloc.h"
+#include "reimpl/alloc_trace.h"
 #include "reimpl/mem.h"
 #include "reimpl/pthr.h"
 #include "reimpl/sys.h"
@@ -226,10 +229,24 @@ so_default_dynlib default_dynlib[] = {
         { "_ZTVN10__cxxabiv117__class_type_infoE", (uintptr_t)&_ZTVN10__cxxabiv117__class_type_infoE },
         { "_ZTVN10__cxxabiv120__si_class_type_infoE", (uintptr_t)&_ZTVN10__cxxabiv120__si_class_type_infoE },
         { "_ZTVN10__cxxabiv121__vmi_class_type_infoE", (uintptr_t)&_ZTVN10__cxxabiv121__vmi_class_type_infoE },
-        { "_ZdaPv", (uintptr_t)&_ZdaPv },
-        { "_ZdlPv", (uintptr_t)&_ZdlPv },
-        { "_Znaj", (uintptr_t)&_Znaj },
-        { "_Znwj", (uintptr_t)&_Znwj },
+        #ifdef ALLOC_TRACE
+            { "_ZdaPv", (uintptr_t)&operator_delete_array_traced },
+            { "_ZdlPv", (uintptr_t)&operator_delete_traced },
+            { "_Znaj", (uintptr_t)&operator_new_array_traced },
+            { "_Znwj", (uintptr_t)&operator_new_traced },
+        #else
+        #ifdef USE_SLAB_ALLOCATOR
+            { "_ZdaPv", (uintptr_t)&free_soloader },
+            { "_ZdlPv", (uintptr_t)&free_soloader },
+            { "_Znaj", (uintptr_t)&operator_new_array_soloader },
+            { "_Znwj", (uintptr_t)&operator_new_soloader },
+        #else
+            { "_ZdaPv", (uintptr_t)&_ZdaPv },
+            { "_ZdlPv", (uintptr_t)&_ZdlPv },
+            { "_Znaj", (uintptr_t)&_Znaj },
+            { "_Znwj", (uintptr_t)&_Znwj },
+        #endif
+        #endif
         { "__aeabi_atexit", (uintptr_t)&__aeabi_atexit },
         { "__aeabi_d2lz", (uintptr_t)&__aeabi_d2lz },
         { "__aeabi_d2ulz", (uintptr_t)&__aeabi_d2ulz },
@@ -463,10 +480,24 @@ so_default_dynlib default_dynlib[] = {
 
 
         // Memory
-        { "calloc", (uintptr_t)&calloc },
-        { "free", (uintptr_t)&free },
-        { "malloc", (uintptr_t)&malloc },
-        { "memalign", (uintptr_t)&memalign },
+        #ifdef ALLOC_TRACE
+            { "calloc", (uintptr_t)&calloc_traced },
+            { "free", (uintptr_t)&free_traced },
+            { "malloc", (uintptr_t)&malloc_traced },
+            { "memalign", (uintptr_t)&memalign_traced },
+        #else
+        #ifdef USE_SLAB_ALLOCATOR
+            { "calloc", (uintptr_t)&calloc_soloader },
+            { "free", (uintptr_t)&free_soloader },
+            { "malloc", (uintptr_t)&malloc_soloader },
+            { "memalign", (uintptr_t)&memalign_soloader },
+        #else
+            { "calloc", (uintptr_t)&calloc },
+            { "free", (uintptr_t)&free },
+            { "malloc", (uintptr_t)&malloc },
+            { "memalign", (uintptr_t)&memalign },
+        #endif
+        #endif
         { "memcmp", (uintptr_t)&memcmp },
         { "memcpy", (uintptr_t)&sceClibMemcpy },
         { "memmem", (uintptr_t)&memmem },
@@ -474,7 +505,15 @@ so_default_dynlib default_dynlib[] = {
         { "memset", (uintptr_t)&memset },
         { "mmap", (uintptr_t)&mmap },
         { "munmap", (uintptr_t)&munmap },
-        { "realloc", (uintptr_t)&realloc },
+        #ifdef ALLOC_TRACE
+            { "realloc", (uintptr_t)&realloc_traced },
+        #else
+        #ifdef USE_SLAB_ALLOCATOR
+            { "realloc", (uintptr_t)&realloc_soloader },
+        #else
+            { "realloc", (uintptr_t)&realloc },
+        #endif
+        #endif
         { "valloc", (uintptr_t)&valloc },
 
 
@@ -618,7 +657,11 @@ so_default_dynlib default_dynlib[] = {
         { "eglQueryContext", (uintptr_t)&eglQueryContext },
         { "eglQueryString", (uintptr_t)&eglQueryString },
         { "eglQuerySurface", (uintptr_t)&eglQuerySurface },
-        { "eglSwapBuffers", (uintptr_t)&eglSwapBuffers },
+        #ifdef ALLOC_TRACE
+            { "eglSwapBuffers", (uintptr_t)&eglSwapBuffers_soloader },
+        #else
+            { "eglSwapBuffers", (uintptr_t)&eglSwapBuffers },
+        #endif
         { "eglSwapInterval", (uintptr_t)&eglSwapInterval },
         { "eglTerminate", (uintptr_t)&eglTerminate },
 
@@ -894,12 +937,12 @@ so_default_dynlib default_dynlib[] = {
         { "pthread_create", (uintptr_t) &pthread_create_soloader },
         { "pthread_detach", (uintptr_t) &pthread_detach_soloader },
         { "pthread_equal", (uintptr_t) &pthread_equal_soloader },
-        { "pthread_exit", (uintptr_t)&pthread_exit },
+        { "pthread_exit", (uintptr_t) &pthread_exit_soloader },
         { "pthread_getschedparam", (uintptr_t) &pthread_getschedparam_soloader },
         { "pthread_getspecific", (uintptr_t)&pthread_getspecific },
         { "pthread_join", (uintptr_t) &pthread_join_soloader },
-        { "pthread_key_create", (uintptr_t)&pthread_key_create },
-        { "pthread_key_delete", (uintptr_t)&pthread_key_delete },
+        { "pthread_key_create", (uintptr_t) &pthread_key_create_soloader },
+        { "pthread_key_delete", (uintptr_t) &pthread_key_delete_soloader },
         { "pthread_kill", (uintptr_t)&pthread_kill_soloader },
 
         { "pthread_mutex_destroy", (uintptr_t) &pthread_mutex_destroy_soloader },
@@ -913,11 +956,29 @@ so_default_dynlib default_dynlib[] = {
         { "pthread_mutexattr_setpshared", (uintptr_t) &ret0 },
         { "pthread_once", (uintptr_t)&pthread_once_soloader },
 
+        { "pthread_rwlock_destroy", (uintptr_t) &pthread_rwlock_destroy_soloader },
+        { "pthread_rwlock_init", (uintptr_t) &pthread_rwlock_init_soloader },
+        { "pthread_rwlock_rdlock", (uintptr_t) &pthread_rwlock_rdlock_soloader },
+        { "pthread_rwlock_timedrdlock", (uintptr_t) &pthread_rwlock_timedrdlock_soloader },
+        { "pthread_rwlock_timedwrlock", (uintptr_t) &pthread_rwlock_timedwrlock_soloader },
+        { "pthread_rwlock_tryrdlock", (uintptr_t) &pthread_rwlock_tryrdlock_soloader },
+        { "pthread_rwlock_trywrlock", (uintptr_t) &pthread_rwlock_trywrlock_soloader },
+        { "pthread_rwlock_unlock", (uintptr_t) &pthread_rwlock_unlock_soloader },
+        { "pthread_rwlock_wrlock", (uintptr_t) &pthread_rwlock_wrlock_soloader },
+        { "pthread_rwlockattr_destroy", (uintptr_t) &pthread_rwlockattr_destroy_soloader },
+        { "pthread_rwlockattr_getpshared", (uintptr_t) &pthread_rwlockattr_getpshared_soloader },
+        { "pthread_rwlockattr_init", (uintptr_t) &pthread_rwlockattr_init_soloader },
+        { "pthread_rwlockattr_setpshared", (uintptr_t) &pthread_rwlockattr_setpshared_soloader },
         { "pthread_self", (uintptr_t) &pthread_self_soloader },
         { "pthread_setname_np", (uintptr_t) &pthread_setname_np_soloader },
         { "pthread_setschedparam", (uintptr_t) &pthread_setschedparam_soloader },
         { "pthread_setspecific", (uintptr_t)&pthread_setspecific },
         { "pthread_sigmask", (uintptr_t)&ret0 },
+        { "pthread_spin_destroy", (uintptr_t) &pthread_spin_destroy_soloader },
+        { "pthread_spin_init", (uintptr_t) &pthread_spin_init_soloader },
+        { "pthread_spin_lock", (uintptr_t) &pthread_spin_lock_soloader },
+        { "pthread_spin_trylock", (uintptr_t) &pthread_spin_trylock_soloader },
+        { "pthread_spin_unlock", (uintptr_t) &pthread_spin_unlock_soloader },
 
         { "__pthread_cleanup_push", (uintptr_t)&retnull },
         { "__pthread_cleanup_pop", (uintptr_t)&retnull },
@@ -941,7 +1002,6 @@ so_default_dynlib default_dynlib[] = {
         { "iswcntrl", (uintptr_t)&iswcntrl },
         { "iswctype", (uintptr_t)&iswctype },
         { "iswdigit", (uintptr_t)&iswdigit },
-        { "iswdigit", (uintptr_t)&iswdigit },
         { "iswlower", (uintptr_t)&iswlower },
         { "iswprint", (uintptr_t)&iswprint },
         { "iswpunct", (uintptr_t)&iswpunct },
@@ -1127,10 +1187,54 @@ so_default_dynlib default_dynlib[] = {
         { "uncompress", (uintptr_t)&uncompress },
 };
 
-void resolve_imports(so_module* mod) {
+// Generated from the table above at build time, see gen_dynlib_index.py
+#include "dynlib_index.h"
+
+_Static_assert(sizeof(default_dynlib) / sizeof(so_default_dynlib) == DEFAULT_DYNLIB_COUNT,
+               "dynlib_index.h is out of sync with default_dynlib[]");
+
+static const so_dynlib_index default_dynlib_index = {
+    .entries = default_dynlib,
+    .num_entries = DEFAULT_DYNLIB_COUNT,
+    .seed = DEFAULT_DYNLIB_SEED,
+    .disp = default_dynlib_disp,
+    .num_disp = sizeof(default_dynlib_disp) / sizeof(default_dynlib_disp[0]),
+    .slots = default_dynlib_slots,
+    .num_slots = sizeof(default_dynlib_slots) / sizeof(default_dynlib_slots[0]),
+};
+
+void resolve_imports_runtime() {
     __sF_fake[0] = *stdin;
     __sF_fake[1] = *stdout;
     __sF_fake[2] = *stderr;
+}
+
+void resolve_imports(so_module* mod) {
+    resolve_imports_runtime();
+    so_resolve(mod, &default_dynlib_index, 0);
+}
+
+char * imports_sha1sum() {
+    SHA1_CTX ctx;
+    sha1_init(&ctx);
+
+    // Everything so_resolve() can write into the module: every name with the
+    // address it resolves to, and the stub used for unresolved imports
+    for (int i = 0; i < DEFAULT_DYNLIB_COUNT; i++) {
+        uint32_t func = default_dynlib[i].func;
+        sha1_update(&ctx, (const BYTE *)default_dynlib[i].symbol, strlen(default_dynlib[i].symbol) + 1);
+        sha1_update(&ctx, (const BYTE *)&func, sizeof(func));
+    }
+
+    uint32_t stub = (uint32_t)&plt0_stub;
+    sha1_update(&ctx, (const BYTE *)&stub, sizeof(stub));
+
+    uint8_t sha1[SHA1_BLOCK_SIZE];
+    sha1_final(&ctx, sha1);
+
+    char * ret = malloc(SHA1_BLOCK_SIZE * 2 + 1);
+    for (int i = 0; i < SHA1_BLOCK_SIZE; i++)
+        sprintf(ret + i * 2, "%02X", sha1[i]);
 
-    so_resolve(mod, default_dynlib, sizeof(default_dynlib), 0);
+    return ret;
 }
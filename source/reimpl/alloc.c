@@ -0,0 +1,344 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+#include "reimpl/alloc.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <psp2/kernel/clib.h>
+#include <psp2/kernel/threadmgr.h>
+
+#define ALLOC_SPAN_SHIFT   16 // 64 KiB slabs, aligned to their size
+#define ALLOC_SPAN_SIZE    (1 << ALLOC_SPAN_SHIFT)
+#define ALLOC_MAX_SMALL    2048
+#define ALLOC_NUM_CLASSES  25
+
+static const uint16_t class_size[ALLOC_NUM_CLASSES] = {
+    8, 16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048
+};
+
+// Size class + 1 of every 64 KiB of the address space, 0 if not a slab
+static uint8_t span_class[1 << (32 - ALLOC_SPAN_SHIFT)];
+
+// (size + 7) / 8 -> size class
+static uint8_t size_class[ALLOC_MAX_SMALL / 8 + 1];
+
+typedef struct {
+    SceKernelLwMutexWork lock;
+    void * free_list;
+    int batch;
+
+    uint32_t spans;
+    uint32_t allocs;
+    uint32_t frees;
+} __attribute__((aligned(8))) alloc_class;
+
+static alloc_class classes[ALLOC_NUM_CLASSES];
+
+typedef struct {
+    void * head;
+    int count;
+    uint32_t allocs;
+    uint32_t frees;
+} alloc_bin;
+
+static __thread alloc_bin cache[ALLOC_NUM_CLASSES];
+static __thread int cache_registered = 0;
+
+static pthread_key_t cache_key;
+
+static volatile uint32_t large_allocs = 0;
+static volatile uint32_t large_frees = 0;
+
+enum {
+    ALLOC_UNINITIALIZED = 0,
+    ALLOC_INITIALIZING,
+    ALLOC_READY
+};
+
+static volatile int alloc_state = ALLOC_UNINITIALIZED;
+
+static void alloc_cache_flush(int cls, int count);
+
+// Hands a finished thread's cached objects back to the shared lists
+static void alloc_thread_exit(void * arg) {
+    for (int i = 0; i < ALLOC_NUM_CLASSES; i++)
+        alloc_cache_flush(i, cache[i].count);
+}
+
+static void alloc_init() {
+    int expected = ALLOC_UNINITIALIZED;
+    if (__atomic_compare_exchange_n(&alloc_state, &expected, ALLOC_INITIALIZING,
+                                    0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        int cls = 0;
+        for (int i = 0; i <= ALLOC_MAX_SMALL / 8; i++) {
+            while (class_size[cls] < i * 8)
+                cls++;
+            size_class[i] = cls;
+        }
+
+        for (int i = 0; i < ALLOC_NUM_CLASSES; i++) {
+            sceKernelCreateLwMutex(&classes[i].lock, "alloc_class", 0, 0, NULL);
+            int batch = 4096 / class_size[i];
+            classes[i].batch = batch < 4 ? 4 : (batch > 64 ? 64 : batch);
+        }
+
+        pthread_key_create(&cache_key, alloc_thread_exit);
+
+        __atomic_store_n(&alloc_state, ALLOC_READY, __ATOMIC_RELEASE);
+        return;
+    }
+
+    while (__atomic_load_n(&alloc_state, __ATOMIC_ACQUIRE) != ALLOC_READY)
+        sceKernelDelayThread(100);
+}
+
+static inline int alloc_class_of_ptr(const void * ptr) {
+    return (int) span_class[(uintptr_t) ptr >> ALLOC_SPAN_SHIFT] - 1;
+}
+
+static void alloc_cache_register() {
+    cache_registered = 1;
+    pthread_setspecific(cache_key, (void *) 1);
+}
+
+// Class lock must be held
+static int alloc_new_span(int cls) {
+    uint8_t * span = memalign(ALLOC_SPAN_SIZE, ALLOC_SPAN_SIZE);
+    if (!span)
+        return 0;
+
+    size_t size = class_size[cls];
+    void * head = classes[cls].free_list;
+    for (size_t off = (ALLOC_SPAN_SIZE / size) * size; off >= size; off -= size) {
+        void ** obj = (void **) (span + off - size);
+        *obj = head;
+        head = obj;
+    }
+    classes[cls].free_list = head;
+    classes[cls].spans++;
+
+    span_class[(uintptr_t) span >> ALLOC_SPAN_SHIFT] = cls + 1;
+    return 1;
+}
+
+static void alloc_cache_refill(int cls) {
+    alloc_class * c = &classes[cls];
+    alloc_bin * bin = &cache[cls];
+
+    if (!cache_registered)
+        alloc_cache_register();
+
+    sceKernelLockLwMutex(&c->lock, 1, NULL);
+
+    c->allocs += bin->allocs;
+    c->frees += bin->frees;
+    bin->allocs = 0;
+    bin->frees = 0;
+
+    for (int i = 0; i < c->batch; i++) {
+        if (!c->free_list && !alloc_new_span(cls))
+            break;
+
+        void ** obj = c->free_list;
+        c->free_list = *obj;
+        *obj = bin->head;
+        bin->head = obj;
+        bin->count++;
+    }
+
+    sceKernelUnlockLwMutex(&c->lock, 1);
+}
+
+static void alloc_cache_flush(int cls, int count) {
+    alloc_class * c = &classes[cls];
+    alloc_bin * bin = &cache[cls];
+
+    sceKernelLockLwMutex(&c->lock, 1, NULL);
+
+    c->allocs += bin->allocs;
+    c->frees += bin->frees;
+    bin->allocs = 0;
+    bin->frees = 0;
+
+    for (int i = 0; i < count && bin->head; i++) {
+        void ** obj = bin->head;
+        bin->head = *obj;
+        bin->count--;
+        *obj = c->free_list;
+        c->free_list = obj;
+    }
+
+    sceKernelUnlockLwMutex(&c->lock, 1);
+}
+
+void * malloc_soloader(size_t size) {
+    if (__builtin_expect(__atomic_load_n(&alloc_state, __ATOMIC_ACQUIRE) != ALLOC_READY, 0))
+        alloc_init();
+
+    if (size > ALLOC_MAX_SMALL) {
+        void * ret = malloc(size);
+        if (ret)
+            __atomic_fetch_add(&large_allocs, 1, __ATOMIC_RELAXED);
+        return ret;
+    }
+
+    int cls = size_class[(size + 7) / 8];
+    alloc_bin * bin = &cache[cls];
+
+    if (__builtin_expect(!bin->head, 0)) {
+        alloc_cache_refill(cls);
+        if (!bin->head) {
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    void ** obj = bin->head;
+    bin->head = *obj;
+    bin->count--;
+    bin->allocs++;
+    return obj;
+}
+
+void free_soloader(void * ptr) {
+    if (!ptr)
+        return;
+
+    int cls = alloc_class_of_ptr(ptr);
+    if (cls < 0) {
+        __atomic_fetch_add(&large_frees, 1, __ATOMIC_RELAXED);
+        free(ptr);
+        return;
+    }
+
+    if (__builtin_expect(!cache_registered, 0))
+        alloc_cache_register();
+
+    alloc_bin * bin = &cache[cls];
+    *(void **) ptr = bin->head;
+    bin->head = ptr;
+    bin->count++;
+    bin->frees++;
+
+    if (__builtin_expect(bin->count >= 2 * classes[cls].batch, 0))
+        alloc_cache_flush(cls, classes[cls].batch);
+}
+
+void * calloc_soloader(size_t num, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(num, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (total > ALLOC_MAX_SMALL) {
+        void * ret = calloc(1, total);
+        if (ret)
+            __atomic_fetch_add(&large_allocs, 1, __ATOMIC_RELAXED);
+        return ret;
+    }
+
+    void * ret = malloc_soloader(total);
+    if (ret)
+        sceClibMemset(ret, 0, total);
+    return ret;
+}
+
+void * realloc_soloader(void * ptr, size_t size) {
+    if (!ptr)
+        return malloc_soloader(size);
+
+    if (size == 0) {
+        free_soloader(ptr);
+        return NULL;
+    }
+
+    int cls = alloc_class_of_ptr(ptr);
+    if (cls < 0)
+        return realloc(ptr, size);
+
+    // Keep the object unless it would waste more than half of it
+    size_t old_size = class_size[cls];
+    if (size <= old_size && size > old_size / 2)
+        return ptr;
+
+    void * ret = malloc_soloader(size);
+    if (!ret)
+        return NULL;
+
+    sceClibMemcpy(ret, ptr, size < old_size ? size : old_size);
+    free_soloader(ptr);
+    return ret;
+}
+
+void * memalign_soloader(size_t alignment, size_t size) {
+    // Slab objects are only 8-byte aligned
+    if (alignment <= 8)
+        return malloc_soloader(size);
+
+    void * ret = memalign(alignment, size);
+    if (ret)
+        __atomic_fetch_add(&large_allocs, 1, __ATOMIC_RELAXED);
+    return ret;
+}
+
+// libstdc++, does not return
+void _ZSt17__throw_bad_allocv();
+
+void * operator_new_soloader(size_t size) {
+    void * ret = malloc_soloader(size);
+    if (__builtin_expect(!ret, 0))
+        _ZSt17__throw_bad_allocv();
+    return ret;
+}
+
+void * operator_new_array_soloader(size_t size) {
+    return operator_new_soloader(size);
+}
+
+void alloc_stats_dump() {
+    uint64_t reserved = 0, live = 0;
+
+    sceClibPrintf("[alloc] class   spans      live  capacity  util\n");
+    for (int i = 0; i < ALLOC_NUM_CLASSES; i++) {
+        alloc_class * c = &classes[i];
+
+        sceKernelLockLwMutex(&c->lock, 1, NULL);
+        uint32_t spans = c->spans;
+        uint32_t objects = c->allocs - c->frees; // excludes unflushed thread counters
+        sceKernelUnlockLwMutex(&c->lock, 1);
+
+        if (!spans)
+            continue;
+
+        uint32_t capacity = spans * (ALLOC_SPAN_SIZE / class_size[i]);
+        sceClibPrintf("[alloc] %5u  %6u  %8u  %8u  %3u%%\n", class_size[i], (unsigned int) spans,
+                      (unsigned int) objects, (unsigned int) capacity,
+                      (unsigned int) ((uint64_t) objects * 100 / capacity));
+
+        reserved += (uint64_t) spans * ALLOC_SPAN_SIZE;
+        live += (uint64_t) objects * class_size[i];
+    }
+
+    sceClibPrintf("[alloc] slabs: %u KiB reserved, %u KiB live (%u%% unused)\n",
+                  (unsigned int) (reserved / 1024), (unsigned int) (live / 1024),
+                  reserved ? (unsigned int) (100 - live * 100 / reserved) : 0);
+
+    struct mallinfo mi = mallinfo();
+    // Frees also count memory newlib handed to the game directly (strdup etc.)
+    sceClibPrintf("[alloc] large: %u allocs, %u frees; newlib heap %u KiB in use of %u KiB\n",
+                  (unsigned int) large_allocs, (unsigned int) large_frees,
+                  (unsigned int) (mi.uordblks / 1024), (unsigned int) (mi.arena / 1024));
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  alloc.h
+ * @brief Size-class allocator backing the .so's malloc/free and new/delete
+ *        imports when built with `USE_SLAB_ALLOCATOR`.
+ *
+ * Requests up to 2048 bytes are served from 64 KiB slabs, each holding
+ * objects of one size class. Every thread keeps a small free list per class
+ * and only takes the class lock to move a batch of objects between its cache
+ * and the shared list. Larger and over-aligned requests go to newlib's
+ * allocator.
+ *
+ * Pointers that did not come from a slab (large objects, and memory newlib
+ * itself hands to the game, e.g. from `strdup`) are recognized in free() and
+ * realloc() and passed on to newlib.
+ */
+
+#ifndef SOLOADER_ALLOC_H
+#define SOLOADER_ALLOC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+void * malloc_soloader(size_t size);
+
+void free_soloader(void * ptr);
+
+void * calloc_soloader(size_t num, size_t size);
+
+void * realloc_soloader(void * ptr, size_t size);
+
+void * memalign_soloader(size_t alignment, size_t size);
+
+// operator new/new[]: like libstdc++'s, throw std::bad_alloc instead of
+// returning NULL
+void * operator_new_soloader(size_t size);
+
+void * operator_new_array_soloader(size_t size);
+
+/**
+ * Print per size class slab usage and large-object totals.
+ */
+void alloc_stats_dump();
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // SOLOADER_ALLOC_H
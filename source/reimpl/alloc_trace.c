@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+#include "reimpl/alloc_trace.h"
+
+#include "utils/logger.h"
+
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <psp2/io/fcntl.h>
+#include <psp2/kernel/clib.h>
+#include <psp2/kernel/processmgr.h>
+#include <psp2/kernel/threadmgr.h>
+
+#include <so_util/so_util.h>
+
+#ifdef USE_SLAB_ALLOCATOR
+#include "reimpl/alloc.h"
+
+#define heap_malloc       malloc_soloader
+#define heap_free         free_soloader
+#define heap_calloc       calloc_soloader
+#define heap_realloc      realloc_soloader
+#define heap_memalign     memalign_soloader
+#define heap_new          operator_new_soloader
+#define heap_new_array    operator_new_array_soloader
+#define heap_delete       free_soloader
+#define heap_delete_array free_soloader
+#else
+// libstdc++ operator new/new[]/delete/delete[]
+void * _Znwj(size_t size);
+void * _Znaj(size_t size);
+void _ZdlPv(void * ptr);
+void _ZdaPv(void * ptr);
+
+#define heap_malloc       malloc
+#define heap_free         free
+#define heap_calloc       calloc
+#define heap_realloc      realloc
+#define heap_memalign     memalign
+#define heap_new          _Znwj
+#define heap_new_array    _Znaj
+#define heap_delete       _ZdlPv
+#define heap_delete_array _ZdaPv
+#endif
+
+#define ALLOC_TRACE_PATH      DATA_PATH "alloc_trace.bin"
+#define ALLOC_TRACE_RING_SIZE 8192 // events per thread, power of two
+#define ALLOC_TRACE_MAX_RINGS 32
+#define ALLOC_TRACE_INTERVAL  (100 * 1000)
+
+extern so_module so_mod;
+
+typedef struct {
+    uint32_t time;
+    uint32_t type;
+    uint32_t ptr;
+    uint32_t size;
+    uint32_t old_ptr;
+    uint32_t site;
+} alloc_trace_event;
+
+typedef enum {
+    RING_ACTIVE = 0,
+    RING_EXITED, // owner is gone, drain and recycle
+    RING_FREE
+} alloc_trace_ring_state;
+
+// Single producer (the owning thread), single consumer (the writer thread)
+typedef struct {
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    volatile uint32_t dropped;
+    volatile int state;
+    SceUID thid;
+    alloc_trace_event events[ALLOC_TRACE_RING_SIZE];
+} alloc_trace_ring;
+
+static alloc_trace_ring * volatile rings[ALLOC_TRACE_MAX_RINGS];
+static volatile int num_rings = 0;
+static volatile uint32_t dropped_no_ring = 0;
+
+static __thread alloc_trace_ring * ring_self = NULL;
+static __thread int ring_failed = 0;
+
+static pthread_key_t ring_key;
+static SceUID trace_fd = -1;
+static uint64_t trace_start = 0;
+
+static void alloc_trace_thread_exit(void * arg) {
+    alloc_trace_ring * r = arg;
+    __atomic_store_n(&r->state, RING_EXITED, __ATOMIC_RELEASE);
+}
+
+static alloc_trace_ring * alloc_trace_ring_get() {
+    if (__builtin_expect(ring_self != NULL, 1))
+        return ring_self;
+    if (ring_failed || trace_fd < 0)
+        return NULL;
+
+    alloc_trace_ring * r = NULL;
+
+    int n = __atomic_load_n(&num_rings, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n && !r; i++) {
+        int expected = RING_FREE;
+        if (rings[i] && __atomic_compare_exchange_n(&rings[i]->state, &expected, RING_ACTIVE,
+                                                    0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            r = rings[i];
+    }
+
+    if (!r) {
+        int i = __atomic_fetch_add(&num_rings, 1, __ATOMIC_ACQ_REL);
+        if (i >= ALLOC_TRACE_MAX_RINGS || !(r = calloc(1, sizeof(alloc_trace_ring)))) {
+            ring_failed = 1;
+            return NULL;
+        }
+        __atomic_store_n(&rings[i], r, __ATOMIC_RELEASE);
+    }
+
+    r->thid = sceKernelGetThreadId();
+    pthread_setspecific(ring_key, r);
+    ring_self = r;
+    return r;
+}
+
+static inline uint32_t alloc_trace_now() {
+    return (uint32_t) (sceKernelGetProcessTimeWide() - trace_start);
+}
+
+static void alloc_trace_record_at(uint32_t time, uint32_t type, void * ptr, size_t size, void * old_ptr, void * site) {
+    alloc_trace_ring * r = alloc_trace_ring_get();
+    if (!r) {
+        __atomic_fetch_add(&dropped_no_ring, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    uint32_t head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= ALLOC_TRACE_RING_SIZE) {
+        __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    alloc_trace_event * e = &r->events[head & (ALLOC_TRACE_RING_SIZE - 1)];
+    e->time = time;
+    e->type = type;
+    e->ptr = (uint32_t) ptr;
+    e->size = size;
+    e->old_ptr = (uint32_t) old_ptr;
+    e->site = (uint32_t) site;
+
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void alloc_trace_record(uint32_t type, void * ptr, size_t size, void * old_ptr, void * site) {
+    alloc_trace_record_at(alloc_trace_now(), type, ptr, size, old_ptr, site);
+}
+
+static void alloc_trace_write_chunk(SceUID thid, const alloc_trace_event * events, uint32_t count, uint32_t dropped) {
+    uint32_t header[3] = { thid, count, dropped };
+    sceIoWrite(trace_fd, header, sizeof(header));
+    if (count)
+        sceIoWrite(trace_fd, events, count * sizeof(alloc_trace_event));
+}
+
+static void alloc_trace_drain() {
+    int n = __atomic_load_n(&num_rings, __ATOMIC_ACQUIRE);
+    if (n > ALLOC_TRACE_MAX_RINGS)
+        n = ALLOC_TRACE_MAX_RINGS;
+
+    for (int i = 0; i < n; i++) {
+        alloc_trace_ring * r = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+        if (!r)
+            continue;
+
+        int state = __atomic_load_n(&r->state, __ATOMIC_ACQUIRE);
+        uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint32_t tail = r->tail;
+        uint32_t dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+
+        if (head != tail || dropped) {
+            // At most two contiguous pieces; the second one continues the chunk
+            uint32_t start = tail & (ALLOC_TRACE_RING_SIZE - 1);
+            uint32_t count = head - tail;
+            uint32_t first = count < ALLOC_TRACE_RING_SIZE - start ? count : ALLOC_TRACE_RING_SIZE - start;
+
+            alloc_trace_write_chunk(r->thid, &r->events[start], first, dropped);
+            if (count > first)
+                alloc_trace_write_chunk(r->thid, &r->events[0], count - first, 0);
+
+            __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+        }
+
+        if (state == RING_EXITED)
+            __atomic_store_n(&r->state, RING_FREE, __ATOMIC_RELEASE);
+    }
+
+    uint32_t dropped = __atomic_exchange_n(&dropped_no_ring, 0, __ATOMIC_RELAXED);
+    if (dropped)
+        alloc_trace_write_chunk(0, NULL, 0, dropped);
+}
+
+static int alloc_trace_writer(SceSize args, void * argp) {
+    while (1) {
+        sceKernelDelayThread(ALLOC_TRACE_INTERVAL);
+        alloc_trace_drain();
+    }
+    return 0;
+}
+
+void alloc_trace_init() {
+    trace_fd = sceIoOpen(ALLOC_TRACE_PATH, SCE_O_WRONLY | SCE_O_CREAT | SCE_O_TRUNC, 0777);
+    if (trace_fd < 0) {
+        l_error("alloc_trace_init: Could not open %s for writing: 0x%X", ALLOC_TRACE_PATH, trace_fd);
+        return;
+    }
+
+    uint32_t header[4] = { 0, ALLOC_TRACE_VERSION, so_mod.text_base, so_mod.text_size };
+    sceClibMemcpy(header, "ALTR", 4);
+    sceIoWrite(trace_fd, header, sizeof(header));
+
+    pthread_key_create(&ring_key, alloc_trace_thread_exit);
+    trace_start = sceKernelGetProcessTimeWide();
+
+    SceUID thid = sceKernelCreateThread("alloc_trace", alloc_trace_writer, 0x10000100 + 20, 0x4000, 0, 0, NULL);
+    if (thid >= 0)
+        sceKernelStartThread(thid, 0, NULL);
+
+    l_success("Allocation trace started: %s", ALLOC_TRACE_PATH);
+}
+
+void alloc_trace_frame() {
+    alloc_trace_record(ALLOC_TRACE_FRAME, NULL, 0, NULL, __builtin_return_address(0));
+}
+
+void * malloc_traced(size_t size) {
+    void * ret = heap_malloc(size);
+    alloc_trace_record(ALLOC_TRACE_ALLOC, ret, size, NULL, __builtin_return_address(0));
+    return ret;
+}
+
+void free_traced(void * ptr) {
+    if (ptr)
+        alloc_trace_record(ALLOC_TRACE_FREE, ptr, 0, NULL, __builtin_return_address(0));
+    heap_free(ptr);
+}
+
+void * calloc_traced(size_t num, size_t size) {
+    void * ret = heap_calloc(num, size);
+    alloc_trace_record(ALLOC_TRACE_ALLOC, ret, num * size, NULL, __builtin_return_address(0));
+    return ret;
+}
+
+void * realloc_traced(void * ptr, size_t size) {
+    // Once heap_realloc() has released `ptr`, another thread may get it back
+    // and record that, so the release is stamped before the call. The new
+    // block is stamped after it, as in malloc_traced(): its previous owner
+    // may have recorded freeing it while the call was running.
+    uint32_t time = alloc_trace_now();
+    void * ret = heap_realloc(ptr, size);
+
+    if (ret == ptr || !ret) {
+        // Resized in place, failed, or freed: no block changed hands
+        alloc_trace_record_at(time, ALLOC_TRACE_REALLOC, ret, size, ptr, __builtin_return_address(0));
+    } else {
+        if (ptr)
+            alloc_trace_record_at(time, ALLOC_TRACE_REALLOC, NULL, 0, ptr, __builtin_return_address(0));
+        alloc_trace_record(ALLOC_TRACE_REALLOC, ret, size, NULL, __builtin_return_address(0));
+    }
+    return ret;
+}
+
+void * memalign_traced(size_t alignment, size_t size) {
+    void * ret = heap_memalign(alignment, size);
+    alloc_trace_record(ALLOC_TRACE_ALLOC, ret, size, NULL, __builtin_return_address(0));
+    return ret;
+}
+
+void * operator_new_traced(size_t size) {
+    void * ret = heap_new(size);
+    alloc_trace_record(ALLOC_TRACE_ALLOC, ret, size, NULL, __builtin_return_address(0));
+    return ret;
+}
+
+void * operator_new_array_traced(size_t size) {
+    void * ret = heap_new_array(size);
+    alloc_trace_record(ALLOC_TRACE_ALLOC, ret, size, NULL, __builtin_return_address(0));
+    return ret;
+}
+
+void operator_delete_traced(void * ptr) {
+    if (ptr)
+        alloc_trace_record(ALLOC_TRACE_FREE, ptr, 0, NULL, __builtin_return_address(0));
+    heap_delete(ptr);
+}
+
+void operator_delete_array_traced(void * ptr) {
+    if (ptr)
+        alloc_trace_record(ALLOC_TRACE_FREE, ptr, 0, NULL, __builtin_return_address(0));
+    heap_delete_array(ptr);
+}
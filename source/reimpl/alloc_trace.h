@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  alloc_trace.h
+ * @brief Recording wrappers around the .so's heap imports for `ALLOC_TRACE`.
+ *
+ * Every malloc/free/calloc/realloc/memalign and operator new/delete call the
+ * game makes is recorded with its size, result, return address and time into
+ * a ring buffer owned by the calling thread. eglSwapBuffers adds a frame
+ * marker. A background thread drains the rings into
+ * `DATA_PATH "alloc_trace.bin"`; `extras/scripts/alloc_trace.py` turns that
+ * into per-call-site live bytes, peaks and per-frame allocation rates.
+ *
+ * File layout, little endian:
+ *
+ * ```
+ * header: char magic[4] = "ALTR", u32 version, u32 text_base, u32 text_size
+ * chunk:  u32 thread_id, u32 num_events, u32 num_dropped, then the events
+ * event:  u32 time_us, u32 type, u32 ptr, u32 size, u32 old_ptr, u32 site
+ * ```
+ *
+ * A realloc that moves the block is recorded as two REALLOC events: the
+ * release of `old_ptr` (with ptr and size 0) stamped before the call, then
+ * the new block (with old_ptr 0) stamped after it.
+ *
+ * Chunks of one thread are written in order. `time_us` is relative to
+ * alloc_trace_init() and wraps after ~71 minutes. The wrappers allocate with
+ * the same backend the import table would use without tracing.
+ */
+
+#ifndef SOLOADER_ALLOC_TRACE_H
+#define SOLOADER_ALLOC_TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+#define ALLOC_TRACE_VERSION 1
+
+typedef enum {
+    ALLOC_TRACE_ALLOC = 1,
+    ALLOC_TRACE_FREE,
+    ALLOC_TRACE_REALLOC,
+    ALLOC_TRACE_FRAME
+} alloc_trace_event_type;
+
+/**
+ * Open the trace file and start the writer thread. Must be called after the
+ * module is loaded and before any of its code runs.
+ */
+void alloc_trace_init();
+
+/**
+ * Record the end of a frame for the calling thread.
+ */
+void alloc_trace_frame();
+
+void * malloc_traced(size_t size);
+
+void free_traced(void * ptr);
+
+void * calloc_traced(size_t num, size_t size);
+
+void * realloc_traced(void * ptr, size_t size);
+
+void * memalign_traced(size_t alignment, size_t size);
+
+void * operator_new_traced(size_t size);
+
+void * operator_new_array_traced(size_t size);
+
+void operator_delete_traced(void * ptr);
+
+void operator_delete_array_traced(void * ptr);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // SOLOADER_ALLOC_TRACE_H
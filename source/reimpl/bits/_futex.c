@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  _futex.c
+ * @brief Linux-style futex wait/wake on top of SceKernelLwCond.
+ */
+
+#include "reimpl/bits/_futex.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <psp2/kernel/threadmgr.h>
+
+#include "reimpl/sys.h"
+
+#define FUTEX_BUCKETS 64 // power of two
+
+typedef struct {
+    SceKernelLwMutexWork lock;
+    SceKernelLwCondWork cond;
+    int waiters;
+} __attribute__((aligned(8))) futex_bucket;
+
+static futex_bucket buckets[FUTEX_BUCKETS];
+
+enum {
+    FUTEX_UNINITIALIZED = 0,
+    FUTEX_INITIALIZING,
+    FUTEX_READY
+};
+
+static volatile int futex_state = FUTEX_UNINITIALIZED;
+
+static void futex_init() {
+    int expected = FUTEX_UNINITIALIZED;
+    if (__atomic_compare_exchange_n(&futex_state, &expected, FUTEX_INITIALIZING,
+                                    0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        for (int i = 0; i < FUTEX_BUCKETS; i++) {
+            sceKernelCreateLwMutex(&buckets[i].lock, "futex_lock", 0, 0, NULL);
+            sceKernelCreateLwCond(&buckets[i].cond, "futex_cond", 0, &buckets[i].lock, NULL);
+            buckets[i].waiters = 0;
+        }
+        __atomic_store_n(&futex_state, FUTEX_READY, __ATOMIC_RELEASE);
+        return;
+    }
+
+    while (__atomic_load_n(&futex_state, __ATOMIC_ACQUIRE) != FUTEX_READY)
+        sceKernelDelayThread(100);
+}
+
+static futex_bucket * futex_bucket_for(volatile int * addr) {
+    if (__builtin_expect(__atomic_load_n(&futex_state, __ATOMIC_ACQUIRE) != FUTEX_READY, 0))
+        futex_init();
+
+    // Fibonacci hashing of the word index
+    uint32_t h = ((uint32_t)(uintptr_t) addr >> 2) * 0x9E3779B1u;
+    return &buckets[h >> (32 - __builtin_ctz(FUTEX_BUCKETS))];
+}
+
+// Returns 0 if the deadline is already in the past
+static int futex_timeout_us(const struct timespec * abstime, SceUInt32 * out) {
+    struct timespec now;
+    clock_gettime_soloader(0 /* BIONIC_CLOCK_REALTIME */, &now);
+
+    int64_t us = (int64_t)(abstime->tv_sec - now.tv_sec) * 1000000
+                 + (abstime->tv_nsec - now.tv_nsec) / 1000;
+    if (us <= 0)
+        return 0;
+
+    *out = us > UINT32_MAX ? UINT32_MAX : (SceUInt32) us;
+    return 1;
+}
+
+int futex_wait(volatile int * addr, int val, const struct timespec * abstime) {
+    futex_bucket * b = futex_bucket_for(addr);
+
+    SceUInt32 timeout = 0;
+    if (abstime && !futex_timeout_us(abstime, &timeout))
+        return ETIMEDOUT;
+
+    sceKernelLockLwMutex(&b->lock, 1, NULL);
+
+    if (__atomic_load_n(addr, __ATOMIC_RELAXED) != val) {
+        sceKernelUnlockLwMutex(&b->lock, 1);
+        return EAGAIN;
+    }
+
+    b->waiters++;
+    int ret = sceKernelWaitLwCond(&b->cond, abstime ? &timeout : NULL);
+    b->waiters--;
+
+    sceKernelUnlockLwMutex(&b->lock, 1);
+
+    return (ret < 0 && abstime) ? ETIMEDOUT : 0;
+}
+
+void futex_wake(volatile int * addr, int count) {
+    futex_bucket * b = futex_bucket_for(addr);
+
+    sceKernelLockLwMutex(&b->lock, 1, NULL);
+
+    // The bucket is shared with other words, so unless the only waiter must
+    // be ours, everybody is woken and the rest go back to sleep.
+    if (b->waiters == 1 && count == 1)
+        sceKernelSignalLwCond(&b->cond);
+    else if (b->waiters > 0)
+        sceKernelSignalLwCondAll(&b->cond);
+
+    sceKernelUnlockLwMutex(&b->lock, 1);
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  _futex.h
+ * @brief Linux-style futex wait/wake on top of SceKernelLwCond.
+ *
+ * Waiters are parked in one of a fixed number of hashed buckets, each being
+ * an LwMutex + LwCond pair, so any 32-bit word can be waited on without
+ * allocating anything for it. Like real futexes, wakeups may be spurious and
+ * callers are expected to re-check their condition in a loop.
+ */
+
+#ifndef SOLOADER_FUTEX_H
+#define SOLOADER_FUTEX_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <time.h>
+
+/**
+ * Block while `*addr == val`.
+ *
+ * @param[in] addr    Word to wait on.
+ * @param[in] val     Value `*addr` is expected to hold. Compared under the
+ *                    bucket lock, so a futex_wake() after changing `*addr`
+ *                    can not be missed.
+ * @param[in] abstime Absolute bionic `CLOCK_REALTIME` deadline, or NULL to
+ *                    wait forever.
+ *
+ * @return 0 when woken (possibly spuriously), `EAGAIN` if `*addr != val`,
+ *         `ETIMEDOUT` if the deadline passed.
+ */
+int futex_wait(volatile int * addr, int val, const struct timespec * abstime);
+
+/**
+ * Wake threads blocked in futex_wait() on `addr`.
+ *
+ * @param[in] addr  Word to wake waiters of.
+ * @param[in] count Number of waiters to wake; `1` or `INT_MAX`. Waiters of
+ *                  other words sharing the bucket may wake as well.
+ */
+void futex_wake(volatile int * addr, int count);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // SOLOADER_FUTEX_H
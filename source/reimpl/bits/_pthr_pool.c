@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  _pthr_pool.c
+ * @brief Parked worker threads backing `pthread_create` for `PTHR_THREAD_POOL`.
+ *
+ * A finished game thread is not torn down: its kernel thread and stack are
+ * parked and the next `pthread_create` with the same stack size hands its
+ * start routine to it instead of creating a new one. The pthread_t given to
+ * the game is the worker's own, so `pthread_self`/`pthread_equal` keep
+ * working; `pthread_join`, `pthread_detach` and `pthread_exit` are redirected
+ * to the job. Between jobs, values of the game's TLS keys are destructed and
+ * cleared, and the worker's priority and affinity are restored, so a job
+ * starts with the same state as a fresh thread.
+ *
+ * This file has to be `#include`d in `reimpl/pthr.c` and not compiled on its own.
+ */
+
+#include <setjmp.h>
+
+#define POOL_MAX_WORKERS 24
+#define POOL_MAX_IDLE    8   // per stack size, extra workers exit
+#define POOL_MAX_KEYS    128 // bionic PTHREAD_KEYS_MAX
+#define POOL_DESTRUCTOR_ITERATIONS 4
+
+typedef enum {
+    WORKER_UNUSED = 0,
+    WORKER_IDLE,
+    WORKER_RUNNING,
+    WORKER_FINISHED, // waiting for pthread_join
+    WORKER_RETIRED
+} pool_worker_state;
+
+typedef struct {
+    pthread_t thread;
+    size_t stack_size;
+    pool_worker_state state;
+    pthread_cond_t_bionic cond;
+
+    void *(*start)(void *);
+    void *param;
+    void *result;
+    int detached;
+
+    jmp_buf exit_jmp;
+    void *exit_value;
+} pool_worker;
+
+typedef struct {
+    pthread_key_t key;
+    void (*destructor)(void *);
+    int used;
+} pool_key;
+
+static pthread_mutex_t_bionic pool_lock = { BIONIC_PTHREAD_MUTEX_INITIALIZER };
+static pool_worker pool_workers[POOL_MAX_WORKERS];
+static pool_key pool_keys[POOL_MAX_KEYS];
+static __thread pool_worker * pool_self = NULL;
+
+static uint32_t pool_created = 0;
+static uint32_t pool_reused = 0;
+
+static void _pool_keys_cleanup() {
+    pool_key keys[POOL_MAX_KEYS];
+
+    for (int iter = 0; iter < POOL_DESTRUCTOR_ITERATIONS; iter++) {
+        // Other threads add and remove keys under pool_lock; take a snapshot
+        // so the destructors run without it, as they may create or delete
+        // keys themselves
+        int num_keys = 0;
+        _mutex_lock(&pool_lock, 0);
+        for (int i = 0; i < POOL_MAX_KEYS; i++) {
+            if (pool_keys[i].used)
+                keys[num_keys++] = pool_keys[i];
+        }
+        _mutex_unlock(&pool_lock);
+
+        int called = 0;
+        for (int i = 0; i < num_keys; i++) {
+            void * value = pthread_getspecific(keys[i].key);
+            if (!value)
+                continue;
+
+            pthread_setspecific(keys[i].key, NULL);
+            if (keys[i].destructor) {
+                keys[i].destructor(value);
+                called = 1;
+            }
+        }
+        if (!called)
+            break;
+    }
+}
+
+static void _pool_key_add(pthread_key_t key, void (*destructor)(void *)) {
+    _mutex_lock(&pool_lock, 0);
+    for (int i = 0; i < POOL_MAX_KEYS; i++) {
+        if (!pool_keys[i].used) {
+            pool_keys[i].key = key;
+            pool_keys[i].destructor = destructor;
+            pool_keys[i].used = 1;
+            break;
+        }
+    }
+    _mutex_unlock(&pool_lock);
+}
+
+static void _pool_key_remove(pthread_key_t key) {
+    _mutex_lock(&pool_lock, 0);
+    for (int i = 0; i < POOL_MAX_KEYS; i++) {
+        if (pool_keys[i].used && pool_keys[i].key == key)
+            pool_keys[i].used = 0;
+    }
+    _mutex_unlock(&pool_lock);
+}
+
+// pool_lock must be held
+static int _pool_num_idle(size_t stack_size) {
+    int n = 0;
+    for (int i = 0; i < POOL_MAX_WORKERS; i++) {
+        if (pool_workers[i].state == WORKER_IDLE && pool_workers[i].stack_size == stack_size)
+            n++;
+    }
+    return n;
+}
+
+// pool_lock must be held
+static void _pool_release(pool_worker * w) {
+    w->state = (_pool_num_idle(w->stack_size) < POOL_MAX_IDLE) ? WORKER_IDLE : WORKER_RETIRED;
+    _cond_pulse(&w->cond, INT_MAX);
+}
+
+static void * _pool_worker_main(void * arg) {
+    pool_worker * w = arg;
+    pool_self = w;
+
+    SceUID thid = sceKernelGetThreadId();
+    int priority = sceKernelGetThreadCurrentPriority();
+    int affinity = sceKernelGetThreadCpuAffinityMask(thid);
+
+    _mutex_lock(&pool_lock, 0);
+    for (;;) {
+        while (w->state != WORKER_RUNNING) {
+            if (w->state == WORKER_RETIRED) {
+                w->state = WORKER_UNUSED;
+                _mutex_unlock(&pool_lock);
+                return NULL;
+            }
+            _cond_wait(&w->cond, &pool_lock, NULL);
+        }
+        _mutex_unlock(&pool_lock);
+
+        void * result;
+        if (setjmp(w->exit_jmp) == 0)
+            result = w->start(w->param);
+        else
+            result = w->exit_value;
+
+        _pool_keys_cleanup();
+        sceKernelChangeThreadPriority(thid, priority);
+        if (affinity > 0)
+            sceKernelChangeThreadCpuAffinityMask(thid, affinity);
+
+        _mutex_lock(&pool_lock, 0);
+        w->result = result;
+        if (w->detached) {
+            _pool_release(w);
+        } else {
+            w->state = WORKER_FINISHED;
+            _cond_pulse(&w->cond, INT_MAX);
+        }
+    }
+}
+
+// Returns ESRCH if the job could not be handed to the pool
+static int _pool_create(pthread_t * thread, size_t stack_size, int detached, void *(*start)(void *), void * param) {
+    _mutex_lock(&pool_lock, 0);
+
+    pool_worker * w = NULL;
+    for (int i = 0; i < POOL_MAX_WORKERS && !w; i++) {
+        if (pool_workers[i].state == WORKER_IDLE && pool_workers[i].stack_size == stack_size)
+            w = &pool_workers[i];
+    }
+
+    if (w) {
+        pool_reused++;
+    } else {
+        for (int i = 0; i < POOL_MAX_WORKERS && !w; i++) {
+            if (pool_workers[i].state == WORKER_UNUSED)
+                w = &pool_workers[i];
+        }
+        if (!w) {
+            _mutex_unlock(&pool_lock);
+            return ESRCH;
+        }
+
+        pthread_attr_t a;
+        pthread_attr_init(&a);
+        pthread_attr_setstacksize(&a, stack_size);
+        pthread_attr_setdetachstate(&a, PTHREAD_CREATE_DETACHED);
+        int ret = pthread_create(&w->thread, &a, _pool_worker_main, w);
+        pthread_attr_destroy(&a);
+
+        if (ret != 0) {
+            _mutex_unlock(&pool_lock);
+            return ESRCH;
+        }
+
+        w->stack_size = stack_size;
+        w->cond.value = BIONIC_PTHREAD_COND_INITIALIZER;
+        pool_created++;
+    }
+
+    w->start = start;
+    w->param = param;
+    w->detached = detached;
+    w->state = WORKER_RUNNING;
+    _cond_pulse(&w->cond, INT_MAX);
+    *thread = w->thread;
+
+    l_debug("thread pool: %u threads created, %u reused", (unsigned int) pool_created, (unsigned int) pool_reused);
+
+    _mutex_unlock(&pool_lock);
+    return 0;
+}
+
+// pool_lock must be held
+static pool_worker * _pool_find_job(pthread_t thread) {
+    for (int i = 0; i < POOL_MAX_WORKERS; i++) {
+        pool_worker * w = &pool_workers[i];
+        if ((w->state == WORKER_RUNNING || w->state == WORKER_FINISHED) && !w->detached
+                && pthread_equal(w->thread, thread))
+            return w;
+    }
+    return NULL;
+}
+
+// Returns ESRCH if `thread` is not a pooled job
+static int _pool_join(pthread_t thread, void ** value_ptr) {
+    _mutex_lock(&pool_lock, 0);
+
+    pool_worker * w = _pool_find_job(thread);
+    if (!w) {
+        _mutex_unlock(&pool_lock);
+        return ESRCH;
+    }
+    if (w == pool_self) {
+        _mutex_unlock(&pool_lock);
+        return EDEADLK_BIONIC;
+    }
+
+    while (w->state == WORKER_RUNNING)
+        _cond_wait(&w->cond, &pool_lock, NULL);
+
+    if (value_ptr)
+        *value_ptr = w->result;
+    _pool_release(w);
+
+    _mutex_unlock(&pool_lock);
+    return 0;
+}
+
+// Returns ESRCH if `thread` is not a pooled job
+static int _pool_detach(pthread_t thread) {
+    _mutex_lock(&pool_lock, 0);
+
+    pool_worker * w = _pool_find_job(thread);
+    if (!w) {
+        _mutex_unlock(&pool_lock);
+        return ESRCH;
+    }
+
+    w->detached = 1;
+    if (w->state == WORKER_FINISHED)
+        _pool_release(w);
+
+    _mutex_unlock(&pool_lock);
+    return 0;
+}
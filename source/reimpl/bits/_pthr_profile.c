@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  _pthr_profile.c
+ * @brief Per-object lock contention statistics for `PTHR_CONTENTION_PROFILE`.
+ *
+ * Mutexes and condvars are tracked by address in a fixed-size, lock-free
+ * open addressing table; the first caller seen for an object is kept to name
+ * it in the report.
+ *
+ * This file has to be `#include`d in `reimpl/pthr.c` and not compiled on its own.
+ */
+
+#include <stdio.h>
+#include <psp2/kernel/processmgr.h>
+#include <so_util/so_util.h>
+
+#define PROF_MAX_OBJECTS 2048 // power of two
+#define PROF_COND_BUCKETS 6   // <10us, <100us, <1ms, <10ms, <100ms, more
+
+extern so_module so_mod;
+
+typedef enum {
+    PROF_MUTEX = 1,
+    PROF_COND
+} prof_kind;
+
+typedef struct {
+    volatile uintptr_t addr;
+    prof_kind kind;
+    uintptr_t caller;
+
+    uint32_t count;     // acquisitions / waits
+    uint32_t contended; // acquisitions that had to wait
+    uint64_t wait_total;
+    uint32_t wait_max;
+    uint64_t hold_total;
+    uint32_t hold_max;
+    uint64_t locked_at; // stamped by the owner, 0 once released
+
+    uint32_t cond_hist[PROF_COND_BUCKETS];
+} prof_object;
+
+static prof_object prof_objects[PROF_MAX_OBJECTS];
+static uint32_t prof_dropped = 0;
+
+PTHR_INLINE uint64_t _prof_now() {
+    return sceKernelGetProcessTimeWide();
+}
+
+static prof_object * _prof_get(const volatile void * addr, prof_kind kind, void * caller) {
+    uint32_t h = ((uint32_t)(uintptr_t) addr >> 2) * 0x9E3779B1u;
+    for (int i = 0; i < PROF_MAX_OBJECTS; i++) {
+        prof_object * o = &prof_objects[(h + i) & (PROF_MAX_OBJECTS - 1)];
+        uintptr_t cur = __atomic_load_n(&o->addr, __ATOMIC_ACQUIRE);
+
+        if (cur == 0) {
+            uintptr_t expected = 0;
+            if (__atomic_compare_exchange_n(&o->addr, &expected, (uintptr_t) addr, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                o->kind = kind;
+                o->caller = (uintptr_t) caller & ~1;
+                return o;
+            }
+            cur = expected;
+        }
+
+        if (cur == (uintptr_t) addr)
+            return o;
+    }
+
+    __atomic_fetch_add(&prof_dropped, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+PTHR_INLINE void _prof_max(uint32_t * max, uint32_t val) {
+    uint32_t cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (val > cur && !__atomic_compare_exchange_n(max, &cur, val, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void _prof_lock_done(prof_object * o, int contended, uint64_t start, uint64_t now) {
+    __atomic_fetch_add(&o->count, 1, __ATOMIC_RELAXED);
+    if (contended) {
+        uint32_t wait = (uint32_t)(now - start);
+        __atomic_fetch_add(&o->contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&o->wait_total, wait, __ATOMIC_RELAXED);
+        _prof_max(&o->wait_max, wait);
+    }
+}
+
+static void _prof_hold_done(prof_object * o, uint64_t locked_at, uint64_t now) {
+    uint32_t hold = (uint32_t)(now - locked_at);
+    __atomic_fetch_add(&o->hold_total, hold, __ATOMIC_RELAXED);
+    _prof_max(&o->hold_max, hold);
+}
+
+static void _prof_unlock(prof_object * o, uint64_t now) {
+    if (!o->locked_at)
+        return;
+
+    _prof_hold_done(o, o->locked_at, now);
+    o->locked_at = 0;
+}
+
+static void _prof_cond_wait_done(prof_object * o, uint64_t start, uint64_t now) {
+    uint32_t wait = (uint32_t)(now - start);
+    int bucket = 0;
+    for (uint32_t limit = 10; bucket < PROF_COND_BUCKETS - 1 && wait >= limit; limit *= 10)
+        bucket++;
+
+    __atomic_fetch_add(&o->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&o->wait_total, wait, __ATOMIC_RELAXED);
+    _prof_max(&o->wait_max, wait);
+    __atomic_fetch_add(&o->cond_hist[bucket], 1, __ATOMIC_RELAXED);
+}
+
+static void _prof_caller_name(uintptr_t caller, char * out, size_t size) {
+    uintptr_t off = 0;
+    const char * sym = NULL;
+
+    if (caller >= so_mod.text_base && caller < so_mod.text_base + so_mod.text_size)
+        sym = so_symbol_name(&so_mod, caller, &off);
+
+    if (sym)
+        snprintf(out, size, "%s+0x%X", sym, (unsigned int) off);
+    else
+        snprintf(out, size, "0x%08X", (unsigned int) caller);
+}
+
+static int _prof_cmp(const void * a, const void * b) {
+    uint64_t x = (*(const prof_object **) a)->wait_total;
+    uint64_t y = (*(const prof_object **) b)->wait_total;
+    return (x < y) - (x > y);
+}
+
+void pthr_profile_dump(int top_n) {
+    static prof_object * sorted[PROF_MAX_OBJECTS];
+    int num = 0;
+
+    for (int i = 0; i < PROF_MAX_OBJECTS; i++) {
+        if (__atomic_load_n(&prof_objects[i].addr, __ATOMIC_ACQUIRE) && prof_objects[i].count)
+            sorted[num++] = &prof_objects[i];
+    }
+    qsort(sorted, num, sizeof(prof_object *), _prof_cmp);
+
+    sceClibPrintf("Lock profile: %d objects (%u untracked), sorted by total wait\n", num, (unsigned int) prof_dropped);
+    for (int i = 0; i < num && i < top_n; i++) {
+        prof_object * o = sorted[i];
+        char name[128];
+        _prof_caller_name(o->caller, name, sizeof(name));
+
+        if (o->kind == PROF_MUTEX) {
+            sceClibPrintf("mutex 0x%08X %s: %u locks, %u contended, wait %llu us (max %u), hold %llu us (max %u)\n",
+                          (unsigned int) o->addr, name, (unsigned int) o->count, (unsigned int) o->contended,
+                          (unsigned long long) o->wait_total, (unsigned int) o->wait_max,
+                          (unsigned long long) o->hold_total, (unsigned int) o->hold_max);
+        } else {
+            sceClibPrintf("cond  0x%08X %s: %u waits, %llu us (max %u), <10us %u <100us %u <1ms %u <10ms %u <100ms %u more %u\n",
+                          (unsigned int) o->addr, name, (unsigned int) o->count,
+                          (unsigned long long) o->wait_total, (unsigned int) o->wait_max,
+                          (unsigned int) o->cond_hist[0], (unsigned int) o->cond_hist[1], (unsigned int) o->cond_hist[2],
+                          (unsigned int) o->cond_hist[3], (unsigned int) o->cond_hist[4], (unsigned int) o->cond_hist[5]);
+        }
+    }
+}
+
+void pthr_profile_reset() {
+    for (int i = 0; i < PROF_MAX_OBJECTS; i++) {
+        prof_object * o = &prof_objects[i];
+        __atomic_store_n(&o->count, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&o->contended, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&o->wait_total, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&o->wait_max, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&o->hold_total, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&o->hold_max, 0, __ATOMIC_RELAXED);
+        for (int b = 0; b < PROF_COND_BUCKETS; b++)
+            __atomic_store_n(&o->cond_hist[b], 0, __ATOMIC_RELAXED);
+    }
+}
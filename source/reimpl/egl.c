@@ -7,6 +7,7 @@
 
 #include "reimpl/egl.h"
 
+#include "reimpl/alloc_trace.h"
 #include "utils/glutil.h"
 #include "utils/logger.h"
 
@@ -345,3 +346,10 @@ EGLBoolean eglGetConfigs(EGLDisplay display, EGLConfig * configs,
 
     return EGL_TRUE;
 }
+
+#ifdef ALLOC_TRACE
+EGLBoolean eglSwapBuffers_soloader(EGLDisplay dpy, EGLSurface surface) {
+    alloc_trace_frame();
+    return eglSwapBuffers(dpy, surface);
+}
+#endif
@@ -59,6 +59,10 @@ EGLBoolean eglGetConfigs(EGLDisplay display, EGLConfig * configs,
 
 char const * eglQueryString(EGLDisplay display, EGLint name);
 
+#ifdef ALLOC_TRACE
+EGLBoolean eglSwapBuffers_soloader(EGLDisplay dpy, EGLSurface surface);
+#endif
+
 #define EGL_CONFIG_ID                     0x3028
 #define EGL_HEIGHT                        0x3056
 #define EGL_WIDTH                         0x3057
@@ -24,6 +24,8 @@
 #include "utils/logger.h"
 #include "utils/utils.h"
 
+#include "falso_ndk/PseudoEpoll.h"
+
 // Includes the following inline utilities:
 // int oflags_musl_to_newlib(int flags);
 // dirent64_bionic * dirent_newlib_to_bionic(struct dirent* dirent_newlib);
@@ -110,7 +112,8 @@ int fclose_soloader(FILE * f) {
 }
 
 int close_soloader(int fd) {
-    int ret = close(fd);
+    // Also handles eventfd/pipe/epoll fds handed out by FalsoNDK
+    int ret = pseudo_close(fd);
     l_debug("close(%i): %i", fd, ret);
     return ret;
 }
@@ -10,17 +10,22 @@
 
 #include "reimpl/pthr.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <psp2/kernel/clib.h>
 #include <psp2/kernel/threadmgr.h>
 #include <stdatomic.h>
+#include <stdbool.h>
 
+#include "reimpl/bits/_errno_bionic.h"
+#include "reimpl/bits/_futex.h"
+#include "utils/thread_policy.h"
 #include "utils/utils.h"
 #include "utils/logger.h"
 
-#define PTHR_MAX_OBJECTS 1024
-
 #define BIONIC_PTHREAD_COND_INITIALIZER              0
 #define BIONIC_PTHREAD_MUTEX_INITIALIZER             0
 #define BIONIC_PTHREAD_RECURSIVE_MUTEX_INITIALIZER   0x4000
@@ -39,149 +44,294 @@ enum {
 
 #define PTHR_INLINE static inline __attribute__((always_inline))
 
-void * initializedObjects[PTHR_MAX_OBJECTS] = {0};
-static SceKernelLwMutexWork pthr_mutex;
-static volatile short int pthr_mutex_inited = 0;
-
-#define PTHR_LOCK \
-    if (!pthr_mutex_inited) { \
-        int ret = sceKernelCreateLwMutex(&pthr_mutex, "log_lock", 0, 0, NULL); \
-        if (ret < 0) { \
-            sceClibPrintf("Error: failed to create pthr mutex: 0x%x\n", ret); \
-            return 0; \
-        } \
-        pthr_mutex_inited = 1; \
-    } \
-    sceKernelLockLwMutex(&pthr_mutex, 1, NULL);
-
-#define PTHR_UNLOCK \
-    if (pthr_mutex_inited) { \
-        sceKernelUnlockLwMutex(&pthr_mutex, 1); \
-    }
-
-int isObjectInitialized(const void * mut) {
-    PTHR_LOCK
-    for (int i = 0; i < PTHR_MAX_OBJECTS; ++i) {
-        if (initializedObjects[i] == mut) {
-            PTHR_UNLOCK
-            return 1;
-        }
+// null check for `attr` must be performed before this
+PTHR_INLINE int _attr_t_static_init(pthread_attr_t_bionic * attr) {
+    if (attr->magic != 0x42424242) {
+        attr->magic = 0x42424242;
+        attr->real_ptr = malloc(sizeof(pthread_attr_t));
+        return pthread_attr_init(attr->real_ptr);
     }
-    PTHR_UNLOCK
     return 0;
 }
 
-int rememberObject(void * mut) {
-    PTHR_LOCK
-    for (int i = 0; i < PTHR_MAX_OBJECTS; ++i) {
-        if (initializedObjects[i] == 0) {
-            initializedObjects[i] = mut;
-            PTHR_UNLOCK
-            return 1;
-        }
-    }
-    PTHR_UNLOCK
-    return 0;
+/*
+ * Mutexes live directly in the 4-byte bionic `pthread_mutex_t`, with the
+ * same layout bionic uses on 32-bit, so its static initializers just work:
+ *
+ *   bits 16-31  owner thread (recursive and errorcheck mutexes only)
+ *   bits 14-15  type: 0 normal, 1 recursive, 2 errorcheck
+ *   bit  13     process-shared (ignored)
+ *   bits 2-12   recursion counter
+ *   bits 0-1    state: 0 unlocked, 1 locked, 2 locked with waiters
+ *
+ * Uncontended lock/unlock is a single CAS; only a contended lock sleeps, via
+ * futex_wait() on the mutex word.
+ */
+#define MUTEX_STATE_MASK          0x0003
+#define MUTEX_UNLOCKED            0x0000
+#define MUTEX_LOCKED_UNCONTENDED  0x0001
+#define MUTEX_LOCKED_CONTENDED    0x0002
+#define MUTEX_COUNTER_SHIFT       2
+#define MUTEX_COUNTER_MASK        0x1ffc
+#define MUTEX_COUNTER_ONE         (1 << MUTEX_COUNTER_SHIFT)
+#define MUTEX_SHARED_MASK         0x2000
+#define MUTEX_TYPE_SHIFT          14
+#define MUTEX_TYPE_MASK           0xc000
+#define MUTEX_OWNER_SHIFT         16
+
+#define MUTEX_TYPE(v)             (((v) & MUTEX_TYPE_MASK) >> MUTEX_TYPE_SHIFT)
+#define MUTEX_OWNER(v)            ((uint32_t)(v) >> MUTEX_OWNER_SHIFT)
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+
+// Thread IDs are 32-bit UIDs, so threads get a 16-bit owner id on first use
+static __thread uint32_t pthr_self_id = 0;
+static uint32_t pthr_next_id = 0;
+
+PTHR_INLINE uint32_t _self_id() {
+    if (!likely(pthr_self_id))
+        pthr_self_id = __atomic_add_fetch(&pthr_next_id, 1, __ATOMIC_RELAXED) % 0xffff + 1;
+    return pthr_self_id;
 }
 
-int forgetObject(const void * mut) {
-    PTHR_LOCK
-    for (int i = 0; i < PTHR_MAX_OBJECTS; ++i) {
-        if (initializedObjects[i] == mut) {
-            initializedObjects[i] = 0;
-            PTHR_UNLOCK
-            return 1;
+PTHR_INLINE int _cas(volatile int * ptr, int * expected, int desired) {
+    return __atomic_compare_exchange_n(ptr, expected, desired, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+PTHR_INLINE int _normal_trylock(volatile int * value, int type_bits) {
+    int unlocked = type_bits | MUTEX_UNLOCKED;
+    return _cas(value, &unlocked, type_bits | MUTEX_LOCKED_UNCONTENDED) ? 0 : EBUSY;
+}
+
+PTHR_INLINE void _normal_lock(volatile int * value, int type_bits) {
+    if (likely(_normal_trylock(value, type_bits) == 0))
+        return;
+
+    // Mark the mutex contended; whoever unlocks it then has to wake us up
+    while (__atomic_exchange_n(value, type_bits | MUTEX_LOCKED_CONTENDED, __ATOMIC_ACQUIRE) != (type_bits | MUTEX_UNLOCKED))
+        futex_wait(value, type_bits | MUTEX_LOCKED_CONTENDED, NULL);
+}
+
+PTHR_INLINE void _normal_unlock(volatile int * value, int type_bits) {
+    if (__atomic_exchange_n(value, type_bits | MUTEX_UNLOCKED, __ATOMIC_RELEASE) == (type_bits | MUTEX_LOCKED_CONTENDED))
+        futex_wake(value, 1);
+}
+
+static int _recursive_lock(volatile int * value, int mvalue, int try) {
+    int type_bits = mvalue & (MUTEX_TYPE_MASK | MUTEX_SHARED_MASK);
+    uint32_t self = _self_id();
+
+    if (MUTEX_OWNER(mvalue) == self) {
+        if (MUTEX_TYPE(mvalue) == BIONIC_PTHREAD_MUTEX_ERRORCHECK)
+            return EDEADLK_BIONIC;
+
+        // Only the owner changes the counter, but waiters may flip the state
+        do {
+            if ((mvalue & MUTEX_COUNTER_MASK) == MUTEX_COUNTER_MASK)
+                return EAGAIN;
+        } while (!_cas(value, &mvalue, mvalue + MUTEX_COUNTER_ONE));
+        return 0;
+    }
+
+    int owned = (self << MUTEX_OWNER_SHIFT) | type_bits;
+    int unlocked = type_bits | MUTEX_UNLOCKED;
+    if (mvalue == unlocked && _cas(value, &mvalue, owned | MUTEX_LOCKED_UNCONTENDED))
+        return 0;
+    if (try)
+        return EBUSY;
+
+    for (;;) {
+        if (mvalue == unlocked) {
+            // Others may still be sleeping, so keep the mutex marked contended
+            if (_cas(value, &mvalue, owned | MUTEX_LOCKED_CONTENDED))
+                return 0;
+            continue;
+        }
+
+        if ((mvalue & MUTEX_STATE_MASK) == MUTEX_LOCKED_UNCONTENDED) {
+            int contended = (mvalue & ~MUTEX_STATE_MASK) | MUTEX_LOCKED_CONTENDED;
+            if (!_cas(value, &mvalue, contended))
+                continue;
+            mvalue = contended;
         }
+
+        futex_wait(value, mvalue, NULL);
+        mvalue = __atomic_load_n(value, __ATOMIC_RELAXED);
     }
-    PTHR_UNLOCK
-    return 0;
 }
 
-// null check for `attr` must be performed before this
-PTHR_INLINE int _attr_t_static_init(pthread_attr_t_bionic * attr) {
-    if (attr->magic != 0x42424242) {
-        attr->magic = 0x42424242;
-        attr->real_ptr = malloc(sizeof(pthread_attr_t));
-        return pthread_attr_init(attr->real_ptr);
+static int _recursive_unlock(volatile int * value, int mvalue) {
+    if (MUTEX_OWNER(mvalue) != _self_id())
+        return EPERM;
+
+    if (mvalue & MUTEX_COUNTER_MASK) {
+        __atomic_fetch_sub(value, MUTEX_COUNTER_ONE, __ATOMIC_RELEASE);
+        return 0;
     }
+
+    int type_bits = mvalue & (MUTEX_TYPE_MASK | MUTEX_SHARED_MASK);
+    mvalue = __atomic_exchange_n(value, type_bits | MUTEX_UNLOCKED, __ATOMIC_RELEASE);
+    if ((mvalue & MUTEX_STATE_MASK) == MUTEX_LOCKED_CONTENDED)
+        futex_wake(value, 1);
     return 0;
 }
 
-// null check for `mutex` param must be performed before this, `attr` is fine as null
-PTHR_INLINE int _mutex_t_static_init(pthread_mutex_t_bionic * mutex, const pthread_mutexattr_t * attr) {
-    int ret = 0, kind = PTHREAD_MUTEX_NORMAL;
+// null check for `mutex` param must be performed before this
+PTHR_INLINE int _mutex_lock(pthread_mutex_t_bionic * mutex, int try) {
+    int mvalue = __atomic_load_n(&mutex->value, __ATOMIC_RELAXED);
+    int type_bits = mvalue & (MUTEX_TYPE_MASK | MUTEX_SHARED_MASK);
 
-    if (isObjectInitialized(mutex)) {
-        //logv_debug("mutex already initialized: %p", mutex);
-        return ret;
+    if (likely(MUTEX_TYPE(mvalue) == BIONIC_PTHREAD_MUTEX_NORMAL)) {
+        if (try)
+            return _normal_trylock(&mutex->value, type_bits);
+        _normal_lock(&mutex->value, type_bits);
+        return 0;
     }
 
-    if (attr) {
-        pthread_mutexattr_gettype((pthread_mutexattr_t *) attr, &kind);
-    } else {
-        if (* (int *) mutex == BIONIC_PTHREAD_MUTEX_INITIALIZER) kind = PTHREAD_MUTEX_NORMAL;
-        else if (* (int *) mutex == BIONIC_PTHREAD_RECURSIVE_MUTEX_INITIALIZER) kind = PTHREAD_MUTEX_RECURSIVE;
-        else if (* (int *) mutex == BIONIC_PTHREAD_ERRORCHECK_MUTEX_INITIALIZER) kind = PTHREAD_MUTEX_ERRORCHECK;
+    return _recursive_lock(&mutex->value, mvalue, try);
+}
+
+// null check for `mutex` param must be performed before this
+PTHR_INLINE int _mutex_unlock(pthread_mutex_t_bionic * mutex) {
+    int mvalue = __atomic_load_n(&mutex->value, __ATOMIC_RELAXED);
+
+    if (likely(MUTEX_TYPE(mvalue) == BIONIC_PTHREAD_MUTEX_NORMAL)) {
+        _normal_unlock(&mutex->value, mvalue & (MUTEX_TYPE_MASK | MUTEX_SHARED_MASK));
+        return 0;
     }
 
-    pthread_mutex_t mut;
-    mutex->real_ptr = malloc(sizeof(pthread_mutex_t));
-    sceClibMemcpy(mutex->real_ptr, &mut, sizeof(pthread_mutex_t));
+    return _recursive_unlock(&mutex->value, mvalue);
+}
 
-    pthread_mutexattr_t mutattr;
-    pthread_mutexattr_init(&mutattr);
-    pthread_mutexattr_settype(&mutattr, kind);
-    ret = pthread_mutex_init(mutex->real_ptr, &mutattr);
-    pthread_mutexattr_destroy(&mutattr);
+PTHR_INLINE int _cond_pulse(pthread_cond_t_bionic *cond, int count)
+{
+    __atomic_fetch_add(&cond->value, 1, __ATOMIC_RELEASE);
+    futex_wake(&cond->value, count);
+    return 0;
+}
 
-    if (ret == 0) {
-        rememberObject(mutex);
-    } else {
-        l_error("mutex initialization for %p has failed", mutex);
-    }
+PTHR_INLINE int _cond_wait(pthread_cond_t_bionic *cond, pthread_mutex_t_bionic *mutex, const struct timespec *abstime)
+{
+    int seq = __atomic_load_n(&cond->value, __ATOMIC_ACQUIRE);
 
-    return ret;
+    int ret = _mutex_unlock(mutex);
+    if (ret != 0) return ret;
+
+    ret = futex_wait(&cond->value, seq, abstime);
+    _mutex_lock(mutex, 0);
+
+    return ret == ETIMEDOUT ? ETIMEDOUT_BIONIC : 0;
 }
 
-// null check for `cond` param must be performed before this, `attr` is fine as null
-PTHR_INLINE int _cond_t_static_init(pthread_cond_t_bionic * cond, const pthread_condattr_t * attr) {
-    int ret = 0;
+#ifdef PTHR_THREAD_POOL
+#include "reimpl/bits/_pthr_pool.c"
+#endif
 
-    if (isObjectInitialized(cond)) {
-        //logv_debug("cond already initialized: %p", cond);
-        return ret;
-    }
+#ifdef PTHR_CONTENTION_PROFILE
+#include "reimpl/bits/_pthr_profile.c"
 
-    pthread_cond_t c;
-    cond->real_ptr = malloc(sizeof(pthread_cond_t));
-    sceClibMemcpy(cond->real_ptr, &c, sizeof(pthread_cond_t));
+static int _mutex_lock_profiled(pthread_mutex_t_bionic * mutex, int try, void * caller) {
+    prof_object * o = _prof_get(&mutex->value, PROF_MUTEX, caller);
+    uint64_t start = _prof_now();
 
-    ret = pthread_cond_init(cond->real_ptr, attr);
+    int ret = _mutex_lock(mutex, 1);
+    int contended = (ret == EBUSY && !try);
+    if (contended)
+        ret = _mutex_lock(mutex, 0);
 
-    if (ret == 0) {
-        rememberObject(cond);
-    } else {
-        l_error("cond initialization for %p has failed", cond);
+    if (ret == 0 && o) {
+        uint64_t now = contended ? _prof_now() : start;
+        _prof_lock_done(o, contended, start, now);
+        // Recursive re-locks are part of the outermost hold
+        if (!(mutex->value & MUTEX_COUNTER_MASK))
+            o->locked_at = now;
     }
+    return ret;
+}
 
+static int _mutex_unlock_profiled(pthread_mutex_t_bionic * mutex, void * caller) {
+    prof_object * o = NULL;
+    uint64_t locked_at = 0, now = 0;
+    if (!(mutex->value & MUTEX_COUNTER_MASK)) {
+        o = _prof_get(&mutex->value, PROF_MUTEX, caller);
+        if (o) {
+            locked_at = o->locked_at;
+            now = _prof_now();
+        }
+    }
+
+    // A failed unlock (EPERM) ends nobody's hold. After a successful one the
+    // next owner may have stamped locked_at already, so only clear our own.
+    int ret = _mutex_unlock(mutex);
+    if (ret == 0 && locked_at) {
+        uint64_t expected = locked_at;
+        __atomic_compare_exchange_n(&o->locked_at, &expected, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        _prof_hold_done(o, locked_at, now);
+    }
     return ret;
 }
+#endif
+
+typedef struct {
+    void *(*start)(void *);
+    void *param;
+    const thread_policy *policy;
+} _thread_start_ctx;
+
+// Applies the thread policy from inside the new thread, where no SceUID
+// lookup for the pthread_t is needed
+static void * _thread_start(void * arg) {
+    _thread_start_ctx ctx = *(_thread_start_ctx *) arg;
+    free(arg);
+
+    thread_policy_apply_self(ctx.policy);
+    return ctx.start(ctx.param);
+}
 
 int pthread_create_soloader(pthread_t *thread, const pthread_attr_t_bionic *attr, void *(*start)(void *), void *param) {
     int ret;
 
+    const thread_policy * policy = thread_policy_for_start((uintptr_t) start);
+    size_t stack_size = (policy && policy->stack_size) ? policy->stack_size : 512 * 1024;
+
+    void *(*entry)(void *) = start;
+    void * entry_param = param;
+    if (policy && (policy->affinity || policy->priority)) {
+        _thread_start_ctx * ctx = malloc(sizeof(_thread_start_ctx));
+        if (ctx) {
+            ctx->start = start;
+            ctx->param = param;
+            ctx->policy = policy;
+            entry = _thread_start;
+            entry_param = ctx;
+        }
+    }
+
+#ifdef PTHR_THREAD_POOL
+    int detached = PTHREAD_CREATE_JOINABLE;
+    if (attr && attr->magic == 0x42424242)
+        pthread_attr_getdetachstate(attr->real_ptr, &detached);
+
+    ret = _pool_create(thread, stack_size, detached == PTHREAD_CREATE_DETACHED, entry, entry_param);
+    if (ret != ESRCH)
+        return ret;
+#endif
+
     if (!attr) {
         pthread_attr_t a;
         pthread_attr_init(&a);
-        pthread_attr_setstacksize(&a, 512 * 1024);
-        ret = pthread_create(thread, &a, start, param);
+        pthread_attr_setstacksize(&a, stack_size);
+        ret = pthread_create(thread, &a, entry, entry_param);
         pthread_attr_destroy(&a);
     } else{
         _attr_t_static_init((pthread_attr_t_bionic *) attr);
-        pthread_attr_setstacksize(attr->real_ptr, 512 * 1024);
-        ret = pthread_create(thread, attr->real_ptr, start, param);
+        pthread_attr_setstacksize(attr->real_ptr, stack_size);
+        ret = pthread_create(thread, attr->real_ptr, entry, entry_param);
     }
 
+    if (ret != 0 && entry == _thread_start)
+        free(entry_param);
+
     return ret;
 }
 
@@ -208,45 +358,96 @@ int pthread_kill_soloader(pthread_t thread, int sig)
 int pthread_mutex_init_soloader(pthread_mutex_t_bionic *uid, const pthread_mutexattr_t *attr)
 {
     if (!uid) return EINVAL;
-    return _mutex_t_static_init(uid, attr);
+
+    int kind = BIONIC_PTHREAD_MUTEX_NORMAL;
+    if (attr)
+        pthread_mutexattr_gettype((pthread_mutexattr_t *) attr, &kind);
+    if (kind < BIONIC_PTHREAD_MUTEX_NORMAL || kind > BIONIC_PTHREAD_MUTEX_ERRORCHECK)
+        return EINVAL;
+
+    __atomic_store_n(&uid->value, kind << MUTEX_TYPE_SHIFT, __ATOMIC_RELEASE);
+    return 0;
 }
 
 int pthread_mutex_destroy_soloader(pthread_mutex_t_bionic *mutex)
 {
     if (!mutex) return 0;
-    forgetObject(mutex);
-    int ret = pthread_mutex_destroy(mutex->real_ptr);
-    if (mutex->real_ptr) free(mutex->real_ptr);
-    mutex->real_ptr = 0x0;
-    return ret;
+
+    // Nothing is allocated per mutex. The word is left as is, so games that
+    // keep using a destroyed mutex (the old shim tolerated it) still work.
+    if ((__atomic_load_n(&mutex->value, __ATOMIC_RELAXED) & MUTEX_STATE_MASK) != MUTEX_UNLOCKED)
+        return EBUSY;
+    return 0;
 }
 
 int pthread_mutex_lock_soloader(pthread_mutex_t_bionic *mutex)
 {
     if (!mutex) return EINVAL;
-    _mutex_t_static_init(mutex, NULL);
-    return pthread_mutex_lock(mutex->real_ptr);
+#ifdef PTHR_CONTENTION_PROFILE
+    return _mutex_lock_profiled(mutex, 0, __builtin_return_address(0));
+#else
+    return _mutex_lock(mutex, 0);
+#endif
 }
 
 int pthread_mutex_trylock_soloader(pthread_mutex_t_bionic *mutex)
 {
     if (!mutex) return EINVAL;
-    _mutex_t_static_init(mutex, NULL);
-    return pthread_mutex_trylock(mutex->real_ptr);
+#ifdef PTHR_CONTENTION_PROFILE
+    return _mutex_lock_profiled(mutex, 1, __builtin_return_address(0));
+#else
+    return _mutex_lock(mutex, 1);
+#endif
 }
 
 int pthread_mutex_unlock_soloader(pthread_mutex_t_bionic *mutex)
 {
     if (!mutex) return EINVAL;
-    if (!mutex->real_ptr) return EINVAL;
-    return pthread_mutex_unlock(mutex->real_ptr);
+#ifdef PTHR_CONTENTION_PROFILE
+    return _mutex_unlock_profiled(mutex, __builtin_return_address(0));
+#else
+    return _mutex_unlock(mutex);
+#endif
 }
 
 int pthread_join_soloader(pthread_t thread, void **value_ptr)
 {
+#ifdef PTHR_THREAD_POOL
+    int ret = _pool_join(thread, value_ptr);
+    if (ret != ESRCH) return ret;
+#endif
     return pthread_join(thread, value_ptr);
 }
 
+void pthread_exit_soloader(void *value_ptr)
+{
+#ifdef PTHR_THREAD_POOL
+    // Return a pooled job to its worker instead of ending the worker
+    if (pool_self) {
+        pool_self->exit_value = value_ptr;
+        longjmp(pool_self->exit_jmp, 1);
+    }
+#endif
+    pthread_exit(value_ptr);
+}
+
+int pthread_key_create_soloader(pthread_key_t *key, void (*destructor)(void *))
+{
+    int ret = pthread_key_create(key, destructor);
+#ifdef PTHR_THREAD_POOL
+    if (ret == 0) _pool_key_add(*key, destructor);
+#endif
+    return ret;
+}
+
+int pthread_key_delete_soloader(pthread_key_t key)
+{
+#ifdef PTHR_THREAD_POOL
+    _pool_key_remove(key);
+#endif
+    return pthread_key_delete(key);
+}
+
 int pthread_condattr_init_soloader(pthread_condattr_t *attr)
 {
     if (!attr) return EINVAL;
@@ -259,61 +460,335 @@ int pthread_condattr_destroy_soloader(pthread_condattr_t *attr)
     return pthread_condattr_destroy(attr);
 }
 
+/*
+ * Condvars are a sequence number in the bionic word: signalling bumps it and
+ * wakes futex waiters, a waiter sleeps until it changes from what it saw
+ * before releasing the mutex.
+ */
 int pthread_cond_init_soloader(pthread_cond_t_bionic *cond,
                                const pthread_condattr_t *attr)
 {
     if (!cond) return EINVAL;
 
-    return _cond_t_static_init(cond, attr);
+    __atomic_store_n(&cond->value, BIONIC_PTHREAD_COND_INITIALIZER, __ATOMIC_RELEASE);
+    return 0;
 }
 
 int pthread_cond_destroy_soloader(pthread_cond_t_bionic *cond)
 {
     if (!cond) return 0;
-    forgetObject(cond);
-    int ret = pthread_cond_destroy(cond->real_ptr);
-    if (cond->real_ptr) free(cond->real_ptr);
-    cond->real_ptr = 0x0;
+    return 0;
+}
+
+#ifdef PTHR_CONTENTION_PROFILE
+static int _cond_wait_profiled(pthread_cond_t_bionic *cond, pthread_mutex_t_bionic *mutex, const struct timespec *abstime, void *caller)
+{
+    prof_object * c = _prof_get(&cond->value, PROF_COND, caller);
+    prof_object * m = _prof_get(&mutex->value, PROF_MUTEX, caller);
+    uint64_t start = _prof_now();
+
+    // The mutex is not held while waiting; re-acquiring it counts as the wait
+    if (m)
+        _prof_unlock(m, start);
+
+    int ret = _cond_wait(cond, mutex, abstime);
+
+    uint64_t now = _prof_now();
+    if (c)
+        _prof_cond_wait_done(c, start, now);
+    if (m)
+        m->locked_at = now;
     return ret;
 }
+#endif
 
 int pthread_cond_signal_soloader(pthread_cond_t_bionic *cond)
 {
     if (!cond) return EINVAL;
-
-    _cond_t_static_init(cond, NULL);
-
-    return pthread_cond_signal(cond->real_ptr);
+    return _cond_pulse(cond, 1);
 }
 
 int pthread_cond_timedwait_soloader(pthread_cond_t_bionic *cond, pthread_mutex_t_bionic *mutex, struct timespec *abstime)
 {
     if (!cond || !mutex) return EINVAL;
-
-    _cond_t_static_init(cond, NULL);
-    _mutex_t_static_init(mutex, NULL);
-
-    return pthread_cond_timedwait(cond->real_ptr, mutex->real_ptr, abstime);
+#ifdef PTHR_CONTENTION_PROFILE
+    return _cond_wait_profiled(cond, mutex, abstime, __builtin_return_address(0));
+#else
+    return _cond_wait(cond, mutex, abstime);
+#endif
 }
 
 
 int pthread_cond_wait_soloader(pthread_cond_t_bionic *cond, pthread_mutex_t_bionic *mutex)
 {
     if (!cond || !mutex) return EINVAL;
-
-    _cond_t_static_init(cond, NULL);
-    _mutex_t_static_init(mutex, NULL);
-
-    return pthread_cond_wait(cond->real_ptr, mutex->real_ptr);
+#ifdef PTHR_CONTENTION_PROFILE
+    return _cond_wait_profiled(cond, mutex, NULL, __builtin_return_address(0));
+#else
+    return _cond_wait(cond, mutex, NULL);
+#endif
 }
 
 int pthread_cond_broadcast_soloader(pthread_cond_t_bionic *cond)
 {
     if (!cond) return EINVAL;
+    return _cond_pulse(cond, INT_MAX);
+}
+
+/*
+ * Reader-writer locks, writer-preferring: once a writer is waiting, new
+ * readers queue behind it. `state` holds the reader count and flags and is
+ * all that the uncontended paths touch (one CAS). Sleepers register under
+ * `pending_lock` and wait on a per-side wakeup serial, which unlock bumps.
+ */
+#define RWLOCK_PENDING_READERS  0x00000001
+#define RWLOCK_PENDING_WRITERS  0x00000002
+#define RWLOCK_READER_ONE       0x00000004
+#define RWLOCK_READER_MASK      0x7ffffffc
+#define RWLOCK_WRITER_OWNED     ((int) 0x80000000)
+
+#define BIONIC_PTHREAD_PROCESS_PRIVATE 0
+#define BIONIC_PTHREAD_PROCESS_SHARED  1
+
+PTHR_INLINE int _rwlock_can_read(int state) {
+    return !(state & (RWLOCK_WRITER_OWNED | RWLOCK_PENDING_WRITERS));
+}
+
+PTHR_INLINE int _rwlock_can_write(int state) {
+    return !(state & (RWLOCK_WRITER_OWNED | RWLOCK_READER_MASK));
+}
+
+PTHR_INLINE int _rwlock_tryrdlock(pthread_rwlock_t_bionic * rw) {
+    int old = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+    while (_rwlock_can_read(old)) {
+        if ((old & RWLOCK_READER_MASK) == RWLOCK_READER_MASK)
+            return EAGAIN;
+        if (__atomic_compare_exchange_n(&rw->state, &old, old + RWLOCK_READER_ONE, true,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return 0;
+    }
+    return EBUSY;
+}
+
+PTHR_INLINE int _rwlock_trywrlock(pthread_rwlock_t_bionic * rw) {
+    int old = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+    while (_rwlock_can_write(old)) {
+        if (__atomic_compare_exchange_n(&rw->state, &old, old | RWLOCK_WRITER_OWNED, true,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            rw->writer_owner = _self_id();
+            return 0;
+        }
+    }
+    return EBUSY;
+}
+
+static int _rwlock_lock(pthread_rwlock_t_bionic * rw, int write, const struct timespec * abstime) {
+    if (rw->writer_owner == (int) _self_id() && (__atomic_load_n(&rw->state, __ATOMIC_RELAXED) & RWLOCK_WRITER_OWNED))
+        return EDEADLK_BIONIC;
+
+    int * pending = write ? &rw->pending_writers : &rw->pending_readers;
+    volatile int * serial_ptr = write ? &rw->writer_wakeup_serial : &rw->reader_wakeup_serial;
+    int pending_flag = write ? RWLOCK_PENDING_WRITERS : RWLOCK_PENDING_READERS;
+
+    for (;;) {
+        int ret = write ? _rwlock_trywrlock(rw) : _rwlock_tryrdlock(rw);
+        if (likely(ret != EBUSY))
+            return ret;
+
+        _normal_lock(&rw->pending_lock.value, 0);
+        (*pending)++;
+        int old = __atomic_fetch_or(&rw->state, pending_flag, __ATOMIC_RELAXED);
+        int serial = *serial_ptr;
+        _normal_unlock(&rw->pending_lock.value, 0);
+
+        // The lock may have been released before the flag was set
+        if (!(write ? _rwlock_can_write(old) : _rwlock_can_read(old)))
+            ret = futex_wait(serial_ptr, serial, abstime);
+
+        _normal_lock(&rw->pending_lock.value, 0);
+        if (--(*pending) == 0) {
+            __atomic_fetch_and(&rw->state, ~pending_flag, __ATOMIC_RELAXED);
+            // Unlock woke this writer instead of the readers queued behind it
+            if (write && ret == ETIMEDOUT && rw->pending_readers > 0) {
+                rw->reader_wakeup_serial++;
+                futex_wake(&rw->reader_wakeup_serial, INT_MAX);
+            }
+        }
+        _normal_unlock(&rw->pending_lock.value, 0);
+
+        if (ret == ETIMEDOUT)
+            return ETIMEDOUT_BIONIC;
+    }
+}
+
+static int _rwlock_unlock(pthread_rwlock_t_bionic * rw) {
+    int old = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+
+    if (old & RWLOCK_WRITER_OWNED) {
+        if (rw->writer_owner != (int) _self_id())
+            return EPERM;
+        rw->writer_owner = 0;
+        old = __atomic_fetch_and(&rw->state, ~RWLOCK_WRITER_OWNED, __ATOMIC_RELEASE);
+    } else if (old & RWLOCK_READER_MASK) {
+        old = __atomic_fetch_sub(&rw->state, RWLOCK_READER_ONE, __ATOMIC_RELEASE);
+        if ((old & RWLOCK_READER_MASK) != RWLOCK_READER_ONE)
+            return 0;
+    } else {
+        return EPERM;
+    }
+
+    if (likely(!(old & (RWLOCK_PENDING_READERS | RWLOCK_PENDING_WRITERS))))
+        return 0;
+
+    // Writers first; readers only get woken when no writer is waiting
+    _normal_lock(&rw->pending_lock.value, 0);
+    if (rw->pending_writers > 0) {
+        rw->writer_wakeup_serial++;
+        futex_wake(&rw->writer_wakeup_serial, 1);
+    } else if (rw->pending_readers > 0) {
+        rw->reader_wakeup_serial++;
+        futex_wake(&rw->reader_wakeup_serial, INT_MAX);
+    }
+    _normal_unlock(&rw->pending_lock.value, 0);
+    return 0;
+}
+
+int pthread_rwlockattr_init_soloader(pthread_rwlockattr_t_bionic *attr)
+{
+    if (!attr) return EINVAL;
+    *attr = BIONIC_PTHREAD_PROCESS_PRIVATE;
+    return 0;
+}
 
-    _cond_t_static_init(cond, NULL);
+int pthread_rwlockattr_destroy_soloader(pthread_rwlockattr_t_bionic *attr)
+{
+    if (!attr) return EINVAL;
+    *attr = -1;
+    return 0;
+}
 
-    return pthread_cond_broadcast(cond->real_ptr);
+int pthread_rwlockattr_getpshared_soloader(const pthread_rwlockattr_t_bionic *attr, int *pshared)
+{
+    if (!attr || !pshared) return EINVAL;
+    *pshared = *attr;
+    return 0;
+}
+
+int pthread_rwlockattr_setpshared_soloader(pthread_rwlockattr_t_bionic *attr, int pshared)
+{
+    if (!attr) return EINVAL;
+    if (pshared != BIONIC_PTHREAD_PROCESS_PRIVATE && pshared != BIONIC_PTHREAD_PROCESS_SHARED) return EINVAL;
+    *attr = pshared; // there is only one process anyway
+    return 0;
+}
+
+int pthread_rwlock_init_soloader(pthread_rwlock_t_bionic *rwlock, const pthread_rwlockattr_t_bionic *attr)
+{
+    if (!rwlock) return EINVAL;
+    memset(rwlock, 0, sizeof(pthread_rwlock_t_bionic));
+    return 0;
+}
+
+int pthread_rwlock_destroy_soloader(pthread_rwlock_t_bionic *rwlock)
+{
+    if (!rwlock) return EINVAL;
+    if (__atomic_load_n(&rwlock->state, __ATOMIC_RELAXED) & (RWLOCK_WRITER_OWNED | RWLOCK_READER_MASK))
+        return EBUSY;
+    return 0;
+}
+
+int pthread_rwlock_rdlock_soloader(pthread_rwlock_t_bionic *rwlock)
+{
+    if (!rwlock) return EINVAL;
+    return _rwlock_lock(rwlock, 0, NULL);
+}
+
+int pthread_rwlock_tryrdlock_soloader(pthread_rwlock_t_bionic *rwlock)
+{
+    if (!rwlock) return EINVAL;
+    return _rwlock_tryrdlock(rwlock);
+}
+
+int pthread_rwlock_timedrdlock_soloader(pthread_rwlock_t_bionic *rwlock, const struct timespec *abstime)
+{
+    if (!rwlock) return EINVAL;
+    return _rwlock_lock(rwlock, 0, abstime);
+}
+
+int pthread_rwlock_wrlock_soloader(pthread_rwlock_t_bionic *rwlock)
+{
+    if (!rwlock) return EINVAL;
+    return _rwlock_lock(rwlock, 1, NULL);
+}
+
+int pthread_rwlock_trywrlock_soloader(pthread_rwlock_t_bionic *rwlock)
+{
+    if (!rwlock) return EINVAL;
+    return _rwlock_trywrlock(rwlock);
+}
+
+int pthread_rwlock_timedwrlock_soloader(pthread_rwlock_t_bionic *rwlock, const struct timespec *abstime)
+{
+    if (!rwlock) return EINVAL;
+    return _rwlock_lock(rwlock, 1, abstime);
+}
+
+int pthread_rwlock_unlock_soloader(pthread_rwlock_t_bionic *rwlock)
+{
+    if (!rwlock) return EINVAL;
+    return _rwlock_unlock(rwlock);
+}
+
+/*
+ * Spinlocks share the normal mutex word format. The Vita schedules by strict
+ * priority, so spinning on a holder that got preempted by us would never end;
+ * after a short spin the waiter sleeps like a mutex would.
+ */
+#define SPIN_COUNT 1000
+
+// Also built for the host tests in extras/host
+#if defined(__arm__)
+#define cpu_relax() __asm__ volatile("yield" ::: "memory")
+#else
+#define cpu_relax() __asm__ volatile("" ::: "memory")
+#endif
+
+int pthread_spin_init_soloader(pthread_spinlock_t_bionic *lock, int pshared)
+{
+    if (!lock) return EINVAL;
+    __atomic_store_n(&lock->value, MUTEX_UNLOCKED, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int pthread_spin_destroy_soloader(pthread_spinlock_t_bionic *lock)
+{
+    if (!lock) return EINVAL;
+    return (__atomic_load_n(&lock->value, __ATOMIC_RELAXED) & MUTEX_STATE_MASK) ? EBUSY : 0;
+}
+
+int pthread_spin_lock_soloader(pthread_spinlock_t_bionic *lock)
+{
+    if (!lock) return EINVAL;
+    for (int i = 0; i < SPIN_COUNT; i++) {
+        if (likely(_normal_trylock(&lock->value, 0) == 0))
+            return 0;
+        cpu_relax();
+    }
+    _normal_lock(&lock->value, 0);
+    return 0;
+}
+
+int pthread_spin_trylock_soloader(pthread_spinlock_t_bionic *lock)
+{
+    if (!lock) return EINVAL;
+    return _normal_trylock(&lock->value, 0);
+}
+
+int pthread_spin_unlock_soloader(pthread_spinlock_t_bionic *lock)
+{
+    if (!lock) return EINVAL;
+    _normal_unlock(&lock->value, 0);
+    return 0;
 }
 
 int pthread_attr_init_soloader(pthread_attr_t_bionic *attr)
@@ -362,6 +837,10 @@ int pthread_getschedparam_soloader(pthread_t thread, int *policy,
 
 int pthread_detach_soloader(pthread_t thread)
 {
+#ifdef PTHR_THREAD_POOL
+    int ret = _pool_detach(thread);
+    if (ret != ESRCH) return ret;
+#endif
     return pthread_detach(thread);
 }
 
@@ -379,12 +858,35 @@ pthread_t pthread_self_soloader()
     return pthread_self();
 }
 
+enum {
+    ONCE_INIT = 0, // PTHREAD_ONCE_INIT
+    ONCE_RUNNING,
+    ONCE_DONE
+};
+
 int pthread_once_soloader(volatile int *once_control, void (*init_routine)(void)) {
     if (!once_control || !init_routine)
-        return -1;
-    if (__sync_lock_test_and_set(once_control, 1) == 0)
-        (*init_routine)();
-    return 0;
+        return EINVAL;
+
+    if (likely(__atomic_load_n(once_control, __ATOMIC_ACQUIRE) == ONCE_DONE))
+        return 0;
+
+    for (;;) {
+        int state = ONCE_INIT;
+        if (__atomic_compare_exchange_n(once_control, &state, ONCE_RUNNING, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            (*init_routine)();
+            __atomic_store_n(once_control, ONCE_DONE, __ATOMIC_RELEASE);
+            futex_wake(once_control, INT_MAX);
+            return 0;
+        }
+
+        if (state == ONCE_DONE)
+            return 0;
+
+        // Callers racing the first one must not return before it is done
+        futex_wait(once_control, ONCE_RUNNING, NULL);
+    }
 }
 
 #ifndef MAX_TASK_COMM_LEN
@@ -402,61 +904,110 @@ int pthread_setname_np_soloader(pthread_t thread, const char* thread_name) {
 
     sceClibPrintf("PTHREAD: pthread_setname_np with name %s for thread:0x%x\n", thread_name, pthread_self());
 
+    // Affinity and priority can only be changed through the thread's own SceUID
+    const thread_policy * policy = thread_policy_for_name(thread_name);
+    if (policy) {
+        if (pthread_equal(thread, pthread_self()))
+            thread_policy_apply_self(policy);
+        else
+            l_warn("thread_policy: \"%s\" was named from another thread, policy not applied", thread_name);
+    }
+
+    return 0;
+}
+
+/*
+ * Semaphores are a counter in the 4-byte bionic `sem_t`, like in bionic:
+ * a value >= 0 is the count, -1 means "zero, and somebody may be sleeping".
+ * Posting to or waiting on a semaphore with a positive count is a single CAS;
+ * only an empty semaphore makes the waiter futex_wait() on the word.
+ */
+#define SEM_VALUE_MAX_BIONIC 0x3fffffff
+#define SEM_WAITERS          -1
+
+PTHR_INLINE int _sem_trydec(volatile int * sem) {
+    int old = __atomic_load_n(sem, __ATOMIC_RELAXED);
+    while (old > 0) {
+        if (__atomic_compare_exchange_n(sem, &old, old - 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return 1;
+    }
     return 0;
 }
 
+static int _sem_wait(volatile int * sem, const struct timespec * abstime) {
+    for (;;) {
+        if (likely(_sem_trydec(sem)))
+            return 0;
+
+        // Announce the sleeper so that sem_post knows to wake it up
+        int zero = 0;
+        __atomic_compare_exchange_n(sem, &zero, SEM_WAITERS, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
+        if (futex_wait(sem, SEM_WAITERS, abstime) == ETIMEDOUT) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+}
+
 int sem_destroy_soloader(int * uid) {
-    if (sceKernelDeleteSema(*uid) < 0)
-        return -1;
     return 0;
 }
 
 int sem_getvalue_soloader (int * uid, int * sval) {
-    SceKernelSemaInfo info;
-    info.size = sizeof(SceKernelSemaInfo);
-
-    if (sceKernelGetSemaInfo(*uid, &info) < 0) return -1;
-    if (!sval) sval = malloc(sizeof(int32_t));
-    *sval = info.currentCount;
+    if (!uid || !sval) {
+        errno = EINVAL;
+        return -1;
+    }
+    int value = __atomic_load_n(uid, __ATOMIC_RELAXED);
+    *sval = value < 0 ? 0 : value;
     return 0;
 }
 
 int sem_init_soloader (int * uid, int pshared, unsigned int value) {
-    *uid = sceKernelCreateSema("sema", 0, (int) value, 0x7fffffff, NULL);
-    if (*uid < 0)
+    if (value > SEM_VALUE_MAX_BIONIC) {
+        errno = EINVAL;
         return -1;
+    }
+    __atomic_store_n(uid, (int) value, __ATOMIC_RELEASE);
     return 0;
 }
 
 int sem_post_soloader (int * uid) {
-    if (sceKernelSignalSema(*uid, 1) < 0)
-        return -1;
+    int old = __atomic_load_n(uid, __ATOMIC_RELAXED);
+    int new;
+    do {
+        if (old == SEM_VALUE_MAX_BIONIC) {
+            errno = EOVERFLOW;
+            return -1;
+        }
+        new = old < 0 ? 1 : old + 1;
+    } while (!__atomic_compare_exchange_n(uid, &old, new, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // Every sleeper re-marks the semaphore before sleeping again, so all of
+    // them are woken and the ones that lose the race go back to sleep
+    if (old < 0)
+        futex_wake(uid, INT_MAX);
     return 0;
 }
 
 int sem_timedwait_soloader (int * uid, const struct timespec * abstime) {
-    uint timeout = 1000;
-    if (sceKernelWaitSema(*uid, 1, &timeout) >= 0)
-        return 0;
-    if (!abstime) return -1;
-    long long now = (long long) current_timestamp_ms() * 1000; // us
-    long long _timeout = abstime->tv_sec * 1000 * 1000 + abstime->tv_nsec / 1000; // us
-    if (_timeout-now >= 0) return -1;
-    uint timeout_real = _timeout - now;
-    if (sceKernelWaitSema(*uid, 1, &timeout_real) < 0)
+    if (!abstime || abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000) {
+        if (_sem_trydec(uid))
+            return 0;
+        errno = EINVAL;
         return -1;
-    return 0;
+    }
+    return _sem_wait(uid, abstime);
 }
 
 int sem_trywait_soloader (int * uid) {
-    uint timeout = 1000;
-    if (sceKernelWaitSema(*uid, 1, &timeout) < 0)
-        return -1;
-    return 0;
+    if (_sem_trydec(uid))
+        return 0;
+    errno = EAGAIN;
+    return -1;
 }
 
 int sem_wait_soloader (int * uid) {
-    if (sceKernelWaitSema(*uid, 1, NULL) < 0)
-        return -1;
-    return 0;
+    return _sem_wait(uid, NULL);
 }
@@ -33,23 +33,48 @@ typedef struct {
     int32_t sched_priority;
 } pthread_attr_t_bionic;
 
+// Implemented in place, see pthr.c
 typedef struct {
-    pthread_mutex_t *real_ptr; // replaces `int volatile value;`
+    int volatile value;
 } pthread_mutex_t_bionic;
 
 typedef struct {
-    pthread_cond_t *real_ptr; // replaces `int volatile value;`
+    int volatile value;
 } pthread_cond_t_bionic;
 
+// Bionic's 32-bit pthread_rwlock_t is 40 opaque bytes, all-zero when unlocked
+typedef struct {
+    int volatile state;
+    int volatile writer_owner;
+    pthread_mutex_t_bionic pending_lock;
+    int pending_readers;
+    int pending_writers;
+    int volatile reader_wakeup_serial;
+    int volatile writer_wakeup_serial;
+    int reserved[3];
+} pthread_rwlock_t_bionic;
+
+typedef int pthread_rwlockattr_t_bionic;
+
+// Only the first word of bionic's 8-byte pthread_spinlock_t is used
+typedef struct {
+    int volatile value;
+} pthread_spinlock_t_bionic;
+
 // pthread_t is same size on bionic and newlib
 int pthread_create_soloader(pthread_t *thread, const pthread_attr_t_bionic *attr, void *(*start)(void *), void *param);
 int pthread_kill_soloader(pthread_t thread, int sig);
 int pthread_join_soloader(pthread_t thread, void **value_ptr);
+void pthread_exit_soloader(void *value_ptr);
 int pthread_detach_soloader(pthread_t thread);
 int pthread_equal_soloader(pthread_t t1, pthread_t t2);
 pthread_t pthread_self_soloader();
 int pthread_once_soloader(volatile int *once_control, void (*init_routine)(void));
 
+// pthread_key_t is same size on bionic and newlib
+int pthread_key_create_soloader(pthread_key_t *key, void (*destructor)(void *));
+int pthread_key_delete_soloader(pthread_key_t key);
+
 // pthread_t and sched_param are same size on bionic and newlib
 int pthread_getschedparam_soloader(pthread_t thread, int *policy, struct sched_param *param);
 int pthread_setschedparam_soloader(pthread_t thread, int policy, const struct sched_param *param);
@@ -76,6 +101,27 @@ int pthread_mutex_lock_soloader(pthread_mutex_t_bionic *mutex);
 int pthread_mutex_trylock_soloader(pthread_mutex_t_bionic *mutex);
 int pthread_mutex_unlock_soloader(pthread_mutex_t_bionic *mutex);
 
+int pthread_rwlockattr_init_soloader(pthread_rwlockattr_t_bionic *attr);
+int pthread_rwlockattr_destroy_soloader(pthread_rwlockattr_t_bionic *attr);
+int pthread_rwlockattr_getpshared_soloader(const pthread_rwlockattr_t_bionic *attr, int *pshared);
+int pthread_rwlockattr_setpshared_soloader(pthread_rwlockattr_t_bionic *attr, int pshared);
+
+int pthread_rwlock_init_soloader(pthread_rwlock_t_bionic *rwlock, const pthread_rwlockattr_t_bionic *attr);
+int pthread_rwlock_destroy_soloader(pthread_rwlock_t_bionic *rwlock);
+int pthread_rwlock_rdlock_soloader(pthread_rwlock_t_bionic *rwlock);
+int pthread_rwlock_tryrdlock_soloader(pthread_rwlock_t_bionic *rwlock);
+int pthread_rwlock_timedrdlock_soloader(pthread_rwlock_t_bionic *rwlock, const struct timespec *abstime);
+int pthread_rwlock_wrlock_soloader(pthread_rwlock_t_bionic *rwlock);
+int pthread_rwlock_trywrlock_soloader(pthread_rwlock_t_bionic *rwlock);
+int pthread_rwlock_timedwrlock_soloader(pthread_rwlock_t_bionic *rwlock, const struct timespec *abstime);
+int pthread_rwlock_unlock_soloader(pthread_rwlock_t_bionic *rwlock);
+
+int pthread_spin_init_soloader(pthread_spinlock_t_bionic *lock, int pshared);
+int pthread_spin_destroy_soloader(pthread_spinlock_t_bionic *lock);
+int pthread_spin_lock_soloader(pthread_spinlock_t_bionic *lock);
+int pthread_spin_trylock_soloader(pthread_spinlock_t_bionic *lock);
+int pthread_spin_unlock_soloader(pthread_spinlock_t_bionic *lock);
+
 int pthread_attr_init_soloader(pthread_attr_t_bionic *attr);
 int pthread_attr_destroy_soloader(pthread_attr_t_bionic *attr);
 int pthread_attr_setdetachstate_soloader(pthread_attr_t_bionic *attr, int state);
@@ -83,6 +129,15 @@ int pthread_attr_setstacksize_soloader(pthread_attr_t_bionic *attr, size_t stack
 
 int pthread_setname_np_soloader(pthread_t thread, const char *thread_name);
 
+#ifdef PTHR_CONTENTION_PROFILE
+/**
+ * Print per-mutex and per-condvar wait/hold statistics, sorted by total wait
+ * time, naming each object after the .so function it was first used from.
+ */
+void pthr_profile_dump(int top_n);
+void pthr_profile_reset();
+#endif
+
 int sem_init_soloader(int *sem, int pshared, unsigned int value);
 int sem_destroy_soloader(int *sem);
 int sem_getvalue_soloader(int *sem, int *sval);
@@ -9,17 +9,26 @@
 
 #include "utils/init.h"
 
+#include "reimpl/alloc.h"
+#include "reimpl/alloc_trace.h"
+#include "reimpl/pthr.h"
 #include "utils/dialog.h"
 #include "utils/glutil.h"
 #include "utils/logger.h"
+#include "utils/prelink.h"
+#include "utils/scheduler.h"
 #include "utils/utils.h"
 #include "utils/settings.h"
+#include "utils/thread_policy.h"
+#include "utils/trace.h"
 
 #include <string.h>
 
 #include <psp2/appmgr.h>
 #include <psp2/apputil.h>
+#include <psp2/ctrl.h>
 #include <psp2/kernel/clib.h>
+#include <psp2/kernel/threadmgr.h>
 #include <psp2/power.h>
 
 #include <falso_jni/FalsoJNI.h>
@@ -31,6 +40,44 @@
 
 extern so_module so_mod;
 
+static void trace_ctor(so_module *mod, uintptr_t ctor, SceUInt64 start, SceUInt64 end) {
+    trace_complete(NULL, ctor, start, end);
+}
+
+#if defined(SO_IMPORT_PROFILE) || defined(PTHR_CONTENTION_PROFILE) || defined(USE_SLAB_ALLOCATOR)
+#define PROFILE_BUTTONS (SCE_CTRL_L1 | SCE_CTRL_R1 | SCE_CTRL_SELECT)
+
+// Dumps the enabled profiles each time L1+R1+SELECT is pressed, then starts
+// counting from zero again so consecutive dumps cover separate scenes.
+// Allocator statistics are cumulative.
+static int profile_thread(SceSize args, void *argp) {
+    uint32_t prev = 0;
+    while (1) {
+        SceCtrlData pad;
+        sceCtrlPeekBufferPositive(0, &pad, 1);
+
+        uint32_t held = pad.buttons & PROFILE_BUTTONS;
+        if (held == PROFILE_BUTTONS && prev != PROFILE_BUTTONS) {
+#ifdef SO_IMPORT_PROFILE
+            so_import_profile_dump(32);
+            so_import_profile_reset();
+#endif
+#ifdef PTHR_CONTENTION_PROFILE
+            pthr_profile_dump(32);
+            pthr_profile_reset();
+#endif
+#ifdef USE_SLAB_ALLOCATOR
+            alloc_stats_dump();
+#endif
+        }
+        prev = held;
+
+        sceKernelDelayThread(100 * 1000);
+    }
+    return 0;
+}
+#endif
+
 void soloader_init_all() {
 	// Launch `app0:configurator.bin` on `-config` init param
     sceAppUtilInit(&(SceAppUtilInitParam){}, &(SceAppUtilBootParam){});
@@ -51,8 +98,10 @@ void soloader_init_all() {
     scePowerSetGpuXbarClockFrequency(166);
 
 #ifdef USE_SCELIBC_IO
+    trace_begin("fios_init");
     if (fios_init(DATA_PATH) == 0)
         l_success("FIOS initialized.");
+    trace_end();
 #endif
 
     if (!module_loaded("kubridge")) {
@@ -67,32 +116,86 @@ void soloader_init_all() {
                     "sure that you have %s file exactly at that path.", SO_PATH);
     }
 
+#ifdef USE_PRELINK_CACHE
+    // The prelink hash is the only loader-side work so far; don't park two
+    // workers and their stacks in builds that have none to give them
+    sched_init();
+#endif
+
+    // Hashes the .so on a worker while the main thread loads it
+    prelink_begin();
+
+    trace_begin("so_file_load");
     if (so_file_load(&so_mod, SO_PATH, LOAD_ADDRESS) < 0) {
         l_fatal("SO could not be loaded.");
         fatal_error("Error: could not load %s.", SO_PATH);
     }
+    trace_end();
 
+    trace_begin("settings_load");
     settings_load();
+    thread_policy_load();
     l_success("Settings loaded.");
+    trace_end();
+
+    trace_begin("prelink_load");
+    bool prelinked = prelink_load(&so_mod);
+    trace_end();
+
+    if (prelinked) {
+        resolve_imports_runtime();
+        l_success("SO relocations and imports restored from prelink cache.");
+    } else {
+        trace_begin("so_relocate");
+        so_relocate(&so_mod);
+        l_success("SO relocated.");
+        trace_end();
+
+        trace_begin("resolve_imports");
+        resolve_imports(&so_mod);
+        l_success("SO imports resolved.");
+        trace_end();
+
+        trace_begin("prelink_save");
+        prelink_save(&so_mod);
+        trace_end();
+    }
 
-    so_relocate(&so_mod);
-    l_success("SO relocated.");
-
-    resolve_imports(&so_mod);
-    l_success("SO imports resolved.");
-
+    trace_begin("so_patch");
     so_patch();
     l_success("SO patched.");
+    prelink_finish(&so_mod);
+    trace_end();
 
+    trace_begin("so_flush_caches");
     so_flush_caches(&so_mod);
     l_success("SO caches flushed.");
+    trace_end();
 
-    so_initialize(&so_mod);
+#ifdef ALLOC_TRACE
+    alloc_trace_init();
+#endif
+
+    trace_begin("so_initialize");
+    so_initialize_cb(&so_mod, trace_ctor);
     l_success("SO initialized.");
+    trace_end();
 
+    trace_begin("gl_preload");
     gl_preload();
     l_success("OpenGL preloaded.");
+    trace_end();
 
+    trace_begin("jni_init");
     jni_init();
     l_success("FalsoJNI initialized.");
+    trace_end();
+
+    trace_finish();
+
+#if defined(SO_IMPORT_PROFILE) || defined(PTHR_CONTENTION_PROFILE) || defined(USE_SLAB_ALLOCATOR)
+    SceUID thid = sceKernelCreateThread("profile", profile_thread, 0x10000100, 0x4000, 0, 0, NULL);
+    if (thid >= 0)
+        sceKernelStartThread(thid, 0, NULL);
+#endif
 }
@@ -21,6 +21,21 @@ extern "C" {
 
 void resolve_imports(so_module *mod);
 
+/**
+ * Set up the runtime state referenced by the import table (stdio shims).
+ * Done by resolve_imports(); call it directly when the imports were restored
+ * from the prelink cache instead.
+ */
+void resolve_imports_runtime();
+
+/**
+ * Get SHA1 hash of the import table: every symbol name with the address it
+ * resolves to, and the stub used for unresolved imports.
+ *
+ * @return 40-char long null-terminated string. Must be freed by the caller.
+ */
+char * imports_sha1sum();
+
 void so_patch();
 
 void soloader_init_all();
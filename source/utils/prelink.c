@@ -0,0 +1,325 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+#include "utils/prelink.h"
+
+#include "utils/init.h"
+#include "utils/logger.h"
+#include "utils/scheduler.h"
+#include "utils/utils.h"
+
+#include <kubridge.h>
+#include <psp2/io/fcntl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sha1/sha1.h>
+
+#define PRELINK_PATH     DATA_PATH "prelink/"
+#define PRELINK_MANIFEST PRELINK_PATH "manifest.txt"
+
+// Bump whenever the output of so_relocate() / so_resolve() changes
+#define PRELINK_VERSION 1
+
+#define PRELINK_MAX_SEGMENTS (1 + MAX_DATA_SEG)
+#define PRELINK_CHUNK_SIZE   0x10000
+
+typedef struct {
+    int version;
+    char so_sha1[41];
+    char imports_sha1[41];
+
+    int num_segments;
+    uintptr_t seg_base[PRELINK_MAX_SEGMENTS];
+    size_t seg_size[PRELINK_MAX_SEGMENTS];
+
+    int num_hooks;
+    so_hook_record hooks[SO_MAX_HOOK_LOG];
+} prelink_manifest;
+
+typedef enum {
+    PRELINK_NONE,
+    PRELINK_LOADED,  // image restored from the cache
+    PRELINK_PENDING, // images saved, manifest not written yet
+} prelink_state;
+
+static prelink_state state = PRELINK_NONE;
+static prelink_manifest current;
+static prelink_manifest cached;
+
+// SHA1 of SO_PATH, computed by prelink_begin() while the .so is being loaded
+static sched_group so_hash_group;
+static bool so_hash_ok = false;
+static char so_hash[41];
+
+static bool prelink_file_sha1sum(const char * path, char * out) {
+    SceUID fd = sceIoOpen(path, SCE_O_RDONLY, 0);
+    if (fd < 0)
+        return false;
+
+    uint8_t * buffer = malloc(PRELINK_CHUNK_SIZE);
+    SHA1_CTX ctx;
+    sha1_init(&ctx);
+
+    int read;
+    while ((read = sceIoRead(fd, buffer, PRELINK_CHUNK_SIZE)) > 0)
+        sha1_update(&ctx, buffer, read);
+
+    sceIoClose(fd);
+    free(buffer);
+
+    if (read < 0)
+        return false;
+
+    uint8_t sha1[SHA1_BLOCK_SIZE];
+    sha1_final(&ctx, sha1);
+    for (int i = 0; i < SHA1_BLOCK_SIZE; i++)
+        sprintf(out + i * 2, "%02X", sha1[i]);
+
+    return true;
+}
+
+static void prelink_segment_path(char * out, int i) {
+    sprintf(out, PRELINK_PATH "seg%d.bin", i);
+}
+
+static void prelink_hash_task(void * arg) {
+    so_hash_ok = prelink_file_sha1sum(SO_PATH, so_hash);
+}
+
+static bool prelink_keys(so_module * mod, prelink_manifest * m) {
+    memset(m, 0, sizeof(prelink_manifest));
+
+    sched_wait(&so_hash_group);
+    if (!so_hash_ok)
+        return false;
+    memcpy(m->so_sha1, so_hash, sizeof(m->so_sha1));
+
+    char * imports = imports_sha1sum();
+    strncpy(m->imports_sha1, imports, sizeof(m->imports_sha1) - 1);
+    free(imports);
+
+    m->seg_base[m->num_segments] = mod->text_base;
+    m->seg_size[m->num_segments++] = mod->text_size;
+    for (int i = 0; i < mod->n_data; i++) {
+        m->seg_base[m->num_segments] = mod->data_base[i];
+        m->seg_size[m->num_segments++] = mod->data_size[i];
+    }
+
+    // Only a complete set of keys is valid, prelink_save checks for this
+    m->version = PRELINK_VERSION;
+    return true;
+}
+
+static bool prelink_manifest_read(prelink_manifest * m) {
+    FILE * f = fopen(PRELINK_MANIFEST, "r");
+    if (!f)
+        return false;
+
+    memset(m, 0, sizeof(prelink_manifest));
+
+    char line[128];
+    char key[32];
+    unsigned int a, b;
+    bool ok = true;
+
+    while (ok && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%31s", key) != 1)
+            continue;
+
+        if (strcmp(key, "version") == 0) {
+            ok = sscanf(line, "%*s %d", &m->version) == 1;
+        } else if (strcmp(key, "so_sha1") == 0) {
+            ok = sscanf(line, "%*s %40s", m->so_sha1) == 1;
+        } else if (strcmp(key, "imports_sha1") == 0) {
+            ok = sscanf(line, "%*s %40s", m->imports_sha1) == 1;
+        } else if (strcmp(key, "segment") == 0) {
+            ok = m->num_segments < PRELINK_MAX_SEGMENTS && sscanf(line, "%*s %x %x", &a, &b) == 2;
+            if (ok) {
+                m->seg_base[m->num_segments] = a;
+                m->seg_size[m->num_segments++] = b;
+            }
+        } else if (strcmp(key, "hook") == 0) {
+            ok = m->num_hooks < SO_MAX_HOOK_LOG && sscanf(line, "%*s %x %x", &a, &b) == 2;
+            if (ok) {
+                m->hooks[m->num_hooks].addr = a;
+                m->hooks[m->num_hooks++].dst = b;
+            }
+        }
+    }
+
+    fclose(f);
+    return ok;
+}
+
+static bool prelink_manifest_write(const prelink_manifest * m) {
+    FILE * f = fopen(PRELINK_MANIFEST, "w");
+    if (!f)
+        return false;
+
+    fprintf(f, "version %d\n", m->version);
+    fprintf(f, "so_sha1 %s\n", m->so_sha1);
+    fprintf(f, "imports_sha1 %s\n", m->imports_sha1);
+    for (int i = 0; i < m->num_segments; i++)
+        fprintf(f, "segment 0x%08X 0x%08X\n", (unsigned int)m->seg_base[i], (unsigned int)m->seg_size[i]);
+    for (int i = 0; i < m->num_hooks; i++)
+        fprintf(f, "hook 0x%08X 0x%08X\n", (unsigned int)m->hooks[i].addr, (unsigned int)m->hooks[i].dst);
+
+    return fclose(f) == 0;
+}
+
+static const char * prelink_compare(const prelink_manifest * a, const prelink_manifest * b) {
+    if (a->version != b->version)
+        return "loader version";
+    if (strcmp(a->so_sha1, b->so_sha1) != 0)
+        return ".so SHA1";
+    if (strcmp(a->imports_sha1, b->imports_sha1) != 0)
+        return "import table";
+    if (a->num_segments != b->num_segments)
+        return "segment layout";
+    for (int i = 0; i < a->num_segments; i++) {
+        if (a->seg_base[i] != b->seg_base[i] || a->seg_size[i] != b->seg_size[i])
+            return "segment layout";
+    }
+    return NULL;
+}
+
+static bool prelink_hooks_equal(const prelink_manifest * m, const so_hook_record * hooks, int num_hooks) {
+    if (m->num_hooks != num_hooks)
+        return false;
+    for (int i = 0; i < num_hooks; i++) {
+        if (m->hooks[i].addr != hooks[i].addr || m->hooks[i].dst != hooks[i].dst)
+            return false;
+    }
+    return true;
+}
+
+void prelink_begin() {
+#ifdef USE_PRELINK_CACHE
+    sched_group_init(&so_hash_group);
+    sched_spawn(&so_hash_group, "prelink_hash", prelink_hash_task, NULL);
+#endif
+}
+
+bool prelink_load(so_module * mod) {
+#ifndef USE_PRELINK_CACHE
+    return false;
+#else
+    if (!prelink_keys(mod, &current)) {
+        l_error("prelink_load: Could not hash %s.", SO_PATH);
+        return false;
+    }
+
+    if (!prelink_manifest_read(&cached)) {
+        l_info("prelink_load: No valid manifest, the cache will be built.");
+        return false;
+    }
+
+    const char * mismatch = prelink_compare(&cached, &current);
+    if (mismatch) {
+        l_info("prelink_load: Cache invalidated, %s changed.", mismatch);
+        return false;
+    }
+
+    // Read every image before touching the module, so that a short or
+    // failed read leaves it intact for the regular relocation path
+    uint8_t * images[PRELINK_MAX_SEGMENTS] = { NULL };
+    bool ok = true;
+
+    for (int i = 0; ok && i < current.num_segments; i++) {
+        char path[256];
+        prelink_segment_path(path, i);
+
+        images[i] = malloc(current.seg_size[i] + 1);
+        SceUID fd = sceIoOpen(path, SCE_O_RDONLY, 0);
+        if (!images[i] || fd < 0) {
+            ok = false;
+        } else {
+            ok = sceIoRead(fd, images[i], current.seg_size[i] + 1) == (int)current.seg_size[i];
+        }
+
+        if (fd >= 0)
+            sceIoClose(fd);
+    }
+
+    if (ok) {
+        for (int i = 0; i < current.num_segments; i++)
+            kuKernelCpuUnrestrictedMemcpy((void *)current.seg_base[i], images[i], current.seg_size[i]);
+        state = PRELINK_LOADED;
+    } else {
+        l_error("prelink_load: Could not read the cached segment images.");
+    }
+
+    for (int i = 0; i < current.num_segments; i++)
+        free(images[i]);
+
+    return ok;
+#endif
+}
+
+void prelink_save(so_module * mod) {
+#ifdef USE_PRELINK_CACHE
+    if (state != PRELINK_NONE || current.version != PRELINK_VERSION)
+        return;
+
+    if (!file_mkpath(PRELINK_MANIFEST, 0777)) {
+        l_error("prelink_save: Could not create %s.", PRELINK_PATH);
+        return;
+    }
+
+    // The manifest is what makes the cache valid, drop it before the images
+    // change underneath it
+    sceIoRemove(PRELINK_MANIFEST);
+
+    for (int i = 0; i < current.num_segments; i++) {
+        char path[256];
+        prelink_segment_path(path, i);
+
+        SceUID fd = sceIoOpen(path, SCE_O_WRONLY | SCE_O_CREAT | SCE_O_TRUNC, 0777);
+        if (fd < 0) {
+            l_error("prelink_save: Could not open %s for writing.", path);
+            return;
+        }
+
+        int written = sceIoWrite(fd, (void *)current.seg_base[i], current.seg_size[i]);
+        sceIoClose(fd);
+
+        if (written != (int)current.seg_size[i]) {
+            l_error("prelink_save: Could not write %s.", path);
+            return;
+        }
+    }
+
+    state = PRELINK_PENDING;
+#endif
+}
+
+void prelink_finish(so_module * mod) {
+#ifdef USE_PRELINK_CACHE
+    const so_hook_record * hooks;
+    int num_hooks = so_hook_log(&hooks);
+
+    if (state == PRELINK_PENDING) {
+        current.num_hooks = num_hooks;
+        memcpy(current.hooks, hooks, num_hooks * sizeof(so_hook_record));
+
+        if (prelink_manifest_write(&current)) {
+            l_success("Prelink cache saved.");
+        } else {
+            l_error("prelink_finish: Could not write %s.", PRELINK_MANIFEST);
+            sceIoRemove(PRELINK_MANIFEST);
+        }
+    } else if (state == PRELINK_LOADED && !prelink_hooks_equal(&cached, hooks, num_hooks)) {
+        l_warn("prelink_finish: Hook list changed, the cache will be rebuilt.");
+        sceIoRemove(PRELINK_MANIFEST);
+    }
+
+    state = PRELINK_NONE;
+#endif
+}
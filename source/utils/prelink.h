@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  prelink.h
+ * @brief Persistent cache of the relocated and resolved .so image.
+ *
+ * The output of so_relocate() and resolve_imports() only depends on the .so
+ * file, the import table and the fixed load address, so after the first
+ * successful launch the segment images are stored in `DATA_PATH "prelink/"`
+ * together with a manifest of those inputs. Later launches copy the images
+ * back instead of relocating. Patches are applied on top of the image on
+ * every launch; the hook list is recorded in the manifest as well.
+ *
+ * All functions are no-ops unless built with `USE_PRELINK_CACHE`.
+ */
+
+#ifndef SOLOADER_PRELINK_H
+#define SOLOADER_PRELINK_H
+
+#include <so_util/so_util.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Start hashing the .so file on a scheduler worker. Call before
+ * so_file_load() so that the hash overlaps with loading the module.
+ */
+void prelink_begin();
+
+/**
+ * Restore the relocated and resolved image of a freshly loaded module.
+ *
+ * @param[in] mod Module loaded with so_file_load(), not yet relocated.
+ *
+ * @return `true` if the cache matched and the image was restored, in which
+ *         case so_relocate() and resolve_imports() must be skipped.
+ */
+bool prelink_load(so_module * mod);
+
+/**
+ * Store the segment images of a module after so_relocate() and
+ * resolve_imports(), before any patches are applied. The cache only becomes
+ * valid once prelink_finish() writes its manifest.
+ *
+ * @param[in] mod Relocated and resolved module.
+ */
+void prelink_save(so_module * mod);
+
+/**
+ * Record the hook list after patching. Completes a pending prelink_save(), or
+ * invalidates a restored cache whose hook list no longer matches.
+ *
+ * @param[in] mod Patched module.
+ */
+void prelink_finish(so_module * mod);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // SOLOADER_PRELINK_H
@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+#include "utils/scheduler.h"
+
+#include "utils/logger.h"
+#include "utils/trace.h"
+
+#include <psp2/kernel/threadmgr.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SCHED_MAX_THREADS 3   // main thread + one worker per spare user core
+#define SCHED_DEQUE_SIZE  256 // power of two
+#define SCHED_STACK_SIZE  (256 * 1024)
+
+// sched_group.pending holds the number of unfinished tasks in its low bits
+// and, while someone sleeps in sched_wait(), their wait slot + 1 above them
+#define SCHED_WAITER_SHIFT 24
+#define SCHED_PENDING_MASK ((1 << SCHED_WAITER_SHIFT) - 1)
+// One wait slot per scheduler thread, plus one shared by all other threads
+#define SCHED_EXTERNAL_SLOT SCHED_MAX_THREADS
+
+typedef struct {
+    sched_fn fn;
+    sched_range_fn range_fn;
+    void * arg;
+    int begin;
+    int end;
+    const char * name;
+    sched_group * group;
+} sched_task;
+
+// Chase-Lev deque; the owner works at `bottom`, thieves take from `top`
+typedef struct {
+    volatile int top;
+    volatile int bottom;
+    sched_task tasks[SCHED_DEQUE_SIZE];
+} sched_deque;
+
+static sched_deque deques[SCHED_MAX_THREADS];
+static int num_threads = 0;
+
+static __thread int sched_self = -1;
+
+static SceUID work_sema = -1;
+static volatile int num_idle = 0;
+
+static SceUID wait_sema[SCHED_MAX_THREADS + 1];
+static SceKernelLwMutexWork external_wait_lock;
+
+static int sched_push(sched_deque * d, const sched_task * task) {
+    int b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    int t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    if (b - t >= SCHED_DEQUE_SIZE)
+        return 0;
+
+    d->tasks[b & (SCHED_DEQUE_SIZE - 1)] = *task;
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static int sched_pop(sched_deque * d, sched_task * out) {
+    int b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    if (t > b) {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    *out = d->tasks[b & (SCHED_DEQUE_SIZE - 1)];
+    if (t == b) {
+        // Last task: race the thieves for it
+        int won = __atomic_compare_exchange_n(&d->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return won;
+    }
+    return 1;
+}
+
+static int sched_steal(sched_deque * d, sched_task * out) {
+    int t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+        return 0;
+
+    // May read a slot the owner is rewriting; the CAS then fails and it is dropped
+    *out = d->tasks[t & (SCHED_DEQUE_SIZE - 1)];
+    return __atomic_compare_exchange_n(&d->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static void sched_run(sched_task * task) {
+    uint64_t start = trace_now();
+    if (task->range_fn)
+        task->range_fn(task->begin, task->end, task->arg);
+    else
+        task->fn(task->arg);
+    trace_complete(task->name, 0, start, trace_now());
+
+    // The group may be gone as soon as the count drops, so who to wake is
+    // taken from the value it had rather than read again
+    int old = __atomic_fetch_sub(&task->group->pending, 1, __ATOMIC_ACQ_REL);
+    if ((old & SCHED_PENDING_MASK) == 1 && (old >> SCHED_WAITER_SHIFT) != 0)
+        sceKernelSignalSema(wait_sema[(old >> SCHED_WAITER_SHIFT) - 1], 1);
+}
+
+static int sched_find(int self, sched_task * out) {
+    if (sched_pop(&deques[self], out))
+        return 1;
+    for (int i = 1; i < num_threads; i++) {
+        if (sched_steal(&deques[(self + i) % num_threads], out))
+            return 1;
+    }
+    return 0;
+}
+
+static int sched_worker(SceSize args, void * argp) {
+    sched_self = *(int *) argp;
+
+    sched_task task;
+    for (;;) {
+        if (sched_find(sched_self, &task)) {
+            sched_run(&task);
+            continue;
+        }
+
+        // Re-check after announcing ourselves idle, so a spawn in between
+        // either is seen here or signals the semaphore
+        __atomic_fetch_add(&num_idle, 1, __ATOMIC_SEQ_CST);
+        if (sched_find(sched_self, &task)) {
+            __atomic_fetch_sub(&num_idle, 1, __ATOMIC_SEQ_CST);
+            sched_run(&task);
+            continue;
+        }
+        sceKernelWaitSema(work_sema, 1, NULL);
+        __atomic_fetch_sub(&num_idle, 1, __ATOMIC_SEQ_CST);
+    }
+    return 0;
+}
+
+void sched_init() {
+    if (num_threads > 0)
+        return;
+
+    memset(deques, 0, sizeof(deques));
+    work_sema = sceKernelCreateSema("sched_work", 0, 0, SCHED_MAX_THREADS, NULL);
+    for (int i = 0; i <= SCHED_EXTERNAL_SLOT; i++)
+        wait_sema[i] = sceKernelCreateSema("sched_wait", 0, 0, 1, NULL);
+    sceKernelCreateLwMutex(&external_wait_lock, "sched_wait", 0, 0, NULL);
+
+    sched_self = 0;
+    num_threads = 1;
+
+    for (int i = 1; i < SCHED_MAX_THREADS; i++) {
+        // SCE_KERNEL_CPU_MASK_USER_1, SCE_KERNEL_CPU_MASK_USER_2
+        SceUID thid = sceKernelCreateThread("sched_worker", sched_worker, 0x10000100,
+                                            SCHED_STACK_SIZE, 0, 0x10000 << i, NULL);
+        if (thid < 0) {
+            l_error("sched_init: Could not create worker %d: 0x%X", i, thid);
+            break;
+        }
+
+        int index = num_threads++;
+        sceKernelStartThread(thid, sizeof(int), &index);
+    }
+
+    l_success("Task scheduler started with %d threads.", num_threads);
+}
+
+void sched_group_init(sched_group * group) {
+    group->pending = 0;
+}
+
+static void sched_submit(const sched_task * task) {
+    __atomic_fetch_add(&task->group->pending, 1, __ATOMIC_RELAXED);
+
+    if (sched_self < 0 || !sched_push(&deques[sched_self], task)) {
+        sched_task inline_task = *task;
+        sched_run(&inline_task);
+        return;
+    }
+
+    if (__atomic_load_n(&num_idle, __ATOMIC_SEQ_CST) > 0)
+        sceKernelSignalSema(work_sema, 1);
+}
+
+void sched_spawn(sched_group * group, const char * name, sched_fn fn, void * arg) {
+    sched_task task = { .fn = fn, .arg = arg, .name = name, .group = group };
+    sched_submit(&task);
+}
+
+// Sleep until the last task of `group` wakes us. Returns 0 if the group
+// already has another waiter.
+static int sched_block(sched_group * group, int slot) {
+    int pending = __atomic_load_n(&group->pending, __ATOMIC_ACQUIRE);
+    do {
+        if ((pending & SCHED_PENDING_MASK) == 0)
+            return 1;
+        if ((pending >> SCHED_WAITER_SHIFT) != 0)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&group->pending, &pending, pending | (slot + 1) << SCHED_WAITER_SHIFT,
+                                          true, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE));
+
+    sceKernelWaitSema(wait_sema[slot], 1, NULL);
+    __atomic_store_n(&group->pending, 0, __ATOMIC_RELAXED);
+    return 1;
+}
+
+void sched_wait(sched_group * group) {
+    sched_task task;
+    while ((__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) & SCHED_PENDING_MASK) > 0) {
+        if (sched_self >= 0 && sched_find(sched_self, &task)) {
+            sched_run(&task);
+            continue;
+        }
+
+        // Nothing left to help with, every remaining task is running
+        // somewhere. Sleep until the last one finishes.
+        int blocked;
+        if (sched_self >= 0) {
+            blocked = sched_block(group, sched_self);
+        } else {
+            sceKernelLockLwMutex(&external_wait_lock, 1, NULL);
+            blocked = sched_block(group, SCHED_EXTERNAL_SLOT);
+            sceKernelUnlockLwMutex(&external_wait_lock, 1);
+        }
+
+        // Someone else is already the group's waiter
+        if (!blocked)
+            sceKernelDelayThread(100);
+    }
+}
+
+void sched_parallel_for(const char * name, int begin, int end, int grain, sched_range_fn body, void * arg) {
+    if (grain < 1)
+        grain = 1;
+
+    sched_group group;
+    sched_group_init(&group);
+
+    for (int i = begin; i < end; i += grain) {
+        sched_task task = {
+            .range_fn = body, .arg = arg, .name = name, .group = &group,
+            .begin = i, .end = (end - i > grain) ? i + grain : end,
+        };
+        sched_submit(&task);
+    }
+
+    sched_wait(&group);
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  scheduler.h
+ * @brief Work-stealing task scheduler for loader-side parallel work.
+ *
+ * One worker thread is started per spare user core (cores 1 and 2, core 0
+ * being the loader's main thread). Every participating thread owns a
+ * fixed-size Chase-Lev deque: it pushes and pops tasks at the bottom, idle
+ * threads steal from the top. The thread that called sched_init() takes part
+ * as well while it waits in sched_wait().
+ *
+ * Tasks must be spawned from the main thread or from inside other tasks;
+ * from any other thread they simply run inline. Every task is recorded as a
+ * span in the startup trace (see trace.h) under its name.
+ */
+
+#ifndef SOLOADER_SCHEDULER_H
+#define SOLOADER_SCHEDULER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A set of tasks that can be waited on together (fork/join).
+ */
+typedef struct {
+    volatile int pending; // unfinished tasks and the sleeping waiter, see scheduler.c
+} sched_group;
+
+typedef void (*sched_fn)(void * arg);
+typedef void (*sched_range_fn)(int begin, int end, void * arg);
+
+/**
+ * Start the worker threads. Must be called from the loader's main thread.
+ */
+void sched_init();
+
+/**
+ * Prepare an empty group.
+ */
+void sched_group_init(sched_group * group);
+
+/**
+ * Queue `fn(arg)` as part of `group`.
+ *
+ * @param[in] group Group to account the task to.
+ * @param[in] name  Static string naming the task in the trace.
+ * @param[in] fn    Task function.
+ * @param[in] arg   Task argument.
+ */
+void sched_spawn(sched_group * group, const char * name, sched_fn fn, void * arg);
+
+/**
+ * Run queued tasks until every task of `group` has finished. Once there is
+ * nothing left to run, sleeps until the group's last task wakes it up.
+ */
+void sched_wait(sched_group * group);
+
+/**
+ * Split `[begin, end)` into chunks of at most `grain` indices, run
+ * `body(chunk_begin, chunk_end, arg)` for each in parallel and wait for all.
+ */
+void sched_parallel_for(const char * name, int begin, int end, int grain, sched_range_fn body, void * arg);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // SOLOADER_SCHEDULER_H
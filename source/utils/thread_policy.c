@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+#include "utils/thread_policy.h"
+
+#include "utils/logger.h"
+
+#include <psp2/kernel/threadmgr.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <so_util/so_util.h>
+
+#define THREAD_POLICY_PATH DATA_PATH "threads.txt"
+#define THREAD_POLICY_MAX  32
+
+extern so_module so_mod;
+
+static thread_policy policies[THREAD_POLICY_MAX];
+static int num_policies = 0;
+
+// "0,2" -> SCE_KERNEL_CPU_MASK_USER_0 | SCE_KERNEL_CPU_MASK_USER_2
+static int thread_policy_parse_cores(const char * s) {
+    int mask = 0;
+    for (; *s; s++) {
+        if (*s >= '0' && *s <= '2')
+            mask |= 0x10000 << (*s - '0');
+        else if (*s != ',')
+            return -1;
+    }
+    return mask;
+}
+
+void thread_policy_load() {
+    num_policies = 0;
+
+    FILE * f = fopen(THREAD_POLICY_PATH, "r");
+    if (!f)
+        return;
+
+    char line[256];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f) && num_policies < THREAD_POLICY_MAX) {
+        lineno++;
+
+        char pattern[80], cores[16], prio[16], stack[16];
+        int n = sscanf(line, "%79s %15s %15s %15s", pattern, cores, prio, stack);
+        if (n <= 0 || pattern[0] == '#')
+            continue;
+        if (n != 4) {
+            l_warn("thread_policy_load: %s:%d: expected 4 fields.", THREAD_POLICY_PATH, lineno);
+            continue;
+        }
+
+        thread_policy * p = &policies[num_policies];
+        memset(p, 0, sizeof(thread_policy));
+
+        const char * name = pattern;
+        if (strncmp(name, "sym:", 4) == 0) {
+            p->by_symbol = 1;
+            name += 4;
+        }
+        strncpy(p->pattern, name, sizeof(p->pattern) - 1);
+
+        if (strcmp(cores, "-") != 0)
+            p->affinity = thread_policy_parse_cores(cores);
+        if (strcmp(prio, "-") != 0)
+            p->priority = (int) strtol(prio, NULL, 0);
+        if (strcmp(stack, "-") != 0)
+            p->stack_size = strtoul(stack, NULL, 0) * 1024;
+
+        if (p->affinity < 0) {
+            l_warn("thread_policy_load: %s:%d: bad core list \"%s\".", THREAD_POLICY_PATH, lineno, cores);
+            continue;
+        }
+
+        num_policies++;
+    }
+
+    fclose(f);
+    l_info("Loaded %d thread policies.", num_policies);
+}
+
+static int thread_policy_match(const char * pattern, const char * name) {
+    size_t len = strlen(pattern);
+    if (len > 0 && pattern[len - 1] == '*')
+        return strncmp(pattern, name, len - 1) == 0;
+    return strcmp(pattern, name) == 0;
+}
+
+static const thread_policy * thread_policy_find(const char * name, int by_symbol) {
+    for (int i = 0; i < num_policies; i++) {
+        if (policies[i].by_symbol == by_symbol && thread_policy_match(policies[i].pattern, name))
+            return &policies[i];
+    }
+    return NULL;
+}
+
+const thread_policy * thread_policy_for_start(uintptr_t start) {
+    if (num_policies == 0 || start < so_mod.text_base || start >= so_mod.text_base + so_mod.text_size)
+        return NULL;
+
+    uintptr_t off = 0;
+    const char * sym = so_symbol_name(&so_mod, start & ~1, &off);
+    if (!sym || off != 0)
+        return NULL;
+
+    return thread_policy_find(sym, 1);
+}
+
+const thread_policy * thread_policy_for_name(const char * name) {
+    if (num_policies == 0 || !name)
+        return NULL;
+    return thread_policy_find(name, 0);
+}
+
+void thread_policy_apply_self(const thread_policy * policy) {
+    if (!policy)
+        return;
+
+    SceUID thid = sceKernelGetThreadId();
+
+    if (policy->affinity) {
+        int ret = sceKernelChangeThreadCpuAffinityMask(thid, policy->affinity);
+        if (ret < 0)
+            l_warn("thread_policy: could not set affinity 0x%X for %s: 0x%X", policy->affinity, policy->pattern, ret);
+    }
+
+    if (policy->priority) {
+        int ret = sceKernelChangeThreadPriority(thid, policy->priority);
+        if (ret < 0)
+            l_warn("thread_policy: could not set priority %d for %s: 0x%X", policy->priority, policy->pattern, ret);
+    }
+
+    l_info("thread_policy: applied \"%s\" to thread 0x%X", policy->pattern, thid);
+}
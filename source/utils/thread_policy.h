@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  thread_policy.h
+ * @brief Per-thread CPU affinity, priority and stack size overrides.
+ *
+ * Rules are read from `DATA_PATH "threads.txt"`, one per line:
+ *
+ * ```
+ * # pattern                 cores  priority  stack_kb
+ * AudioTrackThread          2      64        128
+ * sym:_ZN6Loader7runTaskEPv 1,2    -         256
+ * Worker*                   0,1    -         -
+ * ```
+ *
+ * A pattern matches a thread name (set by the game through
+ * `pthread_setname_np`), or, with the `sym:` prefix, the .so symbol of the
+ * thread's start routine. A trailing `*` makes it a prefix match. `-` leaves
+ * a field at its default. The first matching rule wins.
+ *
+ * Symbol rules apply when the thread is created, so they can also set its
+ * stack size. Name rules apply when a thread names itself; by then the stack
+ * is already allocated, so their stack size is ignored.
+ */
+
+#ifndef SOLOADER_THREAD_POLICY_H
+#define SOLOADER_THREAD_POLICY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    char pattern[64];
+    int by_symbol;
+    int affinity;      // SCE_KERNEL_CPU_MASK_USER_* bits, 0 to keep
+    int priority;      // 0 to keep
+    size_t stack_size; // 0 to keep
+} thread_policy;
+
+/**
+ * Load the rules from `DATA_PATH "threads.txt"`, if present.
+ */
+void thread_policy_load();
+
+/**
+ * Find the rule for a thread about to be created.
+ *
+ * @param[in] start Thread start routine.
+ *
+ * @return Matching `sym:` rule, or NULL.
+ */
+const thread_policy * thread_policy_for_start(uintptr_t start);
+
+/**
+ * Find the rule for a thread name.
+ *
+ * @param[in] name Thread name.
+ *
+ * @return Matching name rule, or NULL.
+ */
+const thread_policy * thread_policy_for_name(const char * name);
+
+/**
+ * Apply the affinity and priority of a rule to the calling thread.
+ *
+ * @param[in] policy Rule to apply, may be NULL.
+ */
+void thread_policy_apply_self(const thread_policy * policy);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // SOLOADER_THREAD_POLICY_H
@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+#include "utils/trace.h"
+
+#include "utils/logger.h"
+
+#include <psp2/kernel/processmgr.h>
+#include <psp2/kernel/threadmgr.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <so_util/so_util.h>
+
+#define TRACE_FILE_PATH  DATA_PATH "startup_trace.json"
+#define TRACE_MAX_EVENTS 4096
+#define TRACE_MAX_DEPTH  16
+
+extern so_module so_mod;
+
+typedef struct {
+    const char * name;
+    uintptr_t addr;
+    uint64_t start;
+    uint64_t end;
+    int tid;
+    int depth;
+} trace_event;
+
+static trace_event events[TRACE_MAX_EVENTS];
+static int num_events = 0;
+
+static int stack[TRACE_MAX_DEPTH];
+static int depth = 0;
+
+static int trace_alloc() {
+    int i = __atomic_fetch_add(&num_events, 1, __ATOMIC_RELAXED);
+    return i < TRACE_MAX_EVENTS ? i : -1;
+}
+
+uint64_t trace_now() {
+    return sceKernelGetProcessTimeWide();
+}
+
+void trace_begin(const char * name) {
+    int i = trace_alloc();
+    if (depth < TRACE_MAX_DEPTH)
+        stack[depth] = i;
+    depth++;
+
+    if (i < 0)
+        return;
+
+    events[i].name = name;
+    events[i].addr = 0;
+    events[i].tid = sceKernelGetThreadId();
+    events[i].depth = depth - 1;
+    events[i].start = trace_now();
+    events[i].end = 0;
+}
+
+void trace_end() {
+    uint64_t now = trace_now();
+    if (depth == 0)
+        return;
+
+    depth--;
+    if (depth < TRACE_MAX_DEPTH && stack[depth] >= 0)
+        events[stack[depth]].end = now;
+}
+
+void trace_complete(const char * name, uintptr_t addr, uint64_t start, uint64_t end) {
+    int i = trace_alloc();
+    if (i < 0)
+        return;
+
+    events[i].name = name;
+    events[i].addr = addr;
+    events[i].tid = sceKernelGetThreadId();
+    events[i].depth = -1;
+    events[i].start = start;
+    events[i].end = end;
+}
+
+#ifdef STARTUP_TRACE
+static void trace_event_name(const trace_event * e, char * out, size_t size) {
+    if (e->name) {
+        snprintf(out, size, "%s", e->name);
+        return;
+    }
+
+    uintptr_t off = 0;
+    const char * sym = so_symbol_name(&so_mod, e->addr, &off);
+    if (sym && off == 0)
+        snprintf(out, size, "%s", sym);
+    else if (sym)
+        snprintf(out, size, "%s+0x%X", sym, (unsigned int)off);
+    else
+        snprintf(out, size, "0x%08X", (unsigned int)e->addr);
+}
+
+static void trace_write(int count) {
+    FILE * f = fopen(TRACE_FILE_PATH, "w");
+    if (!f) {
+        l_error("trace_finish: Could not open %s for writing.", TRACE_FILE_PATH);
+        return;
+    }
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (int i = 0; i < count; i++) {
+        const trace_event * e = &events[i];
+        char name[256];
+        trace_event_name(e, name, sizeof(name));
+
+        fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":1,\"tid\":%d",
+                i ? ",\n" : "", name, e->addr ? "init_array" : "loader",
+                (unsigned long long)e->start,
+                (unsigned long long)(e->end >= e->start ? e->end - e->start : 0), e->tid);
+        if (e->addr)
+            fprintf(f, ",\"args\":{\"addr\":\"0x%08X\"}", (unsigned int)e->addr);
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(f);
+}
+#endif
+
+void trace_finish() {
+    int count = num_events < TRACE_MAX_EVENTS ? num_events : TRACE_MAX_EVENTS;
+
+    // One line: total time to here, then every top-level phase in ms
+    char summary[1024];
+    int len = snprintf(summary, sizeof(summary), "Startup: %llu ms |", (unsigned long long)(trace_now() / 1000));
+    for (int i = 0; i < count && len < (int)sizeof(summary); i++) {
+        if (events[i].depth != 0 || events[i].end < events[i].start)
+            continue;
+        uint64_t dur = events[i].end - events[i].start;
+        len += snprintf(summary + len, sizeof(summary) - len, " %s %llu.%llu",
+                        events[i].name, (unsigned long long)(dur / 1000), (unsigned long long)(dur / 100 % 10));
+    }
+    l_info("%s", summary);
+
+#ifdef STARTUP_TRACE
+    trace_write(count);
+#endif
+}
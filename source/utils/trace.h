@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2024 Volodymyr Atamanenko
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license. See the LICENSE file for details.
+ */
+
+/**
+ * @file  trace.h
+ * @brief Startup timeline: phase timing and Chrome trace-event output.
+ *
+ * Timestamps come from `sceKernelGetProcessTimeWide()` (microseconds since
+ * process start). Spans are always recorded since that is only a couple of
+ * clock reads per phase; trace_finish() prints a one-line summary and, when
+ * built with `STARTUP_TRACE`, writes the whole timeline to
+ * `DATA_PATH "startup_trace.json"` (open in chrome://tracing or Perfetto).
+ */
+
+#ifndef SOLOADER_TRACE_H
+#define SOLOADER_TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/**
+ * Open a span on the calling thread. Spans nest and must be closed in
+ * reverse order with trace_end(). Meant for the loader's main thread.
+ *
+ * @param[in] name Static string naming the span.
+ */
+void trace_begin(const char * name);
+
+/**
+ * Close the innermost span opened with trace_begin().
+ */
+void trace_end();
+
+/**
+ * Record a finished span from any thread.
+ *
+ * @param[in] name  Static string naming the span, or NULL to name it after
+ *                  the .so symbol containing `addr`.
+ * @param[in] addr  Address the span relates to (e.g. a constructor), or 0.
+ * @param[in] start Start time in microseconds.
+ * @param[in] end   End time in microseconds.
+ */
+void trace_complete(const char * name, uintptr_t addr, uint64_t start, uint64_t end);
+
+/**
+ * Current trace clock in microseconds.
+ */
+uint64_t trace_now();
+
+/**
+ * Print the one-line startup summary and write the trace file, if enabled.
+ */
+void trace_finish();
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // SOLOADER_TRACE_H